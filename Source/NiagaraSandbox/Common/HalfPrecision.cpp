@@ -0,0 +1,80 @@
+#include "HalfPrecision.h"
+
+const float FHalfPrecision::MaxRelativeError = 1.0f / 2048.0f;
+const float FHalfPrecision::MaxDenormalError = 1.0f / 33554432.0f;
+
+namespace
+{
+	// FFloat16のコンストラクタは仮数を切り捨て、2^-14未満を0にするので、最近接偶数丸めを自前で行う
+	uint16 EncodeRoundToNearestEven(float Value)
+	{
+		uint32 Bits;
+		FMemory::Memcpy(&Bits, &Value, sizeof(float));
+		const uint32 Sign = (Bits >> 16) & 0x8000u;
+		const uint32 AbsBits = Bits & 0x7fffffffu;
+
+		// NaNはquiet NaNに、65520以上は丸めると無限大になる
+		if (AbsBits > 0x7f800000u)
+		{
+			return (uint16)(Sign | 0x7e00u);
+		}
+		if (AbsBits >= 0x477ff000u)
+		{
+			return (uint16)(Sign | 0x7c00u);
+		}
+
+		// 2^-14未満は非正規化数になる。0.5を足すとfloatの加算の丸めで仮数の下位がちょうど半精度の非正規化数になる
+		if (AbsBits < 0x38800000u)
+		{
+			float AbsValue;
+			FMemory::Memcpy(&AbsValue, &AbsBits, sizeof(float));
+			AbsValue += 0.5f;
+			uint32 DenormalBits;
+			FMemory::Memcpy(&DenormalBits, &AbsValue, sizeof(float));
+			return (uint16)(Sign | (DenormalBits - 0x3f000000u));
+		}
+
+		// 指数のバイアスを127から15にし、切り捨てる13ビットを偶数側に丸める
+		uint32 Rebiased = AbsBits - ((127u - 15u) << 23);
+		Rebiased += 0xfffu + ((Rebiased >> 13) & 1u);
+		return (uint16)(Sign | (Rebiased >> 13));
+	}
+}
+
+void FHalfPrecision::Encode(const float* Values, int32 Num, FFloat16* OutEncoded)
+{
+	static_assert(sizeof(FFloat16) == sizeof(uint16), "FFloat16 must be a plain 16-bit value.");
+	uint16* Dst = reinterpret_cast<uint16*>(OutEncoded);
+
+	// F16Cが常に使えるプラットフォームでは4要素ずつ1命令で変換する。F16Cは最近接偶数丸めで非正規化数も扱う。
+	// それ以外のVectorStoreHalfはFFloat16と同じく切り捨てになるので使わない
+	int32 NumVectorValues = 0;
+#if defined(PLATFORM_ALWAYS_HAS_F16C) && PLATFORM_ALWAYS_HAS_F16C
+	NumVectorValues = Num / 4 * 4;
+	for (int32 i = 0; i < NumVectorValues; i += 4)
+	{
+		FPlatformMath::VectorStoreHalf(Dst + i, Values + i);
+	}
+#endif
+
+	for (int32 i = NumVectorValues; i < Num; ++i)
+	{
+		Dst[i] = EncodeRoundToNearestEven(Values[i]);
+	}
+}
+
+void FHalfPrecision::Decode(const FFloat16* Encoded, int32 Num, float* OutValues)
+{
+	const uint16* Src = reinterpret_cast<const uint16*>(Encoded);
+
+	const int32 NumVectorValues = Num / 4 * 4;
+	for (int32 i = 0; i < NumVectorValues; i += 4)
+	{
+		FPlatformMath::VectorLoadHalf(OutValues + i, Src + i);
+	}
+
+	for (int32 i = NumVectorValues; i < Num; ++i)
+	{
+		OutValues[i] = Encoded[i].GetFloat();
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#if defined(PLATFORM_ALWAYS_HAS_F16C) && PLATFORM_ALWAYS_HAS_F16C
+#include <immintrin.h>
+#endif
+
+/**
+ * Batch conversion between float and FFloat16 for compact particle attributes.
+ * Encoding rounds to nearest even, so the relative error of a value in the normal range (at least 2^-14) is at most
+ * MaxRelativeError, smaller values are stored as denormals within MaxDenormalError, and values of 65520 or more become
+ * infinity.
+ */
+struct FHalfPrecision
+{
+	static const float MaxRelativeError;
+	static const float MaxDenormalError;
+
+	static void Encode(const float* Values, int32 Num, FFloat16* OutEncoded);
+	static void Decode(const FFloat16* Encoded, int32 Num, float* OutValues);
+
+	static void EncodeVectors(const FVector* Values, int32 Num, FFloat16* OutEncoded)
+	{
+		Encode(reinterpret_cast<const float*>(Values), Num * 3, OutEncoded);
+	}
+
+	static void DecodeVectors(const FFloat16* Encoded, int32 Num, FVector* OutValues)
+	{
+		Decode(Encoded, Num * 3, reinterpret_cast<float*>(OutValues));
+	}
+
+	// for the random access of the neighbor particles
+	static float Load(const FFloat16& Encoded)
+	{
+		return Encoded.GetFloat();
+	}
+
+	static FVector LoadVector(const FFloat16* Encoded)
+	{
+		return FVector(Load(Encoded[0]), Load(Encoded[1]), Load(Encoded[2]));
+	}
+
+	// two adjacent values, e.g. interleaved attributes of one particle, in one 4 byte load and one conversion where F16C is available
+	static FORCEINLINE void LoadPair(const FFloat16* Encoded, float& OutFirst, float& OutSecond)
+	{
+#if defined(PLATFORM_ALWAYS_HAS_F16C) && PLATFORM_ALWAYS_HAS_F16C
+		int32 Bits;
+		FMemory::Memcpy(&Bits, Encoded, sizeof(int32));
+		const __m128 Decoded = _mm_cvtph_ps(_mm_cvtsi32_si128(Bits));
+		OutFirst = _mm_cvtss_f32(Decoded);
+		OutSecond = _mm_cvtss_f32(_mm_shuffle_ps(Decoded, Decoded, _MM_SHUFFLE(1, 1, 1, 1)));
+#else
+		OutFirst = Encoded[0].GetFloat();
+		OutSecond = Encoded[1].GetFloat();
+#endif
+	}
+};
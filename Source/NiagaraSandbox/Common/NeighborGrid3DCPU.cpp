@@ -1,6 +1,24 @@
 #include "NeighborGrid3DCPU.h"
+#include "HAL/PlatformProcess.h"
 
-void FNeighborGrid3DCPU::Initialize(const FIntVector& NumCells, int32 MaxNeighborsPerCell)
+namespace
+{
+	// 同じセルを同時に書き換えることはまれなので、待つときはスレッドを譲るだけにする
+	void LockCell(int32* Lock)
+	{
+		while (FPlatformAtomics::InterlockedCompareExchange(Lock, 1, 0) != 0)
+		{
+			FPlatformProcess::Sleep(0.0f);
+		}
+	}
+
+	void UnlockCell(int32* Lock)
+	{
+		FPlatformAtomics::InterlockedExchange(Lock, 0);
+	}
+}
+
+void FNeighborGrid3DCPU::Initialize(const FIntVector& NumCells, int32 MaxNeighborsPerCell, int32 NumParticles)
 {
 	check(NumCells.X > 0);
 	check(NumCells.Y > 0);
@@ -12,6 +30,10 @@ void FNeighborGrid3DCPU::Initialize(const FIntVector& NumCells, int32 MaxNeighbo
 
 	_ParticleIndicesArray.SetNum(NumCells.X * NumCells.Y * NumCells.Z * MaxNeighborsPerCell);
 	_ParticleNeighborCountArray.SetNum(NumCells.X * NumCells.Y * NumCells.Z);
+	_ParticleSlotArray.SetNum(NumParticles);
+	_CellLockArray.SetNumZeroed(NumCells.X * NumCells.Y * NumCells.Z);
+
+	Reset();
 }
 
 void FNeighborGrid3DCPU::Reset()
@@ -26,11 +48,12 @@ void FNeighborGrid3DCPU::Reset()
 		ParticleNeighborCount = 0;
 	}
 #else
-	// 0̏Memsetōs
+	// 0の初期化をMemsetで行う
 	FMemory::Memset(_ParticleNeighborCountArray.GetData(), 0, _ParticleNeighborCountArray.Num() * sizeof(_ParticleNeighborCountArray[0]));
-	// -1̏Memsetōs
+	// -1の初期化をMemsetで行う
 	FMemory::Memset(_ParticleIndicesArray.GetData(), 0xff, _ParticleIndicesArray.Num() * sizeof(_ParticleIndicesArray[0]));
 #endif
+	FMemory::Memset(_ParticleSlotArray.GetData(), 0xff, _ParticleSlotArray.Num() * sizeof(_ParticleSlotArray[0]));
 }
 
 FIntVector FNeighborGrid3DCPU::GetNumCells() const
@@ -38,13 +61,6 @@ FIntVector FNeighborGrid3DCPU::GetNumCells() const
 	return _NumCells;
 }
 
-bool FNeighborGrid3DCPU::IsValidCellIndex(const FIntVector& CellIndex) const
-{
-	return CellIndex.X >= 0 && CellIndex.X < _NumCells.X
-		&& CellIndex.Y >= 0 && CellIndex.Y < _NumCells.Y
-		&& CellIndex.Z >= 0 && CellIndex.Z < _NumCells.Z;
-}
-
 int32 FNeighborGrid3DCPU::MaxNeighborsPerCell() const
 {
 	return _MaxNeighborsPerCell;
@@ -57,37 +73,89 @@ FVector FNeighborGrid3DCPU::SimulationToUnit(const FVector& Simulation, const FT
 
 FIntVector FNeighborGrid3DCPU::UnitToIndex(const FVector& Unit) const
 {
-	// floatȂint32ւ̕ῗ̊ۂ߂ɂȂ
+	// 正のfloatならint32への変換はただの丸めになる
 	return FIntVector(Unit * FVector(_NumCells));
 }
 
-int32 FNeighborGrid3DCPU::IndexToLinear(const FIntVector& Index) const
+void FNeighborGrid3DCPU::SetParticleNeighborCount(int32 InLinearIndex, int32 InIncrement, int32& PreviousNeighborCount)
 {
-	return Index.X + Index.Y * _NumCells.X + Index.Z * _NumCells.X * _NumCells.Y;
+	// 並列に登録されるので、同じセルに入るパーティクルが同じスロットを取り合わないようアトミックに加算する
+	PreviousNeighborCount = FPlatformAtomics::InterlockedAdd(&_ParticleNeighborCountArray[InLinearIndex], InIncrement);
 }
 
-int32 FNeighborGrid3DCPU::NeighborGridIndexToLinear(const FIntVector& Index, int32 NeighborIndex)
+void FNeighborGrid3DCPU::SetParticleNeighbor(int32 NeighborGridLinearIndex, int32 ParticleIndex)
 {
-	return NeighborIndex + IndexToLinear(Index) * _MaxNeighborsPerCell;
+	_ParticleIndicesArray[NeighborGridLinearIndex] = ParticleIndex;
 }
 
-int32 FNeighborGrid3DCPU::GetParticleNeighborCount(int32 LinearIndex) const
+bool FNeighborGrid3DCPU::UpdateParticle(int32 ParticleIndex, int32 CellLinearIndex)
 {
-	return _ParticleNeighborCountArray[LinearIndex];
-}
+	// 登録中のパーティクルのスロットは他のスレッドに詰め直されてもセルの中でしか動かないので、ロックなしでセルが分かる。
+	// ただし詰め直しと同時に読むことがあるので、読み書きはアトミックにする
+	const int32 Slot = FPlatformAtomics::AtomicRead(&_ParticleSlotArray[ParticleIndex]);
+	if (Slot != INDEX_NONE)
+	{
+		const int32 PrevCellLinearIndex = Slot / _MaxNeighborsPerCell;
+		if (PrevCellLinearIndex == CellLinearIndex)
+		{
+			return true;
+		}
 
-void FNeighborGrid3DCPU::SetParticleNeighborCount(int32 InLinearIndex, int32 InIncrement, int32& PreviousNeighborCount)
-{
-	PreviousNeighborCount = _ParticleNeighborCountArray[InLinearIndex];
-	_ParticleNeighborCountArray[InLinearIndex] += InIncrement;
-}
+		// 抜けたスロットにセルの末尾のパーティクルを詰め、カウントより前のスロットが埋まっている状態を保つ
+		LockCell(&_CellLockArray[PrevCellLinearIndex]);
+		const int32 RemovedSlot = _ParticleSlotArray[ParticleIndex];
+		const int32 LastSlot = PrevCellLinearIndex * _MaxNeighborsPerCell + _ParticleNeighborCountArray[PrevCellLinearIndex] - 1;
+		const int32 LastParticleIndex = _ParticleIndicesArray[LastSlot];
+		_ParticleIndicesArray[RemovedSlot] = LastParticleIndex;
+		FPlatformAtomics::AtomicStore(&_ParticleSlotArray[LastParticleIndex], RemovedSlot);
+		_ParticleIndicesArray[LastSlot] = INDEX_NONE;
+		FPlatformAtomics::AtomicStore(&_ParticleSlotArray[ParticleIndex], (int32)INDEX_NONE);
+		--_ParticleNeighborCountArray[PrevCellLinearIndex];
+		UnlockCell(&_CellLockArray[PrevCellLinearIndex]);
+	}
 
-int32 FNeighborGrid3DCPU::GetParticleNeighbor(int32 NeighborGridLinearIndex) const
-{
-	return _ParticleIndicesArray[NeighborGridLinearIndex];
+	if (CellLinearIndex == INDEX_NONE)
+	{
+		return true;
+	}
+
+	// あふれたパーティクルは未登録のままにし、次の呼び出しで登録し直す
+	bool bRegistered = false;
+	LockCell(&_CellLockArray[CellLinearIndex]);
+	const int32 Count = _ParticleNeighborCountArray[CellLinearIndex];
+	if (Count < _MaxNeighborsPerCell)
+	{
+		const int32 NewSlot = CellLinearIndex * _MaxNeighborsPerCell + Count;
+		_ParticleIndicesArray[NewSlot] = ParticleIndex;
+		FPlatformAtomics::AtomicStore(&_ParticleSlotArray[ParticleIndex], NewSlot);
+		_ParticleNeighborCountArray[CellLinearIndex] = Count + 1;
+		bRegistered = true;
+	}
+	UnlockCell(&_CellLockArray[CellLinearIndex]);
+
+	return bRegistered;
 }
 
-void FNeighborGrid3DCPU::SetParticleNeighbor(int32 NeighborGridLinearIndex, int32 ParticleIndex)
+FNeighborGridStencil FNeighborGrid3DCPU::MakeStencil(const FIntVector& Extent) const
 {
-	_ParticleIndicesArray[NeighborGridLinearIndex] = ParticleIndex;
+	check(Extent.X >= 0 && Extent.Y >= 0 && Extent.Z >= 0);
+
+	FNeighborGridStencil Stencil;
+	Stencil.Extent = Extent;
+
+	// Xが最内のループになるよう並べ、セルをメモリ順に歩く
+	for (int32 Z = -Extent.Z; Z <= Extent.Z; ++Z)
+	{
+		for (int32 Y = -Extent.Y; Y <= Extent.Y; ++Y)
+		{
+			for (int32 X = -Extent.X; X <= Extent.X; ++X)
+			{
+				const FIntVector Offset(X, Y, Z);
+				Stencil.CellOffsets.Add(Offset);
+				Stencil.LinearOffsets.Add(IndexToLinear(Offset));
+			}
+		}
+	}
+
+	return Stencil;
 }
@@ -3,11 +3,25 @@
 #include "CoreMinimal.h"
 #include "UObject/ObjectMacros.h"
 
+// Cells around a cell made by FNeighborGrid3DCPU::MakeStencil().
+struct FNeighborGridStencil
+{
+	// The stencil covers [-Extent, Extent] around the cell.
+	FIntVector Extent = FIntVector::ZeroValue;
+	TArray<FIntVector, TInlineAllocator<27>> CellOffsets;
+	// CellOffsets in linear index of the grid the stencil is made for.
+	TArray<int32, TInlineAllocator<27>> LinearOffsets;
+};
+
 struct FNeighborGrid3DCPU
 {
 private:
 	TArray<int32> _ParticleIndicesArray;
 	TArray<int32> _ParticleNeighborCountArray;
+	// UpdateParticle()で登録したパーティクルの_ParticleIndicesArray上の位置。未登録はINDEX_NONE
+	TArray<int32> _ParticleSlotArray;
+	// UpdateParticle()でセルを書き換えるときのスピンロック
+	TArray<int32> _CellLockArray;
 
 	FIntVector _NumCells;
 	// The name is max neighbors but it is just the count of particle indices in the cell.
@@ -15,26 +29,135 @@ private:
 	int32 _MaxNeighborsPerCell;
 
 public:
-	void Initialize(const FIntVector& NumCells, int32 MaxNeighborsPerCell);
+	// NumParticles is needed only for UpdateParticle().
+	void Initialize(const FIntVector& NumCells, int32 MaxNeighborsPerCell, int32 NumParticles = 0);
 	void Reset();
 
 	// all methods below are usable after Initialize().
 
-	bool IsValidCellIndex(const FIntVector& CellIndex) const;
+	FORCEINLINE bool IsValidCellIndex(const FIntVector& CellIndex) const
+	{
+		return CellIndex.X >= 0 && CellIndex.X < _NumCells.X
+			&& CellIndex.Y >= 0 && CellIndex.Y < _NumCells.Y
+			&& CellIndex.Z >= 0 && CellIndex.Z < _NumCells.Z;
+	}
+
 	FIntVector GetNumCells() const;
 	// get MaxNeighborsPerCell
 	int32 MaxNeighborsPerCell() const;
 	static FVector SimulationToUnit(const FVector& Simulation, const FTransform& SimulationToUnitTransform);
 	FIntVector UnitToIndex(const FVector& Unit) const;
+
 	// cell index to linear index
-	int32 IndexToLinear(const FIntVector& Index) const;
+	FORCEINLINE int32 IndexToLinear(const FIntVector& Index) const
+	{
+		return Index.X + Index.Y * _NumCells.X + Index.Z * _NumCells.X * _NumCells.Y;
+	}
+
 	// cell index to neighbor grid linear index
-	int32 NeighborGridIndexToLinear(const FIntVector& Index, int32 NeighborIndex);
-	int32 GetParticleNeighborCount(int32 LinearIndex) const;
+	FORCEINLINE int32 NeighborGridIndexToLinear(const FIntVector& Index, int32 NeighborIndex) const
+	{
+		return NeighborIndex + IndexToLinear(Index) * _MaxNeighborsPerCell;
+	}
+
+	FORCEINLINE int32 GetParticleNeighborCount(int32 LinearIndex) const
+	{
+		return _ParticleNeighborCountArray[LinearIndex];
+	}
+
 	// PreviousNeighborCount just become neigbor index (i.e. particle index) of the cell.
 	// As if incrementation cause over MaxNeighborsPerCell, _ParticleNeighborCountArray[InLinearIndex] is incremented.
+	// The incrementation is atomic so that particles can be registered in parallel.
 	void SetParticleNeighborCount(int32 InLinearIndex, int32 InIncrement, int32& PreviousNeighborCount);
-	int32 GetParticleNeighbor(int32 NeighborGridLinearIndex) const;
+
+	FORCEINLINE int32 GetParticleNeighbor(int32 NeighborGridLinearIndex) const
+	{
+		return _ParticleIndicesArray[NeighborGridLinearIndex];
+	}
+
 	void SetParticleNeighbor(int32 NeighborGridLinearIndex, int32 ParticleIndex);
+
+	// Moves the particle to the cell of CellLinearIndex, or unregisters it if CellLinearIndex is INDEX_NONE.
+	// A particle staying in its cell costs nothing, so calling this every substep without Reset() keeps the grid up to date
+	// at the cost of the particles which changed cells. Can be called for different particles in parallel.
+	// Returns false if the cell is full and the particle is not registered. Do not mix with SetParticleNeighbor() until Reset().
+	// Rebuilding the whole grid after Reset() is cheaper with SetParticleNeighborCount() and SetParticleNeighbor(), which take no lock.
+	bool UpdateParticle(int32 ParticleIndex, int32 CellLinearIndex);
+
+	// Stencil of the cells in [-Extent, Extent] around a cell.
+	// e.g. (1, 1, 1) for 27 cells, (0, 1, 1) for 9 cells of a grid which has one cell in X.
+	FNeighborGridStencil MakeStencil(const FIntVector& Extent) const;
+
+	// Calls Function(ParticleIndex) for each particle in the cells of Stencil around CellIndex except ExcludedParticleIndex.
+	// CellIndex must be valid. Cells out of the grid are skipped.
+	template<typename FunctionType>
+	FORCEINLINE void ForEachNeighbor(const FIntVector& CellIndex, const FNeighborGridStencil& Stencil, int32 ExcludedParticleIndex, FunctionType&& Function) const
+	{
+		const int32 CellLinearIndex = IndexToLinear(CellIndex);
+		const int32 NumOffsets = Stencil.LinearOffsets.Num();
+
+		// ステンシルがグリッドに収まる内部のセルでは、境界判定なしに線形オフセットだけで歩く
+		if (CellIndex.X >= Stencil.Extent.X && CellIndex.X < _NumCells.X - Stencil.Extent.X
+			&& CellIndex.Y >= Stencil.Extent.Y && CellIndex.Y < _NumCells.Y - Stencil.Extent.Y
+			&& CellIndex.Z >= Stencil.Extent.Z && CellIndex.Z < _NumCells.Z - Stencil.Extent.Z)
+		{
+			for (int32 i = 0; i < NumOffsets; ++i)
+			{
+				ForEachParticleInCell(CellLinearIndex + Stencil.LinearOffsets[i], ExcludedParticleIndex, Function);
+			}
+		}
+		else
+		{
+			for (int32 i = 0; i < NumOffsets; ++i)
+			{
+				if (IsValidCellIndex(CellIndex + Stencil.CellOffsets[i]))
+				{
+					ForEachParticleInCell(CellLinearIndex + Stencil.LinearOffsets[i], ExcludedParticleIndex, Function);
+				}
+			}
+		}
+	}
+
+	// Calls Function(ParticleIndex) for each particle in the cells overlapping the box of UnitRadius around UnitPosition.
+	// Both are in the unit space of the grid. Particles are not tested by the distance.
+	template<typename FunctionType>
+	FORCEINLINE void ForEachNeighbor(const FVector& UnitPosition, const FVector& UnitRadius, FunctionType&& Function) const
+	{
+		const FVector NumCellsFloat(_NumCells);
+		const FVector& MinCell = (UnitPosition - UnitRadius) * NumCellsFloat;
+		const FVector& MaxCell = (UnitPosition + UnitRadius) * NumCellsFloat;
+		// グリッド外の範囲はクランプで空のループになる
+		const FIntVector Min(FMath::Max(FMath::FloorToInt(MinCell.X), 0), FMath::Max(FMath::FloorToInt(MinCell.Y), 0), FMath::Max(FMath::FloorToInt(MinCell.Z), 0));
+		const FIntVector Max(FMath::Min(FMath::FloorToInt(MaxCell.X), _NumCells.X - 1), FMath::Min(FMath::FloorToInt(MaxCell.Y), _NumCells.Y - 1), FMath::Min(FMath::FloorToInt(MaxCell.Z), _NumCells.Z - 1));
+
+		for (int32 Z = Min.Z; Z <= Max.Z; ++Z)
+		{
+			for (int32 Y = Min.Y; Y <= Max.Y; ++Y)
+			{
+				const int32 RowLinearIndex = IndexToLinear(FIntVector(0, Y, Z));
+				for (int32 X = Min.X; X <= Max.X; ++X)
+				{
+					ForEachParticleInCell(RowLinearIndex + X, INDEX_NONE, Function);
+				}
+			}
+		}
+	}
+
+private:
+	template<typename FunctionType>
+	FORCEINLINE void ForEachParticleInCell(int32 CellLinearIndex, int32 ExcludedParticleIndex, FunctionType& Function) const
+	{
+		// カウントより前のスロットは必ず埋まっているので、INDEX_NONEや配列範囲の判定は要らない
+		const int32 Count = FMath::Min(_ParticleNeighborCountArray.GetData()[CellLinearIndex], _MaxNeighborsPerCell);
+		const int32* ParticleIndices = _ParticleIndicesArray.GetData() + CellLinearIndex * _MaxNeighborsPerCell;
+		for (int32 i = 0; i < Count; ++i)
+		{
+			const int32 ParticleIndex = ParticleIndices[i];
+			if (ParticleIndex != ExcludedParticleIndex)
+			{
+				Function(ParticleIndex);
+			}
+		}
+	}
 };
 
@@ -0,0 +1,132 @@
+#include "ParallelWorkerTeam.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+
+namespace
+{
+	// フェーズ間の待ちは短いので、しばらくはスピンし、それでも終わらなければ他のスレッドに譲る
+	const int32 NumSpinsBeforeYield = 4096;
+
+	template<typename PredicateType>
+	void SpinWait(PredicateType Predicate)
+	{
+		for (int32 NumSpins = 0; !Predicate(); ++NumSpins)
+		{
+			if (NumSpins >= NumSpinsBeforeYield)
+			{
+				FPlatformProcess::SleepNoStats(0.0f);
+			}
+		}
+	}
+}
+
+class FParallelWorkerTeam::FWorker : public FRunnable
+{
+public:
+	FWorker(FParallelWorkerTeam& InTeam, int32 InWorkerIndex, const FString& ThreadName)
+		: Team(InTeam)
+		, WorkerIndex(InWorkerIndex)
+	{
+		WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+		Thread = FRunnableThread::Create(this, *ThreadName, 0, TPri_AboveNormal);
+	}
+
+	virtual ~FWorker()
+	{
+		FPlatformAtomics::InterlockedExchange(&bStopRequested, 1);
+		WakeEvent->Trigger();
+		Thread->WaitForCompletion();
+		delete Thread;
+		FPlatformProcess::ReturnSynchEventToPool(WakeEvent);
+	}
+
+	virtual uint32 Run() override
+	{
+		while (true)
+		{
+			WakeEvent->Wait();
+			if (FPlatformAtomics::AtomicRead(&bStopRequested) != 0)
+			{
+				break;
+			}
+
+			(*Team.CurrentJob)(WorkerIndex);
+			FPlatformAtomics::InterlockedIncrement(&Team.NumFinishedWorkers);
+		}
+
+		return 0;
+	}
+
+	void Wake()
+	{
+		WakeEvent->Trigger();
+	}
+
+private:
+	FParallelWorkerTeam& Team;
+	int32 WorkerIndex;
+	FEvent* WakeEvent = nullptr;
+	FRunnableThread* Thread = nullptr;
+	volatile int32 bStopRequested = 0;
+};
+
+FParallelWorkerTeam::~FParallelWorkerTeam()
+{
+	Stop();
+}
+
+void FParallelWorkerTeam::Start(int32 InNumWorkers, const TCHAR* ThreadName)
+{
+	check(InNumWorkers > 0);
+
+	Stop();
+
+	NumWorkers = InNumWorkers;
+	BarrierCount = 0;
+	BarrierGeneration = 0;
+	for (int32 WorkerIndex = 1; WorkerIndex < NumWorkers; ++WorkerIndex)
+	{
+		Workers.Emplace(MakeUnique<FWorker>(*this, WorkerIndex, FString::Printf(TEXT("%s%d"), ThreadName, WorkerIndex)));
+	}
+}
+
+void FParallelWorkerTeam::Stop()
+{
+	// FWorkerのデストラクタでスレッドの終了を待つ
+	Workers.Empty();
+	NumWorkers = 0;
+}
+
+void FParallelWorkerTeam::Run(TFunctionRef<void(int32 WorkerIndex)> Job)
+{
+	check(IsRunning());
+	check(CurrentJob == nullptr);
+
+	CurrentJob = &Job;
+	FPlatformAtomics::InterlockedExchange(&NumFinishedWorkers, 0);
+	for (const TUniquePtr<FWorker>& Worker : Workers)
+	{
+		Worker->Wake();
+	}
+
+	Job(0);
+
+	SpinWait([this]() { return FPlatformAtomics::AtomicRead(&NumFinishedWorkers) == NumWorkers - 1; });
+	CurrentJob = nullptr;
+}
+
+void FParallelWorkerTeam::Barrier()
+{
+	// 世代を先に読んでおく。最後に到着したワーカーがカウンタを戻してから世代を進めるので、
+	// 次のバリアのカウントが今回の待ちと混ざることはない
+	int32 Generation = FPlatformAtomics::AtomicRead(&BarrierGeneration);
+	if (FPlatformAtomics::InterlockedIncrement(&BarrierCount) == NumWorkers)
+	{
+		FPlatformAtomics::InterlockedExchange(&BarrierCount, 0);
+		FPlatformAtomics::InterlockedIncrement(&BarrierGeneration);
+		return;
+	}
+
+	SpinWait([this, Generation]() { return FPlatformAtomics::AtomicRead(&BarrierGeneration) != Generation; });
+}
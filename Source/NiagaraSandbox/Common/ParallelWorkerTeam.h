@@ -0,0 +1,36 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * A team of threads which lives as long as its owner and runs one job on all of them per Run().
+ * The job synchronizes the workers with Barrier() between its phases. This is much cheaper than a ParallelFor per phase
+ * because the workers are already running and only spin, then yield, on a shared counter.
+ * The thread calling Run() takes part in the job as worker 0, so a team of one worker creates no thread.
+ */
+class FParallelWorkerTeam
+{
+public:
+	~FParallelWorkerTeam();
+
+	void Start(int32 InNumWorkers, const TCHAR* ThreadName);
+	void Stop();
+	bool IsRunning() const { return NumWorkers > 0; }
+	int32 GetNumWorkers() const { return NumWorkers; }
+
+	/** Runs Job(WorkerIndex) on every worker and returns when all of them have finished. */
+	void Run(TFunctionRef<void(int32 WorkerIndex)> Job);
+	/** Called from the job on every worker. Returns when all of the workers have reached it. */
+	void Barrier();
+
+private:
+	class FWorker;
+
+	int32 NumWorkers = 0;
+	// ワーカー0はRun()を呼んだスレッドなので、ここにはワーカー1以降が入る
+	TArray<TUniquePtr<FWorker>> Workers;
+	const TFunctionRef<void(int32)>* CurrentJob = nullptr;
+	volatile int32 NumFinishedWorkers = 0;
+	volatile int32 BarrierCount = 0;
+	volatile int32 BarrierGeneration = 0;
+};
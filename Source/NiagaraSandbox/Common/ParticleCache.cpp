@@ -0,0 +1,307 @@
+#include "ParticleCache.h"
+#include "HAL/PlatformFilemanager.h"
+#include "HAL/FileManager.h"
+#include "Misc/Paths.h"
+#include "ParticleQuantization.h"
+
+const uint32 FParticleCache::Magic = 0x48435050; // "PPCH"
+const uint32 FParticleCache::Version = 2;
+const int64 FParticleCache::ChunkAlignment = 4096;
+
+FString FParticleCache::ResolveFilePath(const FString& FilePath)
+{
+	if (FPaths::IsRelative(FilePath))
+	{
+		return FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("ParticleCache"), FilePath);
+	}
+
+	return FilePath;
+}
+
+int64 FParticleCache::GetAttributeSize(const FParticleCacheHeader& Header)
+{
+	int64 ElementSize = EnumHasAnyFlags((EParticleCacheFlags)Header.Flags, EParticleCacheFlags::Quantized) ? 3 * sizeof(uint16) : sizeof(FVector);
+	return ElementSize * Header.NumParticles;
+}
+
+int64 FParticleCache::GetFrameSize(const FParticleCacheHeader& Header)
+{
+	int64 NumAttributes = EnumHasAnyFlags((EParticleCacheFlags)Header.Flags, EParticleCacheFlags::Velocities) ? 2 : 1;
+	return NumAttributes * GetAttributeSize(Header);
+}
+
+FParticleCacheWriter::~FParticleCacheWriter()
+{
+	Close();
+}
+
+bool FParticleCacheWriter::Open(const FString& FilePath, int32 NumParticles, float FrameRate, bool bWriteVelocities, bool bQuantize, const FBox& QuantizationBounds, float MaxVelocity, int32 NumFramesPerChunk)
+{
+	check(NumParticles > 0);
+	check(NumFramesPerChunk > 0);
+	check(!bQuantize || QuantizationBounds.IsValid);
+
+	Close();
+
+	const FString& ResolvedFilePath = FParticleCache::ResolveFilePath(FilePath);
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	PlatformFile.CreateDirectoryTree(*FPaths::GetPath(ResolvedFilePath));
+
+	FileHandle.Reset(PlatformFile.OpenWrite(*ResolvedFilePath));
+	if (!FileHandle.IsValid())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Failed to open particle cache for writing. Path = %s."), *ResolvedFilePath);
+		return false;
+	}
+
+	Header = FParticleCacheHeader();
+	Header.Magic = FParticleCache::Magic;
+	Header.Version = FParticleCache::Version;
+	Header.NumParticles = NumParticles;
+	Header.NumFramesPerChunk = NumFramesPerChunk;
+	Header.Flags = (uint32)(bWriteVelocities ? EParticleCacheFlags::Velocities : EParticleCacheFlags::None);
+	Header.FrameRate = FrameRate;
+	ChunkOffsets.Reset();
+
+	if (bQuantize)
+	{
+		Header.Flags |= (uint32)EParticleCacheFlags::Quantized;
+		Header.PositionMin = QuantizationBounds.Min;
+		Header.PositionMax = QuantizationBounds.Max;
+		Header.MaxVelocity = MaxVelocity;
+		EncodedBuffer.SetNumUninitialized(NumParticles * 3);
+	}
+
+	// ヘッダはClose()で確定させるので、ここでは領域の確保だけ行う
+	return FileHandle->Write(reinterpret_cast<const uint8*>(&Header), sizeof(Header));
+}
+
+void FParticleCacheWriter::Close()
+{
+	if (!FileHandle.IsValid())
+	{
+		return;
+	}
+
+	Header.ChunkTableOffset = FileHandle->Tell();
+	FileHandle->Write(reinterpret_cast<const uint8*>(ChunkOffsets.GetData()), ChunkOffsets.Num() * sizeof(int64));
+	FileHandle->Seek(0);
+	FileHandle->Write(reinterpret_cast<const uint8*>(&Header), sizeof(Header));
+	FileHandle->Flush();
+	FileHandle.Reset();
+}
+
+bool FParticleCacheWriter::IsOpen() const
+{
+	return FileHandle.IsValid();
+}
+
+bool FParticleCacheWriter::WriteFrame(const FVector* Positions, const FVector* Velocities)
+{
+	if (!FileHandle.IsValid())
+	{
+		return false;
+	}
+
+	if (Header.NumFrames % Header.NumFramesPerChunk == 0)
+	{
+		// チャンクの先頭はメモリマップしやすいようにアラインしておく
+		int64 Offset = FileHandle->Tell();
+		int64 AlignedOffset = Align(Offset, FParticleCache::ChunkAlignment);
+		if (AlignedOffset > Offset)
+		{
+			TArray<uint8> Padding;
+			Padding.SetNumZeroed(AlignedOffset - Offset);
+			FileHandle->Write(Padding.GetData(), Padding.Num());
+		}
+
+		ChunkOffsets.Add(AlignedOffset);
+	}
+
+	bool bQuantized = EnumHasAnyFlags((EParticleCacheFlags)Header.Flags, EParticleCacheFlags::Quantized);
+	int64 AttributeSize = FParticleCache::GetAttributeSize(Header);
+
+	bool bSucceeded = true;
+	if (bQuantized)
+	{
+		FParticleQuantization::EncodePositions(Positions, Header.NumParticles, FBox(Header.PositionMin, Header.PositionMax), EncodedBuffer.GetData());
+		bSucceeded &= FileHandle->Write(reinterpret_cast<const uint8*>(EncodedBuffer.GetData()), AttributeSize);
+	}
+	else
+	{
+		bSucceeded &= FileHandle->Write(reinterpret_cast<const uint8*>(Positions), AttributeSize);
+	}
+
+	if (EnumHasAnyFlags((EParticleCacheFlags)Header.Flags, EParticleCacheFlags::Velocities))
+	{
+		check(Velocities != nullptr);
+		if (bQuantized)
+		{
+			FParticleQuantization::EncodeVelocities(Velocities, Header.NumParticles, Header.MaxVelocity, EncodedBuffer.GetData());
+			bSucceeded &= FileHandle->Write(reinterpret_cast<const uint8*>(EncodedBuffer.GetData()), AttributeSize);
+		}
+		else
+		{
+			bSucceeded &= FileHandle->Write(reinterpret_cast<const uint8*>(Velocities), AttributeSize);
+		}
+	}
+
+	++Header.NumFrames;
+	return bSucceeded;
+}
+
+FParticleCacheReader::~FParticleCacheReader()
+{
+	Close();
+}
+
+bool FParticleCacheReader::Open(const FString& FilePath)
+{
+	Close();
+
+	const FString& ResolvedFilePath = FParticleCache::ResolveFilePath(FilePath);
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+
+	TUniquePtr<IFileHandle> HeaderFileHandle(PlatformFile.OpenRead(*ResolvedFilePath));
+	if (!HeaderFileHandle.IsValid())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Failed to open particle cache. Path = %s."), *ResolvedFilePath);
+		return false;
+	}
+
+	if (!HeaderFileHandle->Read(reinterpret_cast<uint8*>(&Header), sizeof(Header))
+		|| Header.Magic != FParticleCache::Magic
+		|| Header.Version != FParticleCache::Version
+		|| Header.NumParticles <= 0
+		|| Header.NumFramesPerChunk <= 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Invalid particle cache. The file may be not closed properly or be an old version. Path = %s."), *ResolvedFilePath);
+		Header = FParticleCacheHeader();
+		return false;
+	}
+
+	int32 NumChunks = (Header.NumFrames + Header.NumFramesPerChunk - 1) / Header.NumFramesPerChunk;
+	ChunkOffsets.SetNum(NumChunks);
+	if (!HeaderFileHandle->Seek(Header.ChunkTableOffset)
+		|| !HeaderFileHandle->Read(reinterpret_cast<uint8*>(ChunkOffsets.GetData()), NumChunks * sizeof(int64)))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Failed to read the chunk table of particle cache. Path = %s."), *ResolvedFilePath);
+		Close();
+		return false;
+	}
+
+	MappedFileHandle.Reset(PlatformFile.OpenMapped(*ResolvedFilePath));
+	if (!MappedFileHandle.IsValid())
+	{
+		// メモリマップができないときは通常のファイル読み込みにフォールバックする
+		FileHandle = MoveTemp(HeaderFileHandle);
+		FrameBuffer.SetNumUninitialized(FParticleCache::GetFrameSize(Header));
+	}
+
+	if (IsQuantized())
+	{
+		DecodedBuffer.SetNumUninitialized(Header.NumParticles);
+	}
+
+	return true;
+}
+
+void FParticleCacheReader::Close()
+{
+	// リージョンはファイルハンドルより先に解放する必要がある
+	MappedChunk.Reset();
+	MappedFileHandle.Reset();
+	MappedChunkIndex = INDEX_NONE;
+
+	FileHandle.Reset();
+	FrameBuffer.Empty();
+	BufferedFrameIndex = INDEX_NONE;
+	DecodedBuffer.Empty();
+
+	ChunkOffsets.Empty();
+	Header = FParticleCacheHeader();
+}
+
+bool FParticleCacheReader::IsOpen() const
+{
+	return MappedFileHandle.IsValid() || FileHandle.IsValid();
+}
+
+const FVector* FParticleCacheReader::GetFramePositions(int32 FrameIndex)
+{
+	const uint8* FrameData = GetFrameData(FrameIndex);
+	if (FrameData == nullptr || !IsQuantized())
+	{
+		return reinterpret_cast<const FVector*>(FrameData);
+	}
+
+	FParticleQuantization::DecodePositions(reinterpret_cast<const uint16*>(FrameData), Header.NumParticles, GetQuantizationBounds(), DecodedBuffer.GetData());
+	return DecodedBuffer.GetData();
+}
+
+const FVector* FParticleCacheReader::GetFrameVelocities(int32 FrameIndex)
+{
+	if (!HasVelocities())
+	{
+		return nullptr;
+	}
+
+	const uint8* FrameData = GetFrameData(FrameIndex);
+	if (FrameData == nullptr)
+	{
+		return nullptr;
+	}
+
+	const uint8* VelocityData = FrameData + FParticleCache::GetAttributeSize(Header);
+	if (!IsQuantized())
+	{
+		return reinterpret_cast<const FVector*>(VelocityData);
+	}
+
+	FParticleQuantization::DecodeVelocities(reinterpret_cast<const uint16*>(VelocityData), Header.NumParticles, Header.MaxVelocity, DecodedBuffer.GetData());
+	return DecodedBuffer.GetData();
+}
+
+const uint16* FParticleCacheReader::GetFrameEncodedPositions(int32 FrameIndex)
+{
+	return IsQuantized() ? reinterpret_cast<const uint16*>(GetFrameData(FrameIndex)) : nullptr;
+}
+
+const uint8* FParticleCacheReader::GetFrameData(int32 FrameIndex)
+{
+	if (!IsOpen() || FrameIndex < 0 || FrameIndex >= Header.NumFrames)
+	{
+		return nullptr;
+	}
+
+	int32 ChunkIndex = FrameIndex / Header.NumFramesPerChunk;
+	int32 FrameIndexInChunk = FrameIndex % Header.NumFramesPerChunk;
+	int64 FrameSize = FParticleCache::GetFrameSize(Header);
+
+	if (MappedFileHandle.IsValid())
+	{
+		if (ChunkIndex != MappedChunkIndex)
+		{
+			int32 NumFramesInChunk = FMath::Min(Header.NumFramesPerChunk, Header.NumFrames - ChunkIndex * Header.NumFramesPerChunk);
+			MappedChunk.Reset();
+			MappedChunk.Reset(MappedFileHandle->MapRegion(ChunkOffsets[ChunkIndex], NumFramesInChunk * FrameSize));
+			MappedChunkIndex = MappedChunk.IsValid() ? ChunkIndex : INDEX_NONE;
+		}
+
+		return MappedChunk.IsValid() ? MappedChunk->GetMappedPtr() + FrameIndexInChunk * FrameSize : nullptr;
+	}
+
+	if (FrameIndex != BufferedFrameIndex)
+	{
+		if (!FileHandle->Seek(ChunkOffsets[ChunkIndex] + FrameIndexInChunk * FrameSize)
+			|| !FileHandle->Read(FrameBuffer.GetData(), FrameSize))
+		{
+			BufferedFrameIndex = INDEX_NONE;
+			return nullptr;
+		}
+
+		BufferedFrameIndex = FrameIndex;
+	}
+
+	return FrameBuffer.GetData();
+}
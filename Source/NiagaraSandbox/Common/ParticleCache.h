@@ -0,0 +1,125 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/ObjectMacros.h"
+#include "ParticleCache.generated.h"
+
+class IFileHandle;
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+UENUM()
+enum class EParticleCacheMode : uint8
+{
+	// Simulate every frame.
+	None,
+	// Simulate every frame and write the result to the cache file.
+	Record,
+	// Do not simulate and stream the frames of the cache file.
+	Playback,
+};
+
+// The layout of the cache file is
+// [FParticleCacheHeader][Chunk 0][Chunk 1]...[Chunk N-1][int64 chunk offsets x N]
+// A chunk is NumFramesPerChunk frames (the last one may be shorter) and starts at a CacheChunkAlignment aligned offset.
+// A frame is NumParticles positions followed by NumParticles velocities if EParticleCacheFlags::Velocities is set.
+// If EParticleCacheFlags::Quantized is set, positions and velocities are encoded by FParticleQuantization
+// with PositionMin/PositionMax and MaxVelocity.
+struct FParticleCacheHeader
+{
+	uint32 Magic = 0;
+	uint32 Version = 0;
+	int32 NumParticles = 0;
+	int32 NumFrames = 0;
+	int32 NumFramesPerChunk = 0;
+	uint32 Flags = 0;
+	float FrameRate = 0.0f;
+	float MaxVelocity = 0.0f;
+	int64 ChunkTableOffset = 0;
+	FVector PositionMin = FVector::ZeroVector;
+	FVector PositionMax = FVector::ZeroVector;
+};
+
+enum class EParticleCacheFlags : uint32
+{
+	None = 0,
+	Velocities = 1 << 0,
+	Quantized = 1 << 1,
+};
+ENUM_CLASS_FLAGS(EParticleCacheFlags);
+
+struct FParticleCache
+{
+	static const uint32 Magic;
+	static const uint32 Version;
+	static const int64 ChunkAlignment;
+
+	// Resolve the relative path under Saved/ParticleCache.
+	static FString ResolveFilePath(const FString& FilePath);
+	static int64 GetAttributeSize(const FParticleCacheHeader& Header);
+	static int64 GetFrameSize(const FParticleCacheHeader& Header);
+};
+
+class FParticleCacheWriter
+{
+public:
+	~FParticleCacheWriter();
+
+	// If bQuantize is true, positions are encoded in QuantizationBounds and velocities are encoded in [-MaxVelocity, MaxVelocity].
+	bool Open(const FString& FilePath, int32 NumParticles, float FrameRate, bool bWriteVelocities, bool bQuantize = false, const FBox& QuantizationBounds = FBox(ForceInit), float MaxVelocity = 0.0f, int32 NumFramesPerChunk = 64);
+	// Writes the chunk table and the final header. Must be called to make a readable file.
+	void Close();
+	bool IsOpen() const;
+
+	// Velocities is ignored unless the file is opened with bWriteVelocities.
+	bool WriteFrame(const FVector* Positions, const FVector* Velocities);
+
+private:
+	FParticleCacheHeader Header;
+	TUniquePtr<IFileHandle> FileHandle;
+	TArray<int64> ChunkOffsets;
+	TArray<uint16> EncodedBuffer;
+};
+
+class FParticleCacheReader
+{
+public:
+	~FParticleCacheReader();
+
+	bool Open(const FString& FilePath);
+	void Close();
+	bool IsOpen() const;
+
+	int32 GetNumParticles() const { return Header.NumParticles; }
+	int32 GetNumFrames() const { return Header.NumFrames; }
+	float GetFrameRate() const { return Header.FrameRate; }
+	bool HasVelocities() const { return EnumHasAnyFlags((EParticleCacheFlags)Header.Flags, EParticleCacheFlags::Velocities); }
+	bool IsQuantized() const { return EnumHasAnyFlags((EParticleCacheFlags)Header.Flags, EParticleCacheFlags::Quantized); }
+	FBox GetQuantizationBounds() const { return FBox(Header.PositionMin, Header.PositionMax); }
+
+	// Any frame can be requested in any order. The returned pointer is valid until the next call or Close().
+	const FVector* GetFramePositions(int32 FrameIndex);
+	const FVector* GetFrameVelocities(int32 FrameIndex);
+	// Returns the encoded positions without decoding. nullptr if the cache is not quantized.
+	const uint16* GetFrameEncodedPositions(int32 FrameIndex);
+
+private:
+	const uint8* GetFrameData(int32 FrameIndex);
+
+private:
+	FParticleCacheHeader Header;
+	TArray<int64> ChunkOffsets;
+
+	// メモリマップしたチャンク。フレームがチャンクをまたいだらマップし直す
+	TUniquePtr<IMappedFileHandle> MappedFileHandle;
+	TUniquePtr<IMappedFileRegion> MappedChunk;
+	int32 MappedChunkIndex = INDEX_NONE;
+
+	// メモリマップをサポートしないプラットフォームではフレーム単位で読み込む
+	TUniquePtr<IFileHandle> FileHandle;
+	TArray<uint8> FrameBuffer;
+	int32 BufferedFrameIndex = INDEX_NONE;
+
+	// 量子化されたキャッシュのデコード先
+	TArray<FVector> DecodedBuffer;
+};
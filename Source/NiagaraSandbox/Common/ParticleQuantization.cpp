@@ -0,0 +1,105 @@
+#include "ParticleQuantization.h"
+
+namespace
+{
+	const float QuantizationMax = 65535.0f;
+
+	// FVectorの配列をfloatの配列として4要素ずつ読むと、成分の並びは12要素(4パーティクル)で一巡する。
+	// その3レジスタ分の成分の並びに合わせた係数
+	struct FComponentPattern
+	{
+		VectorRegister Registers[3];
+		float Components[3];
+
+		explicit FComponentPattern(const FVector& V)
+		{
+			Registers[0] = MakeVectorRegister(V.X, V.Y, V.Z, V.X);
+			Registers[1] = MakeVectorRegister(V.Y, V.Z, V.X, V.Y);
+			Registers[2] = MakeVectorRegister(V.Z, V.X, V.Y, V.Z);
+			Components[0] = V.X;
+			Components[1] = V.Y;
+			Components[2] = V.Z;
+		}
+	};
+
+	FVector GetScale(const FVector& Min, const FVector& Max)
+	{
+		// 2Dシミュレーションのように幅のない軸はすべて0にエンコードする
+		const FVector& Extent = Max - Min;
+		return FVector(
+			Extent.X > SMALL_NUMBER ? QuantizationMax / Extent.X : 0.0f,
+			Extent.Y > SMALL_NUMBER ? QuantizationMax / Extent.Y : 0.0f,
+			Extent.Z > SMALL_NUMBER ? QuantizationMax / Extent.Z : 0.0f
+		);
+	}
+}
+
+void FParticleQuantization::Encode(const FVector* Values, int32 Num, const FVector& Min, const FVector& Max, uint16* OutEncoded)
+{
+	const FVector& Scale = GetScale(Min, Max);
+	// (Value - Min) * Scale + 0.5をValue * Scale + Biasとして計算し、int変換の切り捨てで四捨五入にする
+	const FComponentPattern ScalePattern(Scale);
+	const FComponentPattern BiasPattern(FVector(0.5f) - Min * Scale);
+	const VectorRegister Zero = VectorZero();
+	const VectorRegister Upper = VectorSetFloat1(QuantizationMax);
+
+	const float* Src = reinterpret_cast<const float*>(Values);
+	const int32 NumFloats = Num * 3;
+	const int32 NumVectorFloats = NumFloats / 12 * 12;
+	MS_ALIGN(16) int32 Quantized[4] GCC_ALIGN(16);
+
+	for (int32 i = 0; i < NumVectorFloats; i += 12)
+	{
+		for (int32 j = 0; j < 3; ++j)
+		{
+			VectorRegister V = VectorLoad(Src + i + j * 4);
+			V = VectorMultiplyAdd(V, ScalePattern.Registers[j], BiasPattern.Registers[j]);
+			V = VectorMin(VectorMax(V, Zero), Upper);
+			VectorIntStore(VectorFloatToInt(V), Quantized);
+
+			uint16* Dst = OutEncoded + i + j * 4;
+			Dst[0] = (uint16)Quantized[0];
+			Dst[1] = (uint16)Quantized[1];
+			Dst[2] = (uint16)Quantized[2];
+			Dst[3] = (uint16)Quantized[3];
+		}
+	}
+
+	for (int32 i = NumVectorFloats; i < NumFloats; ++i)
+	{
+		int32 Component = i % 3;
+		OutEncoded[i] = (uint16)FMath::Clamp(Src[i] * ScalePattern.Components[Component] + BiasPattern.Components[Component], 0.0f, QuantizationMax);
+	}
+}
+
+void FParticleQuantization::Decode(const uint16* Encoded, int32 Num, const FVector& Min, const FVector& Max, FVector* OutValues)
+{
+	const FComponentPattern StepPattern(GetPrecision(Min, Max));
+	const FComponentPattern MinPattern(Min);
+
+	float* Dst = reinterpret_cast<float*>(OutValues);
+	const int32 NumFloats = Num * 3;
+	const int32 NumVectorFloats = NumFloats / 12 * 12;
+	MS_ALIGN(16) int32 Quantized[4] GCC_ALIGN(16);
+
+	for (int32 i = 0; i < NumVectorFloats; i += 12)
+	{
+		for (int32 j = 0; j < 3; ++j)
+		{
+			const uint16* Src = Encoded + i + j * 4;
+			Quantized[0] = Src[0];
+			Quantized[1] = Src[1];
+			Quantized[2] = Src[2];
+			Quantized[3] = Src[3];
+
+			VectorRegister V = VectorIntToFloat(VectorIntLoad(Quantized));
+			VectorStore(VectorMultiplyAdd(V, StepPattern.Registers[j], MinPattern.Registers[j]), Dst + i + j * 4);
+		}
+	}
+
+	for (int32 i = NumVectorFloats; i < NumFloats; ++i)
+	{
+		int32 Component = i % 3;
+		Dst[i] = Encoded[i] * StepPattern.Components[Component] + MinPattern.Components[Component];
+	}
+}
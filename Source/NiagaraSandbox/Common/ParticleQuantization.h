@@ -0,0 +1,42 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * 16-bit fixed point encoding of particle attributes.
+ * Each component is mapped from [Min, Max] to [0, 65535] so the round trip error of a value inside the range is at most GetPrecision() / 2.
+ * Values outside the range are clamped.
+ */
+struct FParticleQuantization
+{
+	static void Encode(const FVector* Values, int32 Num, const FVector& Min, const FVector& Max, uint16* OutEncoded);
+	static void Decode(const uint16* Encoded, int32 Num, const FVector& Min, const FVector& Max, FVector* OutValues);
+
+	// positions relative to the bounds
+	static void EncodePositions(const FVector* Positions, int32 Num, const FBox& Bounds, uint16* OutEncoded)
+	{
+		Encode(Positions, Num, Bounds.Min, Bounds.Max, OutEncoded);
+	}
+
+	static void DecodePositions(const uint16* Encoded, int32 Num, const FBox& Bounds, FVector* OutPositions)
+	{
+		Decode(Encoded, Num, Bounds.Min, Bounds.Max, OutPositions);
+	}
+
+	// velocities in [-MaxVelocity, MaxVelocity] per component
+	static void EncodeVelocities(const FVector* Velocities, int32 Num, float MaxVelocity, uint16* OutEncoded)
+	{
+		Encode(Velocities, Num, FVector(-MaxVelocity), FVector(MaxVelocity), OutEncoded);
+	}
+
+	static void DecodeVelocities(const uint16* Encoded, int32 Num, float MaxVelocity, FVector* OutVelocities)
+	{
+		Decode(Encoded, Num, FVector(-MaxVelocity), FVector(MaxVelocity), OutVelocities);
+	}
+
+	// size of one quantization step for each component
+	static FVector GetPrecision(const FVector& Min, const FVector& Max)
+	{
+		return (Max - Min) / 65535.0f;
+	}
+};
@@ -0,0 +1,212 @@
+#include "SignedDistanceField3D.h"
+#include "Async/ParallelFor.h"
+
+namespace
+{
+	// Axis方向の直線(他の2軸の座標がU,V)と三角形の交点のAxis座標を求める
+	bool IntersectAxisLine(const FVector& A, const FVector& B, const FVector& C, int32 Axis, float U, float V, float& OutT)
+	{
+		const int32 AxisU = (Axis + 1) % 3;
+		const int32 AxisV = (Axis + 2) % 3;
+
+		float Area = (B[AxisU] - A[AxisU]) * (C[AxisV] - A[AxisV]) - (B[AxisV] - A[AxisV]) * (C[AxisU] - A[AxisU]);
+		if (FMath::Abs(Area) < SMALL_NUMBER) // 直線と平行な三角形
+		{
+			return false;
+		}
+
+		float WeightA = ((B[AxisU] - U) * (C[AxisV] - V) - (B[AxisV] - V) * (C[AxisU] - U)) / Area;
+		float WeightB = ((C[AxisU] - U) * (A[AxisV] - V) - (C[AxisV] - V) * (A[AxisU] - U)) / Area;
+		float WeightC = 1.0f - WeightA - WeightB;
+		if (WeightA < 0.0f || WeightB < 0.0f || WeightC < 0.0f)
+		{
+			return false;
+		}
+
+		OutT = WeightA * A[Axis] + WeightB * B[Axis] + WeightC * C[Axis];
+		return true;
+	}
+}
+
+bool FSignedDistanceField3D::IsValid() const
+{
+	return Bounds.IsValid
+		&& Resolution.X >= 2 && Resolution.Y >= 2 && Resolution.Z >= 2
+		&& Distances.Num() == Resolution.X * Resolution.Y * Resolution.Z;
+}
+
+FVector FSignedDistanceField3D::GetCellSize() const
+{
+	return Bounds.GetSize() / FVector(Resolution - FIntVector(1));
+}
+
+float FSignedDistanceField3D::Sample(const FVector& Position) const
+{
+	FVector Gradient;
+	return SampleWithGradient(Position, Gradient);
+}
+
+float FSignedDistanceField3D::SampleWithGradient(const FVector& Position, FVector& OutGradient) const
+{
+	const FVector& CellSize = GetCellSize();
+	const FVector& GridPos = (Position.ComponentMax(Bounds.Min).ComponentMin(Bounds.Max) - Bounds.Min) / CellSize;
+
+	const int32 X = FMath::Clamp(FMath::FloorToInt(GridPos.X), 0, Resolution.X - 2);
+	const int32 Y = FMath::Clamp(FMath::FloorToInt(GridPos.Y), 0, Resolution.Y - 2);
+	const int32 Z = FMath::Clamp(FMath::FloorToInt(GridPos.Z), 0, Resolution.Z - 2);
+	const float FracX = GridPos.X - X;
+	const float FracY = GridPos.Y - Y;
+	const float FracZ = GridPos.Z - Z;
+
+	const int32 StrideY = Resolution.X;
+	const int32 StrideZ = Resolution.X * Resolution.Y;
+	const float* D = Distances.GetData() + X + Y * StrideY + Z * StrideZ;
+	const float D000 = D[0];
+	const float D100 = D[1];
+	const float D010 = D[StrideY];
+	const float D110 = D[StrideY + 1];
+	const float D001 = D[StrideZ];
+	const float D101 = D[StrideZ + 1];
+	const float D011 = D[StrideZ + StrideY];
+	const float D111 = D[StrideZ + StrideY + 1];
+
+	// X方向に補間した4辺の値とその差分
+	const float D00 = FMath::Lerp(D000, D100, FracX);
+	const float D10 = FMath::Lerp(D010, D110, FracX);
+	const float D01 = FMath::Lerp(D001, D101, FracX);
+	const float D11 = FMath::Lerp(D011, D111, FracX);
+
+	const float D0 = FMath::Lerp(D00, D10, FracY);
+	const float D1 = FMath::Lerp(D01, D11, FracY);
+
+	OutGradient.X = FMath::Lerp(FMath::Lerp(D100 - D000, D110 - D010, FracY), FMath::Lerp(D101 - D001, D111 - D011, FracY), FracZ) / CellSize.X;
+	OutGradient.Y = FMath::Lerp(D10 - D00, D11 - D01, FracZ) / CellSize.Y;
+	OutGradient.Z = (D1 - D0) / CellSize.Z;
+
+	return FMath::Lerp(D0, D1, FracZ);
+}
+
+void FSignedDistanceField3D::Build(const FBox& InBounds, const FIntVector& InResolution, const TArray<FVector>& TriangleVertices)
+{
+	check(InBounds.IsValid);
+	check(InResolution.X >= 2 && InResolution.Y >= 2 && InResolution.Z >= 2);
+	check(TriangleVertices.Num() % 3 == 0);
+
+	Bounds = InBounds;
+	Resolution = InResolution;
+	const int32 NumPoints = Resolution.X * Resolution.Y * Resolution.Z;
+	const int32 NumTriangles = TriangleVertices.Num() / 3;
+	const FVector& CellSize = GetCellSize();
+
+	Distances.SetNumUninitialized(NumPoints);
+	if (NumTriangles == 0)
+	{
+		for (int32 i = 0; i < NumPoints; ++i)
+		{
+			Distances[i] = Bounds.GetSize().Size();
+		}
+		return;
+	}
+
+	TArray<FBox> TriangleBounds;
+	TriangleBounds.SetNumUninitialized(NumTriangles);
+	for (int32 TriIdx = 0; TriIdx < NumTriangles; ++TriIdx)
+	{
+		TriangleBounds[TriIdx] = FBox(&TriangleVertices[TriIdx * 3], 3);
+	}
+
+	// 符号なし距離。三角形のAABBまでの距離で明らかに遠い三角形の計算を省く
+	ParallelFor(Resolution.Z,
+		[this, &TriangleVertices, &TriangleBounds, &CellSize, NumTriangles](int32 Z)
+		{
+			for (int32 Y = 0; Y < Resolution.Y; ++Y)
+			{
+				for (int32 X = 0; X < Resolution.X; ++X)
+				{
+					const FVector& Point = Bounds.Min + FVector(X, Y, Z) * CellSize;
+					float MinDistanceSq = MAX_flt;
+					for (int32 TriIdx = 0; TriIdx < NumTriangles; ++TriIdx)
+					{
+						if (TriangleBounds[TriIdx].ComputeSquaredDistanceToPoint(Point) >= MinDistanceSq)
+						{
+							continue;
+						}
+
+						const FVector& Closest = FMath::ClosestPointOnTriangleToPoint(Point, TriangleVertices[TriIdx * 3], TriangleVertices[TriIdx * 3 + 1], TriangleVertices[TriIdx * 3 + 2]);
+						MinDistanceSq = FMath::Min(MinDistanceSq, (Point - Closest).SizeSquared());
+					}
+
+					Distances[X + Resolution.X * (Y + Resolution.Y * Z)] = FMath::Sqrt(MinDistanceSq);
+				}
+			}
+		}
+	);
+
+	// 符号。各軸方向に格子点から+方向へ飛ばしたレイの交差回数が奇数なら内側とし、3軸の多数決をとる
+	TArray<uint8> InsideVotes;
+	InsideVotes.SetNumZeroed(NumPoints);
+	const int32 Strides[3] = {1, Resolution.X, Resolution.X * Resolution.Y};
+
+	for (int32 Axis = 0; Axis < 3; ++Axis)
+	{
+		const int32 AxisU = (Axis + 1) % 3;
+		const int32 AxisV = (Axis + 2) % 3;
+
+		ParallelFor(Resolution[AxisU] * Resolution[AxisV],
+			[&, Axis, AxisU, AxisV](int32 Row)
+			{
+				const int32 U = Row % Resolution[AxisU];
+				const int32 V = Row / Resolution[AxisU];
+				const float CoordU = Bounds.Min[AxisU] + U * CellSize[AxisU];
+				const float CoordV = Bounds.Min[AxisV] + V * CellSize[AxisV];
+
+				TArray<float> Hits;
+				for (int32 TriIdx = 0; TriIdx < NumTriangles; ++TriIdx)
+				{
+					const FBox& TriBounds = TriangleBounds[TriIdx];
+					if (CoordU < TriBounds.Min[AxisU] || CoordU > TriBounds.Max[AxisU] || CoordV < TriBounds.Min[AxisV] || CoordV > TriBounds.Max[AxisV])
+					{
+						continue;
+					}
+
+					float T;
+					if (IntersectAxisLine(TriangleVertices[TriIdx * 3], TriangleVertices[TriIdx * 3 + 1], TriangleVertices[TriIdx * 3 + 2], Axis, CoordU, CoordV, T))
+					{
+						Hits.Add(T);
+					}
+				}
+
+				if (Hits.Num() == 0)
+				{
+					return;
+				}
+
+				Hits.Sort();
+
+				const int32 RowStart = U * Strides[AxisU] + V * Strides[AxisV];
+				int32 NumHitsBefore = 0;
+				for (int32 i = 0; i < Resolution[Axis]; ++i)
+				{
+					const float Coord = Bounds.Min[Axis] + i * CellSize[Axis];
+					while (NumHitsBefore < Hits.Num() && Hits[NumHitsBefore] <= Coord)
+					{
+						++NumHitsBefore;
+					}
+
+					if ((Hits.Num() - NumHitsBefore) % 2 == 1)
+					{
+						++InsideVotes[RowStart + i * Strides[Axis]];
+					}
+				}
+			}
+		);
+	}
+
+	for (int32 i = 0; i < NumPoints; ++i)
+	{
+		if (InsideVotes[i] >= 2)
+		{
+			Distances[i] = -Distances[i];
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/ObjectMacros.h"
+#include "SignedDistanceField3D.generated.h"
+
+/**
+ * Signed distances sampled at Resolution.X * Resolution.Y * Resolution.Z grid points spanning Bounds (both ends inclusive).
+ * The distance is negative inside solids. Sampling is trilinear and positions outside Bounds are clamped onto Bounds.
+ */
+USTRUCT()
+struct FSignedDistanceField3D
+{
+	GENERATED_BODY()
+
+	UPROPERTY(VisibleAnywhere)
+	FBox Bounds = FBox(ForceInit);
+
+	UPROPERTY(VisibleAnywhere)
+	FIntVector Resolution = FIntVector::ZeroValue;
+
+	// X is the fastest axis.
+	UPROPERTY()
+	TArray<float> Distances;
+
+	bool IsValid() const;
+	FVector GetCellSize() const;
+
+	float Sample(const FVector& Position) const;
+	// OutGradient is the gradient of the trilinear interpolation and is not normalized.
+	float SampleWithGradient(const FVector& Position, FVector& OutGradient) const;
+
+	/**
+	 * Bakes the field from triangles given as 3 vertices each in the same space as InBounds.
+	 * The inside of the meshes is decided by the majority of the ray parities along the 3 axes, so the meshes should be closed.
+	 * It is a brute force bake in parallel on the CPU and is meant for offline use.
+	 */
+	void Build(const FBox& InBounds, const FIntVector& InResolution, const TArray<FVector>& TriangleVertices);
+};
@@ -0,0 +1,240 @@
+#include "SparseDensityVolume.h"
+#include "Async/ParallelFor.h"
+
+namespace
+{
+	// パーティクル単位の並列処理の1タスクあたりのパーティクル数
+	const int32 NumParticlesPerTask = 4096;
+}
+
+void FSparseDensityVolume::Initialize(const FBox& InBounds, const FIntVector& InResolution)
+{
+	check(InBounds.IsValid);
+	check(InResolution.X > 0 && InResolution.Y > 0 && InResolution.Z > 0);
+
+	Bounds = InBounds;
+	NumBricks = FIntVector(
+		FMath::DivideAndRoundUp(InResolution.X, BrickSize),
+		FMath::DivideAndRoundUp(InResolution.Y, BrickSize),
+		FMath::DivideAndRoundUp(InResolution.Z, BrickSize)
+	);
+	VoxelSize = Bounds.GetSize() / FVector(GetResolution());
+
+	const int32 NumBricksTotal = NumBricks.X * NumBricks.Y * NumBricks.Z;
+	BrickParticleCounts.SetNumZeroed(NumBricksTotal);
+	BrickToActive.Init(INDEX_NONE, NumBricksTotal);
+	ActiveBricks.Reset();
+	DenseDensities.Reset();
+	ExportedBricks.Reset();
+}
+
+FIntVector FSparseDensityVolume::GetActiveBrickCoord(int32 ActiveBrickIdx) const
+{
+	return GetBrickCoord(ActiveBricks[ActiveBrickIdx]);
+}
+
+FIntVector FSparseDensityVolume::GetBrickCoord(int32 BrickIdx) const
+{
+	return FIntVector(BrickIdx % NumBricks.X, (BrickIdx / NumBricks.X) % NumBricks.Y, BrickIdx / (NumBricks.X * NumBricks.Y));
+}
+
+bool FSparseDensityVolume::GetBrickRange(const FVector& Position, float SmoothLength, FIntVector& OutMin, FIntVector& OutMax) const
+{
+	const FVector& BrickExtent = VoxelSize * BrickSize;
+	const FVector& MinCoord = (Position - FVector(SmoothLength) - Bounds.Min) / BrickExtent;
+	const FVector& MaxCoord = (Position + FVector(SmoothLength) - Bounds.Min) / BrickExtent;
+
+	OutMin = FIntVector(FMath::Max(FMath::FloorToInt(MinCoord.X), 0), FMath::Max(FMath::FloorToInt(MinCoord.Y), 0), FMath::Max(FMath::FloorToInt(MinCoord.Z), 0));
+	OutMax = FIntVector(FMath::Min(FMath::FloorToInt(MaxCoord.X), NumBricks.X - 1), FMath::Min(FMath::FloorToInt(MaxCoord.Y), NumBricks.Y - 1), FMath::Min(FMath::FloorToInt(MaxCoord.Z), NumBricks.Z - 1));
+	return OutMin.X <= OutMax.X && OutMin.Y <= OutMax.Y && OutMin.Z <= OutMax.Z;
+}
+
+void FSparseDensityVolume::Rasterize(const FVector* Positions, int32 NumParticles, float SmoothLength, float KernelCoef)
+{
+	check(BrickParticleCounts.Num() > 0);
+
+	const int32 NumTasks = FMath::DivideAndRoundUp(NumParticles, NumParticlesPerTask);
+	const int32 NumBricksTotal = BrickParticleCounts.Num();
+
+	// 1. ブリックごとのパーティクル数を数え、初めて使われたブリックを登録する
+	ActiveBricks.SetNumUninitialized(NumBricksTotal);
+	int32 NumActiveBricks = 0;
+	ParallelFor(NumTasks,
+		[this, Positions, NumParticles, SmoothLength, &NumActiveBricks](int32 TaskIdx)
+		{
+			const int32 EndIdx = FMath::Min((TaskIdx + 1) * NumParticlesPerTask, NumParticles);
+			for (int32 ParticleIdx = TaskIdx * NumParticlesPerTask; ParticleIdx < EndIdx; ++ParticleIdx)
+			{
+				FIntVector Min, Max;
+				if (!GetBrickRange(Positions[ParticleIdx], SmoothLength, Min, Max))
+				{
+					continue;
+				}
+
+				for (int32 Z = Min.Z; Z <= Max.Z; ++Z)
+				for (int32 Y = Min.Y; Y <= Max.Y; ++Y)
+				for (int32 X = Min.X; X <= Max.X; ++X)
+				{
+					int32 BrickIdx = X + NumBricks.X * (Y + NumBricks.Y * Z);
+					if (FPlatformAtomics::InterlockedIncrement(&BrickParticleCounts[BrickIdx]) == 1)
+					{
+						ActiveBricks[FPlatformAtomics::InterlockedIncrement(&NumActiveBricks) - 1] = BrickIdx;
+					}
+				}
+			}
+		}
+	);
+
+	// 登録順はスレッドのタイミングで変わるので、出力を決定的にするためにソートする
+	ActiveBricks.SetNum(NumActiveBricks, false);
+	ActiveBricks.Sort();
+
+	// 2. 使われたブリックだけの累積和でパーティクルリストの範囲を決める
+	ActiveBrickOffsets.SetNumUninitialized(NumActiveBricks + 1);
+	ActiveBrickOffsets[0] = 0;
+	for (int32 ActiveBrickIdx = 0; ActiveBrickIdx < NumActiveBricks; ++ActiveBrickIdx)
+	{
+		int32 BrickIdx = ActiveBricks[ActiveBrickIdx];
+		BrickToActive[BrickIdx] = ActiveBrickIdx;
+		ActiveBrickOffsets[ActiveBrickIdx + 1] = ActiveBrickOffsets[ActiveBrickIdx] + BrickParticleCounts[BrickIdx];
+	}
+	ActiveBrickCursors = ActiveBrickOffsets;
+	BrickParticles.SetNumUninitialized(ActiveBrickOffsets[NumActiveBricks]);
+
+	// 3. ブリックごとのパーティクルリストを埋める
+	ParallelFor(NumTasks,
+		[this, Positions, NumParticles, SmoothLength](int32 TaskIdx)
+		{
+			const int32 EndIdx = FMath::Min((TaskIdx + 1) * NumParticlesPerTask, NumParticles);
+			for (int32 ParticleIdx = TaskIdx * NumParticlesPerTask; ParticleIdx < EndIdx; ++ParticleIdx)
+			{
+				FIntVector Min, Max;
+				if (!GetBrickRange(Positions[ParticleIdx], SmoothLength, Min, Max))
+				{
+					continue;
+				}
+
+				for (int32 Z = Min.Z; Z <= Max.Z; ++Z)
+				for (int32 Y = Min.Y; Y <= Max.Y; ++Y)
+				for (int32 X = Min.X; X <= Max.X; ++X)
+				{
+					int32 ActiveBrickIdx = BrickToActive[X + NumBricks.X * (Y + NumBricks.Y * Z)];
+					BrickParticles[FPlatformAtomics::InterlockedIncrement(&ActiveBrickCursors[ActiveBrickIdx]) - 1] = ParticleIdx;
+				}
+			}
+		}
+	);
+
+	// 4. ブリック単位で並列にスプラットする。ブリックは1タスクが占有するので書き込みの競合はない
+	BrickDensities.SetNumUninitialized(NumActiveBricks * NumVoxelsPerBrick);
+	const float SmoothLenSq = SmoothLength * SmoothLength;
+	ParallelFor(NumActiveBricks,
+		[this, Positions, SmoothLength, SmoothLenSq, KernelCoef](int32 ActiveBrickIdx)
+		{
+			float* Densities = BrickDensities.GetData() + ActiveBrickIdx * NumVoxelsPerBrick;
+			FMemory::Memzero(Densities, NumVoxelsPerBrick * sizeof(float));
+
+			// 加算順を決定的にする
+			int32* Particles = BrickParticles.GetData() + ActiveBrickOffsets[ActiveBrickIdx];
+			const int32 NumBrickParticles = ActiveBrickOffsets[ActiveBrickIdx + 1] - ActiveBrickOffsets[ActiveBrickIdx];
+			Sort(Particles, NumBrickParticles);
+
+			const FIntVector& BrickVoxelMin = GetActiveBrickCoord(ActiveBrickIdx) * BrickSize;
+			const FVector& BrickOrigin = Bounds.Min + (FVector(BrickVoxelMin) + FVector(0.5f)) * VoxelSize;
+
+			for (int32 i = 0; i < NumBrickParticles; ++i)
+			{
+				// ブリック内のボクセル座標でのカーネルの範囲
+				const FVector& LocalPos = (Positions[Particles[i]] - BrickOrigin) / VoxelSize;
+				const FVector& LocalExtent = FVector(SmoothLength) / VoxelSize;
+				const int32 MinX = FMath::Max(FMath::CeilToInt(LocalPos.X - LocalExtent.X), 0);
+				const int32 MinY = FMath::Max(FMath::CeilToInt(LocalPos.Y - LocalExtent.Y), 0);
+				const int32 MinZ = FMath::Max(FMath::CeilToInt(LocalPos.Z - LocalExtent.Z), 0);
+				const int32 MaxX = FMath::Min(FMath::FloorToInt(LocalPos.X + LocalExtent.X), BrickSize - 1);
+				const int32 MaxY = FMath::Min(FMath::FloorToInt(LocalPos.Y + LocalExtent.Y), BrickSize - 1);
+				const int32 MaxZ = FMath::Min(FMath::FloorToInt(LocalPos.Z + LocalExtent.Z), BrickSize - 1);
+
+				for (int32 Z = MinZ; Z <= MaxZ; ++Z)
+				{
+					const float DiffZ = (Z - LocalPos.Z) * VoxelSize.Z;
+					for (int32 Y = MinY; Y <= MaxY; ++Y)
+					{
+						const float DiffY = (Y - LocalPos.Y) * VoxelSize.Y;
+						const float DistanceSqYZ = DiffY * DiffY + DiffZ * DiffZ;
+						if (DistanceSqYZ >= SmoothLenSq)
+						{
+							continue;
+						}
+
+						float* Row = Densities + BrickSize * (Y + BrickSize * Z);
+						for (int32 X = MinX; X <= MaxX; ++X)
+						{
+							const float DiffX = (X - LocalPos.X) * VoxelSize.X;
+							const float DiffLenSq = SmoothLenSq - DistanceSqYZ - DiffX * DiffX;
+							if (DiffLenSq > 0.0f)
+							{
+								Row[X] += KernelCoef * DiffLenSq * DiffLenSq * DiffLenSq;
+							}
+						}
+					}
+				}
+			}
+		}
+	);
+
+	// 5. 次回のために使った要素だけ初期値に戻す
+	for (int32 BrickIdx : ActiveBricks)
+	{
+		BrickParticleCounts[BrickIdx] = 0;
+		BrickToActive[BrickIdx] = INDEX_NONE;
+	}
+}
+
+const TArray<float>& FSparseDensityVolume::ExportDense()
+{
+	const FIntVector& Resolution = GetResolution();
+	const int32 NumVoxels = Resolution.X * Resolution.Y * Resolution.Z;
+
+	// 配列はこのクラスが持っていて、Initialize()で空にするまでは前回書いたブリック以外は0のままなので、そのブリックだけを0に戻す
+	if (DenseDensities.Num() == NumVoxels)
+	{
+		ParallelFor(ExportedBricks.Num(),
+			[this, &Resolution](int32 ExportedBrickIdx)
+			{
+				const FIntVector& VoxelMin = GetBrickCoord(ExportedBricks[ExportedBrickIdx]) * BrickSize;
+				for (int32 Z = 0; Z < BrickSize; ++Z)
+				{
+					for (int32 Y = 0; Y < BrickSize; ++Y)
+					{
+						float* Dst = DenseDensities.GetData() + VoxelMin.X + Resolution.X * (VoxelMin.Y + Y + Resolution.Y * (VoxelMin.Z + Z));
+						FMemory::Memzero(Dst, BrickSize * sizeof(float));
+					}
+				}
+			}
+		);
+	}
+	else
+	{
+		DenseDensities.SetNumUninitialized(NumVoxels);
+		FMemory::Memzero(DenseDensities.GetData(), NumVoxels * sizeof(float));
+	}
+
+	ParallelFor(ActiveBricks.Num(),
+		[this, &Resolution](int32 ActiveBrickIdx)
+		{
+			const FIntVector& VoxelMin = GetActiveBrickCoord(ActiveBrickIdx) * BrickSize;
+			const float* Densities = GetActiveBrickDensities(ActiveBrickIdx);
+			for (int32 Z = 0; Z < BrickSize; ++Z)
+			{
+				for (int32 Y = 0; Y < BrickSize; ++Y)
+				{
+					float* Dst = DenseDensities.GetData() + VoxelMin.X + Resolution.X * (VoxelMin.Y + Y + Resolution.Y * (VoxelMin.Z + Z));
+					FMemory::Memcpy(Dst, Densities + BrickSize * (Y + BrickSize * Z), BrickSize * sizeof(float));
+				}
+			}
+		}
+	);
+
+	ExportedBricks = ActiveBricks;
+	return DenseDensities;
+}
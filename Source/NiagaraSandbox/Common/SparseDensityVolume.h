@@ -0,0 +1,60 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Density volume rasterized from particles with the SPH poly6 kernel shape KernelCoef * (SmoothLength^2 - r^2)^3.
+ * The volume is divided into bricks of BrickSize^3 voxels and only the bricks which the kernels of the particles touch are rasterized,
+ * so the cost is proportional to the number of particles instead of the volume.
+ * Voxel (i, j, k) is centered at Bounds.Min + (FVector(i, j, k) + 0.5) * GetVoxelSize() and X is the fastest axis in all voxel arrays.
+ */
+class FSparseDensityVolume
+{
+public:
+	static const int32 BrickSize = 8;
+	static const int32 NumVoxelsPerBrick = BrickSize * BrickSize * BrickSize;
+
+	// Resolution is the number of voxels per axis and is rounded up to a multiple of BrickSize.
+	void Initialize(const FBox& InBounds, const FIntVector& InResolution);
+	void Rasterize(const FVector* Positions, int32 NumParticles, float SmoothLength, float KernelCoef);
+
+	const FBox& GetBounds() const { return Bounds; }
+	FIntVector GetResolution() const { return NumBricks * BrickSize; }
+	FIntVector GetNumBricks() const { return NumBricks; }
+	FVector GetVoxelSize() const { return VoxelSize; }
+
+	// the bricks rasterized by the last Rasterize()
+	int32 GetNumActiveBricks() const { return ActiveBricks.Num(); }
+	FIntVector GetActiveBrickCoord(int32 ActiveBrickIdx) const;
+	// NumVoxelsPerBrick densities of the brick
+	const float* GetActiveBrickDensities(int32 ActiveBrickIdx) const { return BrickDensities.GetData() + ActiveBrickIdx * NumVoxelsPerBrick; }
+
+	// All voxels of GetResolution() in the array owned by the volume. The voxels out of the active bricks are 0.
+	// The array is reused, so only the bricks of the previous ExportDense() are cleared instead of the whole volume.
+	// It is overwritten by the next ExportDense() and cleared by Initialize().
+	const TArray<float>& ExportDense();
+
+private:
+	FIntVector GetBrickCoord(int32 BrickIdx) const;
+	bool GetBrickRange(const FVector& Position, float SmoothLength, FIntVector& OutMin, FIntVector& OutMax) const;
+
+private:
+	FBox Bounds = FBox(ForceInit);
+	FIntVector NumBricks = FIntVector::ZeroValue;
+	FVector VoxelSize = FVector::ZeroVector;
+
+	// ブリック単位の密な配列。Rasterize()の終わりに使った要素だけ0に戻すので、毎回の全体のクリアは不要
+	TArray<int32> BrickParticleCounts;
+	TArray<int32> BrickToActive;
+
+	// 使われたブリックの線形インデックスとそのパーティクルリスト
+	TArray<int32> ActiveBricks;
+	TArray<int32> ActiveBrickOffsets;
+	TArray<int32> ActiveBrickCursors;
+	TArray<int32> BrickParticles;
+	TArray<float> BrickDensities;
+
+	// ExportDense()の出力と、そこに書き込んだブリック。次の出力ではこのブリックだけを0に戻す
+	TArray<float> DenseDensities;
+	TArray<int32> ExportedBricks;
+};
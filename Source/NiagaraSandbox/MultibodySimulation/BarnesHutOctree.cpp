@@ -0,0 +1,337 @@
+#include "BarnesHutOctree.h"
+#include "Async/ParallelFor.h"
+#include "MultibodyGravity.h"
+
+namespace
+{
+	// 1軸21bitで64bitのモートンコードに収める
+	const int32 MaxDepth = 21;
+	const uint32 MaxCoordinate = (1u << MaxDepth) - 1;
+
+	uint64 SpreadBits(uint32 Value)
+	{
+		uint64 X = Value & 0x1fffff;
+		X = (X | X << 32) & 0x1f00000000ffffull;
+		X = (X | X << 16) & 0x1f0000ff0000ffull;
+		X = (X | X << 8) & 0x100f00f00f00f00full;
+		X = (X | X << 4) & 0x10c30c30c30c30c3ull;
+		X = (X | X << 2) & 0x1249249249249249ull;
+		return X;
+	}
+
+	// Levelの深さのノードを子に分けるときの3bitの桁
+	uint32 GetOctant(uint64 Code, int32 Level)
+	{
+		return (uint32)(Code >> (3 * (MaxDepth - 1 - Level))) & 7;
+	}
+
+	// ソート済みの[First, First + Num)で、Levelの桁がOctant以上になる最初の位置
+	int32 LowerBoundOctant(const TArray<uint64>& Codes, int32 First, int32 Num, int32 Level, uint32 Octant)
+	{
+		int32 Low = First;
+		int32 High = First + Num;
+		while (Low < High)
+		{
+			int32 Mid = (Low + High) / 2;
+			if (GetOctant(Codes[Mid], Level) < Octant)
+			{
+				Low = Mid + 1;
+			}
+			else
+			{
+				High = Mid;
+			}
+		}
+		return Low;
+	}
+}
+
+void FBarnesHutOctree::Build(TArrayView<const FVector> Positions, TArrayView<const float> Masses, int32 MaxBodiesPerLeaf)
+{
+	check(Positions.Num() == Masses.Num());
+	check(MaxBodiesPerLeaf > 0);
+
+	const int32 NumBodies = Positions.Num();
+	Nodes.Reset();
+	LevelOffsets.Reset();
+	if (NumBodies == 0)
+	{
+		return;
+	}
+
+	// ルートは全物体を含む立方体にし、同じ深さのノードの大きさをそろえる
+	FBox Bounds(ForceInit);
+	for (const FVector& Position : Positions)
+	{
+		Bounds += Position;
+	}
+	const float RootSize = FMath::Max(Bounds.GetExtent().GetMax() * 2.0f, KINDA_SMALL_NUMBER);
+	const FVector RootMin = Bounds.GetCenter() - FVector(RootSize * 0.5f);
+	const float ToCoordinate = MaxCoordinate / RootSize;
+
+	SortedCodes.SetNumUninitialized(NumBodies);
+	SortedIndices.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[this, &Positions, &RootMin, ToCoordinate](int32 i)
+		{
+			const FVector& Coordinate = (Positions[i] - RootMin) * ToCoordinate;
+			SortedCodes[i] = SpreadBits((uint32)FMath::Clamp(Coordinate.X, 0.0f, (float)MaxCoordinate))
+				| SpreadBits((uint32)FMath::Clamp(Coordinate.Y, 0.0f, (float)MaxCoordinate)) << 1
+				| SpreadBits((uint32)FMath::Clamp(Coordinate.Z, 0.0f, (float)MaxCoordinate)) << 2;
+			SortedIndices[i] = i;
+		}
+	);
+
+	// 同じコードの物体の順序もインデックスで決めて、結果を毎回同じにする
+	SortedIndices.Sort(
+		[this](int32 A, int32 B)
+		{
+			return SortedCodes[A] < SortedCodes[B] || (SortedCodes[A] == SortedCodes[B] && A < B);
+		}
+	);
+
+	// SortedCodesはまだ元の順序なので、並べ替えた結果は一度別の配列に作る
+	TArray<uint64> Codes;
+	Codes.SetNumUninitialized(NumBodies);
+	SortedPositions.SetNumUninitialized(NumBodies);
+	SortedMasses.SetNumUninitialized(NumBodies);
+	InverseSortedIndices.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[this, &Positions, &Masses, &Codes](int32 i)
+		{
+			int32 BodyIdx = SortedIndices[i];
+			InverseSortedIndices[BodyIdx] = i;
+			Codes[i] = SortedCodes[BodyIdx];
+			SortedPositions[i] = Positions[BodyIdx];
+			SortedMasses[i] = Masses[BodyIdx];
+		}
+	);
+	SortedCodes = MoveTemp(Codes);
+
+	FNode& Root = Nodes.AddDefaulted_GetRef();
+	Root.Center = RootMin + FVector(RootSize * 0.5f);
+	Root.Size = RootSize;
+	Root.FirstChild = INDEX_NONE;
+	Root.NumChildren = 0;
+	Root.FirstBody = 0;
+	Root.NumBodies = NumBodies;
+
+	// 深さごとに、子の数を数える、プレフィックスサムで子の位置を決める、子を作る、の順に並列に分割する
+	LevelOffsets.Add(0);
+	for (int32 Level = 0; Level < MaxDepth; ++Level)
+	{
+		const int32 LevelStart = LevelOffsets.Last();
+		const int32 NumLevelNodes = Nodes.Num() - LevelStart;
+		if (NumLevelNodes == 0)
+		{
+			break;
+		}
+		LevelOffsets.Add(Nodes.Num());
+
+		ChildCounts.SetNumUninitialized(NumLevelNodes + 1);
+		ParallelFor(NumLevelNodes,
+			[this, LevelStart, Level, MaxBodiesPerLeaf](int32 i)
+			{
+				const FNode& Node = Nodes[LevelStart + i];
+				int32 NumChildren = 0;
+				if (Node.NumBodies > MaxBodiesPerLeaf)
+				{
+					for (uint32 Octant = 0; Octant < 8; ++Octant)
+					{
+						int32 Begin = LowerBoundOctant(SortedCodes, Node.FirstBody, Node.NumBodies, Level, Octant);
+						int32 End = LowerBoundOctant(SortedCodes, Node.FirstBody, Node.NumBodies, Level, Octant + 1);
+						NumChildren += Begin < End ? 1 : 0;
+					}
+				}
+				ChildCounts[i] = NumChildren;
+			}
+		);
+
+		int32 NumLevelChildren = 0;
+		for (int32 i = 0; i < NumLevelNodes; ++i)
+		{
+			int32 NumChildren = ChildCounts[i];
+			ChildCounts[i] = NumLevelChildren;
+			NumLevelChildren += NumChildren;
+		}
+		ChildCounts[NumLevelNodes] = NumLevelChildren;
+
+		const int32 ChildStart = Nodes.Num();
+		Nodes.AddUninitialized(NumLevelChildren);
+		ParallelFor(NumLevelNodes,
+			[this, LevelStart, ChildStart, Level](int32 i)
+			{
+				FNode& Node = Nodes[LevelStart + i];
+				Node.NumChildren = ChildCounts[i + 1] - ChildCounts[i];
+				Node.FirstChild = Node.NumChildren > 0 ? ChildStart + ChildCounts[i] : INDEX_NONE;
+				if (Node.NumChildren == 0)
+				{
+					return;
+				}
+
+				const float ChildSize = Node.Size * 0.5f;
+				int32 ChildIdx = Node.FirstChild;
+				for (uint32 Octant = 0; Octant < 8; ++Octant)
+				{
+					int32 Begin = LowerBoundOctant(SortedCodes, Node.FirstBody, Node.NumBodies, Level, Octant);
+					int32 End = LowerBoundOctant(SortedCodes, Node.FirstBody, Node.NumBodies, Level, Octant + 1);
+					if (Begin == End)
+					{
+						continue;
+					}
+
+					// モートンコードのbitはX、Y、Zの順
+					const FVector Offset((Octant & 1) ? 0.5f : -0.5f, (Octant & 2) ? 0.5f : -0.5f, (Octant & 4) ? 0.5f : -0.5f);
+					FNode& Child = Nodes[ChildIdx++];
+					Child.Center = Node.Center + Offset * ChildSize;
+					Child.Size = ChildSize;
+					Child.FirstChild = INDEX_NONE;
+					Child.NumChildren = 0;
+					Child.FirstBody = Begin;
+					Child.NumBodies = End - Begin;
+				}
+			}
+		);
+	}
+
+	if (LevelOffsets.Last() != Nodes.Num())
+	{
+		LevelOffsets.Add(Nodes.Num());
+	}
+
+	ComputeMassProperties(false);
+}
+
+void FBarnesHutOctree::Refit(TArrayView<const FVector> Positions)
+{
+	check(Positions.Num() == SortedIndices.Num());
+
+	ParallelFor(Positions.Num(),
+		[this, &Positions](int32 i)
+		{
+			SortedPositions[i] = Positions[SortedIndices[i]];
+		}
+	);
+
+	ComputeMassProperties(true);
+}
+
+void FBarnesHutOctree::ComputeMassProperties(bool bExpandBounds)
+{
+	// 質量と重心は深い方から並列に集める
+	for (int32 Level = LevelOffsets.Num() - 2; Level >= 0; --Level)
+	{
+		const int32 LevelStart = LevelOffsets[Level];
+		ParallelFor(LevelOffsets[Level + 1] - LevelStart,
+			[this, LevelStart, bExpandBounds](int32 i)
+			{
+				FNode& Node = Nodes[LevelStart + i];
+				float Mass = 0.0f;
+				FVector WeightedPosition = FVector::ZeroVector;
+				// 中心からの最大のずれ。ノードの立方体がはみ出した物体も含むようにして、開く判定を保守的に保つ
+				float HalfSize = Node.Size * 0.5f;
+				if (Node.FirstChild == INDEX_NONE)
+				{
+					for (int32 BodyIdx = Node.FirstBody; BodyIdx < Node.FirstBody + Node.NumBodies; ++BodyIdx)
+					{
+						Mass += SortedMasses[BodyIdx];
+						WeightedPosition += SortedMasses[BodyIdx] * SortedPositions[BodyIdx];
+						if (bExpandBounds)
+						{
+							HalfSize = FMath::Max(HalfSize, (SortedPositions[BodyIdx] - Node.Center).GetAbsMax());
+						}
+					}
+				}
+				else
+				{
+					for (int32 ChildIdx = Node.FirstChild; ChildIdx < Node.FirstChild + Node.NumChildren; ++ChildIdx)
+					{
+						const FNode& Child = Nodes[ChildIdx];
+						Mass += Child.Mass;
+						WeightedPosition += Child.Mass * Child.CenterOfMass;
+						if (bExpandBounds)
+						{
+							HalfSize = FMath::Max(HalfSize, (Child.Center - Node.Center).GetAbsMax() + Child.Size * 0.5f);
+						}
+					}
+				}
+
+				Node.Mass = Mass;
+				Node.CenterOfMass = Mass > SMALL_NUMBER ? WeightedPosition / Mass : Node.Center;
+				Node.Size = HalfSize * 2.0f;
+			}
+		);
+	}
+}
+
+void FBarnesHutOctree::ComputeAccelerations(float Gravity, float OpeningAngle, TArrayView<FVector> OutAccelerations) const
+{
+	check(OutAccelerations.Num() == SortedIndices.Num());
+
+	// ソート順に処理すると、隣り合う物体が同じノードをたどるのでキャッシュに乗りやすい
+	const float OpeningAngleSq = OpeningAngle * OpeningAngle;
+	ParallelFor(SortedIndices.Num(),
+		[this, Gravity, OpeningAngleSq, &OutAccelerations](int32 i)
+		{
+			OutAccelerations[SortedIndices[i]] = ComputeAcceleration(i, Gravity, OpeningAngleSq);
+		}
+	);
+}
+
+void FBarnesHutOctree::ComputeAccelerations(float Gravity, float OpeningAngle, TArrayView<const int32> BodyIndices, TArrayView<FVector> OutAccelerations) const
+{
+	check(OutAccelerations.Num() == SortedIndices.Num());
+
+	const float OpeningAngleSq = OpeningAngle * OpeningAngle;
+	ParallelFor(BodyIndices.Num(),
+		[this, Gravity, OpeningAngleSq, &BodyIndices, &OutAccelerations](int32 i)
+		{
+			const int32 BodyIdx = BodyIndices[i];
+			OutAccelerations[BodyIdx] = ComputeAcceleration(InverseSortedIndices[BodyIdx], Gravity, OpeningAngleSq);
+		}
+	);
+}
+
+FVector FBarnesHutOctree::ComputeAcceleration(int32 SortedBodyIdx, float Gravity, float OpeningAngleSq) const
+{
+	const FVector& Position = SortedPositions[SortedBodyIdx];
+	FVector Acceleration = FVector::ZeroVector;
+
+	// 1段で積むのは最大8個なので、深さ分あれば足りる
+	int32 Stack[8 * (MaxDepth + 1)];
+	int32 StackSize = 0;
+	Stack[StackSize++] = 0;
+
+	while (StackSize > 0)
+	{
+		const FNode& Node = Nodes[Stack[--StackSize]];
+		const FVector& Diff = Node.CenterOfMass - Position;
+
+		if (Node.FirstChild == INDEX_NONE)
+		{
+			for (int32 BodyIdx = Node.FirstBody; BodyIdx < Node.FirstBody + Node.NumBodies; ++BodyIdx)
+			{
+				if (BodyIdx != SortedBodyIdx)
+				{
+					Acceleration += FMultibodyGravity::GetAcceleration(SortedPositions[BodyIdx] - Position, SortedMasses[BodyIdx], Gravity);
+				}
+			}
+			continue;
+		}
+
+		// 自分を含むノードは重心が遠くても必ず開く。Refit()後は物体が立方体の外にもいるので、物体の範囲で判定する
+		bool bContains = SortedBodyIdx >= Node.FirstBody && SortedBodyIdx < Node.FirstBody + Node.NumBodies;
+		if (!bContains && Node.Size * Node.Size < OpeningAngleSq * Diff.SizeSquared())
+		{
+			Acceleration += FMultibodyGravity::GetAcceleration(Diff, Node.Mass, Gravity);
+			continue;
+		}
+
+		for (int32 ChildIdx = Node.FirstChild; ChildIdx < Node.FirstChild + Node.NumChildren; ++ChildIdx)
+		{
+			Stack[StackSize++] = ChildIdx;
+		}
+	}
+
+	return Acceleration;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Octree of bodies for the Barnes-Hut approximation of the gravity of AMultibodySimulator.
+ * Build() sorts the bodies by Morton code in a cubic root bounds and splits the sorted range level by level in parallel.
+ * A node farther than its size / OpeningAngle is approximated by its total mass at its center of mass.
+ * Refit() keeps the nodes and updates only their bounds and centers of mass for moved bodies in O(N), which is cheaper than
+ * Build() but loosens the tree as the bodies move, so it should be rebuilt periodically.
+ */
+class FBarnesHutOctree
+{
+public:
+	void Build(TArrayView<const FVector> Positions, TArrayView<const float> Masses, int32 MaxBodiesPerLeaf);
+	/** Updates the tree for new positions of the same bodies as the last Build(). The masses are kept. */
+	void Refit(TArrayView<const FVector> Positions);
+
+	/** Accelerations of all bodies given to Build() in the original order. Computed in parallel. */
+	void ComputeAccelerations(float Gravity, float OpeningAngle, TArrayView<FVector> OutAccelerations) const;
+	/** Accelerations of the bodies of BodyIndices only. The other elements of OutAccelerations are not touched. */
+	void ComputeAccelerations(float Gravity, float OpeningAngle, TArrayView<const int32> BodyIndices, TArrayView<FVector> OutAccelerations) const;
+
+	int32 GetNumBodies() const { return SortedIndices.Num(); }
+	int32 GetNumNodes() const { return Nodes.Num(); }
+	int32 GetDepth() const { return LevelOffsets.Num() - 1; }
+
+private:
+	struct FNode
+	{
+		FVector Center;
+		FVector CenterOfMass;
+		float Mass;
+		// 立方体の一辺の長さ。Refit()では物体が出ないように中心を保ったまま広げる
+		float Size;
+		// 子は連続して並ぶ。葉のときはINDEX_NONE
+		int32 FirstChild;
+		int32 NumChildren;
+		// ソート済みの物体の範囲
+		int32 FirstBody;
+		int32 NumBodies;
+	};
+
+	void ComputeMassProperties(bool bExpandBounds);
+	FVector ComputeAcceleration(int32 SortedBodyIdx, float Gravity, float OpeningAngleSq) const;
+
+private:
+	TArray<FNode> Nodes;
+	// 深さごとのNodesの開始位置。末尾はNodes.Num()
+	TArray<int32> LevelOffsets;
+	TArray<uint64> SortedCodes;
+	TArray<int32> SortedIndices;
+	// 元のインデックスからソート後のインデックスへの対応
+	TArray<int32> InverseSortedIndices;
+	TArray<FVector> SortedPositions;
+	TArray<float> SortedMasses;
+	TArray<int32> ChildCounts;
+};
@@ -1,5 +1,7 @@
 #include "MassPoint.h"
 #include "Components/StaticMeshComponent.h"
+#include "EngineUtils.h"
+#include "MultibodySimulator.h"
 
 AMassPoint::AMassPoint()
 {
@@ -11,7 +13,28 @@ void AMassPoint::BeginPlay()
 {
 	Super::BeginPlay();
 
-	Velocity = InitialVelocity;
-	Position = GetActorLocation();
+	AMultibodySimulator* TargetSimulator = Simulator;
+	if (TargetSimulator == nullptr)
+	{
+		TActorIterator<AMultibodySimulator> It(GetWorld());
+		TargetSimulator = It ? *It : nullptr;
+	}
+
+	// 位置と速度はシミュレータが持ち、毎フレームこのアクタの位置に書き戻す
+	if (TargetSimulator != nullptr)
+	{
+		TargetSimulator->RegisterMassPoint(this);
+		RegisteredSimulator = TargetSimulator;
+	}
 }
 
+void AMassPoint::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (AMultibodySimulator* TargetSimulator = RegisteredSimulator.Get())
+	{
+		TargetSimulator->UnregisterMassPoint(this);
+	}
+	RegisteredSimulator.Reset();
+
+	Super::EndPlay(EndPlayReason);
+}
@@ -24,10 +24,15 @@ public:
 	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
 	FVector InitialVelocity = FVector::ZeroVector;
 
-	FVector Position = FVector::ZeroVector;
-	FVector Velocity = FVector::ZeroVector;
+	/** Simulator which moves this mass point. If none, the first simulator in the world is used. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	class AMultibodySimulator* Simulator = nullptr;
 
 protected:
 	virtual void BeginPlay() override;
-};
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 
+private:
+	// シミュレータが先に破棄されることもあるので弱参照で持つ
+	TWeakObjectPtr<class AMultibodySimulator> RegisteredSimulator;
+};
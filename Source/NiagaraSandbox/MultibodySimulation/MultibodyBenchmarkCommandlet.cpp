@@ -0,0 +1,351 @@
+#include "MultibodyBenchmarkCommandlet.h"
+#include "HAL/FileManager.h"
+#include "Math/RandomStream.h"
+#include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
+#include "MultibodySolver.h"
+#include "MultibodyGravity.h"
+
+namespace
+{
+	// AMultibodySimulatorと同じ重力定数と物体の質量
+	const float Gravity = 10000.0f;
+	const float BodyMass = 1000.0f;
+	// エネルギーを測る回数。O(N^2)なので途中は間引く
+	const int32 NumEnergySamples = 10;
+
+	const TCHAR* SetupNames[] = {TEXT("Plummer"), TEXT("TwoBody"), TEXT("ColdCollapse")};
+
+	struct FSetup
+	{
+		// シミュレーションする時間
+		float Duration = 0.0f;
+		// 運動量のずれを正規化する速度の目安
+		float VelocityScale = 0.0f;
+	};
+
+	// Aarseth, Henon and Wielen (1974)のサンプリングによるプラマー球
+	FSetup CreatePlummer(FMultibodyState& State, int32 NumBodies, FRandomStream& RandomStream)
+	{
+		// 平均密度が物体数によらないようにスケール半径を決める
+		const float ScaleRadius = 100.0f * FMath::Pow(NumBodies / 1000.0f, 1.0f / 3.0f);
+		const float TotalMass = BodyMass * NumBodies;
+		const float VelocityUnit = FMath::Sqrt(Gravity * TotalMass / ScaleRadius);
+
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			float Radius = 0.0f;
+			do
+			{
+				Radius = 1.0f / FMath::Sqrt(FMath::Pow(FMath::Max(RandomStream.GetFraction(), SMALL_NUMBER), -2.0f / 3.0f) - 1.0f);
+			}
+			while (Radius > 20.0f);
+
+			// 速度はq^2 * (1 - q^2)^3.5に従うqを棄却法で選び、脱出速度に掛ける
+			float Q = 0.0f;
+			do
+			{
+				Q = RandomStream.GetFraction();
+			}
+			while (0.1f * RandomStream.GetFraction() > Q * Q * FMath::Pow(1.0f - Q * Q, 3.5f));
+			const float Speed = Q * FMath::Sqrt(2.0f) * FMath::Pow(1.0f + Radius * Radius, -0.25f);
+
+			State.Add(RandomStream.GetUnitVector() * Radius * ScaleRadius, RandomStream.GetUnitVector() * Speed * VelocityUnit, BodyMass);
+		}
+
+		// 重心を原点に置き、全運動量を0にする
+		FVector CenterOfMass = FVector::ZeroVector;
+		FVector MeanVelocity = FVector::ZeroVector;
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			CenterOfMass += State.Positions[i] / NumBodies;
+			MeanVelocity += State.Velocities[i] / NumBodies;
+		}
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			State.Positions[i] -= CenterOfMass;
+			State.Velocities[i] -= MeanVelocity;
+		}
+
+		FSetup Setup;
+		Setup.Duration = 2.0f * PI * FMath::Sqrt(ScaleRadius * ScaleRadius * ScaleRadius / (Gravity * TotalMass));
+		Setup.VelocityScale = VelocityUnit;
+		return Setup;
+	}
+
+	// 同じ質量の2体の円軌道を1周させる
+	FSetup CreateTwoBody(FMultibodyState& State)
+	{
+		const float Separation = 200.0f;
+		const float Speed = FMath::Sqrt(Gravity * BodyMass / (2.0f * Separation));
+		State.Add(FVector(Separation * 0.5f, 0.0f, 0.0f), FVector(0.0f, Speed, 0.0f), BodyMass);
+		State.Add(FVector(-Separation * 0.5f, 0.0f, 0.0f), FVector(0.0f, -Speed, 0.0f), BodyMass);
+
+		FSetup Setup;
+		Setup.Duration = 2.0f * PI * FMath::Sqrt(Separation * Separation * Separation / (Gravity * 2.0f * BodyMass));
+		Setup.VelocityScale = Speed;
+		return Setup;
+	}
+
+	// 静止した一様球を自由落下時間だけ崩壊させる。最後は中心に集まって近接遭遇が続く
+	FSetup CreateColdCollapse(FMultibodyState& State, int32 NumBodies, FRandomStream& RandomStream)
+	{
+		const float Radius = 100.0f * FMath::Pow(NumBodies / 1000.0f, 1.0f / 3.0f);
+		const float TotalMass = BodyMass * NumBodies;
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			State.Add(RandomStream.GetUnitVector() * Radius * FMath::Pow(RandomStream.GetFraction(), 1.0f / 3.0f), FVector::ZeroVector, BodyMass);
+		}
+
+		FSetup Setup;
+		Setup.Duration = 0.5f * PI * FMath::Sqrt(Radius * Radius * Radius / (2.0f * Gravity * TotalMass));
+		Setup.VelocityScale = FMath::Sqrt(Gravity * TotalMass / Radius);
+		return Setup;
+	}
+
+	FVector ComputeMomentum(const FMultibodyState& State)
+	{
+		FVector Momentum = FVector::ZeroVector;
+		for (int32 i = 0; i < State.Num(); ++i)
+		{
+			Momentum += State.Masses[i] * State.Velocities[i];
+		}
+		return Momentum;
+	}
+
+	template<typename EnumType>
+	bool ParseEnumList(const FString& Params, const TCHAR* Key, TArray<EnumType>& OutValues)
+	{
+		const UEnum* Enum = StaticEnum<EnumType>();
+		FString List;
+		if (!FParse::Value(*Params, Key, List, false))
+		{
+			// 指定がなければすべての値。末尾は_MAX
+			for (int32 Index = 0; Index < Enum->NumEnums() - 1; ++Index)
+			{
+				OutValues.Add((EnumType)Enum->GetValueByIndex(Index));
+			}
+			return true;
+		}
+
+		TArray<FString> Names;
+		List.ParseIntoArray(Names, TEXT(","));
+		for (const FString& Name : Names)
+		{
+			int64 Value = Enum->GetValueByNameString(Name);
+			if (Value == INDEX_NONE)
+			{
+				UE_LOG(LogTemp, Error, TEXT("Unknown %s %s."), *Enum->GetName(), *Name);
+				return false;
+			}
+			OutValues.Add((EnumType)Value);
+		}
+		return true;
+	}
+}
+
+UMultibodyBenchmarkCommandlet::UMultibodyBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 UMultibodyBenchmarkCommandlet::Main(const FString& Params)
+{
+	TArray<FString> Setups;
+	FString SetupList;
+	if (FParse::Value(*Params, TEXT("Setup="), SetupList, false))
+	{
+		SetupList.ParseIntoArray(Setups, TEXT(","));
+	}
+	else
+	{
+		for (const TCHAR* SetupName : SetupNames)
+		{
+			Setups.Add(SetupName);
+		}
+	}
+
+	TArray<int32> NumBodiesList;
+	FString NumBodiesString = TEXT("1024,4096");
+	FParse::Value(*Params, TEXT("NumBodies="), NumBodiesString, false);
+	TArray<FString> NumBodiesStrings;
+	NumBodiesString.ParseIntoArray(NumBodiesStrings, TEXT(","));
+	for (const FString& NumBodies : NumBodiesStrings)
+	{
+		NumBodiesList.Add(FMath::Max(FCString::Atoi(*NumBodies), 2));
+	}
+
+	TArray<EMultibodyGravitySolver> Solvers;
+	TArray<EMultibodyIntegrator> Integrators;
+	if (!ParseEnumList(Params, TEXT("Solver="), Solvers) || !ParseEnumList(Params, TEXT("Integrator="), Integrators))
+	{
+		return 1;
+	}
+
+	int32 NumSteps = 200;
+	FParse::Value(*Params, TEXT("NumSteps="), NumSteps);
+	NumSteps = FMath::Max(NumSteps, 1);
+
+	int32 Seed = 0;
+	FParse::Value(*Params, TEXT("Seed="), Seed);
+
+	bool bSucceeded = true;
+	TArray<FResult> Results;
+	for (const FString& Setup : Setups)
+	{
+		// 2体問題は物体数によらない
+		const bool bTwoBody = Setup == TEXT("TwoBody");
+		for (int32 NumBodiesIdx = 0; NumBodiesIdx < (bTwoBody ? 1 : NumBodiesList.Num()); ++NumBodiesIdx)
+		{
+			for (EMultibodyGravitySolver Solver : Solvers)
+			{
+				for (EMultibodyIntegrator Integrator : Integrators)
+				{
+					FResult& Result = Results.AddDefaulted_GetRef();
+					if (!RunCase(Setup, bTwoBody ? 2 : NumBodiesList[NumBodiesIdx], Solver, Integrator, NumSteps, Seed, Result))
+					{
+						Results.Pop();
+						return 1;
+					}
+					bSucceeded &= Result.bSucceeded;
+				}
+			}
+		}
+	}
+
+	WriteResults(Results);
+
+	return bSucceeded ? 0 : 1;
+}
+
+bool UMultibodyBenchmarkCommandlet::RunCase(const FString& Setup, int32 NumBodies, EMultibodyGravitySolver Solver, EMultibodyIntegrator Integrator, int32 NumSteps, int32 Seed, FResult& OutResult) const
+{
+	FMultibodySolver MultibodySolver;
+	FMultibodyState& State = MultibodySolver.GetState();
+	FRandomStream RandomStream(Seed);
+
+	FSetup SetupParams;
+	if (Setup == TEXT("Plummer"))
+	{
+		SetupParams = CreatePlummer(State, NumBodies, RandomStream);
+	}
+	else if (Setup == TEXT("TwoBody"))
+	{
+		SetupParams = CreateTwoBody(State);
+	}
+	else if (Setup == TEXT("ColdCollapse"))
+	{
+		SetupParams = CreateColdCollapse(State, NumBodies, RandomStream);
+	}
+	else
+	{
+		UE_LOG(LogTemp, Error, TEXT("Unknown setup %s."), *Setup);
+		return false;
+	}
+
+	FMultibodySolverSettings Settings;
+	Settings.Gravity = Gravity;
+	Settings.Solver = Solver;
+	Settings.Integrator = Integrator;
+
+	OutResult.Setup = Setup;
+	OutResult.NumBodies = State.Num();
+	OutResult.Solver = Solver;
+	OutResult.Integrator = Integrator;
+	OutResult.NumSteps = NumSteps;
+	OutResult.DeltaSeconds = SetupParams.Duration / NumSteps;
+
+	// 初期状態での力の誤差。同じ重力の法則の直接和と比べる
+	TArray<FVector> ReferenceAccelerations;
+	ReferenceAccelerations.SetNumUninitialized(State.Num());
+	FMultibodyGravity::ComputeDirect(State.Positions, State.Masses, Gravity, ReferenceAccelerations, Settings.GetEffectiveSofteningLength());
+	MultibodySolver.ComputeAccelerations(Settings);
+	FMultibodyGravity::MeasureRelativeError(State.Accelerations, ReferenceAccelerations, OutResult.ForceErrorMax, OutResult.ForceErrorRMS);
+
+	const int64 NumForceEvaluationsBefore = MultibodySolver.GetNumForceEvaluations();
+	const int64 NumBodyForceEvaluationsBefore = MultibodySolver.GetNumBodyForceEvaluations();
+	const double InitialEnergy = MultibodySolver.ComputeTotalEnergy(Settings);
+	const FVector InitialMomentum = ComputeMomentum(State);
+	const double TotalMass = BodyMass * OutResult.NumBodies;
+
+	auto GetEnergyDrift = [&MultibodySolver, &Settings, InitialEnergy]()
+	{
+		return (MultibodySolver.ComputeTotalEnergy(Settings) - InitialEnergy) / FMath::Max(FMath::Abs(InitialEnergy), (double)SMALL_NUMBER);
+	};
+
+	double StepTime = 0.0;
+	const int32 EnergySampleInterval = FMath::Max(NumSteps / NumEnergySamples, 1);
+	for (int32 Step = 0; Step < NumSteps; ++Step)
+	{
+		double StartTime = FPlatformTime::Seconds();
+		MultibodySolver.Step(Settings, OutResult.DeltaSeconds);
+		StepTime += FPlatformTime::Seconds() - StartTime;
+
+		if ((Step + 1) % EnergySampleInterval == 0 || Step + 1 == NumSteps)
+		{
+			OutResult.EnergyDrift = GetEnergyDrift();
+			OutResult.MaxEnergyDrift = FMath::Max(OutResult.MaxEnergyDrift, FMath::Abs(OutResult.EnergyDrift));
+		}
+	}
+
+	OutResult.WallTimePerStep = StepTime / NumSteps;
+	OutResult.NumForceEvaluations = MultibodySolver.GetNumForceEvaluations() - NumForceEvaluationsBefore;
+	OutResult.NumBodyForceEvaluations = MultibodySolver.GetNumBodyForceEvaluations() - NumBodyForceEvaluationsBefore;
+	// 近似のソルバーも直接和に換算した相互作用数で比べる
+	OutResult.InteractionsPerSecond = StepTime > 0.0 ? (double)OutResult.NumBodyForceEvaluations * (OutResult.NumBodies - 1) / StepTime : 0.0;
+	OutResult.MomentumDrift = (ComputeMomentum(State) - InitialMomentum).Size() / (TotalMass * SetupParams.VelocityScale);
+
+	// 力の近似は数%以内、2体の円軌道はシンプレクティックな積分器なら1周でエネルギーがほぼ保存されるはず
+	const bool bSymplectic = Integrator != EMultibodyIntegrator::SemiImplicitEuler;
+	OutResult.bSucceeded = OutResult.ForceErrorRMS < 0.05f && (!(Setup == TEXT("TwoBody") && bSymplectic) || OutResult.MaxEnergyDrift < 1.0e-3);
+
+	UE_LOG(LogTemp, Display, TEXT("Multibody %s: NumBodies=%d Solver=%s Integrator=%s Step=%.3fms Interactions=%.3g/s ForceError RMS=%g Max=%g EnergyDrift=%g (Max=%g) MomentumDrift=%g %s"),
+		*Setup, OutResult.NumBodies, *StaticEnum<EMultibodyGravitySolver>()->GetNameStringByValue((int64)Solver), *StaticEnum<EMultibodyIntegrator>()->GetNameStringByValue((int64)Integrator),
+		OutResult.WallTimePerStep * 1000.0, OutResult.InteractionsPerSecond, OutResult.ForceErrorRMS, OutResult.ForceErrorMax,
+		OutResult.EnergyDrift, OutResult.MaxEnergyDrift, OutResult.MomentumDrift,
+		OutResult.bSucceeded ? TEXT("OK") : TEXT("FAILED"));
+
+	return true;
+}
+
+void UMultibodyBenchmarkCommandlet::WriteResults(const TArray<FResult>& Results) const
+{
+	FString Csv = TEXT("Setup,NumBodies,Solver,Integrator,NumSteps,DeltaSeconds,WallTimePerStepMs,ForceEvaluations,BodyForceEvaluations,InteractionsPerSecond,ForceErrorRMS,ForceErrorMax,EnergyDrift,MaxEnergyDrift,MomentumDrift,Succeeded\n");
+	FString Json = TEXT("[\n");
+	for (int32 ResultIdx = 0; ResultIdx < Results.Num(); ++ResultIdx)
+	{
+		const FResult& Result = Results[ResultIdx];
+		const FString& SolverName = StaticEnum<EMultibodyGravitySolver>()->GetNameStringByValue((int64)Result.Solver);
+		const FString& IntegratorName = StaticEnum<EMultibodyIntegrator>()->GetNameStringByValue((int64)Result.Integrator);
+
+		Csv += FString::Printf(TEXT("%s,%d,%s,%s,%d,%g,%g,%lld,%lld,%g,%g,%g,%g,%g,%g,%d\n"),
+			*Result.Setup, Result.NumBodies, *SolverName, *IntegratorName, Result.NumSteps, Result.DeltaSeconds, Result.WallTimePerStep * 1000.0,
+			Result.NumForceEvaluations, Result.NumBodyForceEvaluations, Result.InteractionsPerSecond, Result.ForceErrorRMS, Result.ForceErrorMax,
+			Result.EnergyDrift, Result.MaxEnergyDrift, Result.MomentumDrift, Result.bSucceeded ? 1 : 0);
+
+		Json += FString::Printf(TEXT("\t{\"Setup\": \"%s\", \"NumBodies\": %d, \"Solver\": \"%s\", \"Integrator\": \"%s\", \"NumSteps\": %d, \"DeltaSeconds\": %g, \"WallTimePerStepMs\": %g, ")
+			TEXT("\"ForceEvaluations\": %lld, \"BodyForceEvaluations\": %lld, \"InteractionsPerSecond\": %g, \"ForceErrorRMS\": %g, \"ForceErrorMax\": %g, ")
+			TEXT("\"EnergyDrift\": %g, \"MaxEnergyDrift\": %g, \"MomentumDrift\": %g, \"Succeeded\": %s}%s\n"),
+			*Result.Setup, Result.NumBodies, *SolverName, *IntegratorName, Result.NumSteps, Result.DeltaSeconds, Result.WallTimePerStep * 1000.0,
+			Result.NumForceEvaluations, Result.NumBodyForceEvaluations, Result.InteractionsPerSecond, Result.ForceErrorRMS, Result.ForceErrorMax,
+			Result.EnergyDrift, Result.MaxEnergyDrift, Result.MomentumDrift, Result.bSucceeded ? TEXT("true") : TEXT("false"),
+			ResultIdx + 1 < Results.Num() ? TEXT(",") : TEXT(""));
+	}
+	Json += TEXT("]\n");
+
+	const FString& Directory = FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("MultibodyBenchmark"));
+	const FString& BaseName = FPaths::Combine(Directory, FDateTime::Now().ToString());
+	IFileManager::Get().MakeDirectory(*Directory, true);
+	if (!FFileHelper::SaveStringToFile(Csv, *(BaseName + TEXT(".csv"))) || !FFileHelper::SaveStringToFile(Json, *(BaseName + TEXT(".json"))))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Failed to write the benchmark results. Path = %s."), *BaseName);
+		return;
+	}
+
+	UE_LOG(LogTemp, Display, TEXT("Multibody benchmark results are written to %s.csv and .json."), *BaseName);
+}
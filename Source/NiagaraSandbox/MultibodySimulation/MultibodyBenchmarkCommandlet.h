@@ -0,0 +1,51 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MultibodyTypes.h"
+#include "MultibodyBenchmarkCommandlet.generated.h"
+
+/**
+ * Headless benchmark and accuracy check of the gravity solvers and the integrators of AMultibodySimulator.
+ * Each setup (Plummer sphere, two-body orbit, cold collapse) is simulated for one characteristic time in NumSteps steps by FMultibodySolver
+ * for every combination of NumBodies, solver and integrator, and the results are written as CSV and JSON into Saved/MultibodyBenchmark.
+ * Usage: UE4Editor-Cmd NiagaraSandbox -run=MultibodyBenchmark [-Setup=<Name,...>] [-NumBodies=<Num,...>] [-Solver=<Name,...>]
+ *        [-Integrator=<Name,...>] [-NumSteps=<Num>] [-Seed=<Seed>]
+ * Every solver and integrator is swept unless narrowed by -Solver and -Integrator. HierarchicalLeapfrog falls back to Leapfrog
+ * with DirectTiled and ParticleMesh, which evaluate all bodies anyway.
+ * Returns non zero if an accuracy check fails.
+ */
+UCLASS()
+class UMultibodyBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMultibodyBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	struct FResult
+	{
+		FString Setup;
+		int32 NumBodies = 0;
+		EMultibodyGravitySolver Solver = EMultibodyGravitySolver::Direct;
+		EMultibodyIntegrator Integrator = EMultibodyIntegrator::SemiImplicitEuler;
+		int32 NumSteps = 0;
+		float DeltaSeconds = 0.0f;
+		double WallTimePerStep = 0.0;
+		int64 NumForceEvaluations = 0;
+		int64 NumBodyForceEvaluations = 0;
+		double InteractionsPerSecond = 0.0;
+		float ForceErrorMax = 0.0f;
+		float ForceErrorRMS = 0.0f;
+		double EnergyDrift = 0.0;
+		double MaxEnergyDrift = 0.0;
+		double MomentumDrift = 0.0;
+		bool bSucceeded = true;
+	};
+
+	bool RunCase(const FString& Setup, int32 NumBodies, EMultibodyGravitySolver Solver, EMultibodyIntegrator Integrator, int32 NumSteps, int32 Seed, FResult& OutResult) const;
+	void WriteResults(const TArray<FResult>& Results) const;
+};
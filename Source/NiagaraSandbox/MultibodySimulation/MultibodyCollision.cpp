@@ -0,0 +1,265 @@
+#include "MultibodyCollision.h"
+#include "Async/ParallelFor.h"
+#include "MultibodyState.h"
+
+namespace
+{
+	const int32 NumBodiesPerTask = 1024;
+
+	// 階層の数の上限。最も細かいセルの2^(MaxLevels - 1)倍より大きな物体は最上位の階層に入れる
+	const int32 MaxLevels = 32;
+
+	uint32 HashCell(int32 Level, int32 X, int32 Y, int32 Z)
+	{
+		return (uint32)X * 73856093u ^ (uint32)Y * 19349663u ^ (uint32)Z * 83492791u ^ (uint32)Level * 2654435761u;
+	}
+}
+
+int32 FMultibodyCollision::MergeOverlappingBodies(FMultibodyState& State, float Density, TArray<int32>& OutRemovedBodies, TArray<int32>& OutMergedBodies)
+{
+	check(Density > 0.0f);
+
+	OutMergedBodies.Reset();
+
+	const int32 NumBodies = State.Num();
+	if (NumBodies < 2)
+	{
+		return 0;
+	}
+
+	Radii.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[this, &State, Density](int32 i)
+		{
+			Radii[i] = GetRadius(State.Masses[i], Density);
+		}
+	);
+
+	FindOverlappingPairs(State);
+	if (Pairs.Num() == 0)
+	{
+		return 0;
+	}
+
+	// 重なりが連鎖した物体はまとめて1つにする。根は常にグループ内の最小のインデックスにする
+	Parents.SetNumUninitialized(NumBodies);
+	for (int32 i = 0; i < NumBodies; ++i)
+	{
+		Parents[i] = i;
+	}
+
+	for (const FIntPoint& Pair : Pairs)
+	{
+		int32 RootA = FindRoot(Pair.X);
+		int32 RootB = FindRoot(Pair.Y);
+		if (RootA != RootB)
+		{
+			Parents[FMath::Max(RootA, RootB)] = FMath::Min(RootA, RootB);
+		}
+	}
+
+	struct FMergedBody
+	{
+		float Mass = 0.0f;
+		FVector WeightedPosition = FVector::ZeroVector;
+		FVector Momentum = FVector::ZeroVector;
+	};
+
+	// 重なった物体は少ないので、関わる物体だけを集計する
+	TArray<int32> InvolvedBodies;
+	InvolvedBodies.Reserve(Pairs.Num() * 2);
+	for (const FIntPoint& Pair : Pairs)
+	{
+		InvolvedBodies.Add(Pair.X);
+		InvolvedBodies.Add(Pair.Y);
+	}
+	InvolvedBodies.Sort();
+
+	TMap<int32, FMergedBody> MergedBodies;
+	TArray<int32> RemovedBodies;
+	for (int32 InvolvedIdx = 0; InvolvedIdx < InvolvedBodies.Num(); ++InvolvedIdx)
+	{
+		const int32 BodyIdx = InvolvedBodies[InvolvedIdx];
+		if (InvolvedIdx > 0 && BodyIdx == InvolvedBodies[InvolvedIdx - 1])
+		{
+			continue;
+		}
+
+		const int32 Root = FindRoot(BodyIdx);
+		FMergedBody& Merged = MergedBodies.FindOrAdd(Root);
+		Merged.Mass += State.Masses[BodyIdx];
+		Merged.WeightedPosition += State.Masses[BodyIdx] * State.Positions[BodyIdx];
+		Merged.Momentum += State.Masses[BodyIdx] * State.Velocities[BodyIdx];
+
+		if (BodyIdx != Root)
+		{
+			RemovedBodies.Add(BodyIdx);
+		}
+	}
+
+	for (const TPair<int32, FMergedBody>& Pair : MergedBodies)
+	{
+		OutMergedBodies.Add(Pair.Key);
+		const FMergedBody& Merged = Pair.Value;
+		State.Masses[Pair.Key] = Merged.Mass;
+		State.Positions[Pair.Key] = Merged.WeightedPosition / Merged.Mass;
+		State.Velocities[Pair.Key] = Merged.Momentum / Merged.Mass;
+	}
+
+	// 大きいインデックスから詰めれば、末尾から移ってくる物体が削除対象であることはない
+	RemovedBodies.Sort(TGreater<int32>());
+	for (int32 BodyIdx : RemovedBodies)
+	{
+		State.RemoveAtSwap(BodyIdx);
+	}
+	OutRemovedBodies.Append(RemovedBodies);
+
+	return RemovedBodies.Num();
+}
+
+void FMultibodyCollision::FindOverlappingPairs(const FMultibodyState& State)
+{
+	const int32 NumBodies = State.Num();
+
+	// 最も細かいセルは中央値の直径にする。最大の直径に合わせると、重い物体が1つあるだけで全体が1セルに入ってしまう
+	SortedRadii = Radii;
+	SortedRadii.Sort();
+	const float BaseCellSize = FMath::Max(2.0f * SortedRadii[NumBodies / 2], KINDA_SMALL_NUMBER);
+
+	// 物体はセルの大きさが直径以上になる階層に入れる。それより細かい階層の物体との重なりは、相手の側から見つける
+	Levels.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[this, BaseCellSize](int32 i)
+		{
+			const float Ratio = 2.0f * Radii[i] / BaseCellSize;
+			Levels[i] = Ratio > 1.0f ? FMath::Min(FMath::CeilToInt(FMath::Log2(Ratio)), MaxLevels - 1) : 0;
+		}
+	);
+
+	uint32 OccupiedLevels = 0;
+	for (int32 Level : Levels)
+	{
+		OccupiedLevels |= 1u << Level;
+	}
+
+	auto GetCell = [BaseCellSize](const FVector& Position, int32 Level)
+	{
+		const FVector& Coordinate = Position / (BaseCellSize * (float)(1u << Level));
+		return FIntVector(FMath::FloorToInt(Coordinate.X), FMath::FloorToInt(Coordinate.Y), FMath::FloorToInt(Coordinate.Z));
+	};
+
+	// ハッシュの表は物体数の2倍以上の2のべき乗にし、計数ソートで物体をバケットに並べる
+	const int32 NumBuckets = (int32)FMath::RoundUpToPowerOfTwo(NumBodies * 2);
+	const uint32 BucketMask = NumBuckets - 1;
+	BodyHashes.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[this, &State, &GetCell, BucketMask](int32 i)
+		{
+			const FIntVector& Cell = GetCell(State.Positions[i], Levels[i]);
+			BodyHashes[i] = HashCell(Levels[i], Cell.X, Cell.Y, Cell.Z) & BucketMask;
+		}
+	);
+
+	BucketOffsets.Init(0, NumBuckets + 1);
+	for (int32 i = 0; i < NumBodies; ++i)
+	{
+		++BucketOffsets[BodyHashes[i] + 1];
+	}
+	for (int32 Bucket = 0; Bucket < NumBuckets; ++Bucket)
+	{
+		BucketOffsets[Bucket + 1] += BucketOffsets[Bucket];
+	}
+	SortedBodies.SetNumUninitialized(NumBodies);
+	{
+		TArray<int32> Cursors(BucketOffsets.GetData(), NumBuckets);
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			SortedBodies[Cursors[BodyHashes[i]]++] = i;
+		}
+	}
+
+	// 組はタスクごとに集めて順に連結するので、結果は毎回同じになる
+	const int32 NumTasks = (NumBodies + NumBodiesPerTask - 1) / NumBodiesPerTask;
+	TaskPairs.SetNum(NumTasks);
+	ParallelFor(NumTasks,
+		[this, &State, &GetCell, NumBodies, BucketMask, OccupiedLevels](int32 TaskIdx)
+		{
+			TArray<FIntPoint>& LocalPairs = TaskPairs[TaskIdx];
+			LocalPairs.Reset();
+
+			const int32 EndIdx = FMath::Min((TaskIdx + 1) * NumBodiesPerTask, NumBodies);
+			for (int32 i = TaskIdx * NumBodiesPerTask; i < EndIdx; ++i)
+			{
+				const int32 NumPairsBefore = LocalPairs.Num();
+
+				// 自分の階層とそれより粗い階層を探す。その階層のセルは自分と相手の半径の和以上なので、隣接27セルで足りる
+				for (int32 Level = Levels[i]; Level < MaxLevels; ++Level)
+				{
+					if ((OccupiedLevels & (1u << Level)) == 0)
+					{
+						continue;
+					}
+
+					const FIntVector& Cell = GetCell(State.Positions[i], Level);
+					for (int32 Z = Cell.Z - 1; Z <= Cell.Z + 1; ++Z)
+					{
+						for (int32 Y = Cell.Y - 1; Y <= Cell.Y + 1; ++Y)
+						{
+							for (int32 X = Cell.X - 1; X <= Cell.X + 1; ++X)
+							{
+								const uint32 Bucket = HashCell(Level, X, Y, Z) & BucketMask;
+								for (int32 SortedIdx = BucketOffsets[Bucket]; SortedIdx < BucketOffsets[Bucket + 1]; ++SortedIdx)
+								{
+									// 同じ階層の組は小さいインデックスの側だけ、異なる階層の組は細かい階層の側だけが数える
+									const int32 j = SortedBodies[SortedIdx];
+									if (Levels[j] != Level || (Level == Levels[i] && j <= i))
+									{
+										continue;
+									}
+
+									const float RadiusSum = Radii[i] + Radii[j];
+									if (FVector::DistSquared(State.Positions[i], State.Positions[j]) < RadiusSum * RadiusSum)
+									{
+										LocalPairs.Add(FIntPoint(i, j));
+									}
+								}
+							}
+						}
+					}
+				}
+
+				// 別のセルが同じバケットに入ると同じ組が重複するので取り除く
+				if (LocalPairs.Num() - NumPairsBefore > 1)
+				{
+					TArray<FIntPoint> BodyPairs(LocalPairs.GetData() + NumPairsBefore, LocalPairs.Num() - NumPairsBefore);
+					BodyPairs.Sort([](const FIntPoint& A, const FIntPoint& B) { return A.Y < B.Y; });
+					LocalPairs.SetNum(NumPairsBefore, false);
+					for (int32 PairIdx = 0; PairIdx < BodyPairs.Num(); ++PairIdx)
+					{
+						if (PairIdx == 0 || BodyPairs[PairIdx].Y != BodyPairs[PairIdx - 1].Y)
+						{
+							LocalPairs.Add(BodyPairs[PairIdx]);
+						}
+					}
+				}
+			}
+		}
+	);
+
+	Pairs.Reset();
+	for (const TArray<FIntPoint>& LocalPairs : TaskPairs)
+	{
+		Pairs.Append(LocalPairs);
+	}
+}
+
+int32 FMultibodyCollision::FindRoot(int32 BodyIdx)
+{
+	// 経路を半分に縮めながら根をたどる
+	while (Parents[BodyIdx] != BodyIdx)
+	{
+		Parents[BodyIdx] = Parents[Parents[BodyIdx]];
+		BodyIdx = Parents[BodyIdx];
+	}
+	return BodyIdx;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct FMultibodyState;
+
+/**
+ * Inelastic merging of overlapping bodies of AMultibodySimulator.
+ * A body is a sphere of its mass at Density. Overlapping pairs are found in a hierarchical hashed grid whose finest cell is
+ * the median diameter and which doubles the cell per level, so a few heavy bodies do not coarsen the grid of the others and
+ * the search stays O(N log(MaxRadius / MedianRadius)). Every connected group of overlapping bodies is merged into its smallest
+ * index at the center of mass with the total mass and momentum.
+ */
+class FMultibodyCollision
+{
+public:
+	static float GetRadius(float Mass, float Density)
+	{
+		return FMath::Pow(3.0f * Mass / (4.0f * PI * Density), 1.0f / 3.0f);
+	}
+
+	/**
+	 * Merges the overlapping bodies of State. The merged bodies are removed by FMultibodyState::RemoveAtSwap()
+	 * and their indices are appended to OutRemovedBodies in the order of removal. Returns the number of removed bodies.
+	 * OutMergedBodies receives the indices before the removal of the bodies which absorbed the others.
+	 */
+	int32 MergeOverlappingBodies(FMultibodyState& State, float Density, TArray<int32>& OutRemovedBodies, TArray<int32>& OutMergedBodies);
+
+private:
+	void FindOverlappingPairs(const FMultibodyState& State);
+	int32 FindRoot(int32 BodyIdx);
+
+private:
+	TArray<float> Radii;
+	// 物体を入れるグリッドの階層。セルの大きさが直径以上になる最も細かい階層
+	TArray<int32> Levels;
+	TArray<float> SortedRadii;
+	TArray<uint32> BodyHashes;
+	TArray<int32> BucketOffsets;
+	TArray<int32> SortedBodies;
+	// タスクごとに集めた重なる組。iの小さい順に並ぶ
+	TArray<TArray<FIntPoint>> TaskPairs;
+	TArray<FIntPoint> Pairs;
+	TArray<int32> Parents;
+};
@@ -0,0 +1,198 @@
+#include "MultibodyGravity.h"
+#include "Async/ParallelFor.h"
+
+namespace
+{
+	// jの1タイルはX、Y、Z、質量の4配列で16KBになり、L1に収まる
+	const int32 TileSize = 1024;
+	// 1タスクで受け持つiの数。タイルをL1から追い出す前にこれだけのiで使いまわす
+	const int32 NumBodiesPerTask = 64;
+
+	FVector SumDirect(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, float SofteningLengthSq, int32 i)
+	{
+		FVector Acceleration = FVector::ZeroVector;
+		for (int32 j = 0; j < Positions.Num(); ++j)
+		{
+			if (i == j)
+			{
+				continue;
+			}
+
+			const FVector& Diff = Positions[j] - Positions[i];
+			Acceleration += SofteningLengthSq > 0.0f ? FMultibodyGravity::GetSoftenedAcceleration(Diff, Masses[j], Gravity, SofteningLengthSq) : FMultibodyGravity::GetAcceleration(Diff, Masses[j], Gravity);
+		}
+		return Acceleration;
+	}
+}
+
+void FMultibodyGravity::ComputeDirect(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, TArrayView<FVector> OutAccelerations, float SofteningLength)
+{
+	check(Positions.Num() == Masses.Num() && Positions.Num() == OutAccelerations.Num());
+
+	const float SofteningLengthSq = SofteningLength * SofteningLength;
+	ParallelFor(Positions.Num(),
+		[&Positions, &Masses, &OutAccelerations, Gravity, SofteningLengthSq](int32 i)
+		{
+			OutAccelerations[i] = SumDirect(Positions, Masses, Gravity, SofteningLengthSq, i);
+		}
+	);
+}
+
+void FMultibodyGravity::ComputeDirect(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, TArrayView<const int32> BodyIndices, TArrayView<FVector> OutAccelerations, float SofteningLength)
+{
+	check(Positions.Num() == Masses.Num() && Positions.Num() == OutAccelerations.Num());
+
+	const float SofteningLengthSq = SofteningLength * SofteningLength;
+	ParallelFor(BodyIndices.Num(),
+		[&Positions, &Masses, &BodyIndices, &OutAccelerations, Gravity, SofteningLengthSq](int32 i)
+		{
+			OutAccelerations[BodyIndices[i]] = SumDirect(Positions, Masses, Gravity, SofteningLengthSq, BodyIndices[i]);
+		}
+	);
+}
+
+void FMultibodyGravity::ComputeDirectTiled(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, float SofteningLength, TArrayView<FVector> OutAccelerations)
+{
+	check(Positions.Num() == Masses.Num() && Positions.Num() == OutAccelerations.Num());
+	check(SofteningLength > 0.0f);
+
+	// SIMDの幅にそろえ、余りは質量0のダミーで埋める。ソフトニングがあるので自分自身やダミーとの組も0除算にならず、
+	// 相対位置か質量が0なので寄与も0になる。そのためループ内に分岐は要らない
+	const int32 NumBodies = Positions.Num();
+	const int32 NumPaddedBodies = Align(NumBodies, 4);
+	TArray<float, TAlignedHeapAllocator<16>> X;
+	TArray<float, TAlignedHeapAllocator<16>> Y;
+	TArray<float, TAlignedHeapAllocator<16>> Z;
+	TArray<float, TAlignedHeapAllocator<16>> M;
+	X.SetNumZeroed(NumPaddedBodies);
+	Y.SetNumZeroed(NumPaddedBodies);
+	Z.SetNumZeroed(NumPaddedBodies);
+	M.SetNumZeroed(NumPaddedBodies);
+	for (int32 i = 0; i < NumBodies; ++i)
+	{
+		X[i] = Positions[i].X;
+		Y[i] = Positions[i].Y;
+		Z[i] = Positions[i].Z;
+		M[i] = Masses[i];
+	}
+
+	const int32 NumTasks = (NumBodies + NumBodiesPerTask - 1) / NumBodiesPerTask;
+	const float SofteningLengthSq = SofteningLength * SofteningLength;
+	ParallelFor(NumTasks,
+		[&X, &Y, &Z, &M, &OutAccelerations, Gravity, SofteningLengthSq, NumBodies, NumPaddedBodies](int32 TaskIdx)
+		{
+			const int32 StartIdx = TaskIdx * NumBodiesPerTask;
+			const int32 EndIdx = FMath::Min(StartIdx + NumBodiesPerTask, NumBodies);
+			const VectorRegister SofteningSq = VectorSetFloat1(SofteningLengthSq);
+			MS_ALIGN(16) float Sum[4] GCC_ALIGN(16);
+
+			for (int32 i = StartIdx; i < EndIdx; ++i)
+			{
+				OutAccelerations[i] = FVector::ZeroVector;
+			}
+
+			for (int32 TileStart = 0; TileStart < NumPaddedBodies; TileStart += TileSize)
+			{
+				const int32 TileEnd = FMath::Min(TileStart + TileSize, NumPaddedBodies);
+				for (int32 i = StartIdx; i < EndIdx; ++i)
+				{
+					const VectorRegister Xi = VectorSetFloat1(X[i]);
+					const VectorRegister Yi = VectorSetFloat1(Y[i]);
+					const VectorRegister Zi = VectorSetFloat1(Z[i]);
+					VectorRegister Ax = VectorZero();
+					VectorRegister Ay = VectorZero();
+					VectorRegister Az = VectorZero();
+
+					for (int32 j = TileStart; j < TileEnd; j += 4)
+					{
+						const VectorRegister Dx = VectorSubtract(VectorLoadAligned(&X[j]), Xi);
+						const VectorRegister Dy = VectorSubtract(VectorLoadAligned(&Y[j]), Yi);
+						const VectorRegister Dz = VectorSubtract(VectorLoadAligned(&Z[j]), Zi);
+						VectorRegister DistanceSq = VectorMultiplyAdd(Dx, Dx, SofteningSq);
+						DistanceSq = VectorMultiplyAdd(Dy, Dy, DistanceSq);
+						DistanceSq = VectorMultiplyAdd(Dz, Dz, DistanceSq);
+
+						// m / d^3 = m * rsqrt(d^2)^3
+						const VectorRegister InvDistance = VectorReciprocalSqrtAccurate(DistanceSq);
+						const VectorRegister Scale = VectorMultiply(VectorLoadAligned(&M[j]), VectorMultiply(InvDistance, VectorMultiply(InvDistance, InvDistance)));
+						Ax = VectorMultiplyAdd(Dx, Scale, Ax);
+						Ay = VectorMultiplyAdd(Dy, Scale, Ay);
+						Az = VectorMultiplyAdd(Dz, Scale, Az);
+					}
+
+					FVector TileAcceleration;
+					VectorStoreAligned(Ax, Sum);
+					TileAcceleration.X = Sum[0] + Sum[1] + Sum[2] + Sum[3];
+					VectorStoreAligned(Ay, Sum);
+					TileAcceleration.Y = Sum[0] + Sum[1] + Sum[2] + Sum[3];
+					VectorStoreAligned(Az, Sum);
+					TileAcceleration.Z = Sum[0] + Sum[1] + Sum[2] + Sum[3];
+					OutAccelerations[i] += Gravity * TileAcceleration;
+				}
+			}
+		}
+	);
+}
+
+double FMultibodyGravity::ComputePotentialEnergy(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, float SofteningLength)
+{
+	check(Positions.Num() == Masses.Num());
+
+	// 各組を一度だけ数えるため、iはi + 1以降とだけ組にする。和の順序を固定するためにiごとに部分和を持つ
+	const int32 NumBodies = Positions.Num();
+	TArray<double> PartialSums;
+	PartialSums.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[&Positions, &Masses, &PartialSums, Gravity, SofteningLength, NumBodies](int32 i)
+		{
+			double Sum = 0.0;
+			for (int32 j = i + 1; j < NumBodies; ++j)
+			{
+				float Potential = 0.0f;
+				if (SofteningLength > 0.0f)
+				{
+					Potential = -1.0f / FMath::Sqrt((Positions[j] - Positions[i]).SizeSquared() + SofteningLength * SofteningLength);
+				}
+				else
+				{
+					// 距離1未満では力が一定なので、ポテンシャルは距離1で連続になる一次関数
+					float Distance = (Positions[j] - Positions[i]).Size();
+					Potential = Distance >= 1.0f ? -1.0f / Distance : Distance - 2.0f;
+				}
+				Sum += (double)Gravity * Masses[i] * Masses[j] * Potential;
+			}
+			PartialSums[i] = Sum;
+		}
+	);
+
+	double PotentialEnergy = 0.0;
+	for (double Sum : PartialSums)
+	{
+		PotentialEnergy += Sum;
+	}
+	return PotentialEnergy;
+}
+
+void FMultibodyGravity::MeasureRelativeError(TArrayView<const FVector> Approx, TArrayView<const FVector> Reference, float& OutMaxError, float& OutRMSError)
+{
+	check(Approx.Num() == Reference.Num());
+
+	double SumSquaredError = 0.0;
+	OutMaxError = 0.0f;
+	int32 NumMeasured = 0;
+	for (int32 i = 0; i < Reference.Num(); ++i)
+	{
+		float ReferenceSize = Reference[i].Size();
+		if (ReferenceSize < SMALL_NUMBER)
+		{
+			continue;
+		}
+
+		float Error = (Approx[i] - Reference[i]).Size() / ReferenceSize;
+		OutMaxError = FMath::Max(OutMaxError, Error);
+		SumSquaredError += Error * Error;
+		++NumMeasured;
+	}
+
+	OutRMSError = NumMeasured > 0 ? FMath::Sqrt(SumSquaredError / NumMeasured) : 0.0f;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * The gravity laws of AMultibodySimulator shared by its solvers.
+ * By default the squared distance is clamped to 1 so that close bodies do not produce a huge acceleration.
+ * With a positive SofteningLength the Plummer softened law G * m * r / (|r|^2 + SofteningLength^2)^(3/2) is used instead.
+ */
+struct FMultibodyGravity
+{
+	/** Acceleration toward a body of Mass at the relative position Diff. */
+	static FVector GetAcceleration(const FVector& Diff, float Mass, float Gravity)
+	{
+		return Gravity * Mass / FMath::Max(Diff.SizeSquared(), 1.0f) * Diff.GetSafeNormal();
+	}
+
+	static FVector GetSoftenedAcceleration(const FVector& Diff, float Mass, float Gravity, float SofteningLengthSq)
+	{
+		float DistanceSq = Diff.SizeSquared() + SofteningLengthSq;
+		return Gravity * Mass / (DistanceSq * FMath::Sqrt(DistanceSq)) * Diff;
+	}
+
+	/** Sums the acceleration of every pair in parallel. The reference of the approximate solvers. */
+	static void ComputeDirect(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, TArrayView<FVector> OutAccelerations, float SofteningLength = 0.0f);
+	/** Accelerations of the bodies of BodyIndices only. The other elements of OutAccelerations are not touched. */
+	static void ComputeDirect(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, TArrayView<const int32> BodyIndices, TArrayView<FVector> OutAccelerations, float SofteningLength = 0.0f);
+
+	/**
+	 * Plummer softened direct sum by a cache tiled SIMD kernel. SofteningLength must be positive.
+	 * The bodies are copied into SoA arrays and every tile of TileSize bodies is swept by a block of bodies while it stays in L1.
+	 */
+	static void ComputeDirectTiled(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, float SofteningLength, TArrayView<FVector> OutAccelerations);
+
+	/**
+	 * Potential energy of all pairs consistent with the acceleration, i.e. -G * m1 * m2 / d for d >= 1
+	 * and the linear potential of the constant force below it, or -G * m1 * m2 / sqrt(d^2 + SofteningLength^2). Computed in parallel.
+	 */
+	static double ComputePotentialEnergy(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, float SofteningLength = 0.0f);
+
+	/** Max and RMS of |Approx - Reference| / |Reference| over the bodies. */
+	static void MeasureRelativeError(TArrayView<const FVector> Approx, TArrayView<const FVector> Reference, float& OutMaxError, float& OutRMSError);
+};
@@ -1,70 +1,374 @@
 #include "MultibodySimulator.h"
+#include "Async/Async.h"
+#include "Async/ParallelFor.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "NiagaraComponent.h"
+#include "NiagaraDataInterfaceArrayFunctionLibrary.h"
 #include "MassPoint.h"
-#include "Kismet/GameplayStatics.h"
+#include "MultibodyGravity.h"
 
 AMultibodySimulator::AMultibodySimulator()
 {
 	PrimaryActorTick.bCanEverTick = true;
+
+	SceneComponent = CreateDefaultSubobject<USceneComponent>(TEXT("SceneComponent"));
+	RootComponent = SceneComponent;
+
+	// 物体の位置はワールド座標なので、描画用のコンポーネントはアクタの位置によらずワールドの原点に置く
+	InstancedMeshComponent = CreateDefaultSubobject<UInstancedStaticMeshComponent>(TEXT("InstancedMeshComponent"));
+	InstancedMeshComponent->SetupAttachment(RootComponent);
+	InstancedMeshComponent->SetUsingAbsoluteLocation(true);
+	InstancedMeshComponent->SetUsingAbsoluteRotation(true);
+	InstancedMeshComponent->SetUsingAbsoluteScale(true);
+	InstancedMeshComponent->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+
+	NiagaraComponent = CreateDefaultSubobject<UNiagaraComponent>(TEXT("NiagaraComponent"));
+	NiagaraComponent->SetupAttachment(RootComponent);
+	NiagaraComponent->SetUsingAbsoluteLocation(true);
+	NiagaraComponent->SetUsingAbsoluteRotation(true);
+	NiagaraComponent->SetUsingAbsoluteScale(true);
 }
 
 void AMultibodySimulator::BeginPlay()
 {
 	Super::BeginPlay();
-	UGameplayStatics::GetAllActorsOfClass(this, AMassPoint::StaticClass(), MassPoints);
+
+	for (const FMultibodyBody& Body : InitialBodies)
+	{
+		AddBody(Body);
+	}
+
+	UpdateRendering(MultibodySolver.GetState().Positions);
+}
+
+void AMultibodySimulator::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	// タスクはthisを参照しているので、破棄される前に終わらせる
+	WaitForAsyncStep();
+
+	Super::EndPlay(EndPlayReason);
+}
+
+void AMultibodySimulator::RegisterMassPoint(AMassPoint* MassPoint)
+{
+	check(MassPoint != nullptr);
+	if (MassPoints.Contains(MassPoint))
+	{
+		return;
+	}
+
+	WaitForAsyncStep();
+	MassPoints.Add(MassPoint);
+	MultibodySolver.GetState().Add(MassPoint->GetActorLocation(), MassPoint->InitialVelocity, MassPoint->Mass);
+	MultibodySolver.InvalidateAccelerations();
+	ResetPublishedPositions();
+
+	// アクタ以外で描画するときは、アクタはデータの入力としてだけ使う
+	if (RenderMode != EMultibodyRenderMode::Actors)
+	{
+		MassPoint->SetActorHiddenInGame(true);
+		MassPoint->SetActorEnableCollision(false);
+	}
+}
+
+int32 AMultibodySimulator::AddBody(const FMultibodyBody& Body)
+{
+	WaitForAsyncStep();
+	MassPoints.Add(nullptr);
+	MultibodySolver.GetState().Add(Body.Position, Body.Velocity, Body.Mass);
+	MultibodySolver.InvalidateAccelerations();
+	ResetPublishedPositions();
+	return MassPoints.Num();
+}
+
+void AMultibodySimulator::UnregisterMassPoint(AMassPoint* MassPoint)
+{
+	// 実行中のステップの公開で合体した物体が詰められるので、待ってから探す。
+	// このアクタ自身が合体で取り除かれていれば、もう配列にはない
+	WaitForAsyncStep();
+	int32 Index = MassPoints.Find(MassPoint);
+	if (Index == INDEX_NONE)
+	{
+		return;
+	}
+
+	// 末尾の物体を詰めるのでアクタの配列も同じ順序で詰める
+	MassPoints.RemoveAtSwap(Index, 1, false);
+	MultibodySolver.RemoveBodyAtSwap(Index);
+	ResetPublishedPositions();
 }
 
 void AMultibodySimulator::Tick(float DeltaSeconds)
 {
 	Super::Tick(DeltaSeconds);
 
-	if (DeltaSeconds < KINDA_SMALL_NUMBER)
+	if (bAsyncSimulation)
 	{
+		TickAsync(DeltaSeconds);
 		return;
 	}
 
-	// TuXebv̎
-	float Delta = DeltaSeconds / NumIteration;
+	// 非同期モードから切り替えられたときは実行中のステップを待ち、持ち越していた時間は捨てる
+	WaitForAsyncStep();
+	PendingDeltaSeconds = 0.0f;
 
-	for (int32 IterCount = 0; IterCount < NumIteration; ++IterCount)
+	const FMultibodyState& State = MultibodySolver.GetState();
+	if (DeltaSeconds < KINDA_SMALL_NUMBER || State.Num() == 0)
 	{
-		for (int32 i = 0; i < MassPoints.Num(); ++i)
+		return;
+	}
+
+	SimulateFrame(GetFrameSettings(), DeltaSeconds, EnergyReport);
+	RemoveMergedBodies();
+	UpdateRendering(State.Positions);
+}
+
+void AMultibodySimulator::SimulateFrame(const FFrameSettings& Settings, float DeltaSeconds, FEnergyReportState& InOutEnergyReport)
+{
+	// サブステップの時間
+	float Delta = DeltaSeconds / Settings.NumIteration;
+
+	for (int32 IterCount = 0; IterCount < Settings.NumIteration; ++IterCount)
+	{
+		if (Settings.bValidateAgainstDirectSum && Settings.Solver.Solver != EMultibodyGravitySolver::Direct && IterCount == 0)
 		{
-			AMassPoint* MassPoint = Cast<AMassPoint>(MassPoints[i]);
+			ValidateAccelerations(Settings.Solver);
+		}
+
+		MultibodySolver.Step(Settings.Solver, Delta);
+	}
 
-			for (int j = 0; j < MassPoints.Num(); ++j)
+	if (Settings.bReportEnergyDrift)
+	{
+		ReportEnergyDrift(Settings, InOutEnergyReport);
+	}
+}
+
+void AMultibodySimulator::TickAsync(float DeltaSeconds)
+{
+	PendingDeltaSeconds += DeltaSeconds;
+	TimeSincePublish += DeltaSeconds;
+
+	// 前のステップが終わっていなければ待たずに、前回公開した位置を描画する
+	if (!AsyncStep.IsValid() || AsyncStep.IsReady())
+	{
+		if (AsyncStep.IsValid())
+		{
+			PublishAsyncStep();
+		}
+
+		// ステップの実行中にたまった時間をまとめて1フレームにするとサブステップがタスクの遅延に応じて伸びるので、
+		// 固定長のフレームに分けて進める。端数は持ち越し、上限を超えた分は捨てて実時間より遅れることを許す
+		const float FrameSeconds = AsyncFrameSeconds;
+		const int32 NumFrames = FMath::Min(FMath::FloorToInt(PendingDeltaSeconds / FrameSeconds), MaxAsyncFramesPerStep);
+		if (NumFrames > 0 && MultibodySolver.GetState().Num() > 0)
+		{
+			PendingDeltaSeconds -= NumFrames * FrameSeconds;
+			if (NumFrames == MaxAsyncFramesPerStep)
 			{
-				if (i == j)
+				PendingDeltaSeconds = FMath::Min(PendingDeltaSeconds, FrameSeconds);
+			}
+
+			// 設定と報告の状態はゲームスレッドで取り出して値で渡し、タスクはアクタのメンバーを読み書きしない
+			const FFrameSettings Settings = GetFrameSettings();
+			AsyncStepSeconds = NumFrames * FrameSeconds;
+			AsyncStep = Async(EAsyncExecution::TaskGraph,
+				[this, Settings, NumFrames, FrameSeconds, TaskEnergyReport = EnergyReport]() mutable
 				{
-					continue;
+					for (int32 FrameCount = 0; FrameCount < NumFrames; ++FrameCount)
+					{
+						SimulateFrame(Settings, FrameSeconds, TaskEnergyReport);
+					}
+					return TaskEnergyReport;
 				}
+			);
+		}
+		else if (MultibodySolver.GetState().Num() == 0)
+		{
+			PendingDeltaSeconds = 0.0f;
+		}
+	}
 
-				AMassPoint* AnotherMassPoint = Cast<AMassPoint>(MassPoints[j]);
+	UpdateRendering(GetPresentedPositions());
+}
+
+void AMultibodySimulator::WaitForAsyncStep()
+{
+	if (AsyncStep.IsValid())
+	{
+		AsyncStep.Wait();
+		PublishAsyncStep();
+	}
+}
 
-				// ʒuϐ̑OTuXebv̒lpđxvZ
-				const FVector& Diff = AnotherMassPoint->Position - MassPoint->Position;
-				float DistSquared = Diff.SizeSquared();
-				const FVector& Acceleration
-					= Gravity * AnotherMassPoint->Mass
-					/ FMath::Max(DistSquared, 1.0f) // 0ZɂȂȂ悤AŒ዗1mƂ
-					* Diff.GetSafeNormal();
+void AMultibodySimulator::PublishAsyncStep()
+{
+	EnergyReport = AsyncStep.Get();
+	AsyncStep = TFuture<FEnergyReportState>();
+	RemoveMergedBodies();
 
-				MassPoint->Velocity += Acceleration * Delta;
-			}
+	// 1つ前の公開分は補間の始点として残す。物体が合体して数が変わったら補間しない
+	Swap(PreviousPublishedPositions, PublishedPositions);
+	PublishedPositions = MultibodySolver.GetState().Positions;
+	PublishedStepSeconds = AsyncStepSeconds;
+	TimeSincePublish = 0.0f;
+}
+
+void AMultibodySimulator::RemoveMergedBodies()
+{
+	// ソルバーと同じ順序で詰める。配列から外してから破棄するので、EndPlay()からの登録解除では何もしない
+	for (int32 Index : MultibodySolver.PopRemovedBodies())
+	{
+		AMassPoint* MassPoint = MassPoints[Index];
+		MassPoints.RemoveAtSwap(Index, 1, false);
+		if (MassPoint != nullptr)
+		{
+			MassPoint->Destroy();
 		}
+	}
+}
 
-		// x獡TuXebv̈ʒuXV
-		for (int32 i = 0; i < MassPoints.Num(); ++i)
+void AMultibodySimulator::ResetPublishedPositions()
+{
+	// 物体が増減したら補間の始点も今の位置にそろえる
+	PublishedPositions = MultibodySolver.GetState().Positions;
+	PreviousPublishedPositions = PublishedPositions;
+	PublishedStepSeconds = 0.0f;
+}
+
+const TArray<FVector>& AMultibodySimulator::GetPresentedPositions()
+{
+	if (!bInterpolateAsyncPositions || PublishedStepSeconds < KINDA_SMALL_NUMBER || PreviousPublishedPositions.Num() != PublishedPositions.Num())
+	{
+		return PublishedPositions;
+	}
+
+	// 公開されたばかりのときは1つ前の公開分を描画し、次の公開までに最新の公開分へ近づける
+	const float Alpha = FMath::Min(TimeSincePublish / PublishedStepSeconds, 1.0f);
+	InterpolatedPositions.SetNumUninitialized(PublishedPositions.Num());
+	ParallelFor(PublishedPositions.Num(),
+		[this, Alpha](int32 i)
 		{
-			AMassPoint* MassPoint = Cast<AMassPoint>(MassPoints[i]);
-			MassPoint->Position += MassPoint->Velocity * Delta;
+			InterpolatedPositions[i] = FMath::Lerp(PreviousPublishedPositions[i], PublishedPositions[i], Alpha);
 		}
+	);
+	return InterpolatedPositions;
+}
+
+void AMultibodySimulator::UpdateRendering(const TArray<FVector>& Positions)
+{
+	switch (RenderMode)
+	{
+		case EMultibodyRenderMode::Actors:
+			for (int32 i = 0; i < MassPoints.Num(); ++i)
+			{
+				if (MassPoints[i] != nullptr)
+				{
+					MassPoints[i]->SetActorLocation(Positions[i]);
+				}
+			}
+			break;
+		case EMultibodyRenderMode::InstancedStaticMesh:
+			UpdateInstances(Positions);
+			break;
+		case EMultibodyRenderMode::Niagara:
+			UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), Positions);
+			break;
+		default:
+			check(false);
+			break;
 	}
+}
+
+void AMultibodySimulator::UpdateInstances(const TArray<FVector>& Positions)
+{
+	InstanceTransforms.SetNumUninitialized(Positions.Num());
+	ParallelFor(Positions.Num(),
+		[this, &Positions](int32 i)
+		{
+			InstanceTransforms[i] = FTransform(FQuat::Identity, Positions[i], InstanceScale);
+		}
+	);
 
-	// AN^̈ʒuXV
-	for (int32 i = 0; i < MassPoints.Num(); ++i)
+	// 物体が増減したときだけインスタンスを作り直し、それ以外は全インスタンスを一度に更新して描画状態の更新も1回にする
+	if (InstancedMeshComponent->GetInstanceCount() != InstanceTransforms.Num())
+	{
+		InstancedMeshComponent->ClearInstances();
+		InstancedMeshComponent->AddInstances(InstanceTransforms, false);
+	}
+	else if (InstanceTransforms.Num() > 0)
 	{
-		AMassPoint* MassPoint = Cast<AMassPoint>(MassPoints[i]);
-		MassPoint->SetActorLocation(MassPoint->Position);
+		InstancedMeshComponent->BatchUpdateInstancesTransforms(0, InstanceTransforms, false, true, true);
 	}
 }
 
+FMultibodySolverSettings AMultibodySimulator::GetSolverSettings() const
+{
+	FMultibodySolverSettings Settings;
+	Settings.Gravity = Gravity;
+	Settings.Solver = Solver;
+	Settings.Integrator = Integrator;
+	Settings.MaxTimeStepLevel = MaxTimeStepLevel;
+	Settings.TimeStepAccuracy = TimeStepAccuracy;
+	Settings.bMergeCollisions = bMergeCollisions;
+	Settings.BodyDensity = BodyDensity;
+	Settings.OpeningAngle = OpeningAngle;
+	Settings.MaxBodiesPerLeaf = MaxBodiesPerLeaf;
+	Settings.SofteningLength = SofteningLength;
+	Settings.ParticleMeshResolution = ParticleMeshResolution;
+	Settings.bParticleMeshShortRangeCorrection = bParticleMeshShortRangeCorrection;
+	return Settings;
+}
+
+AMultibodySimulator::FFrameSettings AMultibodySimulator::GetFrameSettings() const
+{
+	FFrameSettings Settings;
+	Settings.Solver = GetSolverSettings();
+	Settings.NumIteration = NumIteration;
+	Settings.bValidateAgainstDirectSum = bValidateAgainstDirectSum;
+	Settings.bReportEnergyDrift = bReportEnergyDrift;
+	Settings.EnergyReportInterval = EnergyReportInterval;
+	return Settings;
+}
+
+void AMultibodySimulator::ValidateAccelerations(const FMultibodySolverSettings& Settings)
+{
+	// 今の位置での近似の加速度を求めるので、積分器が使いまわす加速度もこれで更新される
+	MultibodySolver.ComputeAccelerations(Settings);
+
+	// SIMDカーネルは同じソフトニングのスカラーの総和と比べる
+	const FMultibodyState& State = MultibodySolver.GetState();
+	TArray<FVector> ReferenceAccelerations;
+	ReferenceAccelerations.SetNumUninitialized(State.Num());
+	FMultibodyGravity::ComputeDirect(State.Positions, State.Masses, Settings.Gravity, ReferenceAccelerations, Settings.GetEffectiveSofteningLength());
+
+	float MaxError = 0.0f;
+	float RMSError = 0.0f;
+	FMultibodyGravity::MeasureRelativeError(State.Accelerations, ReferenceAccelerations, MaxError, RMSError);
+	UE_LOG(LogTemp, Display, TEXT("Multibody %s: NumBodies=%d RelativeError Max=%g RMS=%g"),
+		*UEnum::GetValueAsString(Settings.Solver), State.Num(), MaxError, RMSError);
+}
+
+void AMultibodySimulator::ReportEnergyDrift(const FFrameSettings& Settings, FEnergyReportState& InOutEnergyReport)
+{
+	const int32 NumBodies = MultibodySolver.GetState().Num();
+	if (NumBodies != InOutEnergyReport.NumBodies)
+	{
+		InOutEnergyReport.InitialEnergy = MultibodySolver.ComputeTotalEnergy(Settings.Solver);
+		InOutEnergyReport.NumBodies = NumBodies;
+		InOutEnergyReport.NumFramesSinceReport = 0;
+		return;
+	}
+
+	if (++InOutEnergyReport.NumFramesSinceReport < Settings.EnergyReportInterval)
+	{
+		return;
+	}
+	InOutEnergyReport.NumFramesSinceReport = 0;
+
+	const double InitialEnergy = InOutEnergyReport.InitialEnergy;
+	double Energy = MultibodySolver.ComputeTotalEnergy(Settings.Solver);
+	double Drift = FMath::Abs(InitialEnergy) > SMALL_NUMBER ? (Energy - InitialEnergy) / FMath::Abs(InitialEnergy) : 0.0;
+	UE_LOG(LogTemp, Display, TEXT("Multibody %s: NumBodies=%d Energy=%g EnergyDrift=%g ForceEvaluations=%lld BodyForceEvaluations=%lld"),
+		*UEnum::GetValueAsString(Settings.Solver.Integrator), NumBodies, Energy, Drift, MultibodySolver.GetNumForceEvaluations(), MultibodySolver.GetNumBodyForceEvaluations());
+}
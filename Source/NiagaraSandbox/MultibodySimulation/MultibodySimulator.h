@@ -2,6 +2,9 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "Async/Future.h"
+#include "MultibodyTypes.h"
+#include "MultibodySolver.h"
 #include "MultibodySimulator.generated.h"
 
 UCLASS()
@@ -9,12 +12,45 @@ class AMultibodySimulator : public AActor
 {
 	GENERATED_BODY()
 
+public:
+	/** Adds the body at the current location of MassPoint. Can be called before BeginPlay() of this simulator. */
+	void RegisterMassPoint(class AMassPoint* MassPoint);
+	void UnregisterMassPoint(class AMassPoint* MassPoint);
+
+	/** Adds a body without an actor. It is drawn unless RenderMode is Actors. Returns the number of bodies. */
+	UFUNCTION(BlueprintCallable)
+	int32 AddBody(const FMultibodyBody& Body);
+
 protected:
 	AMultibodySimulator();
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	virtual void Tick(float DeltaSeconds) override;
 
 protected:
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = Rendering, meta = (AllowPrivateAccess = "true"))
+	class USceneComponent* SceneComponent = nullptr;
+
+	/** Draws the bodies when RenderMode is InstancedStaticMesh. Set the static mesh and the materials here. */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = Rendering, meta = (AllowPrivateAccess = "true"))
+	class UInstancedStaticMeshComponent* InstancedMeshComponent = nullptr;
+
+	/** Draws the bodies when RenderMode is Niagara. The system needs the Niagara float3 array "Positions" in world space. */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = Rendering, meta = (AllowPrivateAccess = "true"))
+	class UNiagaraComponent* NiagaraComponent = nullptr;
+
+	/** Instanced and Niagara modes update all bodies in one batch instead of moving one actor per body. */
+	UPROPERTY(EditAnywhere, Category = Rendering, meta = (AllowPrivateAccess = "true"))
+	EMultibodyRenderMode RenderMode = EMultibodyRenderMode::Actors;
+
+	/** Scale of every instance of InstancedMeshComponent. */
+	UPROPERTY(EditAnywhere, Category = Rendering, meta = (AllowPrivateAccess = "true", EditCondition = "RenderMode == EMultibodyRenderMode::InstancedStaticMesh"))
+	FVector InstanceScale = FVector::OneVector;
+
+	/** Bodies added at BeginPlay() without actors. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	TArray<FMultibodyBody> InitialBodies;
+
 	/** Constant of gravitation. The unit is m^3 * kg*^-1 * s^-2. 6.6743015E-11f is correct value. */
 	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
 	float Gravity = 10000.0f;
@@ -23,8 +59,137 @@ protected:
 	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "1", ClampMax = "100", UIMin = "1", UIMax = "100"))
 	int32 NumIteration = 1;
 
+	/** Higher order integrators keep orbits stable with fewer iterations. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	EMultibodyIntegrator Integrator = EMultibodyIntegrator::SemiImplicitEuler;
+
+	/** The finest individual step of HierarchicalLeapfrog is the substep / 2^MaxTimeStepLevel. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "0", ClampMax = "12", EditCondition = "Integrator == EMultibodyIntegrator::HierarchicalLeapfrog"))
+	int32 MaxTimeStepLevel = 6;
+
+	/** The individual step of HierarchicalLeapfrog is TimeStepAccuracy * |acceleration| / |jerk|. Smaller is more accurate. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "0.001", EditCondition = "Integrator == EMultibodyIntegrator::HierarchicalLeapfrog"))
+	float TimeStepAccuracy = 0.02f;
+
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	EMultibodyGravitySolver Solver = EMultibodyGravitySolver::Direct;
+
+	/** A node is approximated by its center of mass if its size / distance is less than this. 0 is the same as the direct sum. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "0.0", ClampMax = "2.0", EditCondition = "Solver == EMultibodyGravitySolver::BarnesHut"))
+	float OpeningAngle = 0.5f;
+
+	/** An octree node with more bodies than this is split. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "1", EditCondition = "Solver == EMultibodyGravitySolver::BarnesHut"))
+	int32 MaxBodiesPerLeaf = 8;
+
+	/** Plummer softening length of the DirectTiled solver, which replaces the minimum distance of 1 of the other solvers. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "0.001", EditCondition = "Solver == EMultibodyGravitySolver::DirectTiled"))
+	float SofteningLength = 1.0f;
+
+	/**
+	 * Number of mesh nodes per axis of the ParticleMesh solver. Rounded up to a power of two. The FFT runs on twice this for isolated boundaries.
+	 * The memory grows with the cube: about 216 MiB at 128 and 27 MiB at 64, plus a temporary of the same order when the resolution changes.
+	 */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "8", ClampMax = "128", EditCondition = "Solver == EMultibodyGravitySolver::ParticleMesh"))
+	int32 ParticleMeshResolution = 64;
+
+	/** Sum the gravity of close bodies directly so that the ParticleMesh solver resolves scales smaller than the mesh cells. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", EditCondition = "Solver == EMultibodyGravitySolver::ParticleMesh"))
+	bool bParticleMeshShortRangeCorrection = true;
+
+	/** Merge overlapping bodies inelastically, conserving mass and momentum. Merged AMassPoint actors are destroyed. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	bool bMergeCollisions = false;
+
+	/** A body is a sphere of its mass at this density for the collisions. The unit is kilo gram / cm^3. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "0.001", EditCondition = "bMergeCollisions"))
+	float BodyDensity = 100.0f;
+
+	/** Log the relative error of the approximate solver against the direct sum at the first substep of every frame. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	bool bValidateAgainstDirectSum = false;
+
+	/** Log the relative drift of the total energy from the first report every EnergyReportInterval frames. The energy is O(N^2). */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	bool bReportEnergyDrift = false;
+
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "1", EditCondition = "bReportEnergyDrift"))
+	int32 EnergyReportInterval = 60;
+
+	/**
+	 * Step the bodies on a task graph thread instead of blocking the game thread.
+	 * The positions are published when the step completes and the next step simulates the time elapsed meanwhile
+	 * in frames of AsyncFrameSeconds. Adding or removing bodies waits for the running step.
+	 */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true"))
+	bool bAsyncSimulation = false;
+
+	/** Fixed length of a frame simulated by the async step. The substep is this / NumIteration regardless of the task latency. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "0.001", EditCondition = "bAsyncSimulation"))
+	float AsyncFrameSeconds = 1.0f / 60.0f;
+
+	/** Maximum frames simulated by one async step. Elapsed time beyond this is dropped and the simulation runs slower than real time. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", ClampMin = "1", EditCondition = "bAsyncSimulation"))
+	int32 MaxAsyncFramesPerStep = 4;
+
+	/** Draw the bodies interpolated between the last two published steps. Smooth but one step behind. */
+	UPROPERTY(EditAnywhere, Category = Simulation, meta = (AllowPrivateAccess = "true", EditCondition = "bAsyncSimulation"))
+	bool bInterpolateAsyncPositions = true;
+
+private:
+	// 1フレーム分の設定。非同期モードではタスクがUPROPERTYを読まないように、ゲームスレッドで取り出して値で渡す
+	struct FFrameSettings
+	{
+		FMultibodySolverSettings Solver;
+		int32 NumIteration = 1;
+		bool bValidateAgainstDirectSum = false;
+		bool bReportEnergyDrift = false;
+		int32 EnergyReportInterval = 60;
+	};
+
+	// エネルギーのずれの報告の状態。非同期モードではタスクに値で渡し、更新されたものをステップの公開時に受け取る
+	struct FEnergyReportState
+	{
+		// 物体が増減したら基準のエネルギーを取り直す
+		double InitialEnergy = 0.0;
+		int32 NumBodies = INDEX_NONE;
+		int32 NumFramesSinceReport = 0;
+	};
+
 private:
+	FMultibodySolverSettings GetSolverSettings() const;
+	FFrameSettings GetFrameSettings() const;
+	void SimulateFrame(const FFrameSettings& Settings, float DeltaSeconds, FEnergyReportState& InOutEnergyReport);
+	void TickAsync(float DeltaSeconds);
+	void WaitForAsyncStep();
+	void PublishAsyncStep();
+	void ResetPublishedPositions();
+	void RemoveMergedBodies();
+	const TArray<FVector>& GetPresentedPositions();
+	void ValidateAccelerations(const FMultibodySolverSettings& Settings);
+	void ReportEnergyDrift(const FFrameSettings& Settings, FEnergyReportState& InOutEnergyReport);
+	void UpdateRendering(const TArray<FVector>& Positions);
+	void UpdateInstances(const TArray<FVector>& Positions);
+
+private:
+	// Stateと同じ順序で並ぶ、位置を書き戻すアクタ。アクタを持たない物体はnullptr
 	UPROPERTY(Transient)
-	TArray<class AActor*> MassPoints;
+	TArray<class AMassPoint*> MassPoints;
+
+	TArray<FTransform> InstanceTransforms;
+
+	FMultibodySolver MultibodySolver;
+	FEnergyReportState EnergyReport;
+
+	// 非同期モードではタスクの実行中はMultibodySolverに触れず、ゲームスレッドは公開済みの位置だけを読む
+	TFuture<FEnergyReportState> AsyncStep;
+	float AsyncStepSeconds = 0.0f;
+	// まだステップに渡していない経過時間。AsyncFrameSeconds未満の端数は次のステップに持ち越す
+	float PendingDeltaSeconds = 0.0f;
+	TArray<FVector> PublishedPositions;
+	TArray<FVector> PreviousPublishedPositions;
+	float PublishedStepSeconds = 0.0f;
+	float TimeSincePublish = 0.0f;
+	TArray<FVector> InterpolatedPositions;
 };
 
@@ -0,0 +1,321 @@
+#include "MultibodySolver.h"
+#include "Async/ParallelFor.h"
+#include "MultibodyGravity.h"
+
+namespace
+{
+	// Yoshida(1990)の4次の係数。w1 = 1 / (2 - 2^(1/3))、w0 = 1 - 2 * w1で、w1, w0, w1の順に2次の積分を合成する
+	const float ForestRuthW1 = 1.35120719195965763f;
+	const float ForestRuthW0 = -1.70241438391931527f;
+}
+
+void FMultibodySolver::Step(const FMultibodySolverSettings& Settings, float DeltaSeconds)
+{
+	if (State.Num() == 0)
+	{
+		return;
+	}
+
+	switch (Settings.Integrator)
+	{
+		case EMultibodyIntegrator::SemiImplicitEuler:
+			// 位置変数の前サブステップの値を用いて速度を計算し、その速度で位置を更新する
+			ComputeAccelerations(Settings);
+			Kick(DeltaSeconds);
+			Drift(DeltaSeconds);
+			bAccelerationsValid = false;
+			break;
+		case EMultibodyIntegrator::Leapfrog:
+			LeapfrogStep(Settings, DeltaSeconds);
+			break;
+		case EMultibodyIntegrator::ForestRuth:
+			LeapfrogStep(Settings, ForestRuthW1 * DeltaSeconds);
+			LeapfrogStep(Settings, ForestRuthW0 * DeltaSeconds);
+			LeapfrogStep(Settings, ForestRuthW1 * DeltaSeconds);
+			break;
+		case EMultibodyIntegrator::HierarchicalLeapfrog:
+			if (SupportsPartialAccelerations(Settings.Solver))
+			{
+				HierarchicalLeapfrogStep(Settings, DeltaSeconds);
+			}
+			else
+			{
+				// 全物体を評価するソルバではティックごとの評価が無駄になるだけなので、共通の刻みのLeapfrogにする
+				if (!bWarnedHierarchicalFallback)
+				{
+					UE_LOG(LogTemp, Warning, TEXT("HierarchicalLeapfrog needs a solver which evaluates only the given bodies. %s falls back to Leapfrog."),
+						*StaticEnum<EMultibodyGravitySolver>()->GetNameStringByValue((int64)Settings.Solver));
+					bWarnedHierarchicalFallback = true;
+				}
+				LeapfrogStep(Settings, DeltaSeconds);
+			}
+			break;
+		default:
+			check(false);
+			break;
+	}
+
+	// 重なった物体を合体させ、非常に近い接近を積分しなくて済むようにする
+	const int32 FirstRemovedIdx = RemovedBodies.Num();
+	if (Settings.bMergeCollisions && Collision.MergeOverlappingBodies(State, Settings.BodyDensity, RemovedBodies, MergedBodies) > 0)
+	{
+		RemoveMergedTimeStepLevels(FirstRemovedIdx);
+		InvalidateAccelerations();
+	}
+}
+
+void FMultibodySolver::RemoveBodyAtSwap(int32 Index)
+{
+	State.RemoveAtSwap(Index);
+	if (TimeStepLevels.IsValidIndex(Index))
+	{
+		TimeStepLevels.RemoveAtSwap(Index, 1, false);
+	}
+	else
+	{
+		TimeStepLevels.Reset();
+	}
+	InvalidateAccelerations();
+}
+
+void FMultibodySolver::RemoveMergedTimeStepLevels(int32 FirstRemovedIdx)
+{
+	const int32 NumRemoved = RemovedBodies.Num() - FirstRemovedIdx;
+	if (TimeStepLevels.Num() != State.Num() + NumRemoved)
+	{
+		TimeStepLevels.Reset();
+		return;
+	}
+
+	// 合体した物体は加速度が変わるので履歴を捨て、他の物体のレベルはStateと同じ順序で詰めて残す
+	for (int32 BodyIdx : MergedBodies)
+	{
+		TimeStepLevels[BodyIdx] = INDEX_NONE;
+	}
+	for (int32 i = FirstRemovedIdx; i < RemovedBodies.Num(); ++i)
+	{
+		TimeStepLevels.RemoveAtSwap(RemovedBodies[i], 1, false);
+	}
+}
+
+void FMultibodySolver::LeapfrogStep(const FMultibodySolverSettings& Settings, float DeltaSeconds)
+{
+	if (!bAccelerationsValid)
+	{
+		ComputeAccelerations(Settings);
+	}
+
+	Kick(DeltaSeconds * 0.5f);
+	Drift(DeltaSeconds);
+	ComputeAccelerations(Settings);
+	Kick(DeltaSeconds * 0.5f);
+}
+
+void FMultibodySolver::HierarchicalLeapfrogStep(const FMultibodySolverSettings& Settings, float DeltaSeconds)
+{
+	// サブステップを2^MaxLevel個のティックに分け、レベルLの物体は2^(MaxLevel - L)ティックごとにKick-Drift-Kickする。
+	// ドリフトは全物体をティックごとに行い、力を求める物体の位置は常に今の時刻にそろえる
+	const int32 MaxLevel = FMath::Clamp(Settings.MaxTimeStepLevel, 0, MaxTimeStepLevelLimit);
+	const int32 NumTicks = 1 << MaxLevel;
+	const float TickSeconds = DeltaSeconds / NumTicks;
+
+	// 八分木はサブステップの最初の評価で作り直し、その後のティックではRefit()で済ませる
+	bOctreeRefittable = false;
+
+	// サブステップの境界では全物体の刻みがそろっているので、物体が増減しても全物体の評価は1回で済む
+	if (!bAccelerationsValid)
+	{
+		ComputeAccelerations(Settings);
+	}
+
+	// 加加速度の履歴がない物体だけ最も細かいレベルから始め、刻みの終わりごとに粗くしていく。他の物体はレベルを引き継ぐ
+	if (TimeStepLevels.Num() > State.Num())
+	{
+		TimeStepLevels.Reset();
+	}
+	const int32 NumLevelsKept = TimeStepLevels.Num();
+	TimeStepLevels.SetNumUninitialized(State.Num());
+	for (int32 BodyIdx = 0; BodyIdx < State.Num(); ++BodyIdx)
+	{
+		int32& Level = TimeStepLevels[BodyIdx];
+		Level = (BodyIdx >= NumLevelsKept || Level == INDEX_NONE) ? MaxLevel : FMath::Min(Level, MaxLevel);
+	}
+
+	for (int32 Tick = 0; Tick < NumTicks; ++Tick)
+	{
+		// 刻みの始まりの物体の前半のキック
+		GatherBodiesOnTick(Tick, MaxLevel);
+		ParallelFor(ActiveBodies.Num(),
+			[this, TickSeconds, MaxLevel](int32 i)
+			{
+				const int32 BodyIdx = ActiveBodies[i];
+				const float StepSeconds = TickSeconds * (1 << (MaxLevel - TimeStepLevels[BodyIdx]));
+				State.Velocities[BodyIdx] += State.Accelerations[BodyIdx] * (StepSeconds * 0.5f);
+			}
+		);
+
+		Drift(TickSeconds);
+
+		// 刻みの終わりの物体だけ力を求め直して後半のキックをし、次の刻みのレベルを決める
+		GatherBodiesOnTick(Tick + 1, MaxLevel);
+		StepStartAccelerations.SetNumUninitialized(ActiveBodies.Num());
+		for (int32 i = 0; i < ActiveBodies.Num(); ++i)
+		{
+			StepStartAccelerations[i] = State.Accelerations[ActiveBodies[i]];
+		}
+
+		ComputeAccelerations(Settings, ActiveBodies);
+
+		ParallelFor(ActiveBodies.Num(),
+			[this, &Settings, DeltaSeconds, TickSeconds, MaxLevel, Tick](int32 i)
+			{
+				const int32 BodyIdx = ActiveBodies[i];
+				const int32 Level = TimeStepLevels[BodyIdx];
+				const float StepSeconds = TickSeconds * (1 << (MaxLevel - Level));
+				const FVector& Acceleration = State.Accelerations[BodyIdx];
+				State.Velocities[BodyIdx] += Acceleration * (StepSeconds * 0.5f);
+
+				// 加加速度は刻みの両端の加速度の差分で見積もり、dt = Accuracy * |a| / |jerk|とする
+				const float AccelerationChange = (Acceleration - StepStartAccelerations[i]).Size();
+				int32 DesiredLevel = 0;
+				if (AccelerationChange > KINDA_SMALL_NUMBER * Acceleration.Size())
+				{
+					const float DesiredSeconds = Settings.TimeStepAccuracy * Acceleration.Size() * StepSeconds / AccelerationChange;
+					DesiredLevel = DesiredSeconds < DeltaSeconds ? FMath::CeilToInt(FMath::Log2(DeltaSeconds / FMath::Max(DesiredSeconds, SMALL_NUMBER))) : 0;
+				}
+
+				// 細かくするのはいつでもよいが、粗くするのは1段ずつで、次の刻みがそのレベルのティックにそろうときだけにする
+				int32 NewLevel = FMath::Clamp(DesiredLevel, FMath::Max(Level - 1, 0), MaxLevel);
+				while (NewLevel < Level && (Tick + 1) % (1 << (MaxLevel - NewLevel)) != 0)
+				{
+					++NewLevel;
+				}
+				TimeStepLevels[BodyIdx] = NewLevel;
+			}
+		);
+	}
+
+	// 次に評価するまでに物体が変わりうるので、木は作り直させる
+	bOctreeRefittable = false;
+}
+
+void FMultibodySolver::GatherBodiesOnTick(int32 Tick, int32 MaxLevel)
+{
+	ActiveBodies.Reset();
+	for (int32 BodyIdx = 0; BodyIdx < State.Num(); ++BodyIdx)
+	{
+		if (Tick % (1 << (MaxLevel - TimeStepLevels[BodyIdx])) == 0)
+		{
+			ActiveBodies.Add(BodyIdx);
+		}
+	}
+}
+
+void FMultibodySolver::ComputeAccelerations(const FMultibodySolverSettings& Settings, TArrayView<const int32> BodyIndices)
+{
+	if (BodyIndices.Num() == 0)
+	{
+		return;
+	}
+
+	if (BodyIndices.Num() == State.Num())
+	{
+		ComputeAccelerations(Settings);
+		return;
+	}
+
+	switch (Settings.Solver)
+	{
+		case EMultibodyGravitySolver::Direct:
+			FMultibodyGravity::ComputeDirect(State.Positions, State.Masses, Settings.Gravity, BodyIndices, State.Accelerations);
+			NumBodyForceEvaluations += BodyIndices.Num();
+			break;
+		case EMultibodyGravitySolver::BarnesHut:
+			// 少数の物体のために毎回O(N log N)で作り直さず、同じ物体の木の質量と重心だけをO(N)で更新する
+			if (bOctreeRefittable && Octree.GetNumBodies() == State.Num())
+			{
+				Octree.Refit(State.Positions);
+			}
+			else
+			{
+				Octree.Build(State.Positions, State.Masses, Settings.MaxBodiesPerLeaf);
+				bOctreeRefittable = true;
+			}
+			Octree.ComputeAccelerations(Settings.Gravity, Settings.OpeningAngle, BodyIndices, State.Accelerations);
+			NumBodyForceEvaluations += BodyIndices.Num();
+			break;
+		default:
+			check(false);
+			break;
+	}
+
+	++NumForceEvaluations;
+}
+
+bool FMultibodySolver::SupportsPartialAccelerations(EMultibodyGravitySolver Solver)
+{
+	return Solver == EMultibodyGravitySolver::Direct || Solver == EMultibodyGravitySolver::BarnesHut;
+}
+
+void FMultibodySolver::ComputeAccelerations(const FMultibodySolverSettings& Settings)
+{
+	ComputeAllAccelerations(Settings, State.Accelerations);
+	bAccelerationsValid = true;
+	++NumForceEvaluations;
+	NumBodyForceEvaluations += State.Num();
+}
+
+void FMultibodySolver::ComputeAllAccelerations(const FMultibodySolverSettings& Settings, TArrayView<FVector> OutAccelerations)
+{
+	switch (Settings.Solver)
+	{
+		case EMultibodyGravitySolver::Direct:
+			FMultibodyGravity::ComputeDirect(State.Positions, State.Masses, Settings.Gravity, OutAccelerations);
+			break;
+		case EMultibodyGravitySolver::BarnesHut:
+			// 物体が動くので八分木は評価ごとに作り直す
+			Octree.Build(State.Positions, State.Masses, Settings.MaxBodiesPerLeaf);
+			Octree.ComputeAccelerations(Settings.Gravity, Settings.OpeningAngle, OutAccelerations);
+			break;
+		case EMultibodyGravitySolver::DirectTiled:
+			FMultibodyGravity::ComputeDirectTiled(State.Positions, State.Masses, Settings.Gravity, Settings.GetEffectiveSofteningLength(), OutAccelerations);
+			break;
+		case EMultibodyGravitySolver::ParticleMesh:
+			ParticleMesh.ComputeAccelerations(State.Positions, State.Masses, Settings.Gravity, Settings.ParticleMeshResolution, Settings.bParticleMeshShortRangeCorrection, OutAccelerations);
+			break;
+		default:
+			check(false);
+			break;
+	}
+}
+
+void FMultibodySolver::Kick(float DeltaSeconds)
+{
+	ParallelFor(State.Num(),
+		[this, DeltaSeconds](int32 i)
+		{
+			State.Velocities[i] += State.Accelerations[i] * DeltaSeconds;
+		}
+	);
+}
+
+void FMultibodySolver::Drift(float DeltaSeconds)
+{
+	ParallelFor(State.Num(),
+		[this, DeltaSeconds](int32 i)
+		{
+			State.Positions[i] += State.Velocities[i] * DeltaSeconds;
+		}
+	);
+}
+
+double FMultibodySolver::ComputeTotalEnergy(const FMultibodySolverSettings& Settings) const
+{
+	double KineticEnergy = 0.0;
+	for (int32 i = 0; i < State.Num(); ++i)
+	{
+		KineticEnergy += 0.5 * State.Masses[i] * State.Velocities[i].SizeSquared();
+	}
+
+	return KineticEnergy + FMultibodyGravity::ComputePotentialEnergy(State.Positions, State.Masses, Settings.Gravity, Settings.GetEffectiveSofteningLength());
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MultibodyTypes.h"
+#include "MultibodyState.h"
+#include "BarnesHutOctree.h"
+#include "ParticleMeshGravity.h"
+#include "MultibodyCollision.h"
+
+struct FMultibodySolverSettings
+{
+	float Gravity = 10000.0f;
+	EMultibodyGravitySolver Solver = EMultibodyGravitySolver::Direct;
+	EMultibodyIntegrator Integrator = EMultibodyIntegrator::SemiImplicitEuler;
+	float OpeningAngle = 0.5f;
+	int32 MaxBodiesPerLeaf = 8;
+	float SofteningLength = 1.0f;
+	int32 ParticleMeshResolution = 64;
+	bool bParticleMeshShortRangeCorrection = true;
+	int32 MaxTimeStepLevel = 6;
+	float TimeStepAccuracy = 0.02f;
+	bool bMergeCollisions = false;
+	float BodyDensity = 100.0f;
+
+	/** Softening length of the gravity law of Solver. 0 means the clamped law. */
+	float GetEffectiveSofteningLength() const
+	{
+		return Solver == EMultibodyGravitySolver::DirectTiled ? FMath::Max(SofteningLength, KINDA_SMALL_NUMBER) : 0.0f;
+	}
+};
+
+/**
+ * The core of AMultibodySimulator which does not depend on actors.
+ * Step() advances the bodies by one substep with the selected gravity solver and integrator.
+ */
+class FMultibodySolver
+{
+public:
+	FMultibodyState& GetState() { return State; }
+	const FMultibodyState& GetState() const { return State; }
+
+	/** Must be called when the bodies are changed outside of Step(). */
+	void InvalidateAccelerations() { bAccelerationsValid = false; }
+
+	/** Removes a body by FMultibodyState::RemoveAtSwap() keeping the time step levels of the other bodies. */
+	void RemoveBodyAtSwap(int32 Index);
+
+	/**
+	 * Indices of the bodies merged by Step() in the order of FMultibodyState::RemoveAtSwap() since the last call.
+	 * Arrays parallel to the state have to be compacted in the same order.
+	 */
+	TArray<int32> PopRemovedBodies() { return MoveTemp(RemovedBodies); }
+
+	void Step(const FMultibodySolverSettings& Settings, float DeltaSeconds);
+	/** Accelerations of the current positions into GetState().Accelerations. */
+	void ComputeAccelerations(const FMultibodySolverSettings& Settings);
+	/**
+	 * Accelerations of the bodies of BodyIndices only. The solver must support it (see SupportsPartialAccelerations()).
+	 * BarnesHut refits the octree built earlier in the same HierarchicalLeapfrog substep instead of rebuilding it.
+	 */
+	void ComputeAccelerations(const FMultibodySolverSettings& Settings, TArrayView<const int32> BodyIndices);
+	/**
+	 * Whether the solver evaluates only the given bodies. HierarchicalLeapfrog falls back to Leapfrog with a warning for the others,
+	 * since DirectTiled and ParticleMesh evaluate all bodies anyway.
+	 */
+	static bool SupportsPartialAccelerations(EMultibodyGravitySolver Solver);
+
+	/** Kinetic plus potential energy of the gravity law of Settings.Solver. O(N^2). */
+	double ComputeTotalEnergy(const FMultibodySolverSettings& Settings) const;
+
+	int64 GetNumForceEvaluations() const { return NumForceEvaluations; }
+	/** Sum of the number of bodies of every force evaluation. */
+	int64 GetNumBodyForceEvaluations() const { return NumBodyForceEvaluations; }
+	/** Time step level of each body of HierarchicalLeapfrog. The step of a body is the substep / 2^Level. */
+	const TArray<int32>& GetTimeStepLevels() const { return TimeStepLevels; }
+
+	static const int32 MaxTimeStepLevelLimit = 12;
+	const FBarnesHutOctree& GetOctree() const { return Octree; }
+
+private:
+	void LeapfrogStep(const FMultibodySolverSettings& Settings, float DeltaSeconds);
+	void HierarchicalLeapfrogStep(const FMultibodySolverSettings& Settings, float DeltaSeconds);
+	void GatherBodiesOnTick(int32 Tick, int32 MaxLevel);
+	void RemoveMergedTimeStepLevels(int32 FirstRemovedIdx);
+	void ComputeAllAccelerations(const FMultibodySolverSettings& Settings, TArrayView<FVector> OutAccelerations);
+	void Kick(float DeltaSeconds);
+	void Drift(float DeltaSeconds);
+
+private:
+	FMultibodyState State;
+	FBarnesHutOctree Octree;
+	FParticleMeshGravity ParticleMesh;
+	FMultibodyCollision Collision;
+	TArray<int32> RemovedBodies;
+	TArray<int32> MergedBodies;
+	// State.Accelerationsが今の位置のものか。Leapfrogは前サブステップの最後の加速度を使いまわす
+	bool bAccelerationsValid = false;
+	int64 NumForceEvaluations = 0;
+	int64 NumBodyForceEvaluations = 0;
+
+	// Stateと同じ順序で並ぶ。末尾に足された物体とINDEX_NONEの物体は刻みの履歴がなく、最も細かいレベルから始める
+	TArray<int32> TimeStepLevels;
+	// 今のティックで刻みが始まる、または終わる物体
+	TArray<int32> ActiveBodies;
+	// 刻みの始まりの加速度。刻みの終わりの加速度との差分で加加速度を求める
+	TArray<FVector> StepStartAccelerations;
+	// Octreeが今のサブステップで作られ、同じ物体のままか
+	bool bOctreeRefittable = false;
+	bool bWarnedHierarchicalFallback = false;
+};
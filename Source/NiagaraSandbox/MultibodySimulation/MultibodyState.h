@@ -0,0 +1,34 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Body state of AMultibodySimulator in contiguous arrays so that the solvers and the integration
+ * run over plain memory in parallel instead of through the AMassPoint actors.
+ */
+struct FMultibodyState
+{
+	TArray<FVector> Positions;
+	TArray<FVector> Velocities;
+	TArray<float> Masses;
+	TArray<FVector> Accelerations;
+
+	int32 Num() const { return Positions.Num(); }
+
+	int32 Add(const FVector& Position, const FVector& Velocity, float Mass)
+	{
+		Velocities.Add(Velocity);
+		Masses.Add(Mass);
+		Accelerations.Add(FVector::ZeroVector);
+		return Positions.Add(Position);
+	}
+
+	/** The last body moves to Index, the same as TArray::RemoveAtSwap(). */
+	void RemoveAtSwap(int32 Index)
+	{
+		Positions.RemoveAtSwap(Index, 1, false);
+		Velocities.RemoveAtSwap(Index, 1, false);
+		Masses.RemoveAtSwap(Index, 1, false);
+		Accelerations.RemoveAtSwap(Index, 1, false);
+	}
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/ObjectMacros.h"
+#include "MultibodyTypes.generated.h"
+
+UENUM()
+enum class EMultibodyGravitySolver : uint8
+{
+	// Sum the gravity of every pair. O(N^2).
+	Direct,
+	// Approximate the gravity of far bodies by octree nodes. O(N log N).
+	BarnesHut,
+	// Sum every pair with Plummer softening by a cache tiled SIMD kernel. O(N^2) but much faster than Direct for dense clusters.
+	DirectTiled,
+	// Long range gravity by FFT on a mesh with an optional direct short range correction. O(N + M^3 log M) for M^3 nodes.
+	ParticleMesh,
+};
+
+UENUM()
+enum class EMultibodyIntegrator : uint8
+{
+	// First order. One force evaluation per substep.
+	SemiImplicitEuler,
+	// Second order kick-drift-kick. One force evaluation per substep because the acceleration of the last kick is reused.
+	Leapfrog,
+	// Fourth order composition of three leapfrog steps (Forest-Ruth / Yoshida). Three force evaluations per substep.
+	ForestRuth,
+	// Leapfrog with block individual time steps of Delta / 2^Level chosen per body from its acceleration and jerk.
+	// Only the bodies at the end of their steps get new forces on each of the 2^MaxTimeStepLevel ticks of a substep.
+	HierarchicalLeapfrog,
+};
+
+UENUM()
+enum class EMultibodyRenderMode : uint8
+{
+	// Move every registered AMassPoint actor. Bodies added without actors are not drawn.
+	Actors,
+	// Draw every body as an instance of the instanced static mesh component of the simulator. The AMassPoint actors are hidden.
+	InstancedStaticMesh,
+	// Send the positions of every body to the Niagara array "Positions" of the Niagara component of the simulator. The AMassPoint actors are hidden.
+	Niagara,
+};
+
+/** A body which AMultibodySimulator owns as data without an AMassPoint actor. */
+USTRUCT(BlueprintType)
+struct FMultibodyBody
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Simulation)
+	FVector Position = FVector::ZeroVector;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Simulation)
+	FVector Velocity = FVector::ZeroVector;
+
+	/** The unit is kilo gram. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Simulation)
+	float Mass = 1000.0f;
+};
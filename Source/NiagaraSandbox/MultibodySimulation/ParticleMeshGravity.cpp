@@ -0,0 +1,431 @@
+#include "ParticleMeshGravity.h"
+#include "Async/ParallelFor.h"
+
+const float FParticleMeshGravity::SplitScale = 1.25f;
+const float FParticleMeshGravity::CutoffScale = 4.5f;
+
+namespace
+{
+	const float SqrtPi = 1.77245385f;
+
+	// Abramowitz and Stegun 7.1.26。X >= 0で絶対誤差1.5e-7
+	float Erfc(float X)
+	{
+		float T = 1.0f / (1.0f + 0.3275911f * X);
+		float Poly = T * (0.254829592f + T * (-0.284496736f + T * (1.421413741f + T * (-1.453152027f + T * 1.061405429f))));
+		return Poly * FMath::Exp(-X * X);
+	}
+
+	// 物体をBucketIndexの値ごとに安定にソートする
+	template<typename BucketIndexType>
+	void SortIntoBuckets(int32 NumBodies, int32 NumBuckets, BucketIndexType BucketIndex, TArray<int32>& OutOffsets, TArray<int32>& OutSorted)
+	{
+		OutOffsets.Init(0, NumBuckets + 1);
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			++OutOffsets[BucketIndex(i) + 1];
+		}
+
+		for (int32 Bucket = 0; Bucket < NumBuckets; ++Bucket)
+		{
+			OutOffsets[Bucket + 1] += OutOffsets[Bucket];
+		}
+
+		OutSorted.SetNumUninitialized(NumBodies);
+		TArray<int32> Cursors(OutOffsets.GetData(), NumBuckets);
+		for (int32 i = 0; i < NumBodies; ++i)
+		{
+			OutSorted[Cursors[BucketIndex(i)]++] = i;
+		}
+	}
+}
+
+void FParticleMeshGravity::ComputeAccelerations(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, int32 InResolution, bool bInShortRangeCorrection, TArrayView<FVector> OutAccelerations)
+{
+	check(Positions.Num() == Masses.Num() && Positions.Num() == OutAccelerations.Num());
+
+	if (Positions.Num() == 0)
+	{
+		return;
+	}
+
+	Initialize(FMath::Clamp((int32)FMath::RoundUpToPowerOfTwo(InResolution), 8, MaxResolution), bInShortRangeCorrection);
+
+	// 物体を含む立方体を[1, Resolution - 2]のノードに収め、CICと中心差分が格子の外を読まないようにする
+	FBox Bounds(ForceInit);
+	for (const FVector& Position : Positions)
+	{
+		Bounds += Position;
+	}
+	const float BoundsSize = FMath::Max(Bounds.GetSize().GetMax(), KINDA_SMALL_NUMBER);
+	CellSize = BoundsSize / (Resolution - 3);
+	GridMin = Bounds.GetCenter() - FVector(CellSize * (Resolution - 1) * 0.5f);
+
+	DepositMasses(Positions, Masses);
+	SolvePotential(Gravity);
+	ComputeNodeAccelerations();
+	InterpolateAccelerations(OutAccelerations);
+
+	if (bShortRangeCorrection)
+	{
+		AddShortRangeAccelerations(Positions, Masses, Gravity, OutAccelerations);
+	}
+}
+
+void FParticleMeshGravity::Initialize(int32 InResolution, bool bInShortRangeCorrection)
+{
+	if (InResolution == Resolution && bInShortRangeCorrection == bShortRangeCorrection)
+	{
+		return;
+	}
+
+	Resolution = InResolution;
+	PaddedResolution = Resolution * 2;
+	bShortRangeCorrection = bInShortRangeCorrection;
+
+	const int32 N = PaddedResolution;
+	Twiddles.SetNumUninitialized(N / 2);
+	for (int32 k = 0; k < N / 2; ++k)
+	{
+		float Angle = -2.0f * PI * k / N;
+		Twiddles[k] = {FMath::Cos(Angle), FMath::Sin(Angle)};
+	}
+
+	const int32 NumBits = FMath::CeilLogTwo(N);
+	BitReversedIndices.SetNumUninitialized(N);
+	for (int32 i = 0; i < N; ++i)
+	{
+		int32 Reversed = 0;
+		for (int32 Bit = 0; Bit < NumBits; ++Bit)
+		{
+			Reversed |= ((i >> Bit) & 1) << (NumBits - 1 - Bit);
+		}
+		BitReversedIndices[i] = Reversed;
+	}
+
+	// セル単位のグリーン関数。セルの大きさhに対してはG / hとスケールするだけなので、解像度が変わるまで使いまわせる。
+	// パディングした格子上で周期的に並べ、距離はResolutionまでを正負に折り返す
+	TArray<FComplex> Green;
+	Green.SetNumUninitialized(N * N * N);
+	ParallelFor(N,
+		[this, &Green, N](int32 Z)
+		{
+			const int32 Dz = Z <= N / 2 ? Z : Z - N;
+			for (int32 Y = 0; Y < N; ++Y)
+			{
+				const int32 Dy = Y <= N / 2 ? Y : Y - N;
+				for (int32 X = 0; X < N; ++X)
+				{
+					const int32 Dx = X <= N / 2 ? X : X - N;
+					const float Distance = FMath::Sqrt((float)(Dx * Dx + Dy * Dy + Dz * Dz));
+					float Value = 0.0f;
+					if (bShortRangeCorrection)
+					{
+						// 長距離成分 -erf(r / 2s) / r。r = 0の極限は-1 / (s * sqrt(pi))
+						Value = Distance > 0.0f ? -(1.0f - Erfc(Distance / (2.0f * SplitScale))) / Distance : -1.0f / (SplitScale * SqrtPi);
+					}
+					else
+					{
+						// 自己ポテンシャルは定数で力に寄与しないので、r = 0は何でもよい
+						Value = Distance > 0.0f ? -1.0f / Distance : -1.0f;
+					}
+					Green[GetPaddedIndex(X, Y, Z)] = {Value, 0.0f};
+				}
+			}
+		}
+	);
+
+	TransformAxis(Green, 0, false, N, N);
+	TransformAxis(Green, 1, false, N, N);
+	TransformAxis(Green, 2, false, N, N);
+
+	GreenSpectrum.SetNumUninitialized(N * N * N);
+	for (int32 i = 0; i < Green.Num(); ++i)
+	{
+		GreenSpectrum[i] = Green[i].Re;
+	}
+
+	PaddedGrid.SetNumUninitialized(N * N * N);
+	NodeAccelerations.SetNumUninitialized(Resolution * Resolution * Resolution);
+}
+
+void FParticleMeshGravity::DepositMasses(TArrayView<const FVector> Positions, TArrayView<const float> Masses)
+{
+	const int32 NumBodies = Positions.Num();
+	BodyNodes.SetNumUninitialized(NumBodies);
+	BodyFractions.SetNumUninitialized(NumBodies);
+	ParallelFor(NumBodies,
+		[this, &Positions](int32 i)
+		{
+			const FVector& Coordinate = (Positions[i] - GridMin) / CellSize;
+			FIntVector Node;
+			FVector Fraction;
+			for (int32 Axis = 0; Axis < 3; ++Axis)
+			{
+				float Clamped = FMath::Clamp(Coordinate[Axis], 1.0f, Resolution - 2.0f);
+				Node[Axis] = FMath::Min(FMath::FloorToInt(Clamped), Resolution - 3);
+				Fraction[Axis] = Clamped - Node[Axis];
+			}
+			BodyNodes[i] = Node;
+			BodyFractions[i] = Fraction;
+		}
+	);
+
+	FMemory::Memzero(PaddedGrid.GetData(), PaddedGrid.Num() * sizeof(FComplex));
+
+	// 物体はZのスライスZとZ + 1に書き込むので、偶数スライスと奇数スライスに分ければ並列に書いても衝突しない。
+	// スライス内は物体のインデックス順なので結果も毎回同じになる
+	SortIntoBuckets(NumBodies, Resolution, [this](int32 i) { return BodyNodes[i].Z; }, BucketOffsets, SortedBodies);
+	for (int32 Parity = 0; Parity < 2; ++Parity)
+	{
+		ParallelFor(Resolution / 2,
+			[this, &Masses, Parity](int32 SliceIdx)
+			{
+				const int32 Slice = SliceIdx * 2 + Parity;
+				for (int32 SortedIdx = BucketOffsets[Slice]; SortedIdx < BucketOffsets[Slice + 1]; ++SortedIdx)
+				{
+					const int32 BodyIdx = SortedBodies[SortedIdx];
+					const FIntVector& Node = BodyNodes[BodyIdx];
+					const FVector& Fraction = BodyFractions[BodyIdx];
+					for (int32 Corner = 0; Corner < 8; ++Corner)
+					{
+						const int32 Dx = Corner & 1;
+						const int32 Dy = (Corner >> 1) & 1;
+						const int32 Dz = (Corner >> 2) & 1;
+						const float Weight = (Dx ? Fraction.X : 1.0f - Fraction.X) * (Dy ? Fraction.Y : 1.0f - Fraction.Y) * (Dz ? Fraction.Z : 1.0f - Fraction.Z);
+						PaddedGrid[GetPaddedIndex(Node.X + Dx, Node.Y + Dy, Node.Z + Dz)].Re += Weight * Masses[BodyIdx];
+					}
+				}
+			}
+		);
+	}
+}
+
+void FParticleMeshGravity::SolvePotential(float Gravity)
+{
+	const int32 N = PaddedResolution;
+	const int32 M = Resolution;
+
+	// 値があるのは[0, M)^3だけなので、0の行はFFTを省く
+	TransformAxis(PaddedGrid, 0, false, M, M);
+	TransformAxis(PaddedGrid, 1, false, N, M);
+	TransformAxis(PaddedGrid, 2, false, N, N);
+
+	// 畳み込み。セルの大きさと逆FFTの正規化もここでかける
+	const float Scale = Gravity / (CellSize * N * N * N);
+	ParallelFor(N,
+		[this, Scale, N](int32 Z)
+		{
+			for (int32 i = Z * N * N; i < (Z + 1) * N * N; ++i)
+			{
+				const float Factor = GreenSpectrum[i] * Scale;
+				PaddedGrid[i].Re *= Factor;
+				PaddedGrid[i].Im *= Factor;
+			}
+		}
+	);
+
+	// 必要なのは[0, M)^3だけなので、そこに関わらない行は逆FFTを省く
+	TransformAxis(PaddedGrid, 2, true, N, N);
+	TransformAxis(PaddedGrid, 1, true, N, M);
+	TransformAxis(PaddedGrid, 0, true, M, M);
+}
+
+void FParticleMeshGravity::ComputeNodeAccelerations()
+{
+	// CICが読むのは[1, M - 2]のノードだけなので、その範囲で中心差分をとる
+	const float InvTwoCellSize = 0.5f / CellSize;
+	ParallelFor(Resolution - 2,
+		[this, InvTwoCellSize](int32 ZIdx)
+		{
+			const int32 Z = ZIdx + 1;
+			for (int32 Y = 1; Y < Resolution - 1; ++Y)
+			{
+				for (int32 X = 1; X < Resolution - 1; ++X)
+				{
+					NodeAccelerations[GetNodeIndex(X, Y, Z)] = FVector(
+						PaddedGrid[GetPaddedIndex(X - 1, Y, Z)].Re - PaddedGrid[GetPaddedIndex(X + 1, Y, Z)].Re,
+						PaddedGrid[GetPaddedIndex(X, Y - 1, Z)].Re - PaddedGrid[GetPaddedIndex(X, Y + 1, Z)].Re,
+						PaddedGrid[GetPaddedIndex(X, Y, Z - 1)].Re - PaddedGrid[GetPaddedIndex(X, Y, Z + 1)].Re
+					) * InvTwoCellSize;
+				}
+			}
+		}
+	);
+}
+
+void FParticleMeshGravity::InterpolateAccelerations(TArrayView<FVector> OutAccelerations) const
+{
+	ParallelFor(OutAccelerations.Num(),
+		[this, &OutAccelerations](int32 BodyIdx)
+		{
+			const FIntVector& Node = BodyNodes[BodyIdx];
+			const FVector& Fraction = BodyFractions[BodyIdx];
+			FVector Acceleration = FVector::ZeroVector;
+			for (int32 Corner = 0; Corner < 8; ++Corner)
+			{
+				const int32 Dx = Corner & 1;
+				const int32 Dy = (Corner >> 1) & 1;
+				const int32 Dz = (Corner >> 2) & 1;
+				const float Weight = (Dx ? Fraction.X : 1.0f - Fraction.X) * (Dy ? Fraction.Y : 1.0f - Fraction.Y) * (Dz ? Fraction.Z : 1.0f - Fraction.Z);
+				Acceleration += Weight * NodeAccelerations[GetNodeIndex(Node.X + Dx, Node.Y + Dy, Node.Z + Dz)];
+			}
+			OutAccelerations[BodyIdx] = Acceleration;
+		}
+	);
+}
+
+void FParticleMeshGravity::AddShortRangeAccelerations(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, TArrayView<FVector> OutAccelerations)
+{
+	// 短距離成分はカットオフ半径以上の大きさのセルに分け、隣接27セルの物体と直接和をとる。
+	// 物体が密集するほど近傍が増えるので、その場合は解像度を上げてカットオフ半径を小さくする
+	const float SplitLength = SplitScale * CellSize;
+	const float CutoffLength = CutoffScale * SplitLength;
+	const float CutoffLengthSq = CutoffLength * CutoffLength;
+	const FVector CellGridMin = GridMin + FVector(CellSize);
+	const float CellGridSize = CellSize * (Resolution - 3);
+	const int32 NumCells = FMath::Clamp(FMath::FloorToInt(CellGridSize / CutoffLength), 1, Resolution);
+	const float InvCellGridCellSize = NumCells / CellGridSize;
+
+	auto GetCell = [&CellGridMin, InvCellGridCellSize, NumCells](const FVector& Position)
+	{
+		const FVector& Coordinate = (Position - CellGridMin) * InvCellGridCellSize;
+		return FIntVector(
+			FMath::Clamp(FMath::FloorToInt(Coordinate.X), 0, NumCells - 1),
+			FMath::Clamp(FMath::FloorToInt(Coordinate.Y), 0, NumCells - 1),
+			FMath::Clamp(FMath::FloorToInt(Coordinate.Z), 0, NumCells - 1)
+		);
+	};
+
+	const int32 NumBodies = Positions.Num();
+	SortIntoBuckets(NumBodies, NumCells * NumCells * NumCells,
+		[&Positions, &GetCell, NumCells](int32 i)
+		{
+			const FIntVector& Cell = GetCell(Positions[i]);
+			return Cell.X + NumCells * (Cell.Y + NumCells * Cell.Z);
+		},
+		BucketOffsets, SortedBodies);
+
+	// 近傍のセルの物体を連続したメモリから読めるようにする
+	SortedPositions.SetNumUninitialized(NumBodies);
+	SortedMasses.SetNumUninitialized(NumBodies);
+	for (int32 SortedIdx = 0; SortedIdx < NumBodies; ++SortedIdx)
+	{
+		SortedPositions[SortedIdx] = Positions[SortedBodies[SortedIdx]];
+		SortedMasses[SortedIdx] = Masses[SortedBodies[SortedIdx]];
+	}
+
+	const float InvTwoSplitLength = 0.5f / SplitLength;
+	const float ExpCoef = 1.0f / (SplitLength * SqrtPi);
+	ParallelFor(NumBodies,
+		[this, &OutAccelerations, &GetCell, Gravity, NumCells, CutoffLengthSq, InvTwoSplitLength, ExpCoef](int32 SortedIdx)
+		{
+			const FVector& Position = SortedPositions[SortedIdx];
+			const FIntVector& Cell = GetCell(Position);
+			FVector Acceleration = FVector::ZeroVector;
+			for (int32 Z = FMath::Max(Cell.Z - 1, 0); Z <= FMath::Min(Cell.Z + 1, NumCells - 1); ++Z)
+			{
+				for (int32 Y = FMath::Max(Cell.Y - 1, 0); Y <= FMath::Min(Cell.Y + 1, NumCells - 1); ++Y)
+				{
+					// Xに隣接する3セルはソート順で連続している
+					const int32 RowCellIdx = NumCells * (Y + NumCells * Z);
+					const int32 Begin = BucketOffsets[RowCellIdx + FMath::Max(Cell.X - 1, 0)];
+					const int32 End = BucketOffsets[RowCellIdx + FMath::Min(Cell.X + 1, NumCells - 1) + 1];
+					for (int32 OtherIdx = Begin; OtherIdx < End; ++OtherIdx)
+					{
+						const FVector& Diff = SortedPositions[OtherIdx] - Position;
+						const float DistanceSq = Diff.SizeSquared();
+						if (OtherIdx == SortedIdx || DistanceSq >= CutoffLengthSq)
+						{
+							continue;
+						}
+
+						// ニュートン重力から長距離成分を引いた残り。最低距離1のクランプは他のソルバーと合わせる
+						const float Distance = FMath::Sqrt(DistanceSq);
+						const float Factor = Erfc(Distance * InvTwoSplitLength) + Distance * ExpCoef * FMath::Exp(-DistanceSq * InvTwoSplitLength * InvTwoSplitLength);
+						Acceleration += Gravity * SortedMasses[OtherIdx] * Factor / FMath::Max(DistanceSq, 1.0f) * Diff.GetSafeNormal();
+					}
+				}
+			}
+			OutAccelerations[SortedBodies[SortedIdx]] += Acceleration;
+		}
+	);
+}
+
+void FParticleMeshGravity::TransformAxis(TArray<FComplex>& Data, int32 Axis, bool bInverse, int32 NumLinesU, int32 NumLinesV) const
+{
+	// Axis方向の行を、残りの2軸(XはY、Z。Y、ZはXと残り)の[0, NumLinesU) x [0, NumLinesV)の範囲だけ変換する。
+	// Y、Z方向の行はストライドが大きいので、Xに隣接するLineBatch本をまとめて読み書きしてキャッシュラインを使い切る
+	const int32 N = PaddedResolution;
+	const int32 Strides[3] = {1, N, N * N};
+	const int32 AxisStride = Strides[Axis];
+	const int32 StrideU = Axis == 0 ? N : 1;
+	const int32 StrideV = Axis == 2 ? N : N * N;
+	const int32 NumBatchLines = Axis == 0 ? 1 : LineBatch;
+	check(NumLinesU % NumBatchLines == 0);
+	const int32 NumBatchesU = NumLinesU / NumBatchLines;
+
+	ParallelFor(NumBatchesU * NumLinesV,
+		[this, &Data, N, AxisStride, StrideU, StrideV, NumBatchLines, NumBatchesU, bInverse](int32 BatchIdx)
+		{
+			const int32 Base = (BatchIdx % NumBatchesU) * NumBatchLines * StrideU + (BatchIdx / NumBatchesU) * StrideV;
+			FComplex Lines[LineBatch][MaxResolution * 2];
+			for (int32 i = 0; i < N; ++i)
+			{
+				for (int32 Line = 0; Line < NumBatchLines; ++Line)
+				{
+					Lines[Line][i] = Data[Base + Line * StrideU + i * AxisStride];
+				}
+			}
+
+			for (int32 Line = 0; Line < NumBatchLines; ++Line)
+			{
+				TransformLine(Lines[Line], bInverse);
+			}
+
+			for (int32 i = 0; i < N; ++i)
+			{
+				for (int32 Line = 0; Line < NumBatchLines; ++Line)
+				{
+					Data[Base + Line * StrideU + i * AxisStride] = Lines[Line][i];
+				}
+			}
+		}
+	);
+}
+
+void FParticleMeshGravity::TransformLine(FComplex* Line, bool bInverse) const
+{
+	// 基数2の反復FFT。逆変換は正規化しない
+	const int32 N = PaddedResolution;
+	for (int32 i = 0; i < N; ++i)
+	{
+		int32 j = BitReversedIndices[i];
+		if (i < j)
+		{
+			Swap(Line[i], Line[j]);
+		}
+	}
+
+	for (int32 Size = 2; Size <= N; Size *= 2)
+	{
+		const int32 HalfSize = Size / 2;
+		const int32 TwiddleStep = N / Size;
+		for (int32 Start = 0; Start < N; Start += Size)
+		{
+			for (int32 k = 0; k < HalfSize; ++k)
+			{
+				const FComplex& W = Twiddles[k * TwiddleStep];
+				const float WIm = bInverse ? -W.Im : W.Im;
+				FComplex& A = Line[Start + k];
+				FComplex& B = Line[Start + k + HalfSize];
+				const float TRe = B.Re * W.Re - B.Im * WIm;
+				const float TIm = B.Re * WIm + B.Im * W.Re;
+				B.Re = A.Re - TRe;
+				B.Im = A.Im - TIm;
+				A.Re += TRe;
+				A.Im += TIm;
+			}
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Particle-mesh gravity of AMultibodySimulator for very large numbers of bodies.
+ * The masses are deposited to a node grid by CIC, the potential is the convolution with the isolated Green's function
+ * computed by FFT on the zero padded grid of twice the resolution, and the accelerations are interpolated back by CIC.
+ * With bShortRangeCorrection the Green's function is split by a Gaussian of SplitScale cells as in TreePM
+ * and the short range part is summed directly over the bodies in a cell grid within CutoffScale * SplitScale cells.
+ * The cost is O(N + M^3 log M) for M^3 nodes. The FFT of the Green's function is cached while the resolution does not change.
+ */
+class FParticleMeshGravity
+{
+public:
+	static const float SplitScale;
+	static const float CutoffScale;
+	/** The padded grid of 256 needs about 340 MiB while the Green's function is transformed. 256 would be 8 times that. */
+	static const int32 MaxResolution = 128;
+
+	/** Resolution is the number of nodes per axis and is rounded up to a power of two. */
+	void ComputeAccelerations(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, int32 Resolution, bool bShortRangeCorrection, TArrayView<FVector> OutAccelerations);
+
+private:
+	struct FComplex
+	{
+		float Re;
+		float Im;
+	};
+
+	void Initialize(int32 InResolution, bool bInShortRangeCorrection);
+	void DepositMasses(TArrayView<const FVector> Positions, TArrayView<const float> Masses);
+	void SolvePotential(float Gravity);
+	void ComputeNodeAccelerations();
+	void InterpolateAccelerations(TArrayView<FVector> OutAccelerations) const;
+	void AddShortRangeAccelerations(TArrayView<const FVector> Positions, TArrayView<const float> Masses, float Gravity, TArrayView<FVector> OutAccelerations);
+	void TransformAxis(TArray<FComplex>& Data, int32 Axis, bool bInverse, int32 NumLinesU, int32 NumLinesV) const;
+	void TransformLine(FComplex* Line, bool bInverse) const;
+	int32 GetPaddedIndex(int32 X, int32 Y, int32 Z) const { return X + PaddedResolution * (Y + PaddedResolution * Z); }
+	int32 GetNodeIndex(int32 X, int32 Y, int32 Z) const { return X + Resolution * (Y + Resolution * Z); }
+
+private:
+	// FFTで一度に変換する隣接した行の数
+	static const int32 LineBatch = 8;
+
+	int32 Resolution = 0;
+	int32 PaddedResolution = 0;
+	bool bShortRangeCorrection = false;
+	FVector GridMin = FVector::ZeroVector;
+	float CellSize = 1.0f;
+
+	// 偶関数なのでグリーン関数のFFTは実数になる
+	TArray<float> GreenSpectrum;
+	TArray<FComplex> PaddedGrid;
+	TArray<FVector> NodeAccelerations;
+	TArray<FComplex> Twiddles;
+	TArray<int32> BitReversedIndices;
+
+	// CICの左下のノードと重み。デポジットと補間で使いまわす
+	TArray<FIntVector> BodyNodes;
+	TArray<FVector> BodyFractions;
+	// Z方向のスライスごと、または短距離用のセルごとにソートした物体
+	TArray<int32> SortedBodies;
+	TArray<int32> BucketOffsets;
+	// 短距離成分のセル順に並べた位置と質量
+	TArray<FVector> SortedPositions;
+	TArray<float> SortedMasses;
+};
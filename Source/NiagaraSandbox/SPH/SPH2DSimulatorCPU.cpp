@@ -7,21 +7,42 @@
 #include "NiagaraSystem.h"
 #include "NiagaraFunctionLibrary.h"
 #include "NiagaraDataInterfaceArrayFloat.h"
+#include "NiagaraDataInterfaceArrayInt.h"
+#include "SPHSimulatorSubsystem.h"
+#include "SPHSnapshot.h"
+#include "../Common/ParticleQuantization.h"
 
 namespace
 {
-	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayVector()QlɂĂ
-	void SetNiagaraArrayVector(UNiagaraComponent* NiagaraSystem, FName OverrideName, const TArray<FVector>& ArrayData)
+	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayVector()を参考にしている
+	void SetNiagaraArrayVector(UNiagaraComponent* NiagaraSystem, FName OverrideName, const FVector* ArrayData, int32 Num)
 	{
 		if (UNiagaraDataInterfaceArrayFloat3* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayFloat3>(NiagaraSystem, OverrideName))
 		{
 			FRWScopeLock WriteLock(ArrayDI->ArrayRWGuard, SLT_Write);
-			ArrayDI->FloatData = ArrayData;
+			ArrayDI->FloatData.SetNumUninitialized(Num);
+			FMemory::Memcpy(ArrayDI->FloatData.GetData(), ArrayData, Num * sizeof(FVector));
 			ArrayDI->MarkRenderDataDirty();
 		}
 	}
 
-	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayColor()QlɂĂ
+	// uint16の3成分を2つずつint32の配列に詰めて渡す。Niagara側では(Index * 3 + Component)番目の16bitを取り出し、
+	// OverrideName + "Min"とOverrideName + "Max"の範囲にデコードする
+	void SetNiagaraArrayQuantizedVector(UNiagaraComponent* NiagaraSystem, FName OverrideName, const FBox& Bounds, const uint16* EncodedData, int32 Num)
+	{
+		if (UNiagaraDataInterfaceArrayInt32* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayInt32>(NiagaraSystem, OverrideName))
+		{
+			FRWScopeLock WriteLock(ArrayDI->ArrayRWGuard, SLT_Write);
+			ArrayDI->IntData.SetNumZeroed((Num * 3 + 1) / 2);
+			FMemory::Memcpy(ArrayDI->IntData.GetData(), EncodedData, Num * 3 * sizeof(uint16));
+			ArrayDI->MarkRenderDataDirty();
+		}
+
+		NiagaraSystem->SetNiagaraVariableVec3(OverrideName.ToString() + TEXT("Min"), Bounds.Min);
+		NiagaraSystem->SetNiagaraVariableVec3(OverrideName.ToString() + TEXT("Max"), Bounds.Max);
+	}
+
+	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayColor()を参考にしている
 	void SetNiagaraArrayColor(UNiagaraComponent* NiagaraSystem, FName OverrideName, const TArray<FLinearColor>& ArrayData)
 	{
 		if (UNiagaraDataInterfaceArrayColor* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayColor>(NiagaraSystem, OverrideName))
@@ -37,49 +58,127 @@ void ASPH2DSimulatorCPU::BeginPlay()
 {
 	Super::BeginPlay();
 
+	if (CacheMode == EParticleCacheMode::Playback)
+	{
+		if (CacheReader.Open(CacheFilePath))
+		{
+			NumParticles = CacheReader.GetNumParticles();
+			// キャッシュ再生中はシミュレーションしないのでサブシステムへの登録も不要
+			bUseSimulatorSubsystem = false;
+			// キャッシュはワールド空間で記録している
+			bSimulateInLocalSpace = false;
+		}
+		else
+		{
+			CacheMode = EParticleCacheMode::None;
+		}
+	}
+
 	Positions.SetNum(NumParticles);
 	PrevPositions.SetNum(NumParticles);
 	Colors.SetNum(NumParticles);
 	Velocities.SetNum(NumParticles);
 	Accelerations.SetNum(NumParticles);
 	Densities.SetNum(NumParticles);
+	ParticleCellIndices.SetNumZeroed(NumParticles);
+	MaxCachedNeighbors = FMath::Max(1, MaxCachedNeighbors);
+	CachedNeighbors.SetNumUninitialized(NumParticles * MaxCachedNeighbors);
+	NumCachedNeighbors.SetNumZeroed(NumParticles);
 	Pressures.SetNum(NumParticles);
 	Positions3D.SetNum(NumParticles);
 
 	const FVector& ActorWorldLocation = GetActorLocation();
 	const FVector2D& ActorWorldLocation2D = FVector2D(ActorWorldLocation.Y, ActorWorldLocation.Z);
+	CachedActorTransform = GetActorTransform();
+	LocalFrame.Reset(CachedActorTransform);
 
-	// InitPosRadiusả~Ƀ_ɔzu
-	for (int32 i = 0; i < NumParticles; ++i)
+	bool bLoadedSnapshot = WarmStartSnapshot != nullptr && CacheMode != EParticleCacheMode::Playback && LoadSnapshot(WarmStartSnapshot);
+	if (!bLoadedSnapshot)
 	{
-		Positions[i] = ActorWorldLocation2D + WallBox.GetCenter() + FMath::RandPointInCircle(InitPosRadius);
-		PrevPositions[i] = Positions[i];
+		if (InitialPlacement == ESPHInitialPlacement::Random)
+		{
+			// InitPosRadius半径の円内にランダムに配置
+			for (int32 i = 0; i < NumParticles; ++i)
+			{
+				Positions[i] = ActorWorldLocation2D + WallBox.GetCenter() + FMath::RandPointInCircle(InitPosRadius);
+			}
+		}
+		else if (InitialPlacement == ESPHInitialPlacement::LatticeSphere)
+		{
+			// InitPosRadius半径の円内に静止密度の間隔で格子状に配置
+			const FVector2D& Center = ActorWorldLocation2D + WallBox.GetCenter();
+			float RadiusSquared = FMath::Square(InitPosRadius);
+			FSPHLatticeInitializer::Fill2D(
+				FBox2D(Center - FVector2D(InitPosRadius), Center + FVector2D(InitPosRadius)),
+				[&Center, RadiusSquared](const FVector2D& Point) { return (Point - Center).SizeSquared() <= RadiusSquared; },
+				FSPHLatticeInitializer::GetRestSpacing2D(Mass, RestDensity),
+				InitJitter,
+				InitSeed,
+				Positions
+			);
+		}
+		else
+		{
+			// InitBox内に静止密度の間隔で格子状に配置
+			FSPHLatticeInitializer::Fill2D(
+				FBox2D(InitBox.Min + ActorWorldLocation2D, InitBox.Max + ActorWorldLocation2D),
+				[](const FVector2D& Point) { return true; },
+				FSPHLatticeInitializer::GetRestSpacing2D(Mass, RestDensity),
+				InitJitter,
+				InitSeed,
+				Positions
+			);
+		}
+
+		PrevPositions = Positions;
+
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			Velocities[i] = FVector2D::ZeroVector;
+		}
 	}
 
-	for (int32 i = 0; i < NumParticles; ++i)
+	if (bSimulateInLocalSpace)
 	{
-		Colors[i] = FLinearColor(0.0f, 0.7f, 1.0f, 1.0f);
+		// 初期配置はワールド空間のYZ平面で作っているので、一度だけアクタ空間に変換する
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			const FVector& Position = CachedActorTransform.InverseTransformPositionNoScale(FVector(ActorWorldLocation.X, Positions[i].X, Positions[i].Y));
+			const FVector& PrevPosition = CachedActorTransform.InverseTransformPositionNoScale(FVector(ActorWorldLocation.X, PrevPositions[i].X, PrevPositions[i].Y));
+			const FVector& Velocity = CachedActorTransform.InverseTransformVectorNoScale(FVector(0.0f, Velocities[i].X, Velocities[i].Y));
+			Positions[i] = FVector2D(Position.Y, Position.Z);
+			PrevPositions[i] = FVector2D(PrevPosition.Y, PrevPosition.Z);
+			Velocities[i] = FVector2D(Velocity.Y, Velocity.Z);
+		}
 	}
 
 	for (int32 i = 0; i < NumParticles; ++i)
 	{
-		Velocities[i] = FVector2D::ZeroVector;
+		Colors[i] = FLinearColor(0.0f, 0.7f, 1.0f, 1.0f);
 	}
 
-	for (int32 i = 0; i < NumParticles; ++i)
+	UpdatePositions3D();
+
+	if (CacheMode == EParticleCacheMode::Playback)
 	{
-		Positions3D[i] = FVector(ActorWorldLocation.X, Positions[i].X, Positions[i].Y);
+		// Niagaraへの初期値にはキャッシュの先頭フレームを使う
+		if (const FVector* FramePositions = CacheReader.GetFramePositions(0))
+		{
+			FMemory::Memcpy(Positions3D.GetData(), FramePositions, NumParticles * sizeof(FVector));
+		}
 	}
 
 	if (bUseNeighborGrid3D)
 	{
-		NeighborGrid3D.Initialize(FIntVector(1, NumCellsX, NumCellsY), MaxNeighborsPerCell);
+		NeighborGrid3D.Initialize(FIntVector(1, NumCellsX, NumCellsY), MaxNeighborsPerCell, NumParticles);
+		// X方向は1セルしかないので9セルを歩く
+		NeighborStencil = NeighborGrid3D.MakeStencil(FIntVector(0, 1, 1));
 	}
 
-	// Tick()Őݒ肵ĂAxNiagaraSystemŏzuĂƁÃX|[ł͔z͏lgĂ܂
-	//ԂɍȂ̂BeginPlay()łݒ肷
+	// Tick()で設定しても、レベルにNiagaraSystemが最初から配置されていると、初回のスポーンでは配列は初期値を使ってしまい
+	//間に合わないのでBeginPlay()でも設定する
 	NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
-	SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), Positions3D);
+	SetNiagaraPositions(Positions3D.GetData());
 	SetNiagaraArrayColor(NiagaraComponent, FName("Colors"), Colors);
 
 	DensityCoef = Mass * 4.0f / PI / FMath::Pow(SmoothLength, 8);
@@ -88,257 +187,381 @@ void ASPH2DSimulatorCPU::BeginPlay()
 
 	SmoothLenSq = SmoothLength * SmoothLength;
 	NumThreadParticles = (NumParticles + NumThreads - 1) / NumThreads;
+
+	if (CacheMode == EParticleCacheMode::Record && !CacheWriter.Open(CacheFilePath, NumParticles, FrameRate, bCacheVelocities, bQuantizeCache, GetQuantizationBounds(), MaxVelocity))
+	{
+		CacheMode = EParticleCacheMode::None;
+	}
+
+	if (bUseSimulatorSubsystem)
+	{
+		if (USPHSimulatorSubsystem* SimulatorSubsystem = GetWorld()->GetSubsystem<USPHSimulatorSubsystem>())
+		{
+			SimulatorSubsystem->RegisterSimulator(this);
+		}
+		else
+		{
+			bUseSimulatorSubsystem = false;
+		}
+	}
+
+	if (bUsePersistentWorkers && !bUseSimulatorSubsystem && CacheMode != EParticleCacheMode::Playback)
+	{
+		WorkerTeam.Start(FMath::Max(1, NumThreads), TEXT("SPH2DWorker"));
+	}
+}
+
+void ASPH2DSimulatorCPU::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (bUseSimulatorSubsystem)
+	{
+		if (USPHSimulatorSubsystem* SimulatorSubsystem = GetWorld()->GetSubsystem<USPHSimulatorSubsystem>())
+		{
+			SimulatorSubsystem->UnregisterSimulator(this);
+		}
+	}
+
+	WorkerTeam.Stop();
+	CacheWriter.Close();
+	CacheReader.Close();
+
+	Super::EndPlay(EndPlayReason);
 }
 
 void ASPH2DSimulatorCPU::Tick(float DeltaSeconds)
 {
 	Super::Tick(DeltaSeconds);
 
-	// AN^ʒu̓IȕύXɑΉANeighborGrid3Dւ̓o^ɕKvPostions3DLocalToUnitTransformXVĂ
-	const FVector& ActorWorldLocation = GetActorLocation();
-	for (int32 i = 0; i < NumParticles; ++i)
+	if (CacheMode == EParticleCacheMode::Playback)
 	{
-		Positions3D[i] = FVector(ActorWorldLocation.X, Positions[i].X, Positions[i].Y);
+		CachePlaybackTime += DeltaSeconds;
+		UpdateCachePlayback();
+		return;
 	}
 
-	if (bUseNeighborGrid3D)
+	if (bUseSimulatorSubsystem)
 	{
-		//[-WorldBBoxSize / 2, WorldBBoxSize / 2][0,1]ɎʑĈ
-		LocalToUnitTransform = FTransform(FQuat::Identity, FVector(0.5f), FVector(1.0f) / FVector(1.0f, WorldBBoxSize.X, WorldBBoxSize.Y));
+		// シミュレーションと出力はUSPHSimulatorSubsystemのTick()で行う
+		return;
 	}
 
+	BeginSimulation();
+
 	if (DeltaSeconds > KINDA_SMALL_NUMBER)
 	{
-		// DeltaSeconds̒l̕ϓɊւ炸AV~[VɎgTuXebv^C͌ŒƂ
-		float SubStepDeltaSeconds = 1.0f / FrameRate / NumIterations;
+		// DeltaSecondsの値の変動に関わらず、シミュレーションに使うサブステップタイムは固定とする
+		float SubStepDeltaSeconds = GetSubStepDeltaSeconds();
 
-		for (int32 i = 0; i < NumIterations; ++i)
+		if (WorkerTeam.IsRunning())
 		{
-			Simulate(SubStepDeltaSeconds);
+			SimulateWithWorkerTeam(SubStepDeltaSeconds);
+		}
+		else
+		{
+			for (int32 i = 0; i < NumIterations; ++i)
+			{
+				Simulate(SubStepDeltaSeconds);
+			}
 		}
 	}
 
-	for (int32 i = 0; i < NumParticles; ++i)
-	{
-		Positions3D[i] = FVector(ActorWorldLocation.X, Positions[i].X, Positions[i].Y);
-	}
+	EndSimulation();
+}
 
-	NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
-	SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), Positions3D);
+int32 ASPH2DSimulatorCPU::GetNumParticles() const
+{
+	return NumParticles;
 }
 
-void ASPH2DSimulatorCPU::Simulate(float DeltaSeconds)
+int32 ASPH2DSimulatorCPU::GetNumSubSteps() const
+{
+	return NumIterations;
+}
+
+float ASPH2DSimulatorCPU::GetSubStepDeltaSeconds() const
 {
-	for (int32 ParticleIdx = 0; ParticleIdx < NumParticles; ++ParticleIdx)
+	return 1.0f / FrameRate / NumIterations;
+}
+
+bool ASPH2DSimulatorCPU::IsSimulationPhaseEnabled(ESPHSimulationPhase Phase) const
+{
+	return Phase != ESPHSimulationPhase::BuildNeighborGrid3D || bUseNeighborGrid3D;
+}
+
+void ASPH2DSimulatorCPU::BeginSimulation()
+{
+	// アクタ位置の動的な変更に対応し、NeighborGrid3Dへの登録に必要なアクタのトランスフォームとLocalToUnitTransformを更新しておく
+	CachedActorTransform = GetActorTransform();
+
+	if (bSimulateInLocalSpace)
 	{
-		Densities[ParticleIdx] = 0.0f;
-		Accelerations[ParticleIdx] = FVector2D::ZeroVector;
+		LocalFrame.Update(CachedActorTransform, GetWorld()->GetDeltaSeconds());
+		const FVector& LocalGravity = CachedActorTransform.InverseTransformVectorNoScale(FVector(0.0f, 0.0f, Gravity));
+		SimulationGravity = FVector2D(LocalGravity.Y, LocalGravity.Z);
+	}
+	else
+	{
+		SimulationGravity = FVector2D(0.0f, Gravity);
 	}
 
 	if (bUseNeighborGrid3D)
+	{
+		//[-WorldBBoxSize / 2, WorldBBoxSize / 2]を[0,1]に写像して扱う
+		LocalToUnitTransform = FTransform(FQuat::Identity, FVector(0.5f), FVector(1.0f) / FVector(1.0f, WorldBBoxSize.X, WorldBBoxSize.Y));
+	}
+}
+
+void ASPH2DSimulatorCPU::BeginSubStep()
+{
+	// パーティクルごとの値の初期化は、全パーティクルを余分に1回なめないように各フェーズの先頭で行う
+	// 差分更新ではグリッドをリセットせず、BuildNeighborGrid3D()でセルが変わったパーティクルだけを移す
+	if (bUseNeighborGrid3D && !bIncrementalNeighborGrid3D)
 	{
 		NeighborGrid3D.Reset();
+	}
+}
+
+void ASPH2DSimulatorCPU::SimulatePhase(ESPHSimulationPhase Phase, int32 StartIdx, int32 EndIdx, float DeltaSeconds)
+{
+	switch (Phase)
+	{
+		case ESPHSimulationPhase::BuildNeighborGrid3D:
+			BuildNeighborGrid3D(StartIdx, EndIdx);
+			break;
+		case ESPHSimulationPhase::CalculateDensityAndPressure:
+			CalculateDensityAndPressure(StartIdx, EndIdx);
+			break;
+		case ESPHSimulationPhase::ApplyForcesAndIntegrate:
+			ApplyForcesAndIntegrate(StartIdx, EndIdx, DeltaSeconds);
+			break;
+		default:
+			check(false);
+			break;
+	}
+}
+
+void ASPH2DSimulatorCPU::EndSimulation()
+{
+	// ワールド空間への変換は出力時にフレームあたり一度だけ行う
+	UpdatePositions3D();
 
-		// NeighborGrid3D̍\z
+	NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
+	SetNiagaraPositions(Positions3D.GetData());
+
+	if (CacheMode == EParticleCacheMode::Record)
+	{
+		RecordCacheFrame();
+	}
+}
+
+void ASPH2DSimulatorCPU::Simulate(float DeltaSeconds)
+{
+	BeginSubStep();
+
+	if (bUseNeighborGrid3D)
+	{
+		// NeighborGrid3Dの構築
 		ParallelFor(NumThreads,
 			[this](int32 ThreadIndex)
 			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
-				{
-					const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorTransform().InverseTransformPositionNoScale(Positions3D[ParticleIdx]), LocalToUnitTransform);
-					const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
-					if (NeighborGrid3D.IsValidCellIndex(CellIndex))
-					{
-						int32 LinearIndex = NeighborGrid3D.IndexToLinear(CellIndex);
-						int32 PreviousNeighborCount = 0;
-						NeighborGrid3D.SetParticleNeighborCount(LinearIndex, 1, PreviousNeighborCount);
-
-						if (PreviousNeighborCount < MaxNeighborsPerCell)
-						{
-							int32 NeighborGridLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(CellIndex, PreviousNeighborCount);
-							NeighborGrid3D.SetParticleNeighbor(NeighborGridLinearIndex, ParticleIdx);
-						}
-						else
-						{
-							UE_LOG(LogTemp, Warning, TEXT("Over registation to NeighborGrid3DCPU. CellIndex=(%d, %d, %d). PreviousNeighborCount=%d."), CellIndex.X, CellIndex.Y, CellIndex.Z, PreviousNeighborCount);
-						}
-					}
-					else
-					{
-						UE_LOG(LogTemp, Warning, TEXT("There is a particle which is out of NeighborGrid3D. Idx = %d. Position = (%f, %f, %f)."), ParticleIdx, Positions3D[ParticleIdx].X, Positions3D[ParticleIdx].Y, Positions3D[ParticleIdx].Z);
-						continue;
-					}
-				}
+				BuildNeighborGrid3D(NumThreadParticles * ThreadIndex, FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles));
 			}
 		);
+	}
 
-		ParallelFor(NumThreads,
-			[this](int32 ThreadIndex)
+	ParallelFor(NumThreads,
+		[this](int32 ThreadIndex)
+		{
+			CalculateDensityAndPressure(NumThreadParticles * ThreadIndex, FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles));
+		}
+	);
+
+	// ApplyPressureが他のパーティクルの圧力値を使うので、すべて圧力値を計算してから別ループにする必要がある
+	ParallelFor(NumThreads,
+		[this, DeltaSeconds](int32 ThreadIndex)
+		{
+			ApplyForcesAndIntegrate(NumThreadParticles * ThreadIndex, FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles), DeltaSeconds);
+		}
+	);
+}
+
+void ASPH2DSimulatorCPU::SimulateWithWorkerTeam(float DeltaSeconds)
+{
+	// フレームの全サブステップを1つのジョブとして投げ、フェーズ間はバリアで同期する。
+	// パーティクルの分担はSimulate()のParallelForと同じ
+	WorkerTeam.Run(
+		[this, DeltaSeconds](int32 WorkerIndex)
+		{
+			const int32 StartIdx = FMath::Min(NumThreadParticles * WorkerIndex, NumParticles);
+			const int32 EndIdx = FMath::Min(NumThreadParticles * (WorkerIndex + 1), NumParticles);
+
+			for (int32 i = 0; i < NumIterations; ++i)
 			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
+				if (WorkerIndex == 0)
 				{
-					// LbVقǂ̂̂łȂ̂NeighborGrid3D\ẑƂƓvZĂ̂͋e
-					const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorTransform().InverseTransformPositionNoScale(Positions3D[ParticleIdx]), LocalToUnitTransform);
-					const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
-
-					if (!NeighborGrid3D.IsValidCellIndex(CellIndex))
-					{
-						// \ẑƂɌxOoĂ̂ŌxoƂ͂Ȃ
-						continue;
-					}
-
-					static FIntVector AdjacentIndexOffsets[9] = {
-						FIntVector(0, -1, -1),
-						FIntVector(0, 0, -1),
-						FIntVector(0, +1, -1),
-						FIntVector(0, -1, 0),
-						FIntVector(0, 0, 0),
-						FIntVector(0, +1, 0),
-						FIntVector(0, -1, +1),
-						FIntVector(0, 0, +1),
-						FIntVector(0, +1, +1)
-					};
-
-					for (int32 AdjIdx = 0; AdjIdx < 9; ++AdjIdx)
-					{
-						const FIntVector& AdjacentCellIndex = CellIndex + AdjacentIndexOffsets[AdjIdx];
-						if (!NeighborGrid3D.IsValidCellIndex(AdjacentCellIndex))
-						{
-							continue;
-						}
-
-						for (int32 NeighborIdx = 0; NeighborIdx < MaxNeighborsPerCell; ++NeighborIdx)
-						{
-							int32 NeighborLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(AdjacentCellIndex, NeighborIdx);
-							int32 AnotherParticleIdx = NeighborGrid3D.GetParticleNeighbor(NeighborLinearIndex);
-							if (ParticleIdx == AnotherParticleIdx || AnotherParticleIdx == INDEX_NONE)
-							{
-								continue;
-							}
-
-							CalculateDensity(ParticleIdx, AnotherParticleIdx);
-						}
-					}
-
-					CalculatePressure(ParticleIdx);
+					BeginSubStep();
 				}
+				WorkerTeam.Barrier();
+
+				if (bUseNeighborGrid3D)
+				{
+					BuildNeighborGrid3D(StartIdx, EndIdx);
+					WorkerTeam.Barrier();
+				}
+
+				CalculateDensityAndPressure(StartIdx, EndIdx);
+				WorkerTeam.Barrier();
+
+				ApplyForcesAndIntegrate(StartIdx, EndIdx, DeltaSeconds);
+				WorkerTeam.Barrier();
 			}
-		);
+		}
+	);
+}
 
-		// ApplyPressurẽp[eBN̈͒lĝŁAׂĈ͒lvZĂʃ[vɂKv
-		ParallelFor(NumThreads,
-			[this, DeltaSeconds](int32 ThreadIndex)
+void ASPH2DSimulatorCPU::BuildNeighborGrid3D(int32 StartIdx, int32 EndIdx)
+{
+	for (int32 ParticleIdx = StartIdx; ParticleIdx < EndIdx; ++ParticleIdx)
+	{
+		const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorSpacePosition(ParticleIdx), LocalToUnitTransform);
+		const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
+		ParticleCellIndices[ParticleIdx] = CellIndex;
+		if (NeighborGrid3D.IsValidCellIndex(CellIndex))
+		{
+			if (bIncrementalNeighborGrid3D)
 			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
+				if (!NeighborGrid3D.UpdateParticle(ParticleIdx, NeighborGrid3D.IndexToLinear(CellIndex)))
 				{
-					// LbVقǂ̂̂łȂ̂NeighborGrid3D\ẑƂƓvZĂ̂͋e
-					const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorTransform().InverseTransformPositionNoScale(Positions3D[ParticleIdx]), LocalToUnitTransform);
-					const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
-
-					if (!NeighborGrid3D.IsValidCellIndex(CellIndex))
-					{
-						// \ẑƂɌxOoĂ̂ŌxoƂ͂Ȃ
-						continue;
-					}
-
-					static FIntVector AdjacentIndexOffsets[9] = {
-						FIntVector(0, -1, -1),
-						FIntVector(0, 0, -1),
-						FIntVector(0, +1, -1),
-						FIntVector(0, -1, 0),
-						FIntVector(0, 0, 0),
-						FIntVector(0, +1, 0),
-						FIntVector(0, -1, +1),
-						FIntVector(0, 0, +1),
-						FIntVector(0, +1, +1)
-					};
-
-					for (int32 AdjIdx = 0; AdjIdx < 9; ++AdjIdx)
-					{
-						const FIntVector& AdjacentCellIndex = CellIndex + AdjacentIndexOffsets[AdjIdx];
-						if (!NeighborGrid3D.IsValidCellIndex(AdjacentCellIndex))
-						{
-							continue;
-						}
-
-						for (int32 NeighborIdx = 0; NeighborIdx < MaxNeighborsPerCell; ++NeighborIdx)
-						{
-							int32 NeighborLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(AdjacentCellIndex, NeighborIdx);
-							int32 AnotherParticleIdx = NeighborGrid3D.GetParticleNeighbor(NeighborLinearIndex);
-							if (ParticleIdx == AnotherParticleIdx || AnotherParticleIdx == INDEX_NONE)
-							{
-								continue;
-							}
-
-							ApplyPressure(ParticleIdx, AnotherParticleIdx);
-							ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
-						}
-					}
-
-					if (!bUseWallProjection)
-					{
-						ApplyWallPenalty(ParticleIdx);
-					}
-					Integrate(ParticleIdx, DeltaSeconds);
-					if (bUseWallProjection)
-					{
-						ApplyWallProjection(ParticleIdx, DeltaSeconds);
-					}
+					UE_LOG(LogTemp, Warning, TEXT("Over registation to NeighborGrid3DCPU. CellIndex=(%d, %d, %d). MaxNeighborsPerCell=%d."), CellIndex.X, CellIndex.Y, CellIndex.Z, MaxNeighborsPerCell);
 				}
+				continue;
 			}
-		);
+
+			// 毎サブステップ作り直すときはセルのロックを取らず、アトミックな加算で取ったスロットに書き込むだけにする
+			int32 LinearIndex = NeighborGrid3D.IndexToLinear(CellIndex);
+			int32 PreviousNeighborCount = 0;
+			NeighborGrid3D.SetParticleNeighborCount(LinearIndex, 1, PreviousNeighborCount);
+
+			if (PreviousNeighborCount < MaxNeighborsPerCell)
+			{
+				int32 NeighborGridLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(CellIndex, PreviousNeighborCount);
+				NeighborGrid3D.SetParticleNeighbor(NeighborGridLinearIndex, ParticleIdx);
+			}
+			else
+			{
+				UE_LOG(LogTemp, Warning, TEXT("Over registation to NeighborGrid3DCPU. CellIndex=(%d, %d, %d). PreviousNeighborCount=%d."), CellIndex.X, CellIndex.Y, CellIndex.Z, PreviousNeighborCount);
+			}
+		}
+		else
+		{
+			if (bIncrementalNeighborGrid3D)
+			{
+				NeighborGrid3D.UpdateParticle(ParticleIdx, INDEX_NONE);
+			}
+			UE_LOG(LogTemp, Warning, TEXT("There is a particle which is out of NeighborGrid3D. Idx = %d. Position = (%f, %f)."), ParticleIdx, Positions[ParticleIdx].X, Positions[ParticleIdx].Y);
+			continue;
+		}
 	}
-	else
+}
+
+void ASPH2DSimulatorCPU::CalculateDensityAndPressure(int32 StartIdx, int32 EndIdx)
+{
+	for (int32 ParticleIdx = StartIdx; ParticleIdx < EndIdx; ++ParticleIdx)
 	{
-		ParallelFor(NumThreads,
-			[this](int32 ThreadIndex)
+		// BeginSubStep()でまとめて0クリアするかわりに、ここで自分の分だけ初期化する
+		Densities[ParticleIdx] = 0.0f;
+		NumCachedNeighbors[ParticleIdx] = 0;
+		if (bUseNeighborGrid3D)
+		{
+			const FIntVector& CellIndex = ParticleCellIndices[ParticleIdx];
+			if (!NeighborGrid3D.IsValidCellIndex(CellIndex))
+			{
+				// 構築のときに警告ログを出しているので警告を出すことはしない
+				continue;
+			}
+
+			NeighborGrid3D.ForEachNeighbor(CellIndex, NeighborStencil, ParticleIdx,
+				[this, ParticleIdx](int32 AnotherParticleIdx)
+				{
+					CalculateDensity(ParticleIdx, AnotherParticleIdx);
+				}
+			);
+		}
+		else
+		{
+			for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
 			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
+				if (ParticleIdx == AnotherParticleIdx)
 				{
-					for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
-					{
-						if (ParticleIdx == AnotherParticleIdx)
-						{
-							continue;
-						}
+					continue;
+				}
 
-						CalculateDensity(ParticleIdx, AnotherParticleIdx );
-					}
+				CalculateDensity(ParticleIdx, AnotherParticleIdx);
+			}
+		}
 
-					CalculatePressure(ParticleIdx);
-				}
+		CalculatePressure(ParticleIdx);
+	}
+}
+
+void ASPH2DSimulatorCPU::ApplyForcesAndIntegrate(int32 StartIdx, int32 EndIdx, float DeltaSeconds)
+{
+	for (int32 ParticleIdx = StartIdx; ParticleIdx < EndIdx; ++ParticleIdx)
+	{
+		// BeginSubStep()でまとめて0クリアするかわりに、ここで自分の分だけ初期化する
+		Accelerations[ParticleIdx] = FVector2D::ZeroVector;
+
+		if (bUseNeighborGrid3D && !NeighborGrid3D.IsValidCellIndex(ParticleCellIndices[ParticleIdx]))
+		{
+			// 構築のときに警告ログを出しているので警告を出すことはしない
+			continue;
+		}
+
+		if (NumCachedNeighbors[ParticleIdx] != INDEX_NONE)
+		{
+			// 密度計算で集めたカーネル半径内の近傍だけを使い、近傍セルを歩き直さない
+			const int32* CachedNeighborIndices = &CachedNeighbors[ParticleIdx * MaxCachedNeighbors];
+			for (int32 i = 0; i < NumCachedNeighbors[ParticleIdx]; ++i)
+			{
+				ApplyPressure(ParticleIdx, CachedNeighborIndices[i]);
+				ApplyViscosity(ParticleIdx, CachedNeighborIndices[i], DeltaSeconds);
 			}
-		);
+		}
+		else if (bUseNeighborGrid3D)
+		{
+			const FIntVector& CellIndex = ParticleCellIndices[ParticleIdx];
 
-		// ApplyPressurẽp[eBN̈͒lĝŁAׂĈ͒lvZĂʃ[vɂKv
-		ParallelFor(NumThreads,
-			[this, DeltaSeconds](int32 ThreadIndex)
+			NeighborGrid3D.ForEachNeighbor(CellIndex, NeighborStencil, ParticleIdx,
+				[this, ParticleIdx, DeltaSeconds](int32 AnotherParticleIdx)
+				{
+					ApplyPressure(ParticleIdx, AnotherParticleIdx);
+					ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
+				}
+			);
+		}
+		else
+		{
+			for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
 			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
+				if (ParticleIdx == AnotherParticleIdx)
 				{
-					for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
-					{
-						if (ParticleIdx == AnotherParticleIdx)
-						{
-							continue;
-						}
-
-						ApplyPressure(ParticleIdx, AnotherParticleIdx);
-						ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
-					}
-
-					if (!bUseWallProjection)
-					{
-						ApplyWallPenalty(ParticleIdx);
-					}
-					Integrate(ParticleIdx, DeltaSeconds);
-					if (bUseWallProjection)
-					{
-						ApplyWallProjection(ParticleIdx, DeltaSeconds);
-					}
+					continue;
 				}
+
+				ApplyPressure(ParticleIdx, AnotherParticleIdx);
+				ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
 			}
-		);
+		}
+
+		if (!bUseWallProjection)
+		{
+			ApplyWallPenalty(ParticleIdx);
+		}
+		Integrate(ParticleIdx, DeltaSeconds);
+		if (bUseWallProjection)
+		{
+			ApplyWallProjection(ParticleIdx, DeltaSeconds);
+		}
 	}
 }
 
@@ -352,6 +575,27 @@ void ASPH2DSimulatorCPU::CalculateDensity(int32 ParticleIdx, int32 AnotherPartic
 	{
 		float DiffLenSq = SmoothLenSq - DistanceSq;
 		Densities[ParticleIdx] += DensityCoef * DiffLenSq * DiffLenSq * DiffLenSq;
+		CacheNeighbor(ParticleIdx, AnotherParticleIdx);
+	}
+}
+
+void ASPH2DSimulatorCPU::CacheNeighbor(int32 ParticleIdx, int32 AnotherParticleIdx)
+{
+	int32& NumCached = NumCachedNeighbors[ParticleIdx];
+	if (NumCached == INDEX_NONE)
+	{
+		return;
+	}
+
+	if (NumCached < MaxCachedNeighbors)
+	{
+		CachedNeighbors[ParticleIdx * MaxCachedNeighbors + NumCached] = AnotherParticleIdx;
+		++NumCached;
+	}
+	else
+	{
+		// あふれたら力の計算では近傍セルを歩く
+		NumCached = INDEX_NONE;
 	}
 }
 
@@ -364,7 +608,7 @@ void ASPH2DSimulatorCPU::ApplyPressure(int32 ParticleIdx, int32 AnotherParticleI
 {
 	check(ParticleIdx != AnotherParticleIdx);
 
-	if (Densities[ParticleIdx] < SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+	if (Densities[ParticleIdx] < SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
 	{
 		return;
 	}
@@ -373,11 +617,11 @@ void ASPH2DSimulatorCPU::ApplyPressure(int32 ParticleIdx, int32 AnotherParticleI
 	float DistanceSq = DiffPos.SizeSquared();
 	float Distance = DiffPos.Size();
 	if (DistanceSq < SmoothLenSq
-		&& Densities[AnotherParticleIdx] > SMALL_NUMBER && Distance > SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+		&& Densities[AnotherParticleIdx] > SMALL_NUMBER && Distance > SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
 	{
 		float DiffLen = SmoothLength - Distance;
 #if 1
-		// ƈႤAUnityGraphicsProgramming1\[XR[hŎgĂB̕Ȃ肷邵t[[gオ
+		// 数式と違うが、UnityGraphicsProgramming1がソースコードで使っていた式。こちらの方がなぜか安定するしフレームレートも上がる
 		float AvgPressure = 0.5f * (Pressures[ParticleIdx] + Pressures[AnotherParticleIdx]);
 		const FVector2D& Pressure = GradientPressureCoef * AvgPressure / Densities[AnotherParticleIdx] * DiffLen * DiffLen / Distance * DiffPos;
 #else
@@ -393,7 +637,7 @@ void ASPH2DSimulatorCPU::ApplyViscosity(int32 ParticleIdx, int32 AnotherParticle
 {
 	check(ParticleIdx != AnotherParticleIdx);
 
-	if (Densities[ParticleIdx] < SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+	if (Densities[ParticleIdx] < SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
 	{
 		return;
 	}
@@ -401,7 +645,7 @@ void ASPH2DSimulatorCPU::ApplyViscosity(int32 ParticleIdx, int32 AnotherParticle
 	const FVector2D& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
 	float DistanceSq = DiffPos.SizeSquared();
 	if (DistanceSq < SmoothLenSq
-		&& Densities[AnotherParticleIdx] > SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+		&& Densities[AnotherParticleIdx] > SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
 	{
 		FVector2D DiffVel;
 		if (bUseWallProjection)
@@ -419,31 +663,37 @@ void ASPH2DSimulatorCPU::ApplyViscosity(int32 ParticleIdx, int32 AnotherParticle
 
 void ASPH2DSimulatorCPU::ApplyWallPenalty(int32 ParticleIdx)
 {
-	// vZyȂ̂ŁAAN^̈ʒuړƉ]߂WnŃp[eBNʒu
-	const FVector& Position3D = FVector(GetActorLocation().X, Positions[ParticleIdx].X, Positions[ParticleIdx].Y);
-	const FVector& InvActorMovePos = GetActorTransform().InverseTransformPositionNoScale(Position3D);
-
-	// ㋫E
-	FVector TopAccel = FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Y) * WallStiffness * FVector(0.0f, 0.0f, -1.0f);
-	TopAccel = GetActorTransform().TransformVectorNoScale(TopAccel);
-	Accelerations[ParticleIdx] += FVector2D(TopAccel.Y, TopAccel.Z);
-	// E
-	FVector BottomAccel = FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Z) * WallStiffness * FVector(0.0f, 0.0f, 1.0f);
-	BottomAccel = GetActorTransform().TransformVectorNoScale(BottomAccel);
-	Accelerations[ParticleIdx] += FVector2D(BottomAccel.Y, BottomAccel.Z);
-	// E
-	FVector LeftAccel = FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.Y) * WallStiffness * FVector(0.0f, 1.0f, 0.0f);
-	LeftAccel = GetActorTransform().TransformVectorNoScale(LeftAccel);
-	Accelerations[ParticleIdx] += FVector2D(LeftAccel.Y, LeftAccel.Z);
-	// EE
-	FVector RightAccel = FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.X) * WallStiffness * FVector(0.0f, -1.0f, 0.0f);
-	RightAccel = GetActorTransform().TransformVectorNoScale(RightAccel);
-	Accelerations[ParticleIdx] += FVector2D(RightAccel.Y, RightAccel.Z);
+	// 計算が楽なので、アクタの位置移動と回転を戻した座標系でパーティクル位置を扱う
+	const FVector& InvActorMovePos = GetActorSpacePosition(ParticleIdx);
+
+	FVector WallAccel = FVector::ZeroVector;
+	// 上境界
+	WallAccel += FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Y) * WallStiffness * FVector(0.0f, 0.0f, -1.0f);
+	// 下境界
+	WallAccel += FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Z) * WallStiffness * FVector(0.0f, 0.0f, 1.0f);
+	// 左境界
+	WallAccel += FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.Y) * WallStiffness * FVector(0.0f, 1.0f, 0.0f);
+	// 右境界
+	WallAccel += FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.X) * WallStiffness * FVector(0.0f, -1.0f, 0.0f);
+
+	if (!bSimulateInLocalSpace)
+	{
+		WallAccel = CachedActorTransform.TransformVectorNoScale(WallAccel);
+	}
+	Accelerations[ParticleIdx] += FVector2D(WallAccel.Y, WallAccel.Z);
 }
 
 void ASPH2DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
 {
-	Accelerations[ParticleIdx] += FVector2D(0.0f, Gravity);
+	Accelerations[ParticleIdx] += SimulationGravity;
+	if (bSimulateInLocalSpace)
+	{
+		// アクタの並進と回転による慣性力のうちYZ平面の成分
+		const FVector2D& Velocity = bUseWallProjection ? (Positions[ParticleIdx] - PrevPositions[ParticleIdx]) / DeltaSeconds : Velocities[ParticleIdx];
+		const FVector& InertialAccel = LocalFrame.GetInertialAcceleration(FVector(0.0f, Positions[ParticleIdx].X, Positions[ParticleIdx].Y), FVector(0.0f, Velocity.X, Velocity.Y));
+		Accelerations[ParticleIdx] += InertialForceScale * FVector2D(InertialAccel.Y, InertialAccel.Z);
+	}
+
 	if (bUseWallProjection)
 	{
 		const FVector2D& NewPosition = Positions[ParticleIdx] + (Positions[ParticleIdx] - PrevPositions[ParticleIdx])+ Accelerations[ParticleIdx] * DeltaSeconds * DeltaSeconds;
@@ -452,10 +702,10 @@ void ASPH2DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
 	}
 	else
 	{
-		// OiIC[@
+		// 前進オイラー法
 		Velocities[ParticleIdx] += Accelerations[ParticleIdx] * DeltaSeconds;
 
-		// MaxVelocityɂNv
+		// MaxVelocityによるクランプ
 		FVector2D VelocityNormalized;
 		float Velocity;
 		Velocities[ParticleIdx].ToDirectionAndLength(VelocityNormalized, Velocity);
@@ -470,22 +720,24 @@ void ASPH2DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
 
 void ASPH2DSimulatorCPU::ApplyWallProjection(int32 ParticleIdx, float DeltaSeconds)
 {
-	// vZyȂ̂ŁAAN^̈ʒuړƉ]߂WnŃp[eBNʒu
-	// ǂ̖@gςg邪
-	const FVector& Position3D = FVector(GetActorLocation().X, Positions[ParticleIdx].X, Positions[ParticleIdx].Y);
-	const FVector& InvActorMovePos = GetActorTransform().InverseTransformPositionNoScale(Position3D);
+	// 計算が楽なので、アクタの位置移動と回転を戻した座標系でパーティクル位置を扱う
+	// 壁の法線方向を使った内積を使うやり方もあるが
+	const FVector& InvActorMovePos = GetActorSpacePosition(ParticleIdx);
 
-	//TODO: WallProjectionAlphaɂʂNumIteration̉e傫Bσt[[gΉłĂȂ
+	//TODO: WallProjectionAlphaによる効果はNumIterationの影響が大きい。可変フレームレート対応もできてない
 	FVector ProjectedPos = InvActorMovePos;
 	ProjectedPos += FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Y) * FVector(0.0f, 0.0f, -1.0f) * WallProjectionAlpha;
 	ProjectedPos += FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Z) * FVector(0.0f, 0.0f, 1.0f) * WallProjectionAlpha;
 	ProjectedPos += FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.Y) * FVector(0.0f, 1.0f, 0.0f) * WallProjectionAlpha;
 	ProjectedPos += FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.X) * FVector(0.0f, -1.0f, 0.0f) * WallProjectionAlpha;
-	ProjectedPos = GetActorTransform().TransformPositionNoScale(ProjectedPos);
+	if (!bSimulateInLocalSpace)
+	{
+		ProjectedPos = CachedActorTransform.TransformPositionNoScale(ProjectedPos);
+	}
 
 	Positions[ParticleIdx] = FVector2D(ProjectedPos.Y, ProjectedPos.Z);
 
-	// MaxVelocityɂNv
+	// MaxVelocityによるクランプ
 	FVector2D VelocityNormalized;
 	float Velocity;
 	((Positions[ParticleIdx] - PrevPositions[ParticleIdx]) / DeltaSeconds).ToDirectionAndLength(VelocityNormalized, Velocity);
@@ -495,6 +747,204 @@ void ASPH2DSimulatorCPU::ApplyWallProjection(int32 ParticleIdx, float DeltaSecon
 	}
 }
 
+FVector ASPH2DSimulatorCPU::GetActorSpacePosition(int32 ParticleIdx) const
+{
+	if (bSimulateInLocalSpace)
+	{
+		return FVector(0.0f, Positions[ParticleIdx].X, Positions[ParticleIdx].Y);
+	}
+
+	return CachedActorTransform.InverseTransformPositionNoScale(FVector(CachedActorTransform.GetLocation().X, Positions[ParticleIdx].X, Positions[ParticleIdx].Y));
+}
+
+void ASPH2DSimulatorCPU::UpdatePositions3D()
+{
+	if (bSimulateInLocalSpace)
+	{
+		ParallelFor(NumThreads,
+			[this](int32 ThreadIndex)
+			{
+				const int32 EndIdx = FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles);
+				for (int32 i = NumThreadParticles * ThreadIndex; i < EndIdx; ++i)
+				{
+					Positions3D[i] = CachedActorTransform.TransformPositionNoScale(FVector(0.0f, Positions[i].X, Positions[i].Y));
+				}
+			}
+		);
+	}
+	else
+	{
+		const float ActorWorldLocationX = CachedActorTransform.GetLocation().X;
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			Positions3D[i] = FVector(ActorWorldLocationX, Positions[i].X, Positions[i].Y);
+		}
+	}
+}
+
+void ASPH2DSimulatorCPU::RecordCacheFrame()
+{
+	const FVector* FrameVelocities = nullptr;
+	if (bCacheVelocities)
+	{
+		// 位置ベースの積分では速度を保持していないので、最後のサブステップの位置の差分から求める
+		float SubStepDeltaSeconds = GetSubStepDeltaSeconds();
+		CacheVelocities.SetNumUninitialized(NumParticles);
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			const FVector2D& Velocity = bUseWallProjection ? (Positions[i] - PrevPositions[i]) / SubStepDeltaSeconds : Velocities[i];
+			// アクタ空間のシミュレーションではアクタに対する相対速度をワールド空間の向きに回転する
+			CacheVelocities[i] = bSimulateInLocalSpace ? CachedActorTransform.TransformVectorNoScale(FVector(0.0f, Velocity.X, Velocity.Y)) : FVector(0.0f, Velocity.X, Velocity.Y);
+		}
+		FrameVelocities = CacheVelocities.GetData();
+	}
+
+	CacheWriter.WriteFrame(Positions3D.GetData(), FrameVelocities);
+}
+
+void ASPH2DSimulatorCPU::SeekCache(float Time)
+{
+	CachePlaybackTime = Time;
+	UpdateCachePlayback();
+}
+
+void ASPH2DSimulatorCPU::UpdateCachePlayback()
+{
+	int32 NumFrames = CacheReader.GetNumFrames();
+	if (CacheMode != EParticleCacheMode::Playback || NumFrames == 0)
+	{
+		return;
+	}
+
+	int32 FrameIndex = FMath::FloorToInt(CachePlaybackTime * CacheReader.GetFrameRate());
+	if (bLoopCachePlayback)
+	{
+		FrameIndex = ((FrameIndex % NumFrames) + NumFrames) % NumFrames;
+	}
+	else
+	{
+		FrameIndex = FMath::Clamp(FrameIndex, 0, NumFrames - 1);
+	}
+
+	if (FrameIndex == CacheFrameIndex)
+	{
+		return;
+	}
+
+	// マップしたメモリからNiagaraの配列へ直接コピーする
+	if (bQuantizeNiagaraPositions && CacheReader.IsQuantized())
+	{
+		// 量子化されたキャッシュはデコードせずにそのまま渡す
+		if (const uint16* EncodedPositions = CacheReader.GetFrameEncodedPositions(FrameIndex))
+		{
+			NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
+			SetNiagaraArrayQuantizedVector(NiagaraComponent, FName("QuantizedPositions"), CacheReader.GetQuantizationBounds(), EncodedPositions, NumParticles);
+			CacheFrameIndex = FrameIndex;
+		}
+	}
+	else if (const FVector* FramePositions = CacheReader.GetFramePositions(FrameIndex))
+	{
+		NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
+		SetNiagaraPositions(FramePositions);
+		CacheFrameIndex = FrameIndex;
+	}
+}
+
+FBox ASPH2DSimulatorCPU::GetQuantizationBounds() const
+{
+	// パーティクルはNeighborGrid3Dの範囲内にあるので、そのワールド空間でのAABBを量子化の範囲とする
+	return FBox(FVector(0.0f, -WorldBBoxSize.X, -WorldBBoxSize.Y) * 0.5f, FVector(0.0f, WorldBBoxSize.X, WorldBBoxSize.Y) * 0.5f).TransformBy(FTransform(GetActorQuat(), GetActorLocation()));
+}
+
+void ASPH2DSimulatorCPU::SetNiagaraPositions(const FVector* ParticlePositions)
+{
+	if (bQuantizeNiagaraPositions)
+	{
+		const FBox& Bounds = GetQuantizationBounds();
+		QuantizedPositions.SetNumUninitialized(NumParticles * 3);
+		FParticleQuantization::EncodePositions(ParticlePositions, NumParticles, Bounds, QuantizedPositions.GetData());
+		SetNiagaraArrayQuantizedVector(NiagaraComponent, FName("QuantizedPositions"), Bounds, QuantizedPositions.GetData(), NumParticles);
+	}
+	else
+	{
+		SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), ParticlePositions, NumParticles);
+	}
+}
+
+bool ASPH2DSimulatorCPU::LoadSnapshot(const USPHSnapshot* Snapshot)
+{
+	FString Reason;
+	if (!Snapshot->IsCompatible(NumParticles, FIntVector(1, NumCellsX, NumCellsY), FVector(1.0f, WorldBBoxSize.X, WorldBBoxSize.Y), Reason))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Can not load SPH snapshot %s. %s"), *Snapshot->GetName(), *Reason);
+		return false;
+	}
+
+	// スナップショットはアクタ空間で保存している
+	const FTransform& ActorTransform = GetActorTransform();
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		const FVector& Position = ActorTransform.TransformPositionNoScale(Snapshot->Positions[i]);
+		const FVector& PrevPosition = ActorTransform.TransformPositionNoScale(Snapshot->PrevPositions[i]);
+		const FVector& Velocity = ActorTransform.TransformVectorNoScale(Snapshot->Velocities[i]);
+		Positions[i] = FVector2D(Position.Y, Position.Z);
+		PrevPositions[i] = FVector2D(PrevPosition.Y, PrevPosition.Z);
+		Velocities[i] = FVector2D(Velocity.Y, Velocity.Z);
+	}
+
+	return true;
+}
+
+USPHSnapshot* ASPH2DSimulatorCPU::CaptureSnapshot() const
+{
+	USPHSnapshot* Snapshot = NewObject<USPHSnapshot>();
+	Snapshot->NumParticles = NumParticles;
+	Snapshot->NumCells = FIntVector(1, NumCellsX, NumCellsY);
+	Snapshot->WorldBBoxSize = FVector(1.0f, WorldBBoxSize.X, WorldBBoxSize.Y);
+	Snapshot->Positions.SetNum(NumParticles);
+	Snapshot->PrevPositions.SetNum(NumParticles);
+	Snapshot->Velocities.SetNum(NumParticles);
+
+	if (bSimulateInLocalSpace)
+	{
+		// アクタ空間のシミュレーションでは変換は不要
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			Snapshot->Positions[i] = FVector(0.0f, Positions[i].X, Positions[i].Y);
+			Snapshot->PrevPositions[i] = FVector(0.0f, PrevPositions[i].X, PrevPositions[i].Y);
+			Snapshot->Velocities[i] = FVector(0.0f, Velocities[i].X, Velocities[i].Y);
+		}
+		return Snapshot;
+	}
+
+	const FTransform& ActorTransform = GetActorTransform();
+	const FVector& ActorWorldLocation = GetActorLocation();
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		Snapshot->Positions[i] = ActorTransform.InverseTransformPositionNoScale(FVector(ActorWorldLocation.X, Positions[i].X, Positions[i].Y));
+		Snapshot->PrevPositions[i] = ActorTransform.InverseTransformPositionNoScale(FVector(ActorWorldLocation.X, PrevPositions[i].X, PrevPositions[i].Y));
+		Snapshot->Velocities[i] = ActorTransform.InverseTransformVectorNoScale(FVector(0.0f, Velocities[i].X, Velocities[i].Y));
+	}
+
+	return Snapshot;
+}
+
+void ASPH2DSimulatorCPU::SaveSnapshot()
+{
+#if WITH_EDITOR
+	if (!HasActorBegunPlay())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SaveSnapshot() needs the running simulation. Use it on the simulator in PIE."));
+		return;
+	}
+
+	if (USPHSnapshot* Asset = CaptureSnapshot()->SaveAsAsset(SnapshotPackageName))
+	{
+		UE_LOG(LogTemp, Display, TEXT("Saved SPH snapshot to %s."), *Asset->GetPathName());
+	}
+#endif
+}
+
 ASPH2DSimulatorCPU::ASPH2DSimulatorCPU()
 {
 	PrimaryActorTick.bCanEverTick = true;
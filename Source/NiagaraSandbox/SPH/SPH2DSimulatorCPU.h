@@ -4,11 +4,16 @@
 #include "UObject/ObjectMacros.h"
 #include "GameFramework/Actor.h"
 #include "../Common/NeighborGrid3DCPU.h"
+#include "../Common/ParticleCache.h"
+#include "../Common/ParallelWorkerTeam.h"
+#include "SPHSimulatorCPU.h"
+#include "SPHLatticeInitializer.h"
+#include "SPHLocalFrame.h"
 #include "SPH2DSimulatorCPU.generated.h"
 
 UCLASS(MinimalAPI)
-// ANiagaraActorQlɂĂ
-class ASPH2DSimulatorCPU : public AActor
+// ANiagaraActorを参考にしている
+class ASPH2DSimulatorCPU : public AActor, public ISPHSimulatorCPU
 {
 	GENERATED_BODY()
 
@@ -18,12 +23,36 @@ public:
 	virtual void PostRegisterAllComponents() override;
 
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	virtual void Tick( float DeltaSeconds ) override;
 
+	// ISPHSimulatorCPU interface
+	virtual int32 GetNumParticles() const override;
+	virtual int32 GetNumSubSteps() const override;
+	virtual float GetSubStepDeltaSeconds() const override;
+	virtual bool IsSimulationPhaseEnabled(ESPHSimulationPhase Phase) const override;
+	virtual void BeginSimulation() override;
+	virtual void BeginSubStep() override;
+	virtual void SimulatePhase(ESPHSimulationPhase Phase, int32 StartIdx, int32 EndIdx, float DeltaSeconds) override;
+	virtual void EndSimulation() override;
+	// End of ISPHSimulatorCPU interface
+
 	/** Set true for this actor to self-destruct when the Niagara system finishes, false otherwise */
 	UFUNCTION(BlueprintCallable)
 	void SetDestroyOnSystemFinish(bool bShouldDestroyOnSystemFinish);
 
+	/** Jump to the frame of the time in seconds when CacheMode is Playback. */
+	UFUNCTION(BlueprintCallable)
+	void SeekCache(float Time);
+
+	/** Capture the current solver state as a transient snapshot. */
+	UFUNCTION(BlueprintCallable)
+	class USPHSnapshot* CaptureSnapshot() const;
+
+	/** Save the current solver state to SnapshotPackageName. Use it on the simulator in PIE after the fluid settled. */
+	UFUNCTION(CallInEditor)
+	void SaveSnapshot();
+
 private:
 	/** Pointer to System component */
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
@@ -51,12 +80,72 @@ private:
 	UPROPERTY(EditAnywhere)
 	int32 NumThreads = 4;
 
+	/**
+	 * Run all substeps of a frame as one job on NumThreads persistent worker threads synchronized by barriers between the phases,
+	 * instead of a ParallelFor per phase. This removes most of the dispatch overhead for small and mid-size simulations.
+	 * Ignored when bUseSimulatorSubsystem is true.
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bUsePersistentWorkers = false;
+
+	/** Step this simulator together with the other simulators of the world by USPHSimulatorSubsystem instead of its own Tick(). */
+	UPROPERTY(EditAnywhere)
+	bool bUseSimulatorSubsystem = false;
+
+	/** Record the simulation to the cache file, or play the cache file back without simulation. */
+	UPROPERTY(EditAnywhere)
+	EParticleCacheMode CacheMode = EParticleCacheMode::None;
+
+	/** A relative path is resolved under Saved/ParticleCache. */
+	UPROPERTY(EditAnywhere)
+	FString CacheFilePath = TEXT("SPH2D.pcache");
+
+	UPROPERTY(EditAnywhere)
+	bool bCacheVelocities = false;
+
+	UPROPERTY(EditAnywhere)
+	bool bLoopCachePlayback = true;
+
+	/** Store positions and velocities in the cache file as 16-bit fixed point values relative to the grid bounds and MaxVelocity. */
+	UPROPERTY(EditAnywhere)
+	bool bQuantizeCache = false;
+
+	/**
+	 * Send positions to Niagara as 16-bit fixed point values packed into the int array "QuantizedPositions" instead of the float3 array "Positions".
+	 * The Niagara system has to decode them with "QuantizedPositionsMin" and "QuantizedPositionsMax".
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bQuantizeNiagaraPositions = false;
+
+	/** Restore the particles from this snapshot in BeginPlay instead of scattering them randomly. */
+	UPROPERTY(EditAnywhere)
+	class USPHSnapshot* WarmStartSnapshot = nullptr;
+
+	/** Long package name of the asset which SaveSnapshot() writes. */
+	UPROPERTY(EditAnywhere)
+	FString SnapshotPackageName = TEXT("/Game/SPH/Snapshots/SPH2DSnapshot");
+
 	UPROPERTY(EditAnywhere)
 	bool bUseNeighborGrid3D = true;
 
+	/** Move only the particles which changed cells in the neighbor grid every substep. Otherwise the grid is reset and rebuilt by lock-free atomic appends. */
+	UPROPERTY(EditAnywhere, meta = (EditCondition = "bUseNeighborGrid3D"))
+	bool bIncrementalNeighborGrid3D = true;
+
 	UPROPERTY(EditAnywhere)
 	bool bUseWallProjection = true;
 
+	/**
+	 * Keep the particles in the YZ plane of the actor space and add the inertial forces of the actor motion instead of simulating in the world YZ plane.
+	 * Positions are transformed to the world space only for the output.
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bSimulateInLocalSpace = false;
+
+	/** Scale of the inertial forces in bSimulateInLocalSpace. 0 makes the fluid follow the actor motion rigidly. */
+	UPROPERTY(EditAnywhere)
+	float InertialForceScale = 1.0f;
+
 	UPROPERTY(EditAnywhere)
 	int32 NumParticles = 1000;
 
@@ -99,6 +188,22 @@ private:
 	UPROPERTY(EditAnywhere)
 	float InitPosRadius = 4.0f;
 
+	/** How to place the particles in BeginPlay when WarmStartSnapshot is not used. */
+	UPROPERTY(EditAnywhere)
+	ESPHInitialPlacement InitialPlacement = ESPHInitialPlacement::Random;
+
+	/** The region relative to the actor location which ESPHInitialPlacement::LatticeBox fills. */
+	UPROPERTY(EditAnywhere)
+	FBox2D InitBox = FBox2D(FVector2D(-4.5f, -4.5f), FVector2D(4.5f, 0.0f));
+
+	/** Max random offset of the lattice placement in units of the rest density spacing. */
+	UPROPERTY(EditAnywhere)
+	float InitJitter = 0.1f;
+
+	/** Seed of the lattice placement jitter. The same seed gives the same placement. */
+	UPROPERTY(EditAnywhere)
+	int32 InitSeed = 0;
+
 	UPROPERTY(EditAnywhere)
 	int32 NumCellsX = 10;
 
@@ -108,26 +213,45 @@ private:
 	UPROPERTY(EditAnywhere)
 	int32 MaxNeighborsPerCell = 8;
 
+	/**
+	 * Max number of neighbors in SmoothLength which the density pass caches per particle so that the force pass does not walk the neighbor cells again.
+	 * A particle with more neighbors falls back to the walk.
+	 */
+	UPROPERTY(EditAnywhere)
+	int32 MaxCachedNeighbors = 32;
+
 	UPROPERTY(EditAnywhere)
 	FVector2D WorldBBoxSize = FVector2D(10.0f, 10.0f);
 
 private:
 	void Simulate(float DeltaSeconds);
+	void SimulateWithWorkerTeam(float DeltaSeconds);
+	void BuildNeighborGrid3D(int32 StartIdx, int32 EndIdx);
+	void CalculateDensityAndPressure(int32 StartIdx, int32 EndIdx);
+	void ApplyForcesAndIntegrate(int32 StartIdx, int32 EndIdx, float DeltaSeconds);
 	void CalculateDensity(int32 ParticleIdx, int32 AnotherParticleIdx);
+	void CacheNeighbor(int32 ParticleIdx, int32 AnotherParticleIdx);
 	void CalculatePressure(int32 ParticleIdx);
 	void ApplyPressure(int32 ParticleIdx, int32 AnotherParticleIdx);
 	void ApplyViscosity(int32 ParticleIdx, int32 AnotherParticleIdx, float DeltaSeconds);
 	void ApplyWallPenalty(int32 ParticleIdx);
 	void Integrate(int32 ParticleIdx, float DeltaSeconds);
 	void ApplyWallProjection(int32 ParticleIdx, float DeltaSeconds);
+	FVector GetActorSpacePosition(int32 ParticleIdx) const;
+	void UpdatePositions3D();
+	void RecordCacheFrame();
+	void UpdateCachePlayback();
+	FBox GetQuantizationBounds() const;
+	void SetNiagaraPositions(const FVector* ParticlePositions);
+	bool LoadSnapshot(const class USPHSnapshot* Snapshot);
 
 private:
 	TArray<FVector2D> Positions;
 	TArray<FVector2D> PrevPositions;
 	TArray<FLinearColor> Colors;
 	TArray<FVector2D> Velocities;
-	// x͖t[vẐŃt[Ԃ̂Ђ͂Ȃ̂AgpTArrayׂ̐邽߂
-	// g܂킵Ă
+	// 加速度は毎フレーム計算するのでフレーム間のひきつぎはないのだが、使用メモリやTArrayの生成負荷をおさえるために
+	// 使いまわしている
 	TArray<FVector2D> Accelerations;
 	TArray<float> Densities;
 	TArray<float> Pressures;
@@ -138,7 +262,26 @@ private:
 	float SmoothLenSq = 0.0f;
 	int32 NumThreadParticles = 0.0f;
 	FNeighborGrid3DCPU NeighborGrid3D;
+	// 密度計算と力の計算で歩く近傍セル
+	FNeighborGridStencil NeighborStencil;
+	// BuildNeighborGrid3D()で求めたセルを、同じサブステップの密度計算と力の計算で使いまわす
+	TArray<FIntVector> ParticleCellIndices;
+	// 密度計算で集めたカーネル半径内の近傍。MaxCachedNeighborsを超えたパーティクルはINDEX_NONEにする
+	TArray<int32> CachedNeighbors;
+	TArray<int32> NumCachedNeighbors;
+	FParallelWorkerTeam WorkerTeam;
 	FTransform LocalToUnitTransform;
+	// サブステップ中はアクタが動かないので、BeginSimulation()でキャッシュしたものを使う
+	FTransform CachedActorTransform;
+	FSPHLocalFrame LocalFrame;
+	// bSimulateInLocalSpaceのときはアクタ空間のYZ平面での重力
+	FVector2D SimulationGravity = FVector2D::ZeroVector;
+	FParticleCacheWriter CacheWriter;
+	FParticleCacheReader CacheReader;
+	TArray<FVector> CacheVelocities;
+	float CachePlaybackTime = 0.0f;
+	int32 CacheFrameIndex = INDEX_NONE;
+	TArray<uint16> QuantizedPositions;
 
 public:
 	/** Returns NiagaraComponent subobject **/
@@ -7,9 +7,18 @@
 #include "NiagaraSystem.h"
 #include "NiagaraFunctionLibrary.h"
 #include "NiagaraDataInterfaceArrayFloat.h"
+#include "NiagaraDataInterfaceArrayInt.h"
+#include "SPHSimulatorSubsystem.h"
+#include "SPHSnapshot.h"
+#include "SPHBoundarySDF.h"
+#include "../Common/ParticleQuantization.h"
+#include "../Common/HalfPrecision.h"
 
 namespace
 {
+	// 半精度の密度と圧力を、この粒子数ごとにまとめてSIMDで変換する
+	const int32 NumParticlesPerHalfEncode = 64;
+
 	FVector RandPointInSphere(const FBoxSphereBounds& BoxSphere)
 	{
 		FVector Point;
@@ -18,17 +27,45 @@ namespace
 		do
 		{
 			Point = FMath::RandPointInBox(BoxSphere.GetBox());
-			L = Point.SizeSquared();
+			L = (Point - BoxSphere.Origin).SizeSquared();
 		}
-		while (L > BoxSphere.SphereRadius);
+		while (L > FMath::Square(BoxSphere.SphereRadius));
 
 		return Point;
 	}
 
-	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayVector()QlɂĂ
-	void SetNiagaraArrayVector(UNiagaraComponent* NiagaraSystem, FName OverrideName, const TArray<FVector>& ArrayData)
+	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayVector()を参考にしている
+	void SetNiagaraArrayVector(UNiagaraComponent* NiagaraSystem, FName OverrideName, const FVector* ArrayData, int32 Num)
 	{
 		if (UNiagaraDataInterfaceArrayFloat3* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayFloat3>(NiagaraSystem, OverrideName))
+		{
+			FRWScopeLock WriteLock(ArrayDI->ArrayRWGuard, SLT_Write);
+			ArrayDI->FloatData.SetNumUninitialized(Num);
+			FMemory::Memcpy(ArrayDI->FloatData.GetData(), ArrayData, Num * sizeof(FVector));
+			ArrayDI->MarkRenderDataDirty();
+		}
+	}
+
+	// uint16の3成分を2つずつint32の配列に詰めて渡す。Niagara側では(Index * 3 + Component)番目の16bitを取り出し、
+	// OverrideName + "Min"とOverrideName + "Max"の範囲にデコードする
+	void SetNiagaraArrayQuantizedVector(UNiagaraComponent* NiagaraSystem, FName OverrideName, const FBox& Bounds, const uint16* EncodedData, int32 Num)
+	{
+		if (UNiagaraDataInterfaceArrayInt32* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayInt32>(NiagaraSystem, OverrideName))
+		{
+			FRWScopeLock WriteLock(ArrayDI->ArrayRWGuard, SLT_Write);
+			ArrayDI->IntData.SetNumZeroed((Num * 3 + 1) / 2);
+			FMemory::Memcpy(ArrayDI->IntData.GetData(), EncodedData, Num * 3 * sizeof(uint16));
+			ArrayDI->MarkRenderDataDirty();
+		}
+
+		NiagaraSystem->SetNiagaraVariableVec3(OverrideName.ToString() + TEXT("Min"), Bounds.Min);
+		NiagaraSystem->SetNiagaraVariableVec3(OverrideName.ToString() + TEXT("Max"), Bounds.Max);
+	}
+
+	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayFloat()を参考にしている
+	void SetNiagaraArrayFloat(UNiagaraComponent* NiagaraSystem, FName OverrideName, const TArray<float>& ArrayData)
+	{
+		if (UNiagaraDataInterfaceArrayFloat* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayFloat>(NiagaraSystem, OverrideName))
 		{
 			FRWScopeLock WriteLock(ArrayDI->ArrayRWGuard, SLT_Write);
 			ArrayDI->FloatData = ArrayData;
@@ -36,7 +73,7 @@ namespace
 		}
 	}
 
-	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayColor()QlɂĂ
+	// UNiagaraDataInterfaceArrayFunctionLibrary::SetNiagaraArrayColor()を参考にしている
 	void SetNiagaraArrayColor(UNiagaraComponent* NiagaraSystem, FName OverrideName, const TArray<FLinearColor>& ArrayData)
 	{
 		if (UNiagaraDataInterfaceArrayColor* ArrayDI = UNiagaraFunctionLibrary::GetDataInterface<UNiagaraDataInterfaceArrayColor>(NiagaraSystem, OverrideName))
@@ -52,42 +89,147 @@ void ASPH3DSimulatorCPU::BeginPlay()
 {
 	Super::BeginPlay();
 
+	if (CacheMode == EParticleCacheMode::Playback)
+	{
+		if (CacheReader.Open(CacheFilePath))
+		{
+			NumParticles = CacheReader.GetNumParticles();
+			// キャッシュ再生中はシミュレーションしないのでサブシステムへの登録も不要
+			bUseSimulatorSubsystem = false;
+			// キャッシュはワールド空間で記録している
+			bSimulateInLocalSpace = false;
+		}
+		else
+		{
+			CacheMode = EParticleCacheMode::None;
+		}
+	}
+
 	Positions.SetNum(NumParticles);
 	PrevPositions.SetNum(NumParticles);
 	Colors.SetNum(NumParticles);
 	Velocities.SetNum(NumParticles);
 	Accelerations.SetNum(NumParticles);
-	Densities.SetNum(NumParticles);
-	Pressures.SetNum(NumParticles);
+	ParticleCellIndices.SetNumZeroed(NumParticles);
+	MaxCachedNeighbors = FMath::Max(1, MaxCachedNeighbors);
+	CachedNeighbors.SetNumUninitialized(NumParticles * MaxCachedNeighbors);
+	NumCachedNeighbors.SetNumZeroed(NumParticles);
+	NeighborCounts.SetNumZeroed(NumParticles);
+	NeighborOffsets.SetNumZeroed(NumParticles);
+	// 半精度のときは密度と圧力をfloatでは持たない
+	if (bHalfPrecisionNeighborAttributes)
+	{
+		Densities.Empty();
+		Pressures.Empty();
+		HalfDensityPressures.SetNumZeroed(NumParticles * 2);
+	}
+	else
+	{
+		Densities.SetNum(NumParticles);
+		Pressures.SetNum(NumParticles);
+		HalfDensityPressures.Empty();
+	}
 
-	// InitPosRadiusa̋Ƀ_ɔzu
-	FBoxSphereBounds BoxSphere(WallBox.GetCenter(), FVector(InitPosRadius), InitPosRadius);
-	for (int32 i = 0; i < NumParticles; ++i)
+	CachedActorTransform = GetActorTransform();
+	LocalFrame.Reset(CachedActorTransform);
+
+	BoundaryField = nullptr;
+	if (BoundarySDF != nullptr)
+	{
+		if (BoundarySDF->Field.IsValid())
+		{
+			BoundaryField = &BoundarySDF->Field;
+		}
+		else
+		{
+			UE_LOG(LogTemp, Warning, TEXT("SPH boundary SDF %s is not baked. Use WallBox instead."), *BoundarySDF->GetName());
+		}
+	}
+
+	bool bLoadedSnapshot = WarmStartSnapshot != nullptr && CacheMode != EParticleCacheMode::Playback && LoadSnapshot(WarmStartSnapshot);
+	if (!bLoadedSnapshot)
+	{
+		if (InitialPlacement == ESPHInitialPlacement::Random)
+		{
+			// InitPosRadius半径の球内にランダムに配置
+			FBoxSphereBounds BoxSphere(WallBox.GetCenter(), FVector(InitPosRadius), InitPosRadius);
+			for (int32 i = 0; i < NumParticles; ++i)
+			{
+				Positions[i] = GetActorLocation() + RandPointInSphere(BoxSphere);
+			}
+		}
+		else if (InitialPlacement == ESPHInitialPlacement::LatticeSphere)
+		{
+			// InitPosRadius半径の球内に静止密度の間隔で格子状に配置
+			const FVector& Center = GetActorLocation() + WallBox.GetCenter();
+			float RadiusSquared = FMath::Square(InitPosRadius);
+			FSPHLatticeInitializer::Fill3D(
+				FBox(Center - FVector(InitPosRadius), Center + FVector(InitPosRadius)),
+				[&Center, RadiusSquared](const FVector& Point) { return (Point - Center).SizeSquared() <= RadiusSquared; },
+				FSPHLatticeInitializer::GetRestSpacing3D(Mass, RestDensity),
+				InitJitter,
+				InitSeed,
+				Positions
+			);
+		}
+		else
+		{
+			// InitBox内に静止密度の間隔で格子状に配置
+			FSPHLatticeInitializer::Fill3D(
+				InitBox.ShiftBy(GetActorLocation()),
+				[](const FVector& Point) { return true; },
+				FSPHLatticeInitializer::GetRestSpacing3D(Mass, RestDensity),
+				InitJitter,
+				InitSeed,
+				Positions
+			);
+		}
+
+		PrevPositions = Positions;
+
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			Velocities[i] = FVector::ZeroVector;
+		}
+	}
+
+	if (CacheMode == EParticleCacheMode::Playback)
 	{
-		Positions[i] = GetActorLocation() + RandPointInSphere(BoxSphere);
-		PrevPositions[i] = Positions[i];
+		// 色の塗り分けとNiagaraへの初期値にはキャッシュの先頭フレームを使う
+		if (const FVector* FramePositions = CacheReader.GetFramePositions(0))
+		{
+			FMemory::Memcpy(Positions.GetData(), FramePositions, NumParticles * sizeof(FVector));
+		}
 	}
 
-	for (int32 i = 0; i < NumParticles; ++i)
+	if (bSimulateInLocalSpace)
 	{
-		// {bNX̏ʒuɉRGBœh蕪
-		Colors[i] = FLinearColor((Positions[i] - GetActorLocation() - WallBox.Min) / WallBox.GetExtent() * 0.5f);
+		// 初期配置はワールド空間で作っているので、一度だけアクタ空間に変換する
+		for (int32 i = 0; i < NumParticles; ++i)
+		{
+			Positions[i] = CachedActorTransform.InverseTransformPositionNoScale(Positions[i]);
+			PrevPositions[i] = CachedActorTransform.InverseTransformPositionNoScale(PrevPositions[i]);
+			Velocities[i] = CachedActorTransform.InverseTransformVectorNoScale(Velocities[i]);
+		}
 	}
 
 	for (int32 i = 0; i < NumParticles; ++i)
 	{
-		Velocities[i] = FVector::ZeroVector;
+		// ボックス内の初期位置に応じてRGBで塗り分ける
+		const FVector& RelativePos = bSimulateInLocalSpace ? Positions[i] : Positions[i] - GetActorLocation();
+		Colors[i] = FLinearColor((RelativePos - WallBox.Min) / WallBox.GetExtent() * 0.5f);
 	}
 
 	if (bUseNeighborGrid3D)
 	{
-		NeighborGrid3D.Initialize(FIntVector(NumCellsX, NumCellsY, NumCellsZ), MaxNeighborsPerCell);
+		NeighborGrid3D.Initialize(FIntVector(NumCellsX, NumCellsY, NumCellsZ), MaxNeighborsPerCell, NumParticles);
+		NeighborStencil = NeighborGrid3D.MakeStencil(FIntVector(1, 1, 1));
 	}
 
-	// Tick()Őݒ肵ĂAxNiagaraSystemŏzuĂƁÃX|[ł͔z͏lgĂ܂
-	//ԂɍȂ̂BeginPlay()łݒ肷
+	// Tick()で設定しても、レベルにNiagaraSystemが最初から配置されていると、初回のスポーンでは配列は初期値を使ってしまい
+	//間に合わないのでBeginPlay()でも設定する
 	NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
-	SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), Positions);
+	SetNiagaraPositions(GetWorldPositions(), NumParticles);
 	SetNiagaraArrayColor(NiagaraComponent, FName("Colors"), Colors);
 
 	DensityCoef = Mass * 4.0f / PI / FMath::Pow(SmoothLength, 8);
@@ -96,392 +238,603 @@ void ASPH3DSimulatorCPU::BeginPlay()
 
 	SmoothLenSq = SmoothLength * SmoothLength;
 	NumThreadParticles = (NumParticles + NumThreads - 1) / NumThreads;
-}
-
-void ASPH3DSimulatorCPU::Tick(float DeltaSeconds)
-{
-	Super::Tick(DeltaSeconds);
 
-	if (bUseNeighborGrid3D)
+	if (CacheMode == EParticleCacheMode::Record && !CacheWriter.Open(CacheFilePath, NumParticles, FrameRate, bCacheVelocities, bQuantizeCache, GetQuantizationBounds(), MaxVelocity))
 	{
-		//[-WorldBBoxSize / 2, WorldBBoxSize / 2][0,1]ɎʑĈ
-		LocalToUnitTransform = FTransform(FQuat::Identity, FVector(0.5f), FVector(1.0f) / WorldBBoxSize);
+		CacheMode = EParticleCacheMode::None;
 	}
 
-	if (DeltaSeconds > KINDA_SMALL_NUMBER)
+	if (bUseSimulatorSubsystem)
 	{
-		// DeltaSeconds̒l̕ϓɊւ炸AV~[VɎgTuXebv^C͌ŒƂ
-		float SubStepDeltaSeconds = 1.0f / FrameRate / NumIterations;
-
-		for (int32 i = 0; i < NumIterations; ++i)
+		if (USPHSimulatorSubsystem* SimulatorSubsystem = GetWorld()->GetSubsystem<USPHSimulatorSubsystem>())
+		{
+			SimulatorSubsystem->RegisterSimulator(this);
+		}
+		else
 		{
-			Simulate(SubStepDeltaSeconds);
+			bUseSimulatorSubsystem = false;
 		}
 	}
 
-	NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
-	SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), Positions);
+	if (bUsePersistentWorkers && !bUseSimulatorSubsystem && CacheMode != EParticleCacheMode::Playback)
+	{
+		WorkerTeam.Start(FMath::Max(1, NumThreads), TEXT("SPH3DWorker"));
+	}
 }
 
-void ASPH3DSimulatorCPU::Simulate(float DeltaSeconds)
+void ASPH3DSimulatorCPU::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
-	for (int32 ParticleIdx = 0; ParticleIdx < NumParticles; ++ParticleIdx)
+	if (bUseSimulatorSubsystem)
 	{
-		Densities[ParticleIdx] = 0.0f;
-		Accelerations[ParticleIdx] = FVector::ZeroVector;
+		if (USPHSimulatorSubsystem* SimulatorSubsystem = GetWorld()->GetSubsystem<USPHSimulatorSubsystem>())
+		{
+			SimulatorSubsystem->UnregisterSimulator(this);
+		}
 	}
 
-	if (bUseNeighborGrid3D)
-	{
-		NeighborGrid3D.Reset();
-
-		// NeighborGrid3D̍\z
-		ParallelFor(NumThreads,
-			[this](int32 ThreadIndex)
-			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
-				{
-					const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorTransform().InverseTransformPositionNoScale(Positions[ParticleIdx]), LocalToUnitTransform);
-					const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
-					if (NeighborGrid3D.IsValidCellIndex(CellIndex))
-					{
-						int32 LinearIndex = NeighborGrid3D.IndexToLinear(CellIndex);
-						int32 PreviousNeighborCount = 0;
-						NeighborGrid3D.SetParticleNeighborCount(LinearIndex, 1, PreviousNeighborCount);
+	WorkerTeam.Stop();
+	CacheWriter.Close();
+	CacheReader.Close();
 
-						if (PreviousNeighborCount < MaxNeighborsPerCell)
-						{
-							int32 NeighborGridLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(CellIndex, PreviousNeighborCount);
-							NeighborGrid3D.SetParticleNeighbor(NeighborGridLinearIndex, ParticleIdx);
-						}
-						else
-						{
-							UE_LOG(LogTemp, Warning, TEXT("Over registation to NeighborGrid3DCPU. CellIndex=(%d, %d, %d). PreviousNeighborCount=%d."), CellIndex.X, CellIndex.Y, CellIndex.Z, PreviousNeighborCount);
-						}
-					}
-					else
-					{
-						UE_LOG(LogTemp, Warning, TEXT("There is a particle which is out of NeighborGrid3D. Idx = %d. Position = (%f, %f, %f)."), ParticleIdx, Positions[ParticleIdx].X, Positions[ParticleIdx].Y, Positions[ParticleIdx].Z);
-						continue;
-					}
-				}
-			}
-		);
+	Super::EndPlay(EndPlayReason);
+}
 
-		ParallelFor(NumThreads,
-			[this](int32 ThreadIndex)
-			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
-				{
-					// LbVقǂ̂̂łȂ̂NeighborGrid3D\ẑƂƓvZĂ̂͋e
-					const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorTransform().InverseTransformPositionNoScale(Positions[ParticleIdx]), LocalToUnitTransform);
-					const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
+void ASPH3DSimulatorCPU::Tick(float DeltaSeconds)
+{
+	Super::Tick(DeltaSeconds);
 
-					if (!NeighborGrid3D.IsValidCellIndex(CellIndex))
-					{
-						// \ẑƂɌxOoĂ̂ŌxoƂ͂Ȃ
-						continue;
-					}
+	if (CacheMode == EParticleCacheMode::Playback)
+	{
+		CachePlaybackTime += DeltaSeconds;
+		UpdateCachePlayback();
+		return;
+	}
 
-					static FIntVector AdjacentIndexOffsets[27] = {
-						FIntVector(-1, -1, -1),
-						FIntVector(-1, 0, -1),
-						FIntVector(-1, +1, -1),
-						FIntVector(-1, -1, 0),
-						FIntVector(-1, 0, 0),
-						FIntVector(-1, +1, 0),
-						FIntVector(-1, -1, +1),
-						FIntVector(-1, 0, +1),
-						FIntVector(-1, +1, +1),
-
-						FIntVector(0, -1, -1),
-						FIntVector(0, 0, -1),
-						FIntVector(0, +1, -1),
-						FIntVector(0, -1, 0),
-						FIntVector(0, 0, 0),
-						FIntVector(0, +1, 0),
-						FIntVector(0, -1, +1),
-						FIntVector(0, 0, +1),
-						FIntVector(0, +1, +1),
-
-						FIntVector(+1, -1, -1),
-						FIntVector(+1, 0, -1),
-						FIntVector(+1, +1, -1),
-						FIntVector(+1, -1, 0),
-						FIntVector(+1, 0, 0),
-						FIntVector(+1, +1, 0),
-						FIntVector(+1, -1, +1),
-						FIntVector(+1, 0, +1),
-						FIntVector(+1, +1, +1),
-					};
-
-					for (int32 AdjIdx = 0; AdjIdx < 27; ++AdjIdx)
-					{
-						const FIntVector& AdjacentCellIndex = CellIndex + AdjacentIndexOffsets[AdjIdx];
-						if (!NeighborGrid3D.IsValidCellIndex(AdjacentCellIndex))
-						{
-							continue;
-						}
+	if (bUseSimulatorSubsystem)
+	{
+		// シミュレーションと出力はUSPHSimulatorSubsystemのTick()で行う
+		return;
+	}
 
-						for (int32 NeighborIdx = 0; NeighborIdx < MaxNeighborsPerCell; ++NeighborIdx)
-						{
-							int32 NeighborLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(AdjacentCellIndex, NeighborIdx);
-							int32 AnotherParticleIdx = NeighborGrid3D.GetParticleNeighbor(NeighborLinearIndex);
-							if (ParticleIdx == AnotherParticleIdx || AnotherParticleIdx == INDEX_NONE)
-							{
-								continue;
-							}
+	BeginSimulation();
 
-							CalculateDensity(ParticleIdx, AnotherParticleIdx);
-						}
-					}
+	if (DeltaSeconds > KINDA_SMALL_NUMBER)
+	{
+		// DeltaSecondsの値の変動に関わらず、シミュレーションに使うサブステップタイムは固定とする
+		float SubStepDeltaSeconds = GetSubStepDeltaSeconds();
 
-					CalculatePressure(ParticleIdx);
-				}
+		if (WorkerTeam.IsRunning())
+		{
+			SimulateWithWorkerTeam(SubStepDeltaSeconds);
+		}
+		else
+		{
+			for (int32 i = 0; i < NumIterations; ++i)
+			{
+				Simulate(SubStepDeltaSeconds);
 			}
-		);
+		}
+	}
 
-		// ApplyPressurẽp[eBN̈͒lĝŁAׂĈ͒lvZĂʃ[vɂKv
-		ParallelFor(NumThreads,
-			[this, DeltaSeconds](int32 ThreadIndex)
-			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
-				{
-					// LbVقǂ̂̂łȂ̂NeighborGrid3D\ẑƂƓvZĂ̂͋e
-					const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorTransform().InverseTransformPositionNoScale(Positions[ParticleIdx]), LocalToUnitTransform);
-					const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
+	EndSimulation();
+}
 
-					if (!NeighborGrid3D.IsValidCellIndex(CellIndex))
-					{
-						// \ẑƂɌxOoĂ̂ŌxoƂ͂Ȃ
-						continue;
-					}
+int32 ASPH3DSimulatorCPU::GetNumParticles() const
+{
+	return NumParticles;
+}
 
-					static FIntVector AdjacentIndexOffsets[27] = {
-						FIntVector(-1, -1, -1),
-						FIntVector(-1, 0, -1),
-						FIntVector(-1, +1, -1),
-						FIntVector(-1, -1, 0),
-						FIntVector(-1, 0, 0),
-						FIntVector(-1, +1, 0),
-						FIntVector(-1, -1, +1),
-						FIntVector(-1, 0, +1),
-						FIntVector(-1, +1, +1),
-
-						FIntVector(0, -1, -1),
-						FIntVector(0, 0, -1),
-						FIntVector(0, +1, -1),
-						FIntVector(0, -1, 0),
-						FIntVector(0, 0, 0),
-						FIntVector(0, +1, 0),
-						FIntVector(0, -1, +1),
-						FIntVector(0, 0, +1),
-						FIntVector(0, +1, +1),
-
-						FIntVector(+1, -1, -1),
-						FIntVector(+1, 0, -1),
-						FIntVector(+1, +1, -1),
-						FIntVector(+1, -1, 0),
-						FIntVector(+1, 0, 0),
-						FIntVector(+1, +1, 0),
-						FIntVector(+1, -1, +1),
-						FIntVector(+1, 0, +1),
-						FIntVector(+1, +1, +1),
-					};
-
-					for (int32 AdjIdx = 0; AdjIdx < 27; ++AdjIdx)
-					{
-						const FIntVector& AdjacentCellIndex = CellIndex + AdjacentIndexOffsets[AdjIdx];
-						if (!NeighborGrid3D.IsValidCellIndex(AdjacentCellIndex))
-						{
-							continue;
-						}
+int32 ASPH3DSimulatorCPU::GetNumSubSteps() const
+{
+	return NumIterations;
+}
 
-						for (int32 NeighborIdx = 0; NeighborIdx < MaxNeighborsPerCell; ++NeighborIdx)
-						{
-							int32 NeighborLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(AdjacentCellIndex, NeighborIdx);
-							int32 AnotherParticleIdx = NeighborGrid3D.GetParticleNeighbor(NeighborLinearIndex);
-							if (ParticleIdx == AnotherParticleIdx || AnotherParticleIdx == INDEX_NONE)
-							{
-								continue;
-							}
+float ASPH3DSimulatorCPU::GetSubStepDeltaSeconds() const
+{
+	return 1.0f / FrameRate / NumIterations;
+}
 
-							ApplyPressure(ParticleIdx, AnotherParticleIdx);
-							ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
-						}
-					}
+bool ASPH3DSimulatorCPU::IsSimulationPhaseEnabled(ESPHSimulationPhase Phase) const
+{
+	return Phase != ESPHSimulationPhase::BuildNeighborGrid3D || bUseNeighborGrid3D;
+}
 
-					if (!bUseWallProjection)
-					{
-						ApplyWallPenalty(ParticleIdx);
-					}
-					Integrate(ParticleIdx, DeltaSeconds);
-					if (bUseWallProjection)
-					{
-						ApplyWallProjection(ParticleIdx, DeltaSeconds);
-					}
-				}
-			}
-		);
+void ASPH3DSimulatorCPU::BeginSimulation()
+{
+	CachedActorTransform = GetActorTransform();
+
+	if (bSimulateInLocalSpace)
+	{
+		LocalFrame.Update(CachedActorTransform, GetWorld()->GetDeltaSeconds());
+		SimulationGravity = CachedActorTransform.InverseTransformVectorNoScale(FVector(0.0f, 0.0f, Gravity));
 	}
 	else
 	{
-		ParallelFor(NumThreads,
-			[this](int32 ThreadIndex)
-			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
-				{
-					for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
-					{
-						if (ParticleIdx == AnotherParticleIdx)
-						{
-							continue;
-						}
-
-						CalculateDensity(ParticleIdx, AnotherParticleIdx );
-					}
-
-					CalculatePressure(ParticleIdx);
-				}
-			}
-		);
-
-		// ApplyPressurẽp[eBN̈͒lĝŁAׂĈ͒lvZĂʃ[vɂKv
-		ParallelFor(NumThreads,
-			[this, DeltaSeconds](int32 ThreadIndex)
-			{
-				for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < NumThreadParticles * (ThreadIndex + 1) && ParticleIdx < NumParticles; ++ParticleIdx)
-				{
-					for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
-					{
-						if (ParticleIdx == AnotherParticleIdx)
-						{
-							continue;
-						}
-
-						ApplyPressure(ParticleIdx, AnotherParticleIdx);
-						ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
-					}
+		SimulationGravity = FVector(0.0f, 0.0f, Gravity);
+	}
 
-					if (!bUseWallProjection)
-					{
-						ApplyWallPenalty(ParticleIdx);
-					}
-					Integrate(ParticleIdx, DeltaSeconds);
-					if (bUseWallProjection)
-					{
-						ApplyWallProjection(ParticleIdx, DeltaSeconds);
-					}
-				}
-			}
-		);
+	if (bUseNeighborGrid3D)
+	{
+		//[-WorldBBoxSize / 2, WorldBBoxSize / 2]を[0,1]に写像して扱う
+		LocalToUnitTransform = FTransform(FQuat::Identity, FVector(0.5f), FVector(1.0f) / WorldBBoxSize);
 	}
 }
 
-void ASPH3DSimulatorCPU::CalculateDensity(int32 ParticleIdx, int32 AnotherParticleIdx)
+void ASPH3DSimulatorCPU::BeginSubStep()
 {
-	check(ParticleIdx != AnotherParticleIdx);
-
-	const FVector& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
-	float DistanceSq = DiffPos.SizeSquared();
-	if (DistanceSq < SmoothLenSq)
+	// パーティクルごとの値の初期化は、全パーティクルを余分に1回なめないように各フェーズの先頭で行う
+	// 差分更新ではグリッドをリセットせず、BuildNeighborGrid3D()でセルが変わったパーティクルだけを移す
+	if (bUseNeighborGrid3D && !bIncrementalNeighborGrid3D)
 	{
-		float DiffLenSq = SmoothLenSq - DistanceSq;
-		Densities[ParticleIdx] += DensityCoef * DiffLenSq * DiffLenSq * DiffLenSq;
+		NeighborGrid3D.Reset();
 	}
 }
 
-void ASPH3DSimulatorCPU::CalculatePressure(int32 ParticleIdx)
+void ASPH3DSimulatorCPU::SimulatePhase(ESPHSimulationPhase Phase, int32 StartIdx, int32 EndIdx, float DeltaSeconds)
 {
-	Pressures[ParticleIdx] = PressureStiffness * FMath::Max(FMath::Pow(Densities[ParticleIdx] / RestDensity, 3) - 1.0f, 0.0f);
+	switch (Phase)
+	{
+		case ESPHSimulationPhase::BuildNeighborGrid3D:
+			BuildNeighborGrid3D(StartIdx, EndIdx);
+			break;
+		case ESPHSimulationPhase::CalculateDensityAndPressure:
+			CalculateDensityAndPressure(StartIdx, EndIdx);
+			break;
+		case ESPHSimulationPhase::ApplyForcesAndIntegrate:
+			ApplyForcesAndIntegrate(StartIdx, EndIdx, DeltaSeconds);
+			break;
+		default:
+			check(false);
+			break;
+	}
 }
 
-void ASPH3DSimulatorCPU::ApplyPressure(int32 ParticleIdx, int32 AnotherParticleIdx)
+void ASPH3DSimulatorCPU::EndSimulation()
 {
-	check(ParticleIdx != AnotherParticleIdx);
+	// ワールド空間への変換は出力時にフレームあたり一度だけ行う
+	const FVector* OutputPositions = GetWorldPositions();
 
-	if (Densities[ParticleIdx] < SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+	if (bOutputSurfaceOnly)
 	{
-		return;
+		int32 NumOutputParticles = CompactSurfaceParticles(OutputPositions);
+		NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumOutputParticles);
+		SetNiagaraPositions(SurfacePositions.GetData(), NumOutputParticles);
+		SetNiagaraArrayColor(NiagaraComponent, FName("Colors"), SurfaceColors);
+	}
+	else
+	{
+		NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
+		SetNiagaraPositions(OutputPositions, NumParticles);
 	}
 
-	const FVector& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
-	float DistanceSq = DiffPos.SizeSquared();
-	float Distance = DiffPos.Size();
-	if (DistanceSq < SmoothLenSq
-		&& Densities[AnotherParticleIdx] > SMALL_NUMBER && Distance > SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+	if (bRasterizeDensityVolume)
 	{
-		float DiffLen = SmoothLength - Distance;
-#if 1
-		// ƈႤAUnityGraphicsProgramming1\[XR[hŎgĂB̕Ȃ肷邵t[[gオ
-		float AvgPressure = 0.5f * (Pressures[ParticleIdx] + Pressures[AnotherParticleIdx]);
-		const FVector& Pressure = GradientPressureCoef * AvgPressure / Densities[AnotherParticleIdx] * DiffLen * DiffLen / Distance * DiffPos;
-#else
-		float DiffPressure = Pressures[ParticleIdx] - Pressures[AnotherParticleIdx];
-		const FVector& Pressure = GradientPressureCoef * DiffPressure / Densities[AnotherParticleIdx] * DiffLen * DiffLen / Distance * DiffPos;
-#endif
+		UpdateDensityVolume(OutputPositions);
+	}
 
-		Accelerations[ParticleIdx] += Pressure / Densities[ParticleIdx];
+	if (CacheMode == EParticleCacheMode::Record)
+	{
+		RecordCacheFrame(OutputPositions);
 	}
 }
 
-void ASPH3DSimulatorCPU::ApplyViscosity(int32 ParticleIdx, int32 AnotherParticleIdx, float DeltaSeconds)
+void ASPH3DSimulatorCPU::Simulate(float DeltaSeconds)
 {
-	check(ParticleIdx != AnotherParticleIdx);
+	BeginSubStep();
 
-	if (Densities[ParticleIdx] < SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
+	if (bUseNeighborGrid3D)
 	{
-		return;
+		// NeighborGrid3Dの構築
+		ParallelFor(NumThreads,
+			[this](int32 ThreadIndex)
+			{
+				BuildNeighborGrid3D(NumThreadParticles * ThreadIndex, FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles));
+			}
+		);
 	}
 
-	const FVector& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
-	float DistanceSq = DiffPos.SizeSquared();
-	if (DistanceSq < SmoothLenSq
-		&& Densities[AnotherParticleIdx] > SMALL_NUMBER) // 0ZƁAȒl̏Zł傫ȍɂȂ̂
-	{
-		FVector DiffVel;
-		if (bUseWallProjection)
+	ParallelFor(NumThreads,
+		[this](int32 ThreadIndex)
 		{
-			DiffVel = ((Positions[AnotherParticleIdx] - PrevPositions[AnotherParticleIdx]) - (Positions[ParticleIdx] - PrevPositions[ParticleIdx])) / DeltaSeconds;
+			CalculateDensityAndPressure(NumThreadParticles * ThreadIndex, FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles));
 		}
-		else
+	);
+
+	// ApplyPressureが他のパーティクルの圧力値を使うので、すべて圧力値を計算してから別ループにする必要がある
+	ParallelFor(NumThreads,
+		[this, DeltaSeconds](int32 ThreadIndex)
 		{
-			DiffVel = Velocities[AnotherParticleIdx] - Velocities[ParticleIdx];
+			ApplyForcesAndIntegrate(NumThreadParticles * ThreadIndex, FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles), DeltaSeconds);
 		}
-		const FVector& ViscosityForce = LaplacianViscosityCoef / Densities[AnotherParticleIdx] * (SmoothLength - DiffPos.Size()) * DiffVel;
-		Accelerations[ParticleIdx] += Viscosity * ViscosityForce / Densities[ParticleIdx];
-	}
+	);
 }
 
-void ASPH3DSimulatorCPU::ApplyWallPenalty(int32 ParticleIdx)
+void ASPH3DSimulatorCPU::SimulateWithWorkerTeam(float DeltaSeconds)
 {
-	// vZyȂ̂ŁAAN^̈ʒuړƉ]߂WnŃp[eBNʒu
-	const FVector& InvActorMovePos = GetActorTransform().InverseTransformPositionNoScale(Positions[ParticleIdx]);
-
-	//TODO: SPHČĂxg킸PBDgĂ͂Ȃ񂾂
-	// ㋫E
-	const FVector& TopAccel = FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Z) * WallStiffness * FVector(0.0f, 0.0f, -1.0f);
-	Accelerations[ParticleIdx] += GetActorTransform().TransformVectorNoScale(TopAccel);
-	// E
-	const FVector& BottomAccel = FMath::Max(0.0f, WallBox.Min.Z - InvActorMovePos.Z) * WallStiffness * FVector(0.0f, 0.0f, 1.0f);
-	Accelerations[ParticleIdx] += GetActorTransform().TransformVectorNoScale(BottomAccel);
-	// E
-	const FVector& LeftAccel = FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.X) * WallStiffness * FVector(1.0f, 0.0f, 0.0f);
-	Accelerations[ParticleIdx] += GetActorTransform().TransformVectorNoScale(LeftAccel);
-	// EE
-	const FVector& RightAccel = FMath::Max(0.0f, InvActorMovePos.X - WallBox.Max.X) * WallStiffness * FVector(-1.0f, 0.0f, 0.0f);
-	Accelerations[ParticleIdx] += GetActorTransform().TransformVectorNoScale(RightAccel);
-	// E
-	const FVector& BackAccel = FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Y) * WallStiffness * FVector(0.0f, 1.0f, 0.0f);
-	Accelerations[ParticleIdx] += GetActorTransform().TransformVectorNoScale(BackAccel);
-	// OE
-	const FVector& FrontAccel = FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.Y) * WallStiffness * FVector(0.0f, -1.0f, 0.0f);
-	Accelerations[ParticleIdx] += GetActorTransform().TransformVectorNoScale(FrontAccel);
+	// フレームの全サブステップを1つのジョブとして投げ、フェーズ間はバリアで同期する。
+	// パーティクルの分担はSimulate()のParallelForと同じ
+	WorkerTeam.Run(
+		[this, DeltaSeconds](int32 WorkerIndex)
+		{
+			const int32 StartIdx = FMath::Min(NumThreadParticles * WorkerIndex, NumParticles);
+			const int32 EndIdx = FMath::Min(NumThreadParticles * (WorkerIndex + 1), NumParticles);
+
+			for (int32 i = 0; i < NumIterations; ++i)
+			{
+				if (WorkerIndex == 0)
+				{
+					BeginSubStep();
+				}
+				WorkerTeam.Barrier();
+
+				if (bUseNeighborGrid3D)
+				{
+					BuildNeighborGrid3D(StartIdx, EndIdx);
+					WorkerTeam.Barrier();
+				}
+
+				CalculateDensityAndPressure(StartIdx, EndIdx);
+				WorkerTeam.Barrier();
+
+				ApplyForcesAndIntegrate(StartIdx, EndIdx, DeltaSeconds);
+				WorkerTeam.Barrier();
+			}
+		}
+	);
 }
 
-void ASPH3DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
+void ASPH3DSimulatorCPU::BuildNeighborGrid3D(int32 StartIdx, int32 EndIdx)
 {
-	Accelerations[ParticleIdx] += FVector(0.0f, 0.0f, Gravity);
+	for (int32 ParticleIdx = StartIdx; ParticleIdx < EndIdx; ++ParticleIdx)
+	{
+		const FVector& UnitPos = NeighborGrid3D.SimulationToUnit(GetActorSpacePosition(ParticleIdx), LocalToUnitTransform);
+		const FIntVector& CellIndex = NeighborGrid3D.UnitToIndex(UnitPos);
+		ParticleCellIndices[ParticleIdx] = CellIndex;
+		if (NeighborGrid3D.IsValidCellIndex(CellIndex))
+		{
+			if (bIncrementalNeighborGrid3D)
+			{
+				if (!NeighborGrid3D.UpdateParticle(ParticleIdx, NeighborGrid3D.IndexToLinear(CellIndex)))
+				{
+					UE_LOG(LogTemp, Warning, TEXT("Over registation to NeighborGrid3DCPU. CellIndex=(%d, %d, %d). MaxNeighborsPerCell=%d."), CellIndex.X, CellIndex.Y, CellIndex.Z, MaxNeighborsPerCell);
+				}
+				continue;
+			}
+
+			// 毎サブステップ作り直すときはセルのロックを取らず、アトミックな加算で取ったスロットに書き込むだけにする
+			int32 LinearIndex = NeighborGrid3D.IndexToLinear(CellIndex);
+			int32 PreviousNeighborCount = 0;
+			NeighborGrid3D.SetParticleNeighborCount(LinearIndex, 1, PreviousNeighborCount);
+
+			if (PreviousNeighborCount < MaxNeighborsPerCell)
+			{
+				int32 NeighborGridLinearIndex = NeighborGrid3D.NeighborGridIndexToLinear(CellIndex, PreviousNeighborCount);
+				NeighborGrid3D.SetParticleNeighbor(NeighborGridLinearIndex, ParticleIdx);
+			}
+			else
+			{
+				UE_LOG(LogTemp, Warning, TEXT("Over registation to NeighborGrid3DCPU. CellIndex=(%d, %d, %d). PreviousNeighborCount=%d."), CellIndex.X, CellIndex.Y, CellIndex.Z, PreviousNeighborCount);
+			}
+		}
+		else
+		{
+			if (bIncrementalNeighborGrid3D)
+			{
+				NeighborGrid3D.UpdateParticle(ParticleIdx, INDEX_NONE);
+			}
+			UE_LOG(LogTemp, Warning, TEXT("There is a particle which is out of NeighborGrid3D. Idx = %d. Position = (%f, %f, %f)."), ParticleIdx, Positions[ParticleIdx].X, Positions[ParticleIdx].Y, Positions[ParticleIdx].Z);
+			continue;
+		}
+	}
+}
+
+void ASPH3DSimulatorCPU::CalculateDensityAndPressure(int32 StartIdx, int32 EndIdx)
+{
+	// 半精度のときは密度と圧力を粒子ごとに並べてためておき、一定数ごとにまとめてSIMDで変換して書き込む
+	float PendingDensityPressures[NumParticlesPerHalfEncode * 2];
+
+	for (int32 ParticleIdx = StartIdx; ParticleIdx < EndIdx; ++ParticleIdx)
+	{
+		// BeginSubStep()でまとめて0クリアするかわりに、ここで自分の分だけ初期化する
+		float Density = 0.0f;
+		NumCachedNeighbors[ParticleIdx] = 0;
+		if (bOutputSurfaceOnly)
+		{
+			NeighborCounts[ParticleIdx] = 0;
+			NeighborOffsets[ParticleIdx] = FVector::ZeroVector;
+		}
+
+		if (bUseNeighborGrid3D)
+		{
+			// グリッド外のパーティクルは構築のときに警告ログを出しているので、密度0として扱う
+			const FIntVector& CellIndex = ParticleCellIndices[ParticleIdx];
+			if (NeighborGrid3D.IsValidCellIndex(CellIndex))
+			{
+				NeighborGrid3D.ForEachNeighbor(CellIndex, NeighborStencil, ParticleIdx,
+					[this, ParticleIdx, &Density](int32 AnotherParticleIdx)
+					{
+						Density += CalculateDensity(ParticleIdx, AnotherParticleIdx);
+					}
+				);
+			}
+		}
+		else
+		{
+			for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
+			{
+				if (ParticleIdx == AnotherParticleIdx)
+				{
+					continue;
+				}
+
+				Density += CalculateDensity(ParticleIdx, AnotherParticleIdx);
+			}
+		}
+
+		const float Pressure = CalculatePressure(Density);
+		if (bHalfPrecisionNeighborAttributes)
+		{
+			const int32 PendingIdx = (ParticleIdx - StartIdx) % NumParticlesPerHalfEncode;
+			PendingDensityPressures[PendingIdx * 2] = Density;
+			PendingDensityPressures[PendingIdx * 2 + 1] = Pressure;
+			if (PendingIdx == NumParticlesPerHalfEncode - 1 || ParticleIdx == EndIdx - 1)
+			{
+				const int32 FirstParticleIdx = ParticleIdx - PendingIdx;
+				FHalfPrecision::Encode(PendingDensityPressures, (PendingIdx + 1) * 2, HalfDensityPressures.GetData() + FirstParticleIdx * 2);
+			}
+		}
+		else
+		{
+			Densities[ParticleIdx] = Density;
+			Pressures[ParticleIdx] = Pressure;
+		}
+	}
+}
+
+void ASPH3DSimulatorCPU::ApplyForcesAndIntegrate(int32 StartIdx, int32 EndIdx, float DeltaSeconds)
+{
+	for (int32 ParticleIdx = StartIdx; ParticleIdx < EndIdx; ++ParticleIdx)
+	{
+		// BeginSubStep()でまとめて0クリアするかわりに、ここで自分の分だけ初期化する
+		Accelerations[ParticleIdx] = FVector::ZeroVector;
+
+		if (bUseNeighborGrid3D && !NeighborGrid3D.IsValidCellIndex(ParticleCellIndices[ParticleIdx]))
+		{
+			// 構築のときに警告ログを出しているので警告を出すことはしない
+			continue;
+		}
+
+		if (NumCachedNeighbors[ParticleIdx] != INDEX_NONE)
+		{
+			// 密度計算で集めたカーネル半径内の近傍だけを使い、近傍セルを歩き直さない
+			const int32* CachedNeighborIndices = &CachedNeighbors[ParticleIdx * MaxCachedNeighbors];
+			for (int32 i = 0; i < NumCachedNeighbors[ParticleIdx]; ++i)
+			{
+				ApplyPressure(ParticleIdx, CachedNeighborIndices[i]);
+				ApplyViscosity(ParticleIdx, CachedNeighborIndices[i], DeltaSeconds);
+			}
+		}
+		else if (bUseNeighborGrid3D)
+		{
+			const FIntVector& CellIndex = ParticleCellIndices[ParticleIdx];
+
+			NeighborGrid3D.ForEachNeighbor(CellIndex, NeighborStencil, ParticleIdx,
+				[this, ParticleIdx, DeltaSeconds](int32 AnotherParticleIdx)
+				{
+					ApplyPressure(ParticleIdx, AnotherParticleIdx);
+					ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
+				}
+			);
+		}
+		else
+		{
+			for (int32 AnotherParticleIdx = 0; AnotherParticleIdx < NumParticles; ++AnotherParticleIdx)
+			{
+				if (ParticleIdx == AnotherParticleIdx)
+				{
+					continue;
+				}
+
+				ApplyPressure(ParticleIdx, AnotherParticleIdx);
+				ApplyViscosity(ParticleIdx, AnotherParticleIdx, DeltaSeconds);
+			}
+		}
+
+		if (!bUseWallProjection)
+		{
+			ApplyWallPenalty(ParticleIdx);
+		}
+		Integrate(ParticleIdx, DeltaSeconds);
+		if (bUseWallProjection)
+		{
+			ApplyWallProjection(ParticleIdx, DeltaSeconds);
+		}
+	}
+}
+
+float ASPH3DSimulatorCPU::CalculateDensity(int32 ParticleIdx, int32 AnotherParticleIdx)
+{
+	check(ParticleIdx != AnotherParticleIdx);
+
+	const FVector& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
+	float DistanceSq = DiffPos.SizeSquared();
+	if (DistanceSq < SmoothLenSq)
+	{
+		CacheNeighbor(ParticleIdx, AnotherParticleIdx);
+
+		if (bOutputSurfaceOnly)
+		{
+			// 表面判定用。近傍の重心が自分からずれているほど表面に近い
+			++NeighborCounts[ParticleIdx];
+			NeighborOffsets[ParticleIdx] += DiffPos;
+		}
+
+		float DiffLenSq = SmoothLenSq - DistanceSq;
+		return DensityCoef * DiffLenSq * DiffLenSq * DiffLenSq;
+	}
+
+	return 0.0f;
+}
+
+void ASPH3DSimulatorCPU::CacheNeighbor(int32 ParticleIdx, int32 AnotherParticleIdx)
+{
+	int32& NumCached = NumCachedNeighbors[ParticleIdx];
+	if (NumCached == INDEX_NONE)
+	{
+		return;
+	}
+
+	if (NumCached < MaxCachedNeighbors)
+	{
+		CachedNeighbors[ParticleIdx * MaxCachedNeighbors + NumCached] = AnotherParticleIdx;
+		++NumCached;
+	}
+	else
+	{
+		// あふれたら力の計算では近傍セルを歩く
+		NumCached = INDEX_NONE;
+	}
+}
+
+float ASPH3DSimulatorCPU::CalculatePressure(float Density) const
+{
+	return PressureStiffness * FMath::Max(FMath::Pow(Density / RestDensity, 3) - 1.0f, 0.0f);
+}
+
+float ASPH3DSimulatorCPU::GetDensity(int32 ParticleIdx) const
+{
+	return bHalfPrecisionNeighborAttributes ? FHalfPrecision::Load(HalfDensityPressures[ParticleIdx * 2]) : Densities[ParticleIdx];
+}
+
+void ASPH3DSimulatorCPU::GetDensityAndPressure(int32 ParticleIdx, float& OutDensity, float& OutPressure) const
+{
+	if (bHalfPrecisionNeighborAttributes)
+	{
+		// 密度と圧力は隣り合っているので1回で読んで変換する
+		FHalfPrecision::LoadPair(&HalfDensityPressures[ParticleIdx * 2], OutDensity, OutPressure);
+	}
+	else
+	{
+		OutDensity = Densities[ParticleIdx];
+		OutPressure = Pressures[ParticleIdx];
+	}
+}
+
+void ASPH3DSimulatorCPU::ApplyPressure(int32 ParticleIdx, int32 AnotherParticleIdx)
+{
+	check(ParticleIdx != AnotherParticleIdx);
+
+	float Density, Pressure;
+	GetDensityAndPressure(ParticleIdx, Density, Pressure);
+	if (Density < SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
+	{
+		return;
+	}
+
+	const FVector& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
+	float DistanceSq = DiffPos.SizeSquared();
+	float Distance = DiffPos.Size();
+	if (DistanceSq < SmoothLenSq)
+	{
+		float AnotherDensity, AnotherPressure;
+		GetDensityAndPressure(AnotherParticleIdx, AnotherDensity, AnotherPressure);
+		if (AnotherDensity <= SMALL_NUMBER || Distance <= SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
+		{
+			return;
+		}
+
+		float DiffLen = SmoothLength - Distance;
+#if 1
+		// 数式と違うが、UnityGraphicsProgramming1がソースコードで使っていた式。こちらの方がなぜか安定するしフレームレートも上がる
+		float AvgPressure = 0.5f * (Pressure + AnotherPressure);
+		const FVector& PressureForce = GradientPressureCoef * AvgPressure / AnotherDensity * DiffLen * DiffLen / Distance * DiffPos;
+#else
+		float DiffPressure = Pressure - AnotherPressure;
+		const FVector& PressureForce = GradientPressureCoef * DiffPressure / AnotherDensity * DiffLen * DiffLen / Distance * DiffPos;
+#endif
+
+		Accelerations[ParticleIdx] += PressureForce / Density;
+	}
+}
+
+void ASPH3DSimulatorCPU::ApplyViscosity(int32 ParticleIdx, int32 AnotherParticleIdx, float DeltaSeconds)
+{
+	check(ParticleIdx != AnotherParticleIdx);
+
+	const float Density = GetDensity(ParticleIdx);
+	if (Density < SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
+	{
+		return;
+	}
+
+	const FVector& DiffPos = Positions[AnotherParticleIdx] - Positions[ParticleIdx];
+	float DistanceSq = DiffPos.SizeSquared();
+	if (DistanceSq < SmoothLenSq)
+	{
+		float AnotherDensity = GetDensity(AnotherParticleIdx);
+		if (AnotherDensity <= SMALL_NUMBER) // 0除算と、小さな値の除算ですごく大きな項になるのを回避
+		{
+			return;
+		}
+
+		FVector DiffVel;
+		if (bUseWallProjection)
+		{
+			DiffVel = ((Positions[AnotherParticleIdx] - PrevPositions[AnotherParticleIdx]) - (Positions[ParticleIdx] - PrevPositions[ParticleIdx])) / DeltaSeconds;
+		}
+		else
+		{
+			DiffVel = Velocities[AnotherParticleIdx] - Velocities[ParticleIdx];
+		}
+		const FVector& ViscosityForce = LaplacianViscosityCoef / AnotherDensity * (SmoothLength - DiffPos.Size()) * DiffVel;
+		Accelerations[ParticleIdx] += Viscosity * ViscosityForce / Density;
+	}
+}
+
+void ASPH3DSimulatorCPU::ApplyWallPenalty(int32 ParticleIdx)
+{
+	if (BoundaryField != nullptr)
+	{
+		// SDFはワールド空間なので座標変換せずに引ける。距離が負の分だけ勾配方向に押し戻す
+		FVector Gradient;
+		float Distance = SampleBoundaryField(Positions[ParticleIdx], Gradient);
+		if (Distance < 0.0f)
+		{
+			Accelerations[ParticleIdx] += -Distance * WallStiffness * Gradient.GetSafeNormal();
+		}
+		return;
+	}
+
+	// 計算が楽なので、アクタの位置移動と回転を戻した座標系でパーティクル位置を扱う
+	const FVector& InvActorMovePos = GetActorSpacePosition(ParticleIdx);
+
+	//TODO: SPHって言っても加速度使わずにPBD使ってもいいはずなんだよな
+	FVector WallAccel = FVector::ZeroVector;
+	// 上境界
+	WallAccel += FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Z) * WallStiffness * FVector(0.0f, 0.0f, -1.0f);
+	// 下境界
+	WallAccel += FMath::Max(0.0f, WallBox.Min.Z - InvActorMovePos.Z) * WallStiffness * FVector(0.0f, 0.0f, 1.0f);
+	// 左境界
+	WallAccel += FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.X) * WallStiffness * FVector(1.0f, 0.0f, 0.0f);
+	// 右境界
+	WallAccel += FMath::Max(0.0f, InvActorMovePos.X - WallBox.Max.X) * WallStiffness * FVector(-1.0f, 0.0f, 0.0f);
+	// 奥境界
+	WallAccel += FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Y) * WallStiffness * FVector(0.0f, 1.0f, 0.0f);
+	// 手前境界
+	WallAccel += FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.Y) * WallStiffness * FVector(0.0f, -1.0f, 0.0f);
+	Accelerations[ParticleIdx] += bSimulateInLocalSpace ? WallAccel : CachedActorTransform.TransformVectorNoScale(WallAccel);
+}
+
+void ASPH3DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
+{
+	Accelerations[ParticleIdx] += SimulationGravity;
+	if (bSimulateInLocalSpace)
+	{
+		// アクタの並進と回転による慣性力
+		const FVector& Velocity = bUseWallProjection ? (Positions[ParticleIdx] - PrevPositions[ParticleIdx]) / DeltaSeconds : Velocities[ParticleIdx];
+		Accelerations[ParticleIdx] += InertialForceScale * LocalFrame.GetInertialAcceleration(Positions[ParticleIdx], Velocity);
+	}
+
 	if (bUseWallProjection)
 	{
 		const FVector& NewPosition = Positions[ParticleIdx] + (Positions[ParticleIdx] - PrevPositions[ParticleIdx])+ Accelerations[ParticleIdx] * DeltaSeconds * DeltaSeconds;
@@ -490,10 +843,10 @@ void ASPH3DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
 	}
 	else
 	{
-		// OiIC[@
+		// 前進オイラー法
 		Velocities[ParticleIdx] += Accelerations[ParticleIdx] * DeltaSeconds;
 
-		// MaxVelocityɂNv
+		// MaxVelocityによるクランプ
 		FVector VelocityNormalized;
 		float Velocity;
 		Velocities[ParticleIdx].ToDirectionAndLength(VelocityNormalized, Velocity);
@@ -508,21 +861,33 @@ void ASPH3DSimulatorCPU::Integrate(int32 ParticleIdx, float DeltaSeconds)
 
 void ASPH3DSimulatorCPU::ApplyWallProjection(int32 ParticleIdx, float DeltaSeconds)
 {
-	// vZyȂ̂ŁAAN^̈ʒuړƉ]߂WnŃp[eBNʒu
-	// ǂ̖@gςg邪
-	const FVector& InvActorMovePos = GetActorTransform().InverseTransformPositionNoScale(Positions[ParticleIdx]);
-
-	FVector ProjectedPos = InvActorMovePos;
-	ProjectedPos += FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Z) * WallProjectionAlpha * FVector(0.0f, 0.0f, -1.0f);
-	ProjectedPos += FMath::Max(0.0f, WallBox.Min.Z - InvActorMovePos.Z) * WallProjectionAlpha * FVector(0.0f, 0.0f, 1.0f);
-	ProjectedPos += FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.X) * WallProjectionAlpha * FVector(1.0f, 0.0f, 0.0f);
-	ProjectedPos += FMath::Max(0.0f, InvActorMovePos.X - WallBox.Max.X) * WallProjectionAlpha * FVector(-1.0f, 0.0f, 0.0f);
-	ProjectedPos += FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Y) * WallProjectionAlpha * FVector(0.0f, 1.0f, 0.0f);
-	ProjectedPos += FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.Y) * WallProjectionAlpha * FVector(0.0f, -1.0f, 0.0f);
-
-	Positions[ParticleIdx] = GetActorTransform().TransformPositionNoScale(ProjectedPos);
+	if (BoundaryField != nullptr)
+	{
+		FVector Gradient;
+		float Distance = SampleBoundaryField(Positions[ParticleIdx], Gradient);
+		if (Distance < 0.0f)
+		{
+			Positions[ParticleIdx] += -Distance * WallProjectionAlpha * Gradient.GetSafeNormal();
+		}
+	}
+	else
+	{
+		// 計算が楽なので、アクタの位置移動と回転を戻した座標系でパーティクル位置を扱う
+		// 壁の法線方向を使った内積を使うやり方もあるが
+		const FVector& InvActorMovePos = GetActorSpacePosition(ParticleIdx);
+
+		FVector ProjectedPos = InvActorMovePos;
+		ProjectedPos += FMath::Max(0.0f, InvActorMovePos.Z - WallBox.Max.Z) * WallProjectionAlpha * FVector(0.0f, 0.0f, -1.0f);
+		ProjectedPos += FMath::Max(0.0f, WallBox.Min.Z - InvActorMovePos.Z) * WallProjectionAlpha * FVector(0.0f, 0.0f, 1.0f);
+		ProjectedPos += FMath::Max(0.0f, WallBox.Min.X - InvActorMovePos.X) * WallProjectionAlpha * FVector(1.0f, 0.0f, 0.0f);
+		ProjectedPos += FMath::Max(0.0f, InvActorMovePos.X - WallBox.Max.X) * WallProjectionAlpha * FVector(-1.0f, 0.0f, 0.0f);
+		ProjectedPos += FMath::Max(0.0f, WallBox.Min.Y - InvActorMovePos.Y) * WallProjectionAlpha * FVector(0.0f, 1.0f, 0.0f);
+		ProjectedPos += FMath::Max(0.0f, InvActorMovePos.Y - WallBox.Max.Y) * WallProjectionAlpha * FVector(0.0f, -1.0f, 0.0f);
+
+		Positions[ParticleIdx] = bSimulateInLocalSpace ? ProjectedPos : CachedActorTransform.TransformPositionNoScale(ProjectedPos);
+	}
 
-	// MaxVelocityɂNv
+	// MaxVelocityによるクランプ
 	FVector VelocityNormalized;
 	float Velocity;
 	((Positions[ParticleIdx] - PrevPositions[ParticleIdx]) / DeltaSeconds).ToDirectionAndLength(VelocityNormalized, Velocity);
@@ -532,6 +897,466 @@ void ASPH3DSimulatorCPU::ApplyWallProjection(int32 ParticleIdx, float DeltaSecon
 	}
 }
 
+FVector ASPH3DSimulatorCPU::GetActorSpacePosition(int32 ParticleIdx) const
+{
+	return bSimulateInLocalSpace ? Positions[ParticleIdx] : CachedActorTransform.InverseTransformPositionNoScale(Positions[ParticleIdx]);
+}
+
+bool ASPH3DSimulatorCPU::CanQueryParticles() const
+{
+	if (CacheMode == EParticleCacheMode::Playback)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Particle queries are not available in cache playback. Actor = %s."), *GetName());
+		return false;
+	}
+
+	return NumParticles > 0;
+}
+
+template<typename FunctionType>
+void ASPH3DSimulatorCPU::ForEachParticleInRadius(const FVector& ActorSpacePosition, float Radius, FunctionType&& Function) const
+{
+	const float RadiusSq = Radius * Radius;
+	auto TestParticle = [this, &ActorSpacePosition, RadiusSq, &Function](int32 ParticleIdx)
+	{
+		float DistanceSq = FVector::DistSquared(GetActorSpacePosition(ParticleIdx), ActorSpacePosition);
+		if (DistanceSq <= RadiusSq)
+		{
+			Function(ParticleIdx, DistanceSq);
+		}
+	};
+
+	if (!bUseNeighborGrid3D)
+	{
+		for (int32 ParticleIdx = 0; ParticleIdx < NumParticles; ++ParticleIdx)
+		{
+			TestParticle(ParticleIdx);
+		}
+		return;
+	}
+
+	// グリッドは最後のサブステップの先頭の位置で作っているので、その後に動ける距離だけ探すセルを広げる
+	const float Margin = MaxVelocity * GetSubStepDeltaSeconds();
+	const FVector& UnitPosition = NeighborGrid3D.SimulationToUnit(ActorSpacePosition, LocalToUnitTransform);
+	NeighborGrid3D.ForEachNeighbor(UnitPosition, LocalToUnitTransform.GetScale3D() * (Radius + Margin), TestParticle);
+}
+
+void ASPH3DSimulatorCPU::QueryParticlesInRadius(const TArray<FVector>& QueryPositions, float Radius, TArray<int32>& OutParticleIndices, TArray<int32>& OutQueryOffsets) const
+{
+	const int32 NumQueries = QueryPositions.Num();
+	OutParticleIndices.Reset();
+	OutQueryOffsets.Init(0, NumQueries + 1);
+	if (!CanQueryParticles())
+	{
+		return;
+	}
+
+	// クエリごとの数を数えてから、その累積和の位置に詰めて書き込む
+	ParallelFor(NumQueries,
+		[this, &QueryPositions, Radius, &OutQueryOffsets](int32 QueryIdx)
+		{
+			int32 Count = 0;
+			ForEachParticleInRadius(CachedActorTransform.InverseTransformPositionNoScale(QueryPositions[QueryIdx]), Radius,
+				[&Count](int32 ParticleIdx, float DistanceSq)
+				{
+					++Count;
+				}
+			);
+			OutQueryOffsets[QueryIdx + 1] = Count;
+		}
+	);
+
+	for (int32 QueryIdx = 0; QueryIdx < NumQueries; ++QueryIdx)
+	{
+		OutQueryOffsets[QueryIdx + 1] += OutQueryOffsets[QueryIdx];
+	}
+
+	OutParticleIndices.SetNumUninitialized(OutQueryOffsets[NumQueries]);
+	ParallelFor(NumQueries,
+		[this, &QueryPositions, Radius, &OutParticleIndices, &OutQueryOffsets](int32 QueryIdx)
+		{
+			int32 OutputIdx = OutQueryOffsets[QueryIdx];
+			ForEachParticleInRadius(CachedActorTransform.InverseTransformPositionNoScale(QueryPositions[QueryIdx]), Radius,
+				[&OutParticleIndices, &OutputIdx](int32 ParticleIdx, float DistanceSq)
+				{
+					OutParticleIndices[OutputIdx++] = ParticleIdx;
+				}
+			);
+		}
+	);
+}
+
+void ASPH3DSimulatorCPU::QueryNearestParticles(const TArray<FVector>& QueryPositions, int32 K, float MaxRadius, TArray<int32>& OutParticleIndices) const
+{
+	K = FMath::Max(K, 0);
+	OutParticleIndices.Init(INDEX_NONE, QueryPositions.Num() * K);
+	if (K == 0 || MaxRadius <= 0.0f || !CanQueryParticles())
+	{
+		return;
+	}
+
+	ParallelFor(QueryPositions.Num(),
+		[this, &QueryPositions, K, MaxRadius, &OutParticleIndices](int32 QueryIdx)
+		{
+			const FVector& ActorSpacePosition = CachedActorTransform.InverseTransformPositionNoScale(QueryPositions[QueryIdx]);
+			int32* NearestIndices = &OutParticleIndices[QueryIdx * K];
+			TArray<float, TInlineAllocator<16>> NearestDistancesSq;
+			NearestDistancesSq.SetNumUninitialized(K);
+			int32 NumFound = 0;
+
+			// SmoothLengthから半径を倍々に広げて探す。半径内のパーティクルはすべて見ているので、
+			// K個見つかればそれが最近傍のK個になる
+			for (float Radius = FMath::Min(SmoothLength, MaxRadius); ; Radius = FMath::Min(Radius * 2.0f, MaxRadius))
+			{
+				NumFound = 0;
+				ForEachParticleInRadius(ActorSpacePosition, Radius,
+					[NearestIndices, &NearestDistancesSq, &NumFound, K](int32 ParticleIdx, float DistanceSq)
+					{
+						// 距離の昇順を保つ挿入ソート。あふれたら最も遠いものを捨てる
+						if (NumFound == K)
+						{
+							if (DistanceSq >= NearestDistancesSq[K - 1])
+							{
+								return;
+							}
+							--NumFound;
+						}
+
+						int32 InsertIdx = NumFound;
+						while (InsertIdx > 0 && NearestDistancesSq[InsertIdx - 1] > DistanceSq)
+						{
+							NearestDistancesSq[InsertIdx] = NearestDistancesSq[InsertIdx - 1];
+							NearestIndices[InsertIdx] = NearestIndices[InsertIdx - 1];
+							--InsertIdx;
+						}
+						NearestDistancesSq[InsertIdx] = DistanceSq;
+						NearestIndices[InsertIdx] = ParticleIdx;
+						++NumFound;
+					}
+				);
+
+				if (NumFound == K || Radius >= MaxRadius)
+				{
+					break;
+				}
+			}
+
+			for (int32 i = NumFound; i < K; ++i)
+			{
+				NearestIndices[i] = INDEX_NONE;
+			}
+		}
+	);
+}
+
+FVector ASPH3DSimulatorCPU::GetParticlePosition(int32 ParticleIdx) const
+{
+	if (!Positions.IsValidIndex(ParticleIdx))
+	{
+		return FVector::ZeroVector;
+	}
+
+	return bSimulateInLocalSpace ? CachedActorTransform.TransformPositionNoScale(Positions[ParticleIdx]) : Positions[ParticleIdx];
+}
+
+float ASPH3DSimulatorCPU::SampleBoundaryField(const FVector& Position, FVector& OutGradient) const
+{
+	check(BoundaryField != nullptr);
+
+	if (!bSimulateInLocalSpace)
+	{
+		return BoundaryField->SampleWithGradient(Position, OutGradient);
+	}
+
+	// SDFはワールド空間なので、アクタ空間のシミュレーションでは変換が必要になる
+	float Distance = BoundaryField->SampleWithGradient(CachedActorTransform.TransformPositionNoScale(Position), OutGradient);
+	OutGradient = CachedActorTransform.InverseTransformVectorNoScale(OutGradient);
+	return Distance;
+}
+
+const FVector* ASPH3DSimulatorCPU::GetWorldPositions()
+{
+	if (!bSimulateInLocalSpace)
+	{
+		return Positions.GetData();
+	}
+
+	WorldPositions.SetNumUninitialized(NumParticles);
+	ParallelFor(NumThreads,
+		[this](int32 ThreadIndex)
+		{
+			const int32 EndIdx = FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles);
+			for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < EndIdx; ++ParticleIdx)
+			{
+				WorldPositions[ParticleIdx] = CachedActorTransform.TransformPositionNoScale(Positions[ParticleIdx]);
+			}
+		}
+	);
+
+	return WorldPositions.GetData();
+}
+
+void ASPH3DSimulatorCPU::RecordCacheFrame(const FVector* FramePositions)
+{
+	const FVector* FrameVelocities = nullptr;
+	if (bCacheVelocities)
+	{
+		if (bUseWallProjection || bSimulateInLocalSpace)
+		{
+			// 位置ベースの積分では速度を保持していないので、最後のサブステップの位置の差分から求める。
+			// アクタ空間のシミュレーションではアクタに対する相対速度をワールド空間の向きに回転する
+			float SubStepDeltaSeconds = GetSubStepDeltaSeconds();
+			CacheVelocities.SetNumUninitialized(NumParticles);
+			for (int32 i = 0; i < NumParticles; ++i)
+			{
+				const FVector& Velocity = bUseWallProjection ? (Positions[i] - PrevPositions[i]) / SubStepDeltaSeconds : Velocities[i];
+				CacheVelocities[i] = bSimulateInLocalSpace ? CachedActorTransform.TransformVectorNoScale(Velocity) : Velocity;
+			}
+			FrameVelocities = CacheVelocities.GetData();
+		}
+		else
+		{
+			FrameVelocities = Velocities.GetData();
+		}
+	}
+
+	CacheWriter.WriteFrame(FramePositions, FrameVelocities);
+}
+
+void ASPH3DSimulatorCPU::SeekCache(float Time)
+{
+	CachePlaybackTime = Time;
+	UpdateCachePlayback();
+}
+
+void ASPH3DSimulatorCPU::UpdateCachePlayback()
+{
+	int32 NumFrames = CacheReader.GetNumFrames();
+	if (CacheMode != EParticleCacheMode::Playback || NumFrames == 0)
+	{
+		return;
+	}
+
+	int32 FrameIndex = FMath::FloorToInt(CachePlaybackTime * CacheReader.GetFrameRate());
+	if (bLoopCachePlayback)
+	{
+		FrameIndex = ((FrameIndex % NumFrames) + NumFrames) % NumFrames;
+	}
+	else
+	{
+		FrameIndex = FMath::Clamp(FrameIndex, 0, NumFrames - 1);
+	}
+
+	if (FrameIndex == CacheFrameIndex)
+	{
+		return;
+	}
+
+	// マップしたメモリからNiagaraの配列へ直接コピーする
+	if (bQuantizeNiagaraPositions && CacheReader.IsQuantized())
+	{
+		// 量子化されたキャッシュはデコードせずにそのまま渡す
+		if (const uint16* EncodedPositions = CacheReader.GetFrameEncodedPositions(FrameIndex))
+		{
+			NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
+			SetNiagaraArrayQuantizedVector(NiagaraComponent, FName("QuantizedPositions"), CacheReader.GetQuantizationBounds(), EncodedPositions, NumParticles);
+			CacheFrameIndex = FrameIndex;
+		}
+	}
+	else if (const FVector* FramePositions = CacheReader.GetFramePositions(FrameIndex))
+	{
+		NiagaraComponent->SetNiagaraVariableInt("NumParticles", NumParticles);
+		SetNiagaraPositions(FramePositions, NumParticles);
+		CacheFrameIndex = FrameIndex;
+	}
+}
+
+FBox ASPH3DSimulatorCPU::GetQuantizationBounds() const
+{
+	// パーティクルはNeighborGrid3Dの範囲内にあるので、そのワールド空間でのAABBを量子化の範囲とする
+	return FBox(-WorldBBoxSize * 0.5f, WorldBBoxSize * 0.5f).TransformBy(FTransform(GetActorQuat(), GetActorLocation()));
+}
+
+void ASPH3DSimulatorCPU::SetNiagaraPositions(const FVector* ParticlePositions, int32 Num)
+{
+	if (bQuantizeNiagaraPositions)
+	{
+		const FBox& Bounds = GetQuantizationBounds();
+		QuantizedPositions.SetNumUninitialized(Num * 3);
+		FParticleQuantization::EncodePositions(ParticlePositions, Num, Bounds, QuantizedPositions.GetData());
+		SetNiagaraArrayQuantizedVector(NiagaraComponent, FName("QuantizedPositions"), Bounds, QuantizedPositions.GetData(), Num);
+	}
+	else
+	{
+		SetNiagaraArrayVector(NiagaraComponent, FName("Positions"), ParticlePositions, Num);
+	}
+}
+
+bool ASPH3DSimulatorCPU::IsSurfaceParticle(int32 ParticleIdx) const
+{
+	int32 NeighborCount = NeighborCounts[ParticleIdx];
+	if (NeighborCount < SurfaceNeighborThreshold)
+	{
+		return true;
+	}
+
+	// 近傍の重心のずれ(NeighborOffsets / NeighborCount)の長さを除算なしで比較する
+	float OffsetThreshold = SurfaceOffsetThreshold * SmoothLength * NeighborCount;
+	return NeighborOffsets[ParticleIdx].SizeSquared() > OffsetThreshold * OffsetThreshold;
+}
+
+void ASPH3DSimulatorCPU::UpdateDensityVolume(const FVector* ParticlePositions)
+{
+	// アクタが動いたときだけ範囲を設定し直す
+	const FBox& Bounds = GetQuantizationBounds();
+	if (!(DensityVolume.GetBounds() == Bounds))
+	{
+		DensityVolume.Initialize(Bounds, DensityVolumeResolution);
+	}
+
+	DensityVolume.Rasterize(ParticlePositions, NumParticles, SmoothLength, DensityCoef);
+	SetNiagaraArrayFloat(NiagaraComponent, FName("DensityVolume"), DensityVolume.ExportDense());
+	NiagaraComponent->SetNiagaraVariableVec3(TEXT("DensityVolumeResolution"), FVector(DensityVolume.GetResolution()));
+	NiagaraComponent->SetNiagaraVariableVec3(TEXT("DensityVolumeMin"), Bounds.Min);
+	NiagaraComponent->SetNiagaraVariableVec3(TEXT("DensityVolumeMax"), Bounds.Max);
+}
+
+int32 ASPH3DSimulatorCPU::CompactSurfaceParticles(const FVector* ParticlePositions)
+{
+	auto IsOutputParticle = [this](int32 ParticleIdx)
+	{
+		return IsSurfaceParticle(ParticleIdx) || (InteriorSampleStride > 0 && ParticleIdx % InteriorSampleStride == 0);
+	};
+
+	// スレッドごとの出力数を数えてから、その累積和の位置に詰めて書き込む
+	SurfaceChunkOffsets.SetNumUninitialized(NumThreads + 1);
+	SurfaceChunkOffsets[0] = 0;
+	ParallelFor(NumThreads,
+		[this, &IsOutputParticle](int32 ThreadIndex)
+		{
+			int32 Count = 0;
+			const int32 EndIdx = FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles);
+			for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < EndIdx; ++ParticleIdx)
+			{
+				if (IsOutputParticle(ParticleIdx))
+				{
+					++Count;
+				}
+			}
+			SurfaceChunkOffsets[ThreadIndex + 1] = Count;
+		}
+	);
+
+	for (int32 ThreadIndex = 0; ThreadIndex < NumThreads; ++ThreadIndex)
+	{
+		SurfaceChunkOffsets[ThreadIndex + 1] += SurfaceChunkOffsets[ThreadIndex];
+	}
+
+	int32 NumOutputParticles = SurfaceChunkOffsets[NumThreads];
+	SurfacePositions.SetNumUninitialized(NumOutputParticles);
+	SurfaceColors.SetNumUninitialized(NumOutputParticles);
+
+	ParallelFor(NumThreads,
+		[this, &IsOutputParticle, ParticlePositions](int32 ThreadIndex)
+		{
+			int32 OutputIdx = SurfaceChunkOffsets[ThreadIndex];
+			const int32 EndIdx = FMath::Min(NumThreadParticles * (ThreadIndex + 1), NumParticles);
+			for (int32 ParticleIdx = NumThreadParticles * ThreadIndex; ParticleIdx < EndIdx; ++ParticleIdx)
+			{
+				if (IsOutputParticle(ParticleIdx))
+				{
+					SurfacePositions[OutputIdx] = ParticlePositions[ParticleIdx];
+					SurfaceColors[OutputIdx] = Colors[ParticleIdx];
+					++OutputIdx;
+				}
+			}
+		}
+	);
+
+	return NumOutputParticles;
+}
+
+bool ASPH3DSimulatorCPU::LoadSnapshot(const USPHSnapshot* Snapshot)
+{
+	FString Reason;
+	if (!Snapshot->IsCompatible(NumParticles, FIntVector(NumCellsX, NumCellsY, NumCellsZ), WorldBBoxSize, Reason))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Can not load SPH snapshot %s. %s"), *Snapshot->GetName(), *Reason);
+		return false;
+	}
+
+	// スナップショットはアクタ空間で保存している
+	const FTransform& ActorTransform = GetActorTransform();
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		Positions[i] = ActorTransform.TransformPositionNoScale(Snapshot->Positions[i]);
+		PrevPositions[i] = ActorTransform.TransformPositionNoScale(Snapshot->PrevPositions[i]);
+		Velocities[i] = ActorTransform.TransformVectorNoScale(Snapshot->Velocities[i]);
+	}
+
+	return true;
+}
+
+USPHSnapshot* ASPH3DSimulatorCPU::CaptureSnapshot() const
+{
+	USPHSnapshot* Snapshot = NewObject<USPHSnapshot>();
+	Snapshot->NumParticles = NumParticles;
+	Snapshot->NumCells = FIntVector(NumCellsX, NumCellsY, NumCellsZ);
+	Snapshot->WorldBBoxSize = WorldBBoxSize;
+	if (bSimulateInLocalSpace)
+	{
+		// アクタ空間のシミュレーションではそのまま保存できる
+		Snapshot->Positions = Positions;
+		Snapshot->PrevPositions = PrevPositions;
+		Snapshot->Velocities = Velocities;
+		return Snapshot;
+	}
+
+	Snapshot->Positions.SetNum(NumParticles);
+	Snapshot->PrevPositions.SetNum(NumParticles);
+	Snapshot->Velocities.SetNum(NumParticles);
+
+	const FTransform& ActorTransform = GetActorTransform();
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		Snapshot->Positions[i] = ActorTransform.InverseTransformPositionNoScale(Positions[i]);
+		Snapshot->PrevPositions[i] = ActorTransform.InverseTransformPositionNoScale(PrevPositions[i]);
+		Snapshot->Velocities[i] = ActorTransform.InverseTransformVectorNoScale(Velocities[i]);
+	}
+
+	return Snapshot;
+}
+
+void ASPH3DSimulatorCPU::SaveSnapshot()
+{
+#if WITH_EDITOR
+	if (!HasActorBegunPlay())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SaveSnapshot() needs the running simulation. Use it on the simulator in PIE."));
+		return;
+	}
+
+	if (USPHSnapshot* Asset = CaptureSnapshot()->SaveAsAsset(SnapshotPackageName))
+	{
+		UE_LOG(LogTemp, Display, TEXT("Saved SPH snapshot to %s."), *Asset->GetPathName());
+	}
+#endif
+}
+
+void ASPH3DSimulatorCPU::BakeBoundarySDF()
+{
+#if WITH_EDITOR
+	// 境界付近のパーティクルがグリッド外に出ても引けるよう、グリッドの範囲をSmoothLengthだけ広げて焼く
+	const FBox& Bounds = GetQuantizationBounds().ExpandBy(SmoothLength);
+	if (USPHBoundarySDF* Asset = USPHBoundarySDF::BakeFromWorld(GetWorld(), BoundaryActorTag, Bounds, BoundarySDFResolution, BoundarySDFPackageName))
+	{
+		Modify();
+		BoundarySDF = Asset;
+		UE_LOG(LogTemp, Display, TEXT("Saved SPH boundary SDF to %s."), *Asset->GetPathName());
+	}
+#endif
+}
+
 ASPH3DSimulatorCPU::ASPH3DSimulatorCPU()
 {
 	PrimaryActorTick.bCanEverTick = true;
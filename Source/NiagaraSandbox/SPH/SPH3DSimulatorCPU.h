@@ -4,11 +4,17 @@
 #include "UObject/ObjectMacros.h"
 #include "GameFramework/Actor.h"
 #include "../Common/NeighborGrid3DCPU.h"
+#include "../Common/ParticleCache.h"
+#include "../Common/ParallelWorkerTeam.h"
+#include "../Common/SparseDensityVolume.h"
+#include "SPHSimulatorCPU.h"
+#include "SPHLatticeInitializer.h"
+#include "SPHLocalFrame.h"
 #include "SPH3DSimulatorCPU.generated.h"
 
 UCLASS()
-// ANiagaraActorQlɂĂ
-class ASPH3DSimulatorCPU : public AActor
+// ANiagaraActorを参考にしている
+class ASPH3DSimulatorCPU : public AActor, public ISPHSimulatorCPU
 {
 	GENERATED_BODY()
 
@@ -18,12 +24,60 @@ public:
 	virtual void PostRegisterAllComponents() override;
 
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	virtual void Tick( float DeltaSeconds ) override;
 
+	// ISPHSimulatorCPU interface
+	virtual int32 GetNumParticles() const override;
+	virtual int32 GetNumSubSteps() const override;
+	virtual float GetSubStepDeltaSeconds() const override;
+	virtual bool IsSimulationPhaseEnabled(ESPHSimulationPhase Phase) const override;
+	virtual void BeginSimulation() override;
+	virtual void BeginSubStep() override;
+	virtual void SimulatePhase(ESPHSimulationPhase Phase, int32 StartIdx, int32 EndIdx, float DeltaSeconds) override;
+	virtual void EndSimulation() override;
+	// End of ISPHSimulatorCPU interface
+
 	/** Set true for this actor to self-destruct when the Niagara system finishes, false otherwise */
 	UFUNCTION(BlueprintCallable)
 	void SetDestroyOnSystemFinish(bool bShouldDestroyOnSystemFinish);
 
+	/** Jump to the frame of the time in seconds when CacheMode is Playback. */
+	UFUNCTION(BlueprintCallable)
+	void SeekCache(float Time);
+
+	/** Capture the current solver state as a transient snapshot. */
+	UFUNCTION(BlueprintCallable)
+	class USPHSnapshot* CaptureSnapshot() const;
+
+	/**
+	 * Find the particles within Radius of each of QueryPositions in world space.
+	 * The particles of QueryPositions[i] are OutParticleIndices[OutQueryOffsets[i]] to OutParticleIndices[OutQueryOffsets[i + 1] - 1] in no particular order.
+	 * The queries run in parallel on the neighbor grid of the last substep, so the cost scales with the local particle density instead of NumParticles.
+	 * Nothing is found when CacheMode is Playback.
+	 */
+	UFUNCTION(BlueprintCallable)
+	void QueryParticlesInRadius(const TArray<FVector>& QueryPositions, float Radius, TArray<int32>& OutParticleIndices, TArray<int32>& OutQueryOffsets) const;
+
+	/**
+	 * Find the K nearest particles within MaxRadius of each of QueryPositions in world space, nearest first.
+	 * OutParticleIndices has K entries per query and the entries not found are INDEX_NONE.
+	 */
+	UFUNCTION(BlueprintCallable)
+	void QueryNearestParticles(const TArray<FVector>& QueryPositions, int32 K, float MaxRadius, TArray<int32>& OutParticleIndices) const;
+
+	/** World space position of the particle of an index which the queries returned. */
+	UFUNCTION(BlueprintCallable)
+	FVector GetParticlePosition(int32 ParticleIdx) const;
+
+	/** Save the current solver state to SnapshotPackageName. Use it on the simulator in PIE after the fluid settled. */
+	UFUNCTION(CallInEditor)
+	void SaveSnapshot();
+
+	/** Bake the static meshes of the actors with BoundaryActorTag around the grid bounds into BoundarySDFPackageName and use it as BoundarySDF. */
+	UFUNCTION(CallInEditor)
+	void BakeBoundarySDF();
+
 private:
 	/** Pointer to System component */
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
@@ -51,12 +105,118 @@ private:
 	UPROPERTY(EditAnywhere)
 	int32 NumThreads = 4;
 
+	/**
+	 * Run all substeps of a frame as one job on NumThreads persistent worker threads synchronized by barriers between the phases,
+	 * instead of a ParallelFor per phase. This removes most of the dispatch overhead for small and mid-size simulations.
+	 * Ignored when bUseSimulatorSubsystem is true.
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bUsePersistentWorkers = false;
+
+	/** Step this simulator together with the other simulators of the world by USPHSimulatorSubsystem instead of its own Tick(). */
+	UPROPERTY(EditAnywhere)
+	bool bUseSimulatorSubsystem = false;
+
+	/** Record the simulation to the cache file, or play the cache file back without simulation. */
+	UPROPERTY(EditAnywhere)
+	EParticleCacheMode CacheMode = EParticleCacheMode::None;
+
+	/** A relative path is resolved under Saved/ParticleCache. */
+	UPROPERTY(EditAnywhere)
+	FString CacheFilePath = TEXT("SPH3D.pcache");
+
+	UPROPERTY(EditAnywhere)
+	bool bCacheVelocities = false;
+
+	UPROPERTY(EditAnywhere)
+	bool bLoopCachePlayback = true;
+
+	/** Store positions and velocities in the cache file as 16-bit fixed point values relative to the grid bounds and MaxVelocity. */
+	UPROPERTY(EditAnywhere)
+	bool bQuantizeCache = false;
+
+	/**
+	 * Send positions to Niagara as 16-bit fixed point values packed into the int array "QuantizedPositions" instead of the float3 array "Positions".
+	 * The Niagara system has to decode them with "QuantizedPositionsMin" and "QuantizedPositionsMax".
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bQuantizeNiagaraPositions = false;
+
+	/**
+	 * Send only the free surface particles and a sparse sample of the interior particles to Niagara.
+	 * "NumParticles" becomes the number of the sent particles and "Colors" is sent every frame in the same order.
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bOutputSurfaceOnly = false;
+
+	/** A particle with fewer neighbors in SmoothLength than this is on the surface. */
+	UPROPERTY(EditAnywhere)
+	int32 SurfaceNeighborThreshold = 18;
+
+	/** A particle whose neighbor center is farther than this ratio of SmoothLength is on the surface. */
+	UPROPERTY(EditAnywhere)
+	float SurfaceOffsetThreshold = 0.15f;
+
+	/** Every InteriorSampleStride-th interior particle is sent with the surface particles. 0 sends no interior particles. */
+	UPROPERTY(EditAnywhere)
+	int32 InteriorSampleStride = 16;
+
+	/**
+	 * Rasterize the particle densities onto a voxel grid over the world bounds of the neighbor grid every frame.
+	 * The dense voxels are sent to the float array "DensityVolume" with the Vec3 variables "DensityVolumeResolution", "DensityVolumeMin" and "DensityVolumeMax".
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bRasterizeDensityVolume = false;
+
+	/** Number of voxels per axis. It is rounded up to a multiple of the brick size 8. */
+	UPROPERTY(EditAnywhere)
+	FIntVector DensityVolumeResolution = FIntVector(64, 64, 64);
+
+	/** Restore the particles from this snapshot in BeginPlay instead of scattering them randomly. */
+	UPROPERTY(EditAnywhere)
+	class USPHSnapshot* WarmStartSnapshot = nullptr;
+
+	/** Long package name of the asset which SaveSnapshot() writes. */
+	UPROPERTY(EditAnywhere)
+	FString SnapshotPackageName = TEXT("/Game/SPH/Snapshots/SPH3DSnapshot");
+
+	/** Keep the particles out of the solids of this field instead of inside WallBox. */
+	UPROPERTY(EditAnywhere)
+	class USPHBoundarySDF* BoundarySDF = nullptr;
+
+	/** Actors with this tag are baked by BakeBoundarySDF(). */
+	UPROPERTY(EditAnywhere)
+	FName BoundaryActorTag = TEXT("SPHBoundary");
+
+	/** Number of grid points per axis which BakeBoundarySDF() samples. */
+	UPROPERTY(EditAnywhere)
+	FIntVector BoundarySDFResolution = FIntVector(64, 64, 64);
+
+	/** Long package name of the asset which BakeBoundarySDF() writes. */
+	UPROPERTY(EditAnywhere)
+	FString BoundarySDFPackageName = TEXT("/Game/SPH/Boundaries/SPH3DBoundary");
+
 	UPROPERTY(EditAnywhere)
 	bool bUseNeighborGrid3D = true;
 
+	/** Move only the particles which changed cells in the neighbor grid every substep. Otherwise the grid is reset and rebuilt by lock-free atomic appends. */
+	UPROPERTY(EditAnywhere, meta = (EditCondition = "bUseNeighborGrid3D"))
+	bool bIncrementalNeighborGrid3D = true;
+
 	UPROPERTY(EditAnywhere)
 	bool bUseWallProjection = true;
 
+	/**
+	 * Keep the particles in the actor space and add the inertial forces of the actor motion instead of simulating in the world space.
+	 * Positions are transformed to the world space only for the output.
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bSimulateInLocalSpace = false;
+
+	/** Scale of the inertial forces in bSimulateInLocalSpace. 0 makes the fluid follow the actor motion rigidly. */
+	UPROPERTY(EditAnywhere)
+	float InertialForceScale = 1.0f;
+
 	UPROPERTY(EditAnywhere)
 	int32 NumParticles = 1000;
 
@@ -96,6 +256,31 @@ private:
 	UPROPERTY(EditAnywhere)
 	float InitPosRadius = 4.0f;
 
+	/** How to place the particles in BeginPlay when WarmStartSnapshot is not used. */
+	UPROPERTY(EditAnywhere)
+	ESPHInitialPlacement InitialPlacement = ESPHInitialPlacement::Random;
+
+	/**
+	 * Store the densities and pressures only in FFloat16, interleaved per particle so that the force pass reads both
+	 * of a neighbor in one 4 byte load instead of two float arrays. The density pass accumulates in float and encodes once.
+	 * The relative error of those attributes is FHalfPrecision::MaxRelativeError.
+	 * Positions, PrevPositions and Velocities stay in float because the integration accumulates into them.
+	 */
+	UPROPERTY(EditAnywhere)
+	bool bHalfPrecisionNeighborAttributes = false;
+
+	/** The region relative to the actor location which ESPHInitialPlacement::LatticeBox fills. */
+	UPROPERTY(EditAnywhere)
+	FBox InitBox = FBox(FVector(-4.5f, -4.5f, -4.5f), FVector(4.5f, 4.5f, 0.0f));
+
+	/** Max random offset of the lattice placement in units of the rest density spacing. */
+	UPROPERTY(EditAnywhere)
+	float InitJitter = 0.1f;
+
+	/** Seed of the lattice placement jitter. The same seed gives the same placement. */
+	UPROPERTY(EditAnywhere)
+	int32 InitSeed = 0;
+
 	UPROPERTY(EditAnywhere)
 	float MaxVelocity = 60.0f; // 1.0cm by one frame of 60FPS
 
@@ -111,36 +296,95 @@ private:
 	UPROPERTY(EditAnywhere)
 	int32 MaxNeighborsPerCell = 8;
 
+	/**
+	 * Max number of neighbors in SmoothLength which the density pass caches per particle so that the force pass does not walk the neighbor cells again.
+	 * A particle with more neighbors falls back to the walk.
+	 */
+	UPROPERTY(EditAnywhere)
+	int32 MaxCachedNeighbors = 64;
+
 	UPROPERTY(EditAnywhere)
 	FVector WorldBBoxSize = FVector(10.0f, 10.0f, 10.0f);
 
 private:
 	void Simulate(float DeltaSeconds);
-	void CalculateDensity(int32 ParticleIdx, int32 AnotherParticleIdx);
-	void CalculatePressure(int32 ParticleIdx);
+	void SimulateWithWorkerTeam(float DeltaSeconds);
+	void BuildNeighborGrid3D(int32 StartIdx, int32 EndIdx);
+	void CalculateDensityAndPressure(int32 StartIdx, int32 EndIdx);
+	void ApplyForcesAndIntegrate(int32 StartIdx, int32 EndIdx, float DeltaSeconds);
+	float CalculateDensity(int32 ParticleIdx, int32 AnotherParticleIdx);
+	void CacheNeighbor(int32 ParticleIdx, int32 AnotherParticleIdx);
+	float CalculatePressure(float Density) const;
+	float GetDensity(int32 ParticleIdx) const;
+	void GetDensityAndPressure(int32 ParticleIdx, float& OutDensity, float& OutPressure) const;
 	void ApplyPressure(int32 ParticleIdx, int32 AnotherParticleIdx);
 	void ApplyViscosity(int32 ParticleIdx, int32 AnotherParticleIdx, float DeltaSeconds);
 	void ApplyWallPenalty(int32 ParticleIdx);
 	void Integrate(int32 ParticleIdx, float DeltaSeconds);
 	void ApplyWallProjection(int32 ParticleIdx, float DeltaSeconds);
+	FVector GetActorSpacePosition(int32 ParticleIdx) const;
+	bool CanQueryParticles() const;
+	template<typename FunctionType>
+	void ForEachParticleInRadius(const FVector& ActorSpacePosition, float Radius, FunctionType&& Function) const;
+	float SampleBoundaryField(const FVector& Position, FVector& OutGradient) const;
+	const FVector* GetWorldPositions();
+	void RecordCacheFrame(const FVector* FramePositions);
+	void UpdateCachePlayback();
+	FBox GetQuantizationBounds() const;
+	void SetNiagaraPositions(const FVector* ParticlePositions, int32 Num);
+	bool IsSurfaceParticle(int32 ParticleIdx) const;
+	int32 CompactSurfaceParticles(const FVector* ParticlePositions);
+	void UpdateDensityVolume(const FVector* ParticlePositions);
+	bool LoadSnapshot(const class USPHSnapshot* Snapshot);
 
 private:
 	TArray<FVector> Positions;
 	TArray<FVector> PrevPositions;
 	TArray<FLinearColor> Colors;
 	TArray<FVector> Velocities;
-	// x͖t[vẐŃt[Ԃ̂Ђ͂Ȃ̂AgpTArrayׂ̐邽߂
-	// g܂킵Ă
+	// 加速度は毎フレーム計算するのでフレーム間のひきつぎはないのだが、使用メモリやTArrayの生成負荷をおさえるために
+	// 使いまわしている
 	TArray<FVector> Accelerations;
+	// bHalfPrecisionNeighborAttributesのときは空で、かわりにHalfDensityPressuresに密度、圧力の順に並べて持つ
 	TArray<float> Densities;
 	TArray<float> Pressures;
+	TArray<FFloat16> HalfDensityPressures;
 	float DensityCoef = 0.0f;
 	float GradientPressureCoef = 0.0f;
 	float LaplacianViscosityCoef = 0.0f;
 	float SmoothLenSq = 0.0f;
 	int32 NumThreadParticles = 0.0f;
 	FNeighborGrid3DCPU NeighborGrid3D;
+	// 密度計算と力の計算で歩く近傍セル
+	FNeighborGridStencil NeighborStencil;
+	// BuildNeighborGrid3D()で求めたセルを、同じサブステップの密度計算と力の計算で使いまわす
+	TArray<FIntVector> ParticleCellIndices;
+	// 密度計算で集めたカーネル半径内の近傍。MaxCachedNeighborsを超えたパーティクルはINDEX_NONEにする
+	TArray<int32> CachedNeighbors;
+	TArray<int32> NumCachedNeighbors;
+	FParallelWorkerTeam WorkerTeam;
 	FTransform LocalToUnitTransform;
+	// サブステップ中はアクタが動かないので、BeginSimulation()でキャッシュしたものを使う
+	FTransform CachedActorTransform;
+	const struct FSignedDistanceField3D* BoundaryField = nullptr;
+	FSPHLocalFrame LocalFrame;
+	// bSimulateInLocalSpaceのときはアクタ空間での重力
+	FVector SimulationGravity = FVector::ZeroVector;
+	// bSimulateInLocalSpaceのときの出力用のワールド空間の位置
+	TArray<FVector> WorldPositions;
+	// bOutputSurfaceOnlyのときに密度計算のパスで集める近傍パーティクルの数と相対位置の和
+	TArray<int32> NeighborCounts;
+	TArray<FVector> NeighborOffsets;
+	TArray<FVector> SurfacePositions;
+	TArray<FLinearColor> SurfaceColors;
+	TArray<int32> SurfaceChunkOffsets;
+	FSparseDensityVolume DensityVolume;
+	FParticleCacheWriter CacheWriter;
+	FParticleCacheReader CacheReader;
+	TArray<FVector> CacheVelocities;
+	float CachePlaybackTime = 0.0f;
+	int32 CacheFrameIndex = INDEX_NONE;
+	TArray<uint16> QuantizedPositions;
 
 public:
 	/** Returns NiagaraComponent subobject **/
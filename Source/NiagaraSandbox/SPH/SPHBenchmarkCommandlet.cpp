@@ -0,0 +1,290 @@
+#include "SPHBenchmarkCommandlet.h"
+#include "Math/RandomStream.h"
+#include "Misc/Parse.h"
+#include "../Common/ParticleQuantization.h"
+#include "../Common/SparseDensityVolume.h"
+#include "../Common/HalfPrecision.h"
+
+USPHBenchmarkCommandlet::USPHBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 USPHBenchmarkCommandlet::Main(const FString& Params)
+{
+	FString Case;
+	FParse::Value(*Params, TEXT("Case="), Case);
+
+	int32 NumParticles = 1000000;
+	FParse::Value(*Params, TEXT("NumParticles="), NumParticles);
+
+	int32 Seed = 0;
+	FParse::Value(*Params, TEXT("Seed="), Seed);
+
+	bool bSucceeded = true;
+
+	if (Case.IsEmpty() || Case == TEXT("Quantization"))
+	{
+		bSucceeded &= RunQuantization(NumParticles, Seed);
+	}
+
+	if (Case.IsEmpty() || Case == TEXT("DensityVolume"))
+	{
+		bSucceeded &= RunDensityVolume(NumParticles, Seed);
+	}
+
+	if (Case.IsEmpty() || Case == TEXT("HalfPrecision"))
+	{
+		bSucceeded &= RunHalfPrecision(NumParticles, Seed);
+	}
+
+	return bSucceeded ? 0 : 1;
+}
+
+bool USPHBenchmarkCommandlet::RunQuantization(int32 NumParticles, int32 Seed)
+{
+	// SPH3DSimulatorCPUのデフォルトのWorldBBoxSizeとMaxVelocity
+	const FBox Bounds(FVector(-5.0f), FVector(5.0f));
+	const float MaxVelocity = 60.0f;
+
+	FRandomStream RandomStream(Seed);
+	TArray<FVector> Positions;
+	TArray<FVector> Velocities;
+	Positions.SetNumUninitialized(NumParticles);
+	Velocities.SetNumUninitialized(NumParticles);
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		Positions[i] = RandomStream.RandPointInBox(Bounds);
+		Velocities[i] = RandomStream.RandPointInBox(FBox(FVector(-MaxVelocity), FVector(MaxVelocity)));
+	}
+
+	TArray<uint16> Encoded;
+	TArray<FVector> Decoded;
+	Encoded.SetNumUninitialized(NumParticles * 3);
+	Decoded.SetNumUninitialized(NumParticles);
+
+	double StartTime = FPlatformTime::Seconds();
+	FParticleQuantization::EncodePositions(Positions.GetData(), NumParticles, Bounds, Encoded.GetData());
+	double EncodeTime = FPlatformTime::Seconds() - StartTime;
+
+	StartTime = FPlatformTime::Seconds();
+	FParticleQuantization::DecodePositions(Encoded.GetData(), NumParticles, Bounds, Decoded.GetData());
+	double DecodeTime = FPlatformTime::Seconds() - StartTime;
+
+	FVector MaxPositionError = FVector::ZeroVector;
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		MaxPositionError = MaxPositionError.ComponentMax((Decoded[i] - Positions[i]).GetAbs());
+	}
+
+	FParticleQuantization::EncodeVelocities(Velocities.GetData(), NumParticles, MaxVelocity, Encoded.GetData());
+	FParticleQuantization::DecodeVelocities(Encoded.GetData(), NumParticles, MaxVelocity, Decoded.GetData());
+
+	FVector MaxVelocityError = FVector::ZeroVector;
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		MaxVelocityError = MaxVelocityError.ComponentMax((Decoded[i] - Velocities[i]).GetAbs());
+	}
+
+	// 誤差は量子化ステップの半分以内のはず。floatの演算誤差の分だけ余裕を持たせる
+	const FVector& PositionTolerance = FParticleQuantization::GetPrecision(Bounds.Min, Bounds.Max) * 0.5f * 1.05f;
+	const FVector& VelocityTolerance = FParticleQuantization::GetPrecision(FVector(-MaxVelocity), FVector(MaxVelocity)) * 0.5f * 1.05f;
+	bool bSucceeded = MaxPositionError.X <= PositionTolerance.X && MaxPositionError.Y <= PositionTolerance.Y && MaxPositionError.Z <= PositionTolerance.Z
+		&& MaxVelocityError.X <= VelocityTolerance.X && MaxVelocityError.Y <= VelocityTolerance.Y && MaxVelocityError.Z <= VelocityTolerance.Z;
+
+	UE_LOG(LogTemp, Display, TEXT("Quantization: NumParticles=%d Encode=%.3fms Decode=%.3fms MaxPositionError=%s (Tolerance=%s) MaxVelocityError=%s (Tolerance=%s) %s"),
+		NumParticles, EncodeTime * 1000.0, DecodeTime * 1000.0,
+		*MaxPositionError.ToString(), *PositionTolerance.ToString(), *MaxVelocityError.ToString(), *VelocityTolerance.ToString(),
+		bSucceeded ? TEXT("OK") : TEXT("FAILED"));
+
+	return bSucceeded;
+}
+
+bool USPHBenchmarkCommandlet::RunDensityVolume(int32 NumParticles, int32 Seed)
+{
+	// SPH3DSimulatorCPUのデフォルトのWorldBBoxSizeの範囲を256^3ボクセルで扱い、カーネル半径はおよそ2.5ボクセルとする
+	const FBox Bounds(FVector(-5.0f), FVector(5.0f));
+	const FIntVector Resolution(256, 256, 256);
+	const float SmoothLength = 0.1f;
+	const float Mass = 1.0f;
+	// 積分が1になるpoly6カーネルの係数。全ボクセルの密度の和 * ボクセル体積が総質量になるはず
+	const float KernelCoef = Mass * 315.0f / (64.0f * PI * FMath::Pow(SmoothLength, 9));
+
+	// 流体が容器の一部にたまっている状況を想定し、半径2の球内に配置する
+	FRandomStream RandomStream(Seed);
+	TArray<FVector> Positions;
+	Positions.SetNumUninitialized(NumParticles);
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		Positions[i] = RandomStream.GetUnitVector() * FMath::Pow(RandomStream.GetFraction(), 1.0f / 3.0f) * 2.0f;
+	}
+
+	FSparseDensityVolume DensityVolume;
+	DensityVolume.Initialize(Bounds, Resolution);
+
+	// 1回目は配列の確保を含むので計測しない
+	DensityVolume.Rasterize(Positions.GetData(), NumParticles, SmoothLength, KernelCoef);
+
+	double StartTime = FPlatformTime::Seconds();
+	DensityVolume.Rasterize(Positions.GetData(), NumParticles, SmoothLength, KernelCoef);
+	double RasterizeTime = FPlatformTime::Seconds() - StartTime;
+
+	StartTime = FPlatformTime::Seconds();
+	const TArray<float>& DenseDensities = DensityVolume.ExportDense();
+	double ExportTime = FPlatformTime::Seconds() - StartTime;
+
+	double TotalDensity = 0.0;
+	for (float Density : DenseDensities)
+	{
+		TotalDensity += Density;
+	}
+
+	const FVector& VoxelSize = DensityVolume.GetVoxelSize();
+	const double TotalMass = TotalDensity * VoxelSize.X * VoxelSize.Y * VoxelSize.Z;
+	const double MassError = FMath::Abs(TotalMass / (NumParticles * Mass) - 1.0);
+	const FIntVector& NumBricks = DensityVolume.GetNumBricks();
+	const int32 NumBricksTotal = NumBricks.X * NumBricks.Y * NumBricks.Z;
+
+	// 離散化誤差はボクセルサイズに対するカーネル半径で決まり、この設定ではパーティクル単体でも0.5%程度
+	bool bSucceeded = MassError < 0.01;
+
+	// 次のフレームとして球を移動してから出力し直し、新しいボリュームからの出力と一致すること(前のフレームの密度が残らないこと)を確かめる
+	for (FVector& Position : Positions)
+	{
+		Position.X += 2.5f;
+	}
+	DensityVolume.Rasterize(Positions.GetData(), NumParticles, SmoothLength, KernelCoef);
+
+	StartTime = FPlatformTime::Seconds();
+	DensityVolume.ExportDense();
+	double ReuseExportTime = FPlatformTime::Seconds() - StartTime;
+
+	FSparseDensityVolume FreshDensityVolume;
+	FreshDensityVolume.Initialize(Bounds, Resolution);
+	FreshDensityVolume.Rasterize(Positions.GetData(), NumParticles, SmoothLength, KernelCoef);
+	const TArray<float>& FreshDensities = FreshDensityVolume.ExportDense();
+	const bool bReuseMatched = FMemory::Memcmp(DenseDensities.GetData(), FreshDensities.GetData(), DenseDensities.Num() * sizeof(float)) == 0;
+	bSucceeded &= bReuseMatched;
+
+	UE_LOG(LogTemp, Display, TEXT("DensityVolume: NumParticles=%d Rasterize=%.3fms (%.1fns/particle) ExportDense=%.3fms ExportDense(Reuse)=%.3fms ActiveBricks=%d/%d MassError=%.4f%% ReuseMatched=%d %s"),
+		NumParticles, RasterizeTime * 1000.0, NumParticles > 0 ? RasterizeTime * 1.0e9 / NumParticles : 0.0, ExportTime * 1000.0, ReuseExportTime * 1000.0,
+		DensityVolume.GetNumActiveBricks(), NumBricksTotal, MassError * 100.0, bReuseMatched ? 1 : 0,
+		bSucceeded ? TEXT("OK") : TEXT("FAILED"));
+
+	return bSucceeded;
+}
+
+bool USPHBenchmarkCommandlet::RunHalfPrecision(int32 NumParticles, int32 Seed)
+{
+	// SPH3DSimulatorCPUのデフォルトのRestDensityの付近の値
+	const float RestDensity = 4.0f;
+	// 近傍グリッド27セル分のうち実際にカーネル半径内に入る程度の数
+	const int32 NumNeighbors = 32;
+
+	FRandomStream RandomStream(Seed);
+	TArray<float> Densities;
+	TArray<float> Pressures;
+	Densities.SetNumUninitialized(NumParticles);
+	Pressures.SetNumUninitialized(NumParticles);
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		Densities[i] = RestDensity * RandomStream.FRandRange(0.5f, 1.5f);
+		Pressures[i] = RandomStream.FRandRange(0.0f, 2.0f);
+	}
+
+	// SPH3DSimulatorCPUのbHalfPrecisionNeighborAttributesと同じく、密度と圧力を粒子ごとに並べて半精度にする
+	TArray<float> DensityPressures;
+	DensityPressures.SetNumUninitialized(NumParticles * 2);
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		DensityPressures[i * 2] = Densities[i];
+		DensityPressures[i * 2 + 1] = Pressures[i];
+	}
+
+	TArray<FFloat16> HalfDensityPressures;
+	HalfDensityPressures.SetNumUninitialized(NumParticles * 2);
+
+	double StartTime = FPlatformTime::Seconds();
+	FHalfPrecision::Encode(DensityPressures.GetData(), NumParticles * 2, HalfDensityPressures.GetData());
+	double EncodeTime = FPlatformTime::Seconds() - StartTime;
+
+	TArray<float> Decoded;
+	Decoded.SetNumUninitialized(NumParticles * 2);
+	StartTime = FPlatformTime::Seconds();
+	FHalfPrecision::Decode(HalfDensityPressures.GetData(), NumParticles * 2, Decoded.GetData());
+	double DecodeTime = FPlatformTime::Seconds() - StartTime;
+
+	// 半精度の相対誤差は丸めで2^-11以内。0付近の非正規化数は絶対誤差で評価する
+	const float AbsoluteTolerance = FHalfPrecision::MaxDenormalError;
+	float MaxRelativeError = 0.0f;
+	bool bWithinTolerance = true;
+	for (int32 i = 0; i < NumParticles * 2; ++i)
+	{
+		const float Value = DensityPressures[i];
+		float Error = FMath::Abs(Decoded[i] - Value);
+		bWithinTolerance &= Error <= FHalfPrecision::MaxRelativeError * FMath::Abs(Value) + AbsoluteTolerance;
+		if (FMath::Abs(Value) > SMALL_NUMBER)
+		{
+			MaxRelativeError = FMath::Max(MaxRelativeError, Error / FMath::Abs(Value));
+		}
+
+		// 力の計算と同じ1回の読み込みでも同じ値になること
+		if ((i & 1) == 0)
+		{
+			float Density, Pressure;
+			FHalfPrecision::LoadPair(&HalfDensityPressures[i], Density, Pressure);
+			bWithinTolerance &= Density == Decoded[i] && Pressure == Decoded[i + 1];
+		}
+	}
+
+	// 力の計算の近傍ループと同じく、ランダムな近傍の密度と圧力を読む。
+	// インデックスはハッシュで作り、インデックスの配列の読み込みが帯域を食わないようにする
+	auto GetNeighborIndex = [NumParticles](int32 ParticleIdx, int32 NeighborIdx)
+	{
+		return (int32)(HashCombine(GetTypeHash(ParticleIdx), GetTypeHash(NeighborIdx)) % (uint32)NumParticles);
+	};
+
+	double FullSum = 0.0;
+	StartTime = FPlatformTime::Seconds();
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		float Sum = 0.0f;
+		for (int32 j = 0; j < NumNeighbors; ++j)
+		{
+			int32 Another = GetNeighborIndex(i, j);
+			Sum += Pressures[Another] / Densities[Another];
+		}
+		FullSum += Sum;
+	}
+	double FullGatherTime = FPlatformTime::Seconds() - StartTime;
+
+	double HalfSum = 0.0;
+	StartTime = FPlatformTime::Seconds();
+	for (int32 i = 0; i < NumParticles; ++i)
+	{
+		float Sum = 0.0f;
+		for (int32 j = 0; j < NumNeighbors; ++j)
+		{
+			int32 Another = GetNeighborIndex(i, j);
+			float Density, Pressure;
+			FHalfPrecision::LoadPair(&HalfDensityPressures[Another * 2], Density, Pressure);
+			Sum += Pressure / Density;
+		}
+		HalfSum += Sum;
+	}
+	double HalfGatherTime = FPlatformTime::Seconds() - StartTime;
+
+	const double GatherError = FMath::Abs(HalfSum - FullSum) / FMath::Max(FMath::Abs(FullSum), (double)SMALL_NUMBER);
+
+	bool bSucceeded = bWithinTolerance;
+
+	UE_LOG(LogTemp, Display, TEXT("HalfPrecision: NumParticles=%d Bytes/Particle Float=%d Half=%d Encode=%.3fms Decode=%.3fms Gather(Float)=%.3fms Gather(Half)=%.3fms MaxRelativeError=%g (Tolerance=%g) GatherSumError=%g %s"),
+		NumParticles, (int32)(2 * sizeof(float)), (int32)(2 * sizeof(FFloat16)), EncodeTime * 1000.0, DecodeTime * 1000.0, FullGatherTime * 1000.0, HalfGatherTime * 1000.0,
+		MaxRelativeError, FHalfPrecision::MaxRelativeError, GatherError,
+		bSucceeded ? TEXT("OK") : TEXT("FAILED"));
+
+	return bSucceeded;
+}
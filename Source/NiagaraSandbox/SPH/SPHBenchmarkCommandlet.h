@@ -0,0 +1,26 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "SPHBenchmarkCommandlet.generated.h"
+
+/**
+ * Headless benchmark and accuracy check of the SPH helpers.
+ * Usage: UE4Editor-Cmd NiagaraSandbox -run=SPHBenchmark [-Case=<Name>] [-NumParticles=<Num>] [-Seed=<Seed>]
+ * Returns non zero if an accuracy check fails.
+ */
+UCLASS()
+class USPHBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	USPHBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	bool RunQuantization(int32 NumParticles, int32 Seed);
+	bool RunDensityVolume(int32 NumParticles, int32 Seed);
+	bool RunHalfPrecision(int32 NumParticles, int32 Seed);
+};
@@ -0,0 +1,105 @@
+#include "SPHBoundarySDF.h"
+#if WITH_EDITOR
+#include "AssetRegistryModule.h"
+#include "Components/StaticMeshComponent.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/World.h"
+#include "EngineUtils.h"
+#include "Misc/PackageName.h"
+#include "StaticMeshResources.h"
+#include "UObject/Package.h"
+#endif
+
+#if WITH_EDITOR
+namespace
+{
+	// LOD0の三角形をワールド空間で集める
+	void GatherTriangles(const UStaticMeshComponent* Component, const FBox& Bounds, TArray<FVector>& OutTriangleVertices)
+	{
+		const UStaticMesh* StaticMesh = Component->GetStaticMesh();
+		if (StaticMesh == nullptr || StaticMesh->RenderData == nullptr || StaticMesh->RenderData->LODResources.Num() == 0)
+		{
+			return;
+		}
+
+		if (!Component->Bounds.GetBox().Intersect(Bounds))
+		{
+			return;
+		}
+
+		const FStaticMeshLODResources& LOD = StaticMesh->RenderData->LODResources[0];
+		const FPositionVertexBuffer& PositionBuffer = LOD.VertexBuffers.PositionVertexBuffer;
+		const FTransform& ComponentTransform = Component->GetComponentTransform();
+		const int32 NumIndices = LOD.IndexBuffer.GetNumIndices();
+
+		OutTriangleVertices.Reserve(OutTriangleVertices.Num() + NumIndices);
+		for (int32 i = 0; i < NumIndices; ++i)
+		{
+			OutTriangleVertices.Add(ComponentTransform.TransformPosition(PositionBuffer.VertexPosition(LOD.IndexBuffer.GetIndex(i))));
+		}
+	}
+}
+
+USPHBoundarySDF* USPHBoundarySDF::BakeFromWorld(UWorld* World, FName ActorTag, const FBox& Bounds, const FIntVector& Resolution, const FString& PackageName)
+{
+	check(World != nullptr);
+
+	if (!FPackageName::IsValidLongPackageName(PackageName))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Invalid package name for SPH boundary SDF. PackageName = %s."), *PackageName);
+		return nullptr;
+	}
+
+	if (Resolution.X < 2 || Resolution.Y < 2 || Resolution.Z < 2)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SPH boundary SDF needs at least 2 grid points per axis. Resolution = (%d, %d, %d)."), Resolution.X, Resolution.Y, Resolution.Z);
+		return nullptr;
+	}
+
+	TArray<FVector> TriangleVertices;
+	for (TActorIterator<AActor> It(World); It; ++It)
+	{
+		if (!It->ActorHasTag(ActorTag))
+		{
+			continue;
+		}
+
+		TInlineComponentArray<UStaticMeshComponent*> Components(*It);
+		for (const UStaticMeshComponent* Component : Components)
+		{
+			GatherTriangles(Component, Bounds, TriangleVertices);
+		}
+	}
+
+	if (TriangleVertices.Num() == 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("No static mesh triangles in the bounds for SPH boundary SDF. Add the tag %s to the container actors."), *ActorTag.ToString());
+		return nullptr;
+	}
+
+	UPackage* Package = CreatePackage(*PackageName);
+	const FString& AssetName = FPackageName::GetLongPackageAssetName(PackageName);
+
+	// 既存のアセットがあれば上書きする
+	USPHBoundarySDF* Asset = FindObject<USPHBoundarySDF>(Package, *AssetName);
+	if (Asset == nullptr)
+	{
+		Asset = NewObject<USPHBoundarySDF>(Package, *AssetName, RF_Public | RF_Standalone);
+		FAssetRegistryModule::AssetCreated(Asset);
+	}
+
+	const double StartTime = FPlatformTime::Seconds();
+	Asset->Field.Build(Bounds, Resolution, TriangleVertices);
+	UE_LOG(LogTemp, Display, TEXT("Baked SPH boundary SDF from %d triangles in %.2f seconds."), TriangleVertices.Num() / 3, FPlatformTime::Seconds() - StartTime);
+	Asset->MarkPackageDirty();
+
+	const FString& FileName = FPackageName::LongPackageNameToFilename(PackageName, FPackageName::GetAssetPackageExtension());
+	if (!UPackage::SavePackage(Package, Asset, RF_Public | RF_Standalone, *FileName))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Failed to save SPH boundary SDF. FileName = %s."), *FileName);
+		return nullptr;
+	}
+
+	return Asset;
+}
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/DataAsset.h"
+#include "../Common/SignedDistanceField3D.h"
+#include "SPHBoundarySDF.generated.h"
+
+/**
+ * Container geometry of a CPU SPH simulator baked from level static meshes.
+ * The field is in the world space because the meshes are static, so the simulator can sample it without transforming the particle positions.
+ * Particles are kept in the region of the positive distance.
+ */
+UCLASS()
+class USPHBoundarySDF : public UDataAsset
+{
+	GENERATED_BODY()
+
+public:
+	UPROPERTY(VisibleAnywhere)
+	FSignedDistanceField3D Field;
+
+#if WITH_EDITOR
+	/**
+	 * Bakes the static mesh components of the actors with ActorTag in World into an asset and saves it.
+	 * PackageName is a long package name like /Game/SPH/Boundaries/SPH3DBoundary.
+	 */
+	static USPHBoundarySDF* BakeFromWorld(UWorld* World, FName ActorTag, const FBox& Bounds, const FIntVector& Resolution, const FString& PackageName);
+#endif
+};
@@ -0,0 +1,217 @@
+#include "SPHLatticeInitializer.h"
+#include "Async/ParallelFor.h"
+#include "Math/RandomStream.h"
+
+namespace
+{
+	// 形状が全パーティクルを収容できないときに間隔を詰める回数の上限
+	const int32 MaxShrinkTrials = 8;
+
+	// X方向の格子点の各行に入るパーティクル数を並列に数え、RowOffsetsに各行の先頭のパーティクルインデックスを入れる。
+	// 戻り値は形状に入る格子点の総数
+	int32 CountRows(int32 NumRows, TFunctionRef<int32(int32)> CountRow, TArray<int32>& RowOffsets)
+	{
+		RowOffsets.SetNumUninitialized(NumRows + 1);
+		RowOffsets[0] = 0;
+
+		ParallelFor(NumRows,
+			[&RowOffsets, &CountRow](int32 Row)
+			{
+				RowOffsets[Row + 1] = CountRow(Row);
+			}
+		);
+
+		for (int32 Row = 0; Row < NumRows; ++Row)
+		{
+			RowOffsets[Row + 1] += RowOffsets[Row];
+		}
+
+		return RowOffsets[NumRows];
+	}
+
+	FRandomStream MakeRowRandomStream(int32 Seed, int32 Row)
+	{
+		// スレッドの割り当てに依存しないよう、行ごとに乱数系列を作る
+		return FRandomStream((int32)HashCombine(GetTypeHash(Seed), GetTypeHash(Row)));
+	}
+}
+
+float FSPHLatticeInitializer::GetRestSpacing3D(float Mass, float RestDensity)
+{
+	return FMath::Pow(Mass / RestDensity, 1.0f / 3.0f);
+}
+
+float FSPHLatticeInitializer::GetRestSpacing2D(float Mass, float RestDensity)
+{
+	return FMath::Sqrt(Mass / RestDensity);
+}
+
+void FSPHLatticeInitializer::Fill3D(const FBox& Bounds, TFunctionRef<bool(const FVector&)> IsInside, float Spacing, float Jitter, int32 Seed, TArrayView<FVector> OutPositions)
+{
+	check(Spacing > 0.0f);
+
+	const int32 NumParticles = OutPositions.Num();
+	if (NumParticles == 0)
+	{
+		return;
+	}
+
+	const FVector& Size = Bounds.GetSize();
+	FIntVector NumPoints;
+	TArray<int32> RowOffsets;
+
+	for (int32 Trial = 0; ; ++Trial)
+	{
+		NumPoints = FIntVector(
+			FMath::Max(1, FMath::FloorToInt(Size.X / Spacing)),
+			FMath::Max(1, FMath::FloorToInt(Size.Y / Spacing)),
+			FMath::Max(1, FMath::FloorToInt(Size.Z / Spacing))
+		);
+
+		// 行は下の層から順に並べるので、パーティクルが余る場合は上の層が空く
+		int32 Capacity = CountRows(NumPoints.Y * NumPoints.Z,
+			[&Bounds, &IsInside, &NumPoints, Spacing](int32 Row)
+			{
+				const FVector RowStart = Bounds.Min + FVector(0.5f, Row % NumPoints.Y + 0.5f, Row / NumPoints.Y + 0.5f) * Spacing;
+				int32 Count = 0;
+				for (int32 X = 0; X < NumPoints.X; ++X)
+				{
+					if (IsInside(RowStart + FVector(X * Spacing, 0.0f, 0.0f)))
+					{
+						++Count;
+					}
+				}
+				return Count;
+			},
+			RowOffsets
+		);
+
+		if (Capacity >= NumParticles || Trial == MaxShrinkTrials)
+		{
+			if (Capacity < NumParticles)
+			{
+				UE_LOG(LogTemp, Warning, TEXT("The lattice can not hold all particles. %d particles are not placed."), NumParticles - Capacity);
+			}
+			break;
+		}
+
+		float NewSpacing = Spacing * FMath::Pow((float)FMath::Max(Capacity, 1) / NumParticles, 1.0f / 3.0f) * 0.99f;
+		UE_LOG(LogTemp, Warning, TEXT("The shape can hold only %d of %d particles at the rest density spacing %f. Shrink the spacing to %f."), Capacity, NumParticles, Spacing, NewSpacing);
+		Spacing = NewSpacing;
+	}
+
+	const float JitterLength = Jitter * Spacing;
+	ParallelFor(NumPoints.Y * NumPoints.Z,
+		[&](int32 Row)
+		{
+			int32 ParticleIdx = RowOffsets[Row];
+			if (ParticleIdx >= NumParticles)
+			{
+				return;
+			}
+
+			FRandomStream RandomStream = MakeRowRandomStream(Seed, Row);
+			const FVector RowStart = Bounds.Min + FVector(0.5f, Row % NumPoints.Y + 0.5f, Row / NumPoints.Y + 0.5f) * Spacing;
+			for (int32 X = 0; X < NumPoints.X && ParticleIdx < NumParticles; ++X)
+			{
+				const FVector& Point = RowStart + FVector(X * Spacing, 0.0f, 0.0f);
+				if (IsInside(Point))
+				{
+					OutPositions[ParticleIdx] = Point + JitterLength * FVector(RandomStream.FRandRange(-1.0f, 1.0f), RandomStream.FRandRange(-1.0f, 1.0f), RandomStream.FRandRange(-1.0f, 1.0f));
+					++ParticleIdx;
+				}
+			}
+		}
+	);
+
+	// 収容できなかったパーティクルは配置済みのパーティクルに重ねる
+	int32 NumPlaced = FMath::Min(RowOffsets.Last(), NumParticles);
+	for (int32 ParticleIdx = NumPlaced; ParticleIdx < NumParticles; ++ParticleIdx)
+	{
+		OutPositions[ParticleIdx] = NumPlaced > 0 ? OutPositions[ParticleIdx % NumPlaced] : Bounds.GetCenter();
+	}
+}
+
+void FSPHLatticeInitializer::Fill2D(const FBox2D& Bounds, TFunctionRef<bool(const FVector2D&)> IsInside, float Spacing, float Jitter, int32 Seed, TArrayView<FVector2D> OutPositions)
+{
+	check(Spacing > 0.0f);
+
+	const int32 NumParticles = OutPositions.Num();
+	if (NumParticles == 0)
+	{
+		return;
+	}
+
+	const FVector2D& Size = Bounds.GetSize();
+	FIntPoint NumPoints;
+	TArray<int32> RowOffsets;
+
+	for (int32 Trial = 0; ; ++Trial)
+	{
+		NumPoints = FIntPoint(
+			FMath::Max(1, FMath::FloorToInt(Size.X / Spacing)),
+			FMath::Max(1, FMath::FloorToInt(Size.Y / Spacing))
+		);
+
+		int32 Capacity = CountRows(NumPoints.Y,
+			[&Bounds, &IsInside, &NumPoints, Spacing](int32 Row)
+			{
+				const FVector2D RowStart = Bounds.Min + FVector2D(0.5f, Row + 0.5f) * Spacing;
+				int32 Count = 0;
+				for (int32 X = 0; X < NumPoints.X; ++X)
+				{
+					if (IsInside(RowStart + FVector2D(X * Spacing, 0.0f)))
+					{
+						++Count;
+					}
+				}
+				return Count;
+			},
+			RowOffsets
+		);
+
+		if (Capacity >= NumParticles || Trial == MaxShrinkTrials)
+		{
+			if (Capacity < NumParticles)
+			{
+				UE_LOG(LogTemp, Warning, TEXT("The lattice can not hold all particles. %d particles are not placed."), NumParticles - Capacity);
+			}
+			break;
+		}
+
+		float NewSpacing = Spacing * FMath::Sqrt((float)FMath::Max(Capacity, 1) / NumParticles) * 0.99f;
+		UE_LOG(LogTemp, Warning, TEXT("The shape can hold only %d of %d particles at the rest density spacing %f. Shrink the spacing to %f."), Capacity, NumParticles, Spacing, NewSpacing);
+		Spacing = NewSpacing;
+	}
+
+	const float JitterLength = Jitter * Spacing;
+	ParallelFor(NumPoints.Y,
+		[&](int32 Row)
+		{
+			int32 ParticleIdx = RowOffsets[Row];
+			if (ParticleIdx >= NumParticles)
+			{
+				return;
+			}
+
+			FRandomStream RandomStream = MakeRowRandomStream(Seed, Row);
+			const FVector2D RowStart = Bounds.Min + FVector2D(0.5f, Row + 0.5f) * Spacing;
+			for (int32 X = 0; X < NumPoints.X && ParticleIdx < NumParticles; ++X)
+			{
+				const FVector2D& Point = RowStart + FVector2D(X * Spacing, 0.0f);
+				if (IsInside(Point))
+				{
+					OutPositions[ParticleIdx] = Point + JitterLength * FVector2D(RandomStream.FRandRange(-1.0f, 1.0f), RandomStream.FRandRange(-1.0f, 1.0f));
+					++ParticleIdx;
+				}
+			}
+		}
+	);
+
+	// 収容できなかったパーティクルは配置済みのパーティクルに重ねる
+	int32 NumPlaced = FMath::Min(RowOffsets.Last(), NumParticles);
+	for (int32 ParticleIdx = NumPlaced; ParticleIdx < NumParticles; ++ParticleIdx)
+	{
+		OutPositions[ParticleIdx] = NumPlaced > 0 ? OutPositions[ParticleIdx % NumPlaced] : Bounds.GetCenter();
+	}
+}
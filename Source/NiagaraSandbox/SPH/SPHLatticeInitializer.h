@@ -0,0 +1,31 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/ObjectMacros.h"
+#include "SPHLatticeInitializer.generated.h"
+
+UENUM()
+enum class ESPHInitialPlacement : uint8
+{
+	// Random points in the sphere (circle in 2D) of InitPosRadius. Overlapping particles cause huge initial pressure.
+	Random,
+	// Jittered lattice at the rest density spacing in the sphere (circle in 2D) of InitPosRadius.
+	LatticeSphere,
+	// Jittered lattice at the rest density spacing in InitBox.
+	LatticeBox,
+};
+
+struct FSPHLatticeInitializer
+{
+	// the spacing where a particle of Mass occupies the volume (area in 2D) of RestDensity
+	static float GetRestSpacing3D(float Mass, float RestDensity);
+	static float GetRestSpacing2D(float Mass, float RestDensity);
+
+	/**
+	 * Places OutPositions.Num() particles on a jittered lattice inside the shape, filling from the bottom (-Z in 3D, -Y in 2D) layer.
+	 * Jitter is the max offset in units of Spacing. If the shape can not hold all particles at Spacing, the spacing is shrunk until they fit.
+	 * The result depends only on the arguments and not on the number of threads.
+	 */
+	static void Fill3D(const FBox& Bounds, TFunctionRef<bool(const FVector&)> IsInside, float Spacing, float Jitter, int32 Seed, TArrayView<FVector> OutPositions);
+	static void Fill2D(const FBox2D& Bounds, TFunctionRef<bool(const FVector2D&)> IsInside, float Spacing, float Jitter, int32 Seed, TArrayView<FVector2D> OutPositions);
+};
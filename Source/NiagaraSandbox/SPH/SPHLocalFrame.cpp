@@ -0,0 +1,45 @@
+#include "SPHLocalFrame.h"
+
+void FSPHLocalFrame::Reset(const FTransform& ActorTransform)
+{
+	LinearAcceleration = FVector::ZeroVector;
+	AngularVelocity = FVector::ZeroVector;
+	AngularAcceleration = FVector::ZeroVector;
+	PrevLocation = ActorTransform.GetLocation();
+	PrevRotation = ActorTransform.GetRotation();
+	PrevLinearVelocity = FVector::ZeroVector;
+	NumUpdates = 0;
+}
+
+void FSPHLocalFrame::Update(const FTransform& ActorTransform, float DeltaSeconds)
+{
+	if (DeltaSeconds <= KINDA_SMALL_NUMBER)
+	{
+		return;
+	}
+
+	const FVector& Location = ActorTransform.GetLocation();
+	const FQuat& Rotation = ActorTransform.GetRotation();
+
+	const FVector& LinearVelocity = (Location - PrevLocation) / DeltaSeconds;
+
+	FQuat DeltaRotation = Rotation * PrevRotation.Inverse();
+	DeltaRotation.EnforceShortestArcWith(FQuat::Identity);
+	FVector Axis;
+	float Angle;
+	DeltaRotation.ToAxisAndAngle(Axis, Angle);
+	const FVector& LocalAngularVelocity = Rotation.UnrotateVector(Axis * Angle / DeltaSeconds);
+
+	// 加速度は速度が2フレーム分そろってから求める
+	if (NumUpdates > 0)
+	{
+		LinearAcceleration = Rotation.UnrotateVector((LinearVelocity - PrevLinearVelocity) / DeltaSeconds);
+		AngularAcceleration = (LocalAngularVelocity - AngularVelocity) / DeltaSeconds;
+	}
+
+	AngularVelocity = LocalAngularVelocity;
+	PrevLocation = Location;
+	PrevRotation = Rotation;
+	PrevLinearVelocity = LinearVelocity;
+	++NumUpdates;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Motion of the actor frame estimated from the actor transforms of consecutive frames.
+ * The vectors are in the actor space (no scale) so that a simulation in the actor space can add the inertial forces of the actor motion.
+ */
+struct FSPHLocalFrame
+{
+	FVector LinearAcceleration = FVector::ZeroVector;
+	FVector AngularVelocity = FVector::ZeroVector;
+	FVector AngularAcceleration = FVector::ZeroVector;
+
+	// Forget the motion history, e.g. on the first frame or after a teleport.
+	void Reset(const FTransform& ActorTransform);
+	void Update(const FTransform& ActorTransform, float DeltaSeconds);
+
+	// The sum of the translational, Coriolis, centrifugal and Euler accelerations at the position relative to the actor origin.
+	FVector GetInertialAcceleration(const FVector& LocalPosition, const FVector& LocalVelocity) const
+	{
+		return -LinearAcceleration
+			- 2.0f * (AngularVelocity ^ LocalVelocity)
+			- (AngularVelocity ^ (AngularVelocity ^ LocalPosition))
+			- (AngularAcceleration ^ LocalPosition);
+	}
+
+private:
+	FVector PrevLocation = FVector::ZeroVector;
+	FQuat PrevRotation = FQuat::Identity;
+	// ワールド空間での原点の速度
+	FVector PrevLinearVelocity = FVector::ZeroVector;
+	int32 NumUpdates = 0;
+};
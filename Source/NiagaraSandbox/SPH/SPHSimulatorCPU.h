@@ -0,0 +1,36 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Simulate()の1サブステップを構成するフェーズ。フェーズ間では全パーティクルの処理の完了を待つ必要がある
+enum class ESPHSimulationPhase : uint8
+{
+	BuildNeighborGrid3D,
+	CalculateDensityAndPressure,
+	ApplyForcesAndIntegrate,
+	Num,
+};
+
+/**
+ * Interface of the CPU SPH simulators so that USPHSimulatorSubsystem can step them by phase.
+ * Each phase is executed on a particle range so that the ranges of several simulators can be packed into one parallel job.
+ */
+class ISPHSimulatorCPU
+{
+public:
+	virtual ~ISPHSimulatorCPU() {}
+
+	virtual int32 GetNumParticles() const = 0;
+	virtual int32 GetNumSubSteps() const = 0;
+	virtual float GetSubStepDeltaSeconds() const = 0;
+	virtual bool IsSimulationPhaseEnabled(ESPHSimulationPhase Phase) const = 0;
+
+	/** Called once per frame on the game thread before the first substep. */
+	virtual void BeginSimulation() = 0;
+	/** Called on the game thread before every substep. */
+	virtual void BeginSubStep() = 0;
+	/** Simulates the particles of [StartIdx, EndIdx). Called from worker threads. */
+	virtual void SimulatePhase(ESPHSimulationPhase Phase, int32 StartIdx, int32 EndIdx, float DeltaSeconds) = 0;
+	/** Called once per frame on the game thread after the last substep. */
+	virtual void EndSimulation() = 0;
+};
@@ -0,0 +1,133 @@
+#include "SPHSimulatorSubsystem.h"
+#include "Async/ParallelFor.h"
+#include "HAL/IConsoleManager.h"
+
+namespace
+{
+	int32 GSPHSubsystemMinParticlesPerTask = 256;
+	FAutoConsoleVariableRef CVarSPHSubsystemMinParticlesPerTask(
+		TEXT("sph.Subsystem.MinParticlesPerTask"),
+		GSPHSubsystemMinParticlesPerTask,
+		TEXT("Minimum number of particles of one parallel task when USPHSimulatorSubsystem steps the simulators."),
+		ECVF_Default
+	);
+
+	int32 GSPHSubsystemTasksPerWorker = 4;
+	FAutoConsoleVariableRef CVarSPHSubsystemTasksPerWorker(
+		TEXT("sph.Subsystem.TasksPerWorker"),
+		GSPHSubsystemTasksPerWorker,
+		TEXT("Number of parallel tasks per worker thread which USPHSimulatorSubsystem aims at in one phase."),
+		ECVF_Default
+	);
+}
+
+void USPHSimulatorSubsystem::RegisterSimulator(ISPHSimulatorCPU* Simulator)
+{
+	check(Simulator != nullptr);
+	Simulators.AddUnique(Simulator);
+}
+
+void USPHSimulatorSubsystem::UnregisterSimulator(ISPHSimulatorCPU* Simulator)
+{
+	Simulators.Remove(Simulator);
+}
+
+void USPHSimulatorSubsystem::Tick(float DeltaTime)
+{
+	for (ISPHSimulatorCPU* Simulator : Simulators)
+	{
+		Simulator->BeginSimulation();
+	}
+
+	// アクタ単体でのTick()と同様、DeltaSecondsが小さいときはシミュレーションせずに結果の出力だけ行う
+	if (DeltaTime > KINDA_SMALL_NUMBER)
+	{
+		int32 MaxSubSteps = 0;
+		for (ISPHSimulatorCPU* Simulator : Simulators)
+		{
+			MaxSubSteps = FMath::Max(MaxSubSteps, Simulator->GetNumSubSteps());
+		}
+
+		// サブステップ数の異なるシミュレータは、自分のサブステップ数を消化した後のサブステップには参加しない
+		for (int32 SubStep = 0; SubStep < MaxSubSteps; ++SubStep)
+		{
+			for (ISPHSimulatorCPU* Simulator : Simulators)
+			{
+				if (SubStep < Simulator->GetNumSubSteps())
+				{
+					Simulator->BeginSubStep();
+				}
+			}
+
+			for (int32 Phase = 0; Phase < (int32)ESPHSimulationPhase::Num; ++Phase)
+			{
+				SimulatePhase((ESPHSimulationPhase)Phase, SubStep);
+			}
+		}
+	}
+
+	for (ISPHSimulatorCPU* Simulator : Simulators)
+	{
+		Simulator->EndSimulation();
+	}
+}
+
+void USPHSimulatorSubsystem::SimulatePhase(ESPHSimulationPhase Phase, int32 SubStep)
+{
+	int32 TotalParticles = 0;
+	for (ISPHSimulatorCPU* Simulator : Simulators)
+	{
+		if (SubStep < Simulator->GetNumSubSteps() && Simulator->IsSimulationPhaseEnabled(Phase))
+		{
+			TotalParticles += Simulator->GetNumParticles();
+		}
+	}
+
+	if (TotalParticles == 0)
+	{
+		return;
+	}
+
+	// 全シミュレータのパーティクル総数をワーカースレッド数に応じて均等に分割する。
+	// 小さなシミュレータは1タスクにまとまり、大きなシミュレータは複数タスクに分かれる
+	int32 NumTargetTasks = FMath::Max(1, FTaskGraphInterface::Get().GetNumWorkerThreads() * GSPHSubsystemTasksPerWorker);
+	int32 ParticlesPerTask = FMath::Max(FMath::Max(1, GSPHSubsystemMinParticlesPerTask), (TotalParticles + NumTargetTasks - 1) / NumTargetTasks);
+
+	Tasks.Reset();
+	for (ISPHSimulatorCPU* Simulator : Simulators)
+	{
+		if (SubStep >= Simulator->GetNumSubSteps() || !Simulator->IsSimulationPhaseEnabled(Phase))
+		{
+			continue;
+		}
+
+		int32 NumParticles = Simulator->GetNumParticles();
+		for (int32 StartIdx = 0; StartIdx < NumParticles; StartIdx += ParticlesPerTask)
+		{
+			Tasks.Add({Simulator, StartIdx, FMath::Min(StartIdx + ParticlesPerTask, NumParticles)});
+		}
+	}
+
+	ParallelFor(Tasks.Num(),
+		[this, Phase](int32 TaskIdx)
+		{
+			const FSimulationTask& Task = Tasks[TaskIdx];
+			Task.Simulator->SimulatePhase(Phase, Task.StartIdx, Task.EndIdx, Task.Simulator->GetSubStepDeltaSeconds());
+		}
+	);
+}
+
+bool USPHSimulatorSubsystem::IsTickable() const
+{
+	return !IsTemplate() && Simulators.Num() > 0;
+}
+
+UWorld* USPHSimulatorSubsystem::GetTickableGameObjectWorld() const
+{
+	return GetWorld();
+}
+
+TStatId USPHSimulatorSubsystem::GetStatId() const
+{
+	RETURN_QUICK_DECLARE_CYCLE_STAT(USPHSimulatorSubsystem, STATGROUP_Tickables);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "Tickable.h"
+#include "SPHSimulatorCPU.h"
+#include "SPHSimulatorSubsystem.generated.h"
+
+/**
+ * Steps all registered CPU SPH simulators of the world together.
+ * The same phase of every simulator is packed into one ParallelFor so that many small simulators share the fork/join barriers.
+ */
+UCLASS()
+class USPHSimulatorSubsystem : public UWorldSubsystem, public FTickableGameObject
+{
+	GENERATED_BODY()
+
+public:
+	void RegisterSimulator(ISPHSimulatorCPU* Simulator);
+	void UnregisterSimulator(ISPHSimulatorCPU* Simulator);
+
+	// FTickableGameObject interface
+	virtual void Tick(float DeltaTime) override;
+	virtual bool IsTickable() const override;
+	virtual UWorld* GetTickableGameObjectWorld() const override;
+	virtual TStatId GetStatId() const override;
+	// End of FTickableGameObject interface
+
+private:
+	void SimulatePhase(ESPHSimulationPhase Phase, int32 SubStep);
+
+private:
+	struct FSimulationTask
+	{
+		ISPHSimulatorCPU* Simulator;
+		int32 StartIdx;
+		int32 EndIdx;
+	};
+
+	TArray<ISPHSimulatorCPU*> Simulators;
+	// 毎フェーズ作り直すが、TArrayの生成負荷をおさえるために使いまわしている
+	TArray<FSimulationTask> Tasks;
+};
@@ -0,0 +1,74 @@
+#include "SPHSnapshot.h"
+#if WITH_EDITOR
+#include "AssetRegistryModule.h"
+#include "Misc/PackageName.h"
+#include "UObject/Package.h"
+#endif
+
+bool USPHSnapshot::IsCompatible(int32 InNumParticles, const FIntVector& InNumCells, const FVector& InWorldBBoxSize, FString& OutReason) const
+{
+	if (NumParticles != InNumParticles)
+	{
+		OutReason = FString::Printf(TEXT("NumParticles mismatch. Snapshot=%d. Simulator=%d."), NumParticles, InNumParticles);
+		return false;
+	}
+
+	if (NumCells != InNumCells)
+	{
+		OutReason = FString::Printf(TEXT("NumCells mismatch. Snapshot=(%d, %d, %d). Simulator=(%d, %d, %d)."), NumCells.X, NumCells.Y, NumCells.Z, InNumCells.X, InNumCells.Y, InNumCells.Z);
+		return false;
+	}
+
+	if (!WorldBBoxSize.Equals(InWorldBBoxSize))
+	{
+		OutReason = FString::Printf(TEXT("WorldBBoxSize mismatch. Snapshot=%s. Simulator=%s."), *WorldBBoxSize.ToString(), *InWorldBBoxSize.ToString());
+		return false;
+	}
+
+	if (Positions.Num() != NumParticles || PrevPositions.Num() != NumParticles || Velocities.Num() != NumParticles)
+	{
+		OutReason = TEXT("The array sizes of the snapshot are broken.");
+		return false;
+	}
+
+	return true;
+}
+
+#if WITH_EDITOR
+USPHSnapshot* USPHSnapshot::SaveAsAsset(const FString& PackageName) const
+{
+	if (!FPackageName::IsValidLongPackageName(PackageName))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Invalid package name for SPH snapshot. PackageName = %s."), *PackageName);
+		return nullptr;
+	}
+
+	UPackage* Package = CreatePackage(*PackageName);
+	const FString& AssetName = FPackageName::GetLongPackageAssetName(PackageName);
+
+	// 既存のアセットがあれば上書きする
+	USPHSnapshot* Asset = FindObject<USPHSnapshot>(Package, *AssetName);
+	if (Asset == nullptr)
+	{
+		Asset = NewObject<USPHSnapshot>(Package, *AssetName, RF_Public | RF_Standalone);
+		FAssetRegistryModule::AssetCreated(Asset);
+	}
+
+	Asset->NumParticles = NumParticles;
+	Asset->NumCells = NumCells;
+	Asset->WorldBBoxSize = WorldBBoxSize;
+	Asset->Positions = Positions;
+	Asset->PrevPositions = PrevPositions;
+	Asset->Velocities = Velocities;
+	Asset->MarkPackageDirty();
+
+	const FString& FileName = FPackageName::LongPackageNameToFilename(PackageName, FPackageName::GetAssetPackageExtension());
+	if (!UPackage::SavePackage(Package, Asset, RF_Public | RF_Standalone, *FileName))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Failed to save SPH snapshot. FileName = %s."), *FileName);
+		return nullptr;
+	}
+
+	return Asset;
+}
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/DataAsset.h"
+#include "SPHSnapshot.generated.h"
+
+/**
+ * Complete solver state of a CPU SPH simulator to start a level from a settled fluid.
+ * The state is stored in the actor space (location and rotation of the simulator actor) so that it can be loaded into a simulator placed anywhere.
+ */
+UCLASS()
+class USPHSnapshot : public UDataAsset
+{
+	GENERATED_BODY()
+
+public:
+	UPROPERTY(VisibleAnywhere)
+	int32 NumParticles = 0;
+
+	UPROPERTY(VisibleAnywhere)
+	FIntVector NumCells = FIntVector::ZeroValue;
+
+	UPROPERTY(VisibleAnywhere)
+	FVector WorldBBoxSize = FVector::ZeroVector;
+
+	UPROPERTY()
+	TArray<FVector> Positions;
+
+	UPROPERTY()
+	TArray<FVector> PrevPositions;
+
+	UPROPERTY()
+	TArray<FVector> Velocities;
+
+	/** Returns false with the reason if this snapshot can not be loaded into the simulator with the parameters. */
+	bool IsCompatible(int32 InNumParticles, const FIntVector& InNumCells, const FVector& InWorldBBoxSize, FString& OutReason) const;
+
+#if WITH_EDITOR
+	/** Saves a copy of this snapshot as an asset. PackageName is a long package name like /Game/SPH/Snapshots/SPH3D. */
+	USPHSnapshot* SaveAsAsset(const FString& PackageName) const;
+#endif
+};